@@ -24,6 +24,16 @@
  * limitations under the License.
  **************************************************************************************************/
 
+#if defined(MTB_KVSTORE_PTHREAD)
+// Must precede the first system header, see mtb_kvstore_pthread.h.
+#if !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+#if !defined(_XOPEN_SOURCE)
+#define _XOPEN_SOURCE 700
+#endif
+#endif
+
 #include <string.h>
 #include <stdbool.h>
 
@@ -31,25 +41,99 @@
 #include "cy_utils.h"
 
 #define _MTB_KVSTORE_MIN_BUFF_SIZE          (128U)
+#define _MTB_KVSTORE_READ_BUFFER_SIZE       (64U)
 #define _MTB_KVSTORE_HEADER_MAGIC           (0xFACEFACEU)
 #define _MTB_KVSTORE_FORMAT_VERSION         (0U)
+#define _MTB_KVSTORE_COMPACT_FORMAT_VERSION (1U)
+#define _MTB_KVSTORE_COMPACT_HEADER_MAGIC   (0xC5U)
+#define _MTB_KVSTORE_COMPACT_HEADER_MIN_SIZE (6U)
+#define _MTB_KVSTORE_AREA_FORMAT_PACKED     (1U)
+#define _MTB_KVSTORE_AREA_FORMAT_MASK       (0xFFU)
+#define _MTB_KVSTORE_AREA_SHARDS_SHIFT      (8U)
+#define _MTB_KVSTORE_MAX_SHARDS             (0xFFU)
+#define _MTB_KVSTORE_PACKED_ALIGNMENT       (4U)
 #define _MTB_KVSTORE_INITIAL_AREA_VERSION   (1U)
 #define _MTB_KVSTORE_DELETE_FLAG            (1U << 7)
+#define _MTB_KVSTORE_COUNTER_FLAG           (1U << 0)
+#define _MTB_KVSTORE_APPEND_FLAG            (1U << 1)
+#define _MTB_KVSTORE_COMPRESSED_FLAG        (1U << 2)
+#define _MTB_KVSTORE_KEY_ID_FLAG            (1U << 3)
+#define _MTB_KVSTORE_KEY_DEF_FLAG           (1U << 4)
+#define _MTB_KVSTORE_CHUNK_FLAG             (1U << 5)
+#define _MTB_KVSTORE_CHUNKED_FLAG           (1U << 6)
+#define _MTB_KVSTORE_NO_SEGMENT             (0xFFFFFFFFU)
 #define _MTB_KVSTORE_NO_FLAG                (0U)
 #define _MTB_KVSTORE_INIT_MAX_KEYS          (32U)
+#define _MTB_KVSTORE_INIT_MAX_KEY_IDS       (8U)
+#define _MTB_KVSTORE_MAX_KEY_IDS            (1U << 14)
+#define _MTB_KVSTORE_KEY_ID_SIZE            (2U)
+#define _MTB_KVSTORE_BLOB_FLAGS             (_MTB_KVSTORE_CHUNK_FLAG | _MTB_KVSTORE_KEY_DEF_FLAG)
+#define _MTB_KVSTORE_VALUE_TYPE_FLAGS       (_MTB_KVSTORE_COUNTER_FLAG | \
+                                             _MTB_KVSTORE_APPEND_FLAG | \
+                                             _MTB_KVSTORE_COMPRESSED_FLAG | \
+                                             _MTB_KVSTORE_CHUNKED_FLAG)
+#define _MTB_KVSTORE_BLOB_KEY_SIZE          (16U)
+#define _MTB_KVSTORE_INIT_MAX_BLOBS         (8U)
+#define _MTB_KVSTORE_FNV_OFFSET_BASIS       (0xCBF29CE484222325ULL)
+#define _MTB_KVSTORE_FNV_PRIME              (0x00000100000001B3ULL)
 #define _MTB_KVSTORE_AREA_SIZE(obj)         (((obj)->length) / 2)
 #define _MTB_KVSTORE_AREA_HEADER_OFFSET     (0U)
 #define _MTB_KVSTORE_CRC_INIT_VAL           (0xFFFFU)
+#define _MTB_KVSTORE_ANY_VERSION            (0xFFFFFFFFU)
+#define _MTB_KVSTORE_LZ_HASH_BITS           (8U)
+#define _MTB_KVSTORE_LZ_MATCH_FLAG          (0x80U)
+#define _MTB_KVSTORE_LZ_MIN_MATCH           (3U)
+#define _MTB_KVSTORE_LZ_MAX_MATCH           (0x7FU + _MTB_KVSTORE_LZ_MIN_MATCH)
+#define _MTB_KVSTORE_LZ_MAX_LITERALS        (0x80U)
+#define _MTB_KVSTORE_LOCK_FREE_READ_ATTEMPTS (3U)
+#define _MTB_KVSTORE_REGISTRY_NONE          (0U)
+#define _MTB_KVSTORE_REGISTRY_BUSY          (1U)
+#define _MTB_KVSTORE_REGISTRY_READY         (2U)
+
+#if (MTB_KVSTORE_COMPRESSION_BLOCK_SIZE == 0) || (MTB_KVSTORE_COMPRESSION_BLOCK_SIZE > 32768U)
+#error "MTB_KVSTORE_COMPRESSION_BLOCK_SIZE must be between 1 and 32768"
+#endif
+
+#if (MTB_KVSTORE_CHUNK_SIZE == 0)
+#error "MTB_KVSTORE_CHUNK_SIZE must not be 0"
+#endif
+
+#if (MTB_KVSTORE_INLINE_VALUE_SIZE > 255U)
+#error "MTB_KVSTORE_INLINE_VALUE_SIZE must not exceed 255"
+#endif
+
+#if MTB_KVSTORE_LOCK_FREE_READS
+#if !defined(MTB_KVSTORE_RTOS_AWARE)
+#error "MTB_KVSTORE_LOCK_FREE_READS requires an RTOS"
+#endif
+// State that readers access without the lock is published with release semantics and loaded with
+// acquire semantics, so a reader that sees a new table size also sees the new table.
+// Fields of RAM table entries only need to be loaded and stored whole, as the sequence number
+// tells readers whether they are consistent.
+#define _MTB_KVSTORE_LOAD(var)              __atomic_load_n(&(var), __ATOMIC_ACQUIRE)
+#define _MTB_KVSTORE_PUBLISH(var, val)      __atomic_store_n(&(var), (val), __ATOMIC_RELEASE)
+#define _MTB_KVSTORE_LOAD_FIELD(var)        __atomic_load_n(&(var), __ATOMIC_RELAXED)
+#define _MTB_KVSTORE_STORE_FIELD(var, val)  __atomic_store_n(&(var), (val), __ATOMIC_RELAXED)
+#else
+#define _MTB_KVSTORE_LOAD(var)              (var)
+#define _MTB_KVSTORE_PUBLISH(var, val)      ((var) = (val))
+#define _MTB_KVSTORE_LOAD_FIELD(var)        (var)
+#define _MTB_KVSTORE_STORE_FIELD(var, val)  ((var) = (val))
+#endif
 
 /***************************** Internal Data Structures ********************************/
 
 // Note: If the following structure is changed the _mtb_kvstore_get_header_crc function
 // must be changed to adjust the CRC calculation accordingly.
+// Records of format 0 store this structure as is. Records of the compact format 1 store an 8-bit
+// magic, the flags, the 16-bit CRC and the key and data sizes as little endian base-128 varints,
+// and are decoded into this structure when read. The CRC is calculated on the decoded header in
+// both cases.
 typedef struct
 {
     uint32_t    magic;          /* A constant value, for quick validity checking. */
     uint8_t     format_version; /* Version of the record format */
-    uint8_t     flags;          /* Used to mark a record deleted. */
+    uint8_t     flags;          /* Used to mark a record deleted or its type. */
     uint16_t    header_size;    /* Size of the header */
     uint16_t    key_size;       /* Size of the key */
     uint32_t    data_size;      /* Size of the data */
@@ -57,6 +141,40 @@ typedef struct
                                    (except CRC), key and data. */
 } _mtb_kvstore_record_header_t;
 
+// Stored at the start of the data of a record with the append flag. A record without the flag is
+// the first segment of the value.
+typedef struct
+{
+    uint32_t    prev_offset;    /* Offset of the previous segment or _MTB_KVSTORE_NO_SEGMENT */
+    uint32_t    total_size;     /* Size of the value up to and including this segment */
+    uint32_t    max_size;       /* Maximum size retained at garbage collection, 0 if unbounded */
+} _mtb_kvstore_segment_info_t;
+
+typedef struct
+{
+    uint32_t    payload_addr;
+    uint32_t    payload_size;
+} _mtb_kvstore_segment_t;
+
+// Stored at the start of the data of a record with the compressed flag. It is followed by the
+// stored size of each block as a uint16_t and then by the blocks. A block whose stored size equals
+// its uncompressed size did not compress and is stored as is.
+typedef struct
+{
+    uint32_t    value_size;     /* Size of the uncompressed value */
+    uint32_t    block_size;     /* Uncompressed size of every block but the last */
+} _mtb_kvstore_compressed_info_t;
+
+// Stored at the start of the data of a manifest record, which has the chunked flag. It is followed
+// by the offset of each chunk record as a uint32_t. Chunk records have the chunk flag, the key of
+// the value and one chunk of it as their data, and are not tracked by the RAM table. Shared blobs
+// are chunk records with the blob flags whose key is the hash of the chunk as hexadecimal digits.
+typedef struct
+{
+    uint32_t    value_size;     /* Size of the value */
+    uint32_t    chunk_size;     /* Size of every chunk but the last */
+} _mtb_kvstore_chunked_info_t;
+
 typedef struct
 {
     uint16_t version; /* Version of the area. Use to check if area is the active area */
@@ -89,883 +207,7191 @@ typedef struct
     const uint8_t* data;
     uint32_t data_size;
     uint16_t key_hash;
+    uint8_t flags;
 } _mtb_kvstore_update_record_info_t;
 
+typedef struct
+{
+    uint8_t* buffer;
+    size_t size;
+    void* mem;
+} _mtb_kvstore_buffer_t;
+
 typedef struct
 {
     uint32_t ram_tbl_idx;
     _mtb_kvstore_update_consumed_size_info_t consumed_size_info;
     const _mtb_kvstore_update_record_info_t* update_rec_info;
+    const bool* marked; /* Entries deleted together instead of ram_tbl_idx, or NULL */
 } _mtb_kvstore_record_info_t;
 
-static const char* _mtb_kvstore_area_rec_key = "MTBAREAIDX";
-
-/*************************** Internal Helper Functions *****************************/
+typedef struct
+{
+    mtb_kvstore_t* obj;
+    uint32_t reclaimable;
+    uint32_t cost;
+} _mtb_kvstore_maintenance_candidate_t;
 
-#if defined(CY_RTOS_AWARE) || defined(COMPONENT_RTOS_AWARE)
+struct mtb_kvstore_gc_group
+{
+    mtb_kvstore_gc_group_t* next;
+    const mtb_kvstore_bd_t* bd;
+    uint32_t num_instances;
+    #if defined(MTB_KVSTORE_RTOS_AWARE)
+    cy_mutex_t mutex;
+    #endif
+};
 
-//--------------------------------------------------------------------------------------------------
-// _mtb_kvstore_initlock
-//--------------------------------------------------------------------------------------------------
-static cy_rslt_t _mtb_kvstore_initlock(mtb_kvstore_t* obj)
+struct mtb_kvstore_retired
 {
-    return cy_rtos_init_mutex(&(obj->mtb_kvstore_mutex));
-}
+    mtb_kvstore_retired_t* next;
+    void* mem;
+};
 
+struct mtb_kvstore_cache_entry
+{
+    mtb_kvstore_cache_entry_t* prev;
+    mtb_kvstore_cache_entry_t* next;
+    uint32_t generation;
+    uint32_t size;
+    uint16_t hash;
+    bool pinned;
+    char* key;
+    uint8_t data[];
+};
 
-//--------------------------------------------------------------------------------------------------
-// _mtb_kvstore_lock
-//--------------------------------------------------------------------------------------------------
-static cy_rslt_t _mtb_kvstore_lock(mtb_kvstore_t* obj)
+struct mtb_kvstore_async_entry
 {
-    return cy_rtos_get_mutex(&(obj->mtb_kvstore_mutex), MTB_KVSTORE_MUTEX_TIMEOUT_MS);
-}
+    mtb_kvstore_write_cb_t callback;
+    void* context;
+    uint32_t size;
+    char key[MTB_KVSTORE_MAX_KEY_SIZE];
+    uint8_t data[];
+};
+
+static const char* _mtb_kvstore_area_rec_key = "MTBAREAIDX";
 
+// Initialized instances, for mtb_kvstore_maintenance_all. Instances on the same block device
+// serialize their garbage collections with a mutex of their group. The registry mutex is created
+// with the first instance and never deleted.
+static mtb_kvstore_t* _mtb_kvstore_instances = NULL;
+#if defined(MTB_KVSTORE_RTOS_AWARE)
+static uint8_t _mtb_kvstore_registry_state = _MTB_KVSTORE_REGISTRY_NONE;
+static cy_mutex_t _mtb_kvstore_registry_mutex;
+static mtb_kvstore_gc_group_t* _mtb_kvstore_gc_groups = NULL;
+#endif
+
+/*************************** Internal Helper Functions *****************************/
 
 //--------------------------------------------------------------------------------------------------
-// _mtb_kvstore_lock_wait_forever
+// _mtb_kvstore_has_parallel_reads
 //--------------------------------------------------------------------------------------------------
-static void _mtb_kvstore_lock_wait_forever(mtb_kvstore_t* obj)
+static inline bool _mtb_kvstore_has_parallel_reads(const mtb_kvstore_t* obj)
 {
-    cy_rslt_t result = cy_rtos_get_mutex(&(obj->mtb_kvstore_mutex), CY_RTOS_NEVER_TIMEOUT);
-    CY_ASSERT(result == CY_RSLT_SUCCESS);
-    CY_UNUSED_PARAMETER(result);
+    return ((obj->bd->capabilities & MTB_KVSTORE_BD_CAP_PARALLEL_READ) != 0);
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// _mtb_kvstore_unlock
+// _mtb_kvstore_has_concurrent_reads
 //--------------------------------------------------------------------------------------------------
-static void _mtb_kvstore_unlock(mtb_kvstore_t* obj)
+static inline bool _mtb_kvstore_has_concurrent_reads(const mtb_kvstore_t* obj)
 {
-    cy_rslt_t result = cy_rtos_set_mutex(&(obj->mtb_kvstore_mutex));
-    CY_ASSERT(result == CY_RSLT_SUCCESS);
-    CY_UNUSED_PARAMETER(result);
+    // Reads can also overlap programs and erases of other threads.
+    uint32_t caps = MTB_KVSTORE_BD_CAP_PARALLEL_READ | MTB_KVSTORE_BD_CAP_CONCURRENT_READ;
+    return ((obj->bd->capabilities & caps) == caps);
 }
 
 
-#else // if defined(CY_RTOS_AWARE) || defined(COMPONENT_RTOS_AWARE)
+#if defined(MTB_KVSTORE_RTOS_AWARE)
+
+#if MTB_KVSTORE_LOCK_FREE_READS
 //--------------------------------------------------------------------------------------------------
-// _mtb_kvstore_initlock
+// _mtb_kvstore_begin_modify
 //--------------------------------------------------------------------------------------------------
-static cy_rslt_t _mtb_kvstore_initlock(mtb_kvstore_t* obj)
+static inline void _mtb_kvstore_begin_modify(mtb_kvstore_t* obj)
 {
-    CY_UNUSED_PARAMETER(obj);
-    return CY_RSLT_SUCCESS;
+    // The sequence number is odd while the lock is held exclusively. Only the holder of the lock
+    // changes it, so it needs no atomic increment. The fence keeps the modifications after it.
+    __atomic_store_n(&obj->write_seq, obj->write_seq + 1U, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// _mtb_kvstore_lock
+// _mtb_kvstore_end_modify
 //--------------------------------------------------------------------------------------------------
-static cy_rslt_t _mtb_kvstore_lock(mtb_kvstore_t* obj)
+static inline void _mtb_kvstore_end_modify(mtb_kvstore_t* obj)
 {
-    CY_UNUSED_PARAMETER(obj);
-    return CY_RSLT_SUCCESS;
+    __atomic_store_n(&obj->write_seq, obj->write_seq + 1U, __ATOMIC_RELEASE);
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// _mtb_kvstore_lock_wait_forever
+// _mtb_kvstore_wait_for_lock_free_readers
 //--------------------------------------------------------------------------------------------------
-static void _mtb_kvstore_lock_wait_forever(mtb_kvstore_t* obj)
+static void _mtb_kvstore_wait_for_lock_free_readers(mtb_kvstore_t* obj)
 {
-    CY_UNUSED_PARAMETER(obj);
+    // Readers that do not take the lock never wait for anything, so they finish soon. The fence
+    // orders the stores that replaced the memory they used before the count is checked.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&obj->lock_free_readers, __ATOMIC_SEQ_CST) != 0)
+    {
+        (void)cy_rtos_delay_milliseconds(1);
+    }
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// _mtb_kvstore_unlock
+// _mtb_kvstore_free_retired
 //--------------------------------------------------------------------------------------------------
-static void _mtb_kvstore_unlock(mtb_kvstore_t* obj)
+static void _mtb_kvstore_free_retired(mtb_kvstore_t* obj)
 {
-    CY_UNUSED_PARAMETER(obj);
+    while (obj->retired != NULL)
+    {
+        mtb_kvstore_retired_t* next = obj->retired->next;
+        free(obj->retired->mem);
+        free(obj->retired);
+        obj->retired = next;
+    }
 }
 
 
-#endif // if defined(CY_RTOS_AWARE) || defined(COMPONENT_RTOS_AWARE)
-
 //--------------------------------------------------------------------------------------------------
-// _mtb_kvstore_is_valid_key
+// _mtb_kvstore_reclaim_retired
 //--------------------------------------------------------------------------------------------------
-static inline bool _mtb_kvstore_is_valid_key(const char* key)
+static void _mtb_kvstore_reclaim_retired(mtb_kvstore_t* obj)
 {
-    if (NULL != key)
+    // Called with the lock held, once the retired memory is no longer reachable. A reader that
+    // starts after the check below can only find the memory that replaced it, so the retired
+    // memory is freed if no reader is in progress. Otherwise it is tried again on the next unlock.
+    if (obj->retired != NULL)
     {
-        uint32_t key_size = strlen(key);
-        return (key_size > 0) && (key_size < MTB_KVSTORE_MAX_KEY_SIZE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&obj->lock_free_readers, __ATOMIC_SEQ_CST) == 0)
+        {
+            _mtb_kvstore_free_retired(obj);
+        }
     }
-    return false;
 }
 
 
+#else // if MTB_KVSTORE_LOCK_FREE_READS
 //--------------------------------------------------------------------------------------------------
-// _mtb_kvstore_align_up
+// _mtb_kvstore_begin_modify
 //--------------------------------------------------------------------------------------------------
-static inline uint32_t _mtb_kvstore_align_up(uint32_t val, uint32_t size)
+static inline void _mtb_kvstore_begin_modify(mtb_kvstore_t* obj)
 {
-    return (((val - 1) / size) + 1) * size;
+    CY_UNUSED_PARAMETER(obj);
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// _mtb_kvstore_is_aligned
+// _mtb_kvstore_end_modify
 //--------------------------------------------------------------------------------------------------
-static inline bool _mtb_kvstore_is_aligned(uint32_t val, uint32_t size)
+static inline void _mtb_kvstore_end_modify(mtb_kvstore_t* obj)
 {
-    return ((val & (size - 1)) == 0);
+    CY_UNUSED_PARAMETER(obj);
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// _mtb_kvstore_get_record_size
+// _mtb_kvstore_reclaim_retired
 //--------------------------------------------------------------------------------------------------
-static uint32_t _mtb_kvstore_get_record_size(mtb_kvstore_t* obj, uint32_t record_offset,
-                                             uint32_t key_size, uint32_t data_size)
+static inline void _mtb_kvstore_reclaim_retired(mtb_kvstore_t* obj)
 {
-    uint32_t prog_size = obj->bd->program_size(obj->bd->context, record_offset);
-    return _mtb_kvstore_align_up(sizeof(_mtb_kvstore_record_header_t) + key_size + data_size,
-                                 prog_size);
+    CY_UNUSED_PARAMETER(obj);
 }
 
 
+#endif // if MTB_KVSTORE_LOCK_FREE_READS
+
 //--------------------------------------------------------------------------------------------------
-// _mtb_kvstore_get_area_header_record_size
+// _mtb_kvstore_initlock
 //--------------------------------------------------------------------------------------------------
-static inline uint32_t _mtb_kvstore_get_area_header_record_size(mtb_kvstore_t* obj,
-                                                                uint32_t area_address)
+static cy_rslt_t _mtb_kvstore_initlock(mtb_kvstore_t* obj)
 {
-    return _mtb_kvstore_get_record_size(obj, area_address,
-                                        strlen(_mtb_kvstore_area_rec_key),
-                                        sizeof(_mtb_kvstore_area_record_data_t));
+    cy_rslt_t result = cy_rtos_init_mutex(&(obj->mtb_kvstore_mutex));
+    if (result == CY_RSLT_SUCCESS)
+    {
+        result = cy_rtos_init_mutex(&(obj->modify_mutex));
+    }
+    if (result == CY_RSLT_SUCCESS)
+    {
+        result = cy_rtos_init_mutex(&(obj->readers_mutex));
+    }
+    if (result == CY_RSLT_SUCCESS)
+    {
+        result = cy_rtos_init_semaphore(&(obj->readers_done_sem), 1, 0);
+    }
+    if (result == CY_RSLT_SUCCESS)
+    {
+        result = cy_rtos_init_mutex(&(obj->cache_mutex));
+    }
+    if (result == CY_RSLT_SUCCESS)
+    {
+        result = cy_rtos_init_mutex(&(obj->views_mutex));
+    }
+    if (result == CY_RSLT_SUCCESS)
+    {
+        result = cy_rtos_init_semaphore(&(obj->views_done_sem), 1, 0);
+    }
+    if (result == CY_RSLT_SUCCESS)
+    {
+        result = cy_rtos_init_mutex(&(obj->async_queue.mutex));
+    }
+    if (result == CY_RSLT_SUCCESS)
+    {
+        // One count per queued entry plus one to wake the worker up for stopping.
+        result = cy_rtos_init_semaphore(&(obj->async_queue.work_sem),
+                                        MTB_KVSTORE_ASYNC_QUEUE_DEPTH + 1, 0);
+    }
+    if (result == CY_RSLT_SUCCESS)
+    {
+        result = cy_rtos_init_semaphore(&(obj->async_queue.done_sem),
+                                        MTB_KVSTORE_ASYNC_QUEUE_DEPTH, 0);
+    }
+    return result;
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// _mtb_kvstore_increment_max_keys
+// _mtb_kvstore_wait_for_readers
 //--------------------------------------------------------------------------------------------------
-uint16_t _mtb_kvstore_crc16(const uint8_t* data, uint32_t length, uint16_t init_crc)
+static cy_rslt_t _mtb_kvstore_wait_for_readers(mtb_kvstore_t* obj, cy_time_t timeout_ms)
 {
-    //Using CRC-16/CCITT-0 Algorithm
-    uint32_t crc = init_crc;
-    int i;
-    while (length--)
+    // The caller holds the kv-store mutex, so no new reader can start. The last reader to finish
+    // signals the semaphore, which may also hold a stale signal, so the count is checked again.
+    cy_rslt_t result = CY_RSLT_SUCCESS;
+    while (result == CY_RSLT_SUCCESS)
     {
-        crc ^= ((uint32_t)*data++) << 8;
-        for (i = 0; i < 8; i++)
+        result = cy_rtos_get_mutex(&(obj->readers_mutex), CY_RTOS_NEVER_TIMEOUT);
+        CY_ASSERT(result == CY_RSLT_SUCCESS);
+        bool done = (obj->num_readers == 0);
+        obj->writer_waiting = !done;
+        result = cy_rtos_set_mutex(&(obj->readers_mutex));
+        CY_ASSERT(result == CY_RSLT_SUCCESS);
+        if (done)
         {
-            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+            break;
         }
+        result = cy_rtos_get_semaphore(&(obj->readers_done_sem), timeout_ms, false);
     }
-    return crc & 0xffff;
+    return result;
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// _mtb_kvstore_increment_max_keys
+// _mtb_kvstore_lock
 //--------------------------------------------------------------------------------------------------
-static cy_rslt_t _mtb_kvstore_increment_max_keys(mtb_kvstore_t* obj)
+static cy_rslt_t _mtb_kvstore_lock(mtb_kvstore_t* obj)
 {
-    cy_rslt_t result = CY_RSLT_SUCCESS;
-    uint32_t new_entry_count = obj->max_entries * 2;
-    mtb_kvstore_ram_table_entry_t* new_table = (mtb_kvstore_ram_table_entry_t*)malloc(
-        new_entry_count * sizeof(mtb_kvstore_ram_table_entry_t));
-    if (new_table != NULL)
+    // Takes the lock exclusively, once the readers that are in progress have finished.
+    // Modifications are also serialized by a mutex of their own, which garbage collection keeps
+    // while it lets readers in.
+    cy_rslt_t result = cy_rtos_get_mutex(&(obj->modify_mutex), MTB_KVSTORE_MUTEX_TIMEOUT_MS);
+    if (result != CY_RSLT_SUCCESS)
     {
-        memcpy(new_table, obj->ram_table, obj->max_entries * sizeof(mtb_kvstore_ram_table_entry_t));
-        free(obj->ram_table);
-        obj->ram_table = new_table;
-        obj->max_entries = new_entry_count;
+        return result;
+    }
+
+    result = cy_rtos_get_mutex(&(obj->mtb_kvstore_mutex), MTB_KVSTORE_MUTEX_TIMEOUT_MS);
+    if (result == CY_RSLT_SUCCESS)
+    {
+        result = _mtb_kvstore_wait_for_readers(obj, MTB_KVSTORE_MUTEX_TIMEOUT_MS);
+        if (result != CY_RSLT_SUCCESS)
+        {
+            (void)cy_rtos_set_mutex(&(obj->mtb_kvstore_mutex));
+        }
+    }
+
+    if (result == CY_RSLT_SUCCESS)
+    {
+        _mtb_kvstore_begin_modify(obj);
     }
     else
     {
-        result = MTB_KVSTORE_MEM_ALLOC_ERROR;
+        (void)cy_rtos_set_mutex(&(obj->modify_mutex));
     }
     return result;
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// _mtb_kvstore_update_ram_table
+// _mtb_kvstore_lock_wait_forever
 //--------------------------------------------------------------------------------------------------
-static void _mtb_kvstore_update_ram_table(mtb_kvstore_t* obj, _mtb_kvstore_operation_t operation,
-                                          const _mtb_kvstore_update_ram_table_info_t* info)
+static void _mtb_kvstore_lock_wait_forever(mtb_kvstore_t* obj)
 {
-    switch (operation)
-    {
-        case _MTB_KVSTORE_OPER_DELETE:
-            CY_ASSERT(info->ram_tbl_idx < obj->num_entries);
-            obj->num_entries--;
-            if (info->ram_tbl_idx < obj->num_entries)
-            {
-                memmove(&obj->ram_table[info->ram_tbl_idx], &obj->ram_table[info->ram_tbl_idx + 1],
-                        (obj->num_entries - info->ram_tbl_idx) *
-                        sizeof(mtb_kvstore_ram_table_entry_t));
-            }
-            break;
-
-        case _MTB_KVSTORE_OPER_ADD:
-            CY_ASSERT(obj->num_entries < obj->max_entries);
-            CY_ASSERT(info->ram_tbl_idx <= obj->num_entries);
-            if (info->ram_tbl_idx < obj->num_entries)
-            {
-                memmove(&obj->ram_table[info->ram_tbl_idx + 1], &obj->ram_table[info->ram_tbl_idx],
-                        (obj->num_entries - info->ram_tbl_idx) *
-                        sizeof(mtb_kvstore_ram_table_entry_t));
-            }
-            obj->num_entries++;
-            obj->ram_table[info->ram_tbl_idx].hash = info->entry.hash;
-            obj->ram_table[info->ram_tbl_idx].offset = info->entry.offset;
-            break;
-
-        case _MTB_KVSTORE_OPER_UPDATE:
-            obj->ram_table[info->ram_tbl_idx].hash = info->entry.hash;
-            obj->ram_table[info->ram_tbl_idx].offset = info->entry.offset;
-            break;
-
-        default:
-            CY_ASSERT(false);
-    }
+    cy_rslt_t result = cy_rtos_get_mutex(&(obj->modify_mutex), CY_RTOS_NEVER_TIMEOUT);
+    CY_ASSERT(result == CY_RSLT_SUCCESS);
+    result = cy_rtos_get_mutex(&(obj->mtb_kvstore_mutex), CY_RTOS_NEVER_TIMEOUT);
+    CY_ASSERT(result == CY_RSLT_SUCCESS);
+    result = _mtb_kvstore_wait_for_readers(obj, CY_RTOS_NEVER_TIMEOUT);
+    CY_ASSERT(result == CY_RSLT_SUCCESS);
+    CY_UNUSED_PARAMETER(result);
+    _mtb_kvstore_begin_modify(obj);
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// _mtb_kvstore_update_consumed_size
+// _mtb_kvstore_lock_shared
 //--------------------------------------------------------------------------------------------------
-static void _mtb_kvstore_update_consumed_size(mtb_kvstore_t* obj,
-                                              _mtb_kvstore_operation_t operation,
-                                              const _mtb_kvstore_update_consumed_size_info_t* info)
+static cy_rslt_t _mtb_kvstore_lock_shared(mtb_kvstore_t* obj)
 {
-    switch (operation)
+    // Readers only hold the kv-store mutex while they register, so they run in parallel with each
+    // other but not with a writer. A waiting writer holds the mutex, which stops new readers. If
+    // the block device cannot be read from several threads at once, readers keep the mutex until
+    // they are done instead, which also keeps writers out as they need the mutex too.
+    cy_rslt_t result = cy_rtos_get_mutex(&(obj->mtb_kvstore_mutex), MTB_KVSTORE_MUTEX_TIMEOUT_MS);
+    if ((result == CY_RSLT_SUCCESS) && _mtb_kvstore_has_parallel_reads(obj))
     {
-        case _MTB_KVSTORE_OPER_DELETE:
-            obj->consumed_size -= info->old_record_size;
-            break;
-
-        case _MTB_KVSTORE_OPER_UPDATE:
-            obj->consumed_size = obj->consumed_size - info->old_record_size + info->new_record_size;
-            break;
-
-        case _MTB_KVSTORE_OPER_ADD:
-            obj->consumed_size += info->new_record_size;
-            break;
-
-        default:
-            CY_ASSERT(false);
+        result = cy_rtos_get_mutex(&(obj->readers_mutex), CY_RTOS_NEVER_TIMEOUT);
+        CY_ASSERT(result == CY_RSLT_SUCCESS);
+        obj->num_readers++;
+        result = cy_rtos_set_mutex(&(obj->readers_mutex));
+        CY_ASSERT(result == CY_RSLT_SUCCESS);
+        result = cy_rtos_set_mutex(&(obj->mtb_kvstore_mutex));
+        CY_ASSERT(result == CY_RSLT_SUCCESS);
     }
+    return result;
 }
 
 
 //--------------------------------------------------------------------------------------------------
-//_mtb_kvstore_erase_area
+// _mtb_kvstore_unlock_shared
 //--------------------------------------------------------------------------------------------------
-static cy_rslt_t _mtb_kvstore_erase_area(mtb_kvstore_t* obj, uint32_t area_address)
+static void _mtb_kvstore_unlock_shared(mtb_kvstore_t* obj)
 {
-    // This function operates on the assumption that erasing a sector is atomic. We first erase
-    // everything but the first sector.
-    uint32_t erase_size = obj->bd->erase_size(obj->bd->context, area_address);
-
-    // Erase from second sector to the end
-    cy_rslt_t result = CY_RSLT_SUCCESS;
-    if (erase_size < _MTB_KVSTORE_AREA_SIZE(obj))
+    cy_rslt_t result;
+    if (_mtb_kvstore_has_parallel_reads(obj))
     {
-        result = obj->bd->erase(obj->bd->context, area_address + erase_size,
-                                _MTB_KVSTORE_AREA_SIZE(obj) - erase_size);
+        result = cy_rtos_get_mutex(&(obj->readers_mutex), CY_RTOS_NEVER_TIMEOUT);
+        CY_ASSERT(result == CY_RSLT_SUCCESS);
+        CY_ASSERT(obj->num_readers > 0);
+        obj->num_readers--;
+        if ((obj->num_readers == 0) && obj->writer_waiting)
+        {
+            obj->writer_waiting = false;
+            // The writer may have timed out already, so a full semaphore is not an error.
+            (void)cy_rtos_set_semaphore(&(obj->readers_done_sem), false);
+        }
+        result = cy_rtos_set_mutex(&(obj->readers_mutex));
     }
-
-    if (result == CY_RSLT_SUCCESS)
+    else
     {
-        // Erase the first sector.
-        result = obj->bd->erase(obj->bd->context, area_address, erase_size);
+        result = cy_rtos_set_mutex(&(obj->mtb_kvstore_mutex));
     }
-
-    return result;
+    CY_ASSERT(result == CY_RSLT_SUCCESS);
+    CY_UNUSED_PARAMETER(result);
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// _mtb_kvstore_get_header_crc
+// _mtb_kvstore_unlock
 //--------------------------------------------------------------------------------------------------
-static uint16_t _mtb_kvstore_get_header_crc(_mtb_kvstore_record_header_t* record_header,
-                                            uint16_t init_crc)
+static void _mtb_kvstore_unlock(mtb_kvstore_t* obj)
 {
-    uint16_t crc = init_crc;
+    _mtb_kvstore_reclaim_retired(obj);
+    _mtb_kvstore_end_modify(obj);
+    cy_rslt_t result = cy_rtos_set_mutex(&(obj->mtb_kvstore_mutex));
+    CY_ASSERT(result == CY_RSLT_SUCCESS);
+    result = cy_rtos_set_mutex(&(obj->modify_mutex));
+    CY_ASSERT(result == CY_RSLT_SUCCESS);
+    CY_UNUSED_PARAMETER(result);
+}
 
-    // Compute CRC for header
-    crc = _mtb_kvstore_crc16((uint8_t*)&record_header->magic, sizeof(record_header->magic), crc);
-    crc =
-        _mtb_kvstore_crc16((uint8_t*)&record_header->format_version,
-                           sizeof(record_header->format_version), crc);
-    crc = _mtb_kvstore_crc16((uint8_t*)&record_header->flags, sizeof(record_header->flags), crc);
-    crc =
-        _mtb_kvstore_crc16((uint8_t*)&record_header->header_size,
-                           sizeof(record_header->header_size),
-                           crc);
-    crc = _mtb_kvstore_crc16((uint8_t*)&record_header->key_size, sizeof(record_header->key_size),
-                             crc);
-    crc = _mtb_kvstore_crc16((uint8_t*)&record_header->data_size, sizeof(record_header->data_size),
-                             crc);
 
-    return crc;
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_admit_readers
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_admit_readers(mtb_kvstore_t* obj)
+{
+    // Lets readers in while the caller keeps other modifications out. Until readers are excluded
+    // again, the caller must not change anything that readers access.
+    _mtb_kvstore_end_modify(obj);
+    cy_rslt_t result = cy_rtos_set_mutex(&(obj->mtb_kvstore_mutex));
+    CY_ASSERT(result == CY_RSLT_SUCCESS);
+    CY_UNUSED_PARAMETER(result);
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// _mtb_kvstore_get_record_crc
+// _mtb_kvstore_exclude_readers
 //--------------------------------------------------------------------------------------------------
-static uint16_t _mtb_kvstore_get_record_crc(_mtb_kvstore_record_header_t* record_header,
-                                            const char* key,
-                                            const uint8_t* data)
+static void _mtb_kvstore_exclude_readers(mtb_kvstore_t* obj)
 {
-    CY_ASSERT(record_header != NULL);
-    CY_ASSERT(key != NULL);
-    uint16_t crc = _MTB_KVSTORE_CRC_INIT_VAL;
+    // Readers never wait for the modification mutex, so this cannot deadlock.
+    cy_rslt_t result = cy_rtos_get_mutex(&(obj->mtb_kvstore_mutex), CY_RTOS_NEVER_TIMEOUT);
+    CY_ASSERT(result == CY_RSLT_SUCCESS);
+    result = _mtb_kvstore_wait_for_readers(obj, CY_RTOS_NEVER_TIMEOUT);
+    CY_ASSERT(result == CY_RSLT_SUCCESS);
+    CY_UNUSED_PARAMETER(result);
+    _mtb_kvstore_begin_modify(obj);
+}
 
-    // Compute CRC for header
-    crc = _mtb_kvstore_get_header_crc(record_header, crc);
-    crc = _mtb_kvstore_crc16((uint8_t*)key, record_header->key_size, crc);
-    if ((data != NULL) && (record_header->data_size != 0))
-    {
-        crc = _mtb_kvstore_crc16(data, record_header->data_size, crc);
-    }
 
-    return crc;
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_queue_lock
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_queue_lock(mtb_kvstore_t* obj)
+{
+    cy_rslt_t result = cy_rtos_get_mutex(&(obj->async_queue.mutex), CY_RTOS_NEVER_TIMEOUT);
+    CY_ASSERT(result == CY_RSLT_SUCCESS);
+    CY_UNUSED_PARAMETER(result);
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// _mtb_kvstore_buffered_crc_compute
+// _mtb_kvstore_queue_unlock
 //--------------------------------------------------------------------------------------------------
-static cy_rslt_t _mtb_kvstore_buffered_crc_compute(mtb_kvstore_t* obj, uint32_t address,
-                                                   uint32_t size, uint16_t* crc)
+static void _mtb_kvstore_queue_unlock(mtb_kvstore_t* obj)
 {
-    CY_ASSERT(obj != NULL);
-    cy_rslt_t result = CY_RSLT_SUCCESS;
-    uint32_t remaining_size = size;
-    while (remaining_size > 0)
-    {
-        uint32_t transfer_size = (obj->transaction_buffer_size >= remaining_size)
-                                ? remaining_size
-                                : obj->transaction_buffer_size;
+    cy_rslt_t result = cy_rtos_set_mutex(&(obj->async_queue.mutex));
+    CY_ASSERT(result == CY_RSLT_SUCCESS);
+    CY_UNUSED_PARAMETER(result);
+}
 
-        result = obj->bd->read(obj->bd->context, address, transfer_size, obj->transaction_buffer);
-        if (result != CY_RSLT_SUCCESS)
-        {
-            return result;
-        }
 
-        *crc = _mtb_kvstore_crc16(obj->transaction_buffer, transfer_size, *crc);
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_cache_lock
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_cache_lock(mtb_kvstore_t* obj)
+{
+    // Readers share the kv-store lock, so the cache that they update has a mutex of its own.
+    cy_rslt_t result = cy_rtos_get_mutex(&(obj->cache_mutex), CY_RTOS_NEVER_TIMEOUT);
+    CY_ASSERT(result == CY_RSLT_SUCCESS);
+    CY_UNUSED_PARAMETER(result);
+}
+
 
-        address += transfer_size;
-        remaining_size -= transfer_size;
-    }
-    return result;
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_cache_unlock
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_cache_unlock(mtb_kvstore_t* obj)
+{
+    cy_rslt_t result = cy_rtos_set_mutex(&(obj->cache_mutex));
+    CY_ASSERT(result == CY_RSLT_SUCCESS);
+    CY_UNUSED_PARAMETER(result);
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// _mtb_kvstore_validate_key
+// _mtb_kvstore_hold_view
 //--------------------------------------------------------------------------------------------------
-static cy_rslt_t _mtb_kvstore_validate_key(mtb_kvstore_t* obj, uint32_t key_addr,
-                                           const char* user_key, uint32_t key_size)
+static void _mtb_kvstore_hold_view(mtb_kvstore_t* obj, uint32_t area)
 {
-    CY_ASSERT(obj != NULL);
+    cy_rslt_t result = cy_rtos_get_mutex(&(obj->views_mutex), CY_RTOS_NEVER_TIMEOUT);
+    CY_ASSERT(result == CY_RSLT_SUCCESS);
+    obj->num_views[area]++;
+    result = cy_rtos_set_mutex(&(obj->views_mutex));
+    CY_ASSERT(result == CY_RSLT_SUCCESS);
+    CY_UNUSED_PARAMETER(result);
+}
 
-    if (strlen(user_key) != key_size)
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_drop_view
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_drop_view(mtb_kvstore_t* obj, uint32_t area)
+{
+    // Views are released without the kv-store lock, as garbage collection waits for them with the
+    // lock held.
+    cy_rslt_t result = cy_rtos_get_mutex(&(obj->views_mutex), CY_RTOS_NEVER_TIMEOUT);
+    CY_ASSERT(result == CY_RSLT_SUCCESS);
+    CY_ASSERT(obj->num_views[area] > 0);
+    obj->num_views[area]--;
+    if ((obj->num_views[area] == 0) && obj->gc_waiting_for_views)
     {
-        return MTB_KVSTORE_ITEM_NOT_FOUND_ERROR;
+        obj->gc_waiting_for_views = false;
+        // Garbage collection may have timed out already, so a full semaphore is not an error.
+        (void)cy_rtos_set_semaphore(&(obj->views_done_sem), false);
     }
+    result = cy_rtos_set_mutex(&(obj->views_mutex));
+    CY_ASSERT(result == CY_RSLT_SUCCESS);
+    CY_UNUSED_PARAMETER(result);
+}
+
 
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_wait_for_views
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_wait_for_views(mtb_kvstore_t* obj, uint32_t area)
+{
+    // Same as _mtb_kvstore_wait_for_readers. New views only point into the active area, so the
+    // count for the area that is about to be erased cannot grow.
     cy_rslt_t result = CY_RSLT_SUCCESS;
-    uint32_t remaining_size = key_size;
-    while (remaining_size > 0)
+    while (result == CY_RSLT_SUCCESS)
     {
-        uint32_t transfer_size =
-            (obj->transaction_buffer_size >=
-             remaining_size) ? remaining_size : obj->transaction_buffer_size;
-        result = obj->bd->read(obj->bd->context, key_addr, transfer_size, obj->transaction_buffer);
-        if (result != CY_RSLT_SUCCESS)
+        result = cy_rtos_get_mutex(&(obj->views_mutex), CY_RTOS_NEVER_TIMEOUT);
+        CY_ASSERT(result == CY_RSLT_SUCCESS);
+        bool done = (obj->num_views[area] == 0);
+        obj->gc_waiting_for_views = !done;
+        result = cy_rtos_set_mutex(&(obj->views_mutex));
+        CY_ASSERT(result == CY_RSLT_SUCCESS);
+        if (done)
         {
-            return result;
+            break;
         }
+        result = cy_rtos_get_semaphore(&(obj->views_done_sem), MTB_KVSTORE_VIEW_TIMEOUT_MS, false);
+    }
+    return (result == CY_RSLT_SUCCESS) ? CY_RSLT_SUCCESS : MTB_KVSTORE_VIEW_BUSY_ERROR;
+}
+
 
-        if (memcmp((uint8_t*)user_key, obj->transaction_buffer, transfer_size) != 0)
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_init_registry
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_init_registry(void)
+{
+    // The first instance creates the registry mutex. Instances that are initialized at the same
+    // time wait until it is done, and one of them tries again if it failed. Without the GCC atomic
+    // builtins, the first instance must be initialized before other threads use the library.
+    uint8_t state = _MTB_KVSTORE_REGISTRY_NONE;
+    #if defined(__GNUC__)
+    while (!__atomic_compare_exchange_n(&_mtb_kvstore_registry_state, &state,
+                                        _MTB_KVSTORE_REGISTRY_BUSY, false, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_ACQUIRE))
+    {
+        if (state == _MTB_KVSTORE_REGISTRY_READY)
         {
-            return MTB_KVSTORE_ITEM_NOT_FOUND_ERROR;
+            return CY_RSLT_SUCCESS;
         }
-
-        key_addr += transfer_size;
-        remaining_size -= transfer_size;
+        (void)cy_rtos_delay_milliseconds(1);
+        state = _MTB_KVSTORE_REGISTRY_NONE;
     }
+    #else
+    if (_mtb_kvstore_registry_state == _MTB_KVSTORE_REGISTRY_READY)
+    {
+        return CY_RSLT_SUCCESS;
+    }
+    #endif
 
+    cy_rslt_t result = cy_rtos_init_mutex(&_mtb_kvstore_registry_mutex);
+    state = (result == CY_RSLT_SUCCESS) ? _MTB_KVSTORE_REGISTRY_READY : _MTB_KVSTORE_REGISTRY_NONE;
+    #if defined(__GNUC__)
+    __atomic_store_n(&_mtb_kvstore_registry_state, state, __ATOMIC_RELEASE);
+    #else
+    _mtb_kvstore_registry_state = state;
+    #endif
     return result;
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// _mtb_kvstore_read_record
+// _mtb_kvstore_registry_ready
 //--------------------------------------------------------------------------------------------------
-static cy_rslt_t _mtb_kvstore_read_record(mtb_kvstore_t* obj,
-                                          uint32_t area_address,
-                                          uint32_t offset,
-                                          _mtb_kvstore_record_header_t* record_header,
-                                          const char* key,
-                                          bool validate_key,
-                                          uint8_t* data,
-                                          uint32_t* data_size)
+static bool _mtb_kvstore_registry_ready(void)
 {
-    CY_ASSERT(obj != NULL);
-    cy_rslt_t result = CY_RSLT_SUCCESS;
-    uint16_t crc = _MTB_KVSTORE_CRC_INIT_VAL;
-
-    uint32_t record_start_addr = area_address + offset;
-    uint8_t header_size = sizeof(_mtb_kvstore_record_header_t);
+    #if defined(__GNUC__)
+    return (__atomic_load_n(&_mtb_kvstore_registry_state, __ATOMIC_ACQUIRE) ==
+            _MTB_KVSTORE_REGISTRY_READY);
+    #else
+    return (_mtb_kvstore_registry_state == _MTB_KVSTORE_REGISTRY_READY);
+    #endif
+}
 
-    CY_ASSERT(record_header != NULL);
 
-    // Read header for the record
-    result =
-        obj->bd->read(obj->bd->context, record_start_addr, header_size, (uint8_t*)record_header);
-    if (result != CY_RSLT_SUCCESS)
-    {
-        return result;
-    }
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_registry_lock
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_registry_lock(void)
+{
+    cy_rslt_t result = cy_rtos_get_mutex(&_mtb_kvstore_registry_mutex, CY_RTOS_NEVER_TIMEOUT);
+    CY_ASSERT(result == CY_RSLT_SUCCESS);
+    CY_UNUSED_PARAMETER(result);
+}
 
-    if ((record_header->magic == 0xFFFFFFFFU) || (record_header->magic == 0))
-    {
-        return MTB_KVSTORE_ERASED_DATA_ERROR;
-    }
 
-    if (record_header->magic != _MTB_KVSTORE_HEADER_MAGIC)
-    {
-        return MTB_KVSTORE_INVALID_DATA_ERROR;
-    }
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_registry_unlock
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_registry_unlock(void)
+{
+    cy_rslt_t result = cy_rtos_set_mutex(&_mtb_kvstore_registry_mutex);
+    CY_ASSERT(result == CY_RSLT_SUCCESS);
+    CY_UNUSED_PARAMETER(result);
+}
 
-    if ((record_header->key_size == 0) || (record_header->key_size >= MTB_KVSTORE_MAX_KEY_SIZE))
-    {
-        return MTB_KVSTORE_INVALID_DATA_ERROR;
-    }
 
-    // If a data buffer is provided and the size is less that what is in the storage
-    // return error.
-    if ((data != NULL) && (data_size != NULL) && (*data_size < record_header->data_size))
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_join_gc_group
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_join_gc_group(mtb_kvstore_t* obj)
+{
+    // Instances that use the same block device share the mutex that serializes their garbage
+    // collections. Instances on different devices collect garbage independently.
+    cy_rslt_t result = CY_RSLT_SUCCESS;
+    _mtb_kvstore_registry_lock();
+    mtb_kvstore_gc_group_t* group = _mtb_kvstore_gc_groups;
+    while ((group != NULL) && (group->bd != obj->bd))
     {
-        *data_size = record_header->data_size;
-        return MTB_KVSTORE_BUFFER_TOO_SMALL;
+        group = group->next;
     }
-
-    crc = _mtb_kvstore_get_header_crc(record_header, crc);
-
-    // Copy key into the provided key area
-    uint32_t key_addr = record_start_addr + record_header->header_size;
-    if (key != NULL)
+    if (group == NULL)
     {
-        if (validate_key)
+        group = (mtb_kvstore_gc_group_t*)malloc(sizeof(mtb_kvstore_gc_group_t));
+        result = (group != NULL) ? cy_rtos_init_mutex(&group->mutex) : MTB_KVSTORE_MEM_ALLOC_ERROR;
+        if (result == CY_RSLT_SUCCESS)
         {
-            result = _mtb_kvstore_validate_key(obj, key_addr, key, record_header->key_size);
-            if (result != CY_RSLT_SUCCESS)
-            {
-                return result;
-            }
+            group->bd = obj->bd;
+            group->num_instances = 0;
+            group->next = _mtb_kvstore_gc_groups;
+            _mtb_kvstore_gc_groups = group;
         }
         else
         {
-            result = obj->bd->read(obj->bd->context, key_addr, record_header->key_size,
-                                   (uint8_t*)key);
-            if (result != CY_RSLT_SUCCESS)
-            {
-                return result;
-            }
+            free(group);
+            group = NULL;
         }
-
-        // If the user passes in a key for validation since at this point we have
-        // validated that the key on the storage is the same as what was passes in
-        // it should be ok to use the key passed in by the user for CRC calculation.
-        crc = _mtb_kvstore_crc16((uint8_t*)key, record_header->key_size, crc);
     }
-    else
+    if (group != NULL)
     {
-        // Start buffered CRC
-        result = _mtb_kvstore_buffered_crc_compute(obj, key_addr, record_header->key_size, &crc);
-        if (result != CY_RSLT_SUCCESS)
-        {
-            return result;
-        }
+        group->num_instances++;
+        obj->gc_group = group;
     }
+    _mtb_kvstore_registry_unlock();
+    return result;
+}
 
-    uint32_t data_addr = key_addr + record_header->key_size;
-    if ((data != NULL) && (data_size != NULL))
-    {
-        // Copy data into the data buffer provided
-        result = obj->bd->read(obj->bd->context, data_addr, record_header->data_size, data);
-        if (result != CY_RSLT_SUCCESS)
-        {
-            return result;
-        }
 
-        crc = _mtb_kvstore_crc16(data, record_header->data_size, crc);
-    }
-    else
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_leave_gc_group
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_leave_gc_group(mtb_kvstore_t* obj)
+{
+    mtb_kvstore_gc_group_t* group = obj->gc_group;
+    if (group != NULL)
     {
-        result = _mtb_kvstore_buffered_crc_compute(obj, data_addr, record_header->data_size, &crc);
-        if (result != CY_RSLT_SUCCESS)
+        _mtb_kvstore_registry_lock();
+        group->num_instances--;
+        if (group->num_instances == 0)
         {
-            return result;
+            mtb_kvstore_gc_group_t** link = &_mtb_kvstore_gc_groups;
+            while (*link != group)
+            {
+                link = &(*link)->next;
+            }
+            *link = group->next;
+            (void)cy_rtos_deinit_mutex(&group->mutex);
+            free(group);
         }
+        _mtb_kvstore_registry_unlock();
+        obj->gc_group = NULL;
     }
+}
 
-    // If the CRC did not match then record is corrupted.
-    if (record_header->crc != crc)
-    {
-        return MTB_KVSTORE_INVALID_DATA_ERROR;
-    }
-
-    if (data_size != NULL)
-    {
-        *data_size = record_header->data_size;
-    }
 
-    return result;
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_gc_lock
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_gc_lock(mtb_kvstore_t* obj)
+{
+    CY_ASSERT(obj->gc_group != NULL);
+    cy_rslt_t result = cy_rtos_get_mutex(&obj->gc_group->mutex, CY_RTOS_NEVER_TIMEOUT);
+    CY_ASSERT(result == CY_RSLT_SUCCESS);
+    CY_UNUSED_PARAMETER(result);
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// _mtb_kvstore_read_partial_record
+// _mtb_kvstore_gc_unlock
 //--------------------------------------------------------------------------------------------------
-static cy_rslt_t _mtb_kvstore_read_partial_record(mtb_kvstore_t* obj,
-                                                  uint32_t area_address,
-                                                  uint32_t offset,
-                                                  _mtb_kvstore_record_header_t* record_header,
-                                                  const char* key,
-                                                  bool validate_key,
-                                                  uint8_t* data,
-                                                  uint32_t* data_size,
-                                                  const uint32_t offset_bytes)
+static void _mtb_kvstore_gc_unlock(mtb_kvstore_t* obj)
 {
-    CY_ASSERT(obj != NULL);
-    cy_rslt_t result = CY_RSLT_SUCCESS;
+    cy_rslt_t result = cy_rtos_set_mutex(&obj->gc_group->mutex);
+    CY_ASSERT(result == CY_RSLT_SUCCESS);
+    CY_UNUSED_PARAMETER(result);
+}
 
-    uint32_t record_start_addr = area_address + offset;
-    uint8_t header_size = sizeof(_mtb_kvstore_record_header_t);
 
-    CY_ASSERT(record_header != NULL);
+#else // if defined(MTB_KVSTORE_RTOS_AWARE)
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_initlock
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_initlock(mtb_kvstore_t* obj)
+{
+    CY_UNUSED_PARAMETER(obj);
+    return CY_RSLT_SUCCESS;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_lock
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_lock(mtb_kvstore_t* obj)
+{
+    CY_UNUSED_PARAMETER(obj);
+    return CY_RSLT_SUCCESS;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_lock_wait_forever
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_lock_wait_forever(mtb_kvstore_t* obj)
+{
+    CY_UNUSED_PARAMETER(obj);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_unlock
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_unlock(mtb_kvstore_t* obj)
+{
+    CY_UNUSED_PARAMETER(obj);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_admit_readers
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_admit_readers(mtb_kvstore_t* obj)
+{
+    CY_UNUSED_PARAMETER(obj);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_exclude_readers
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_exclude_readers(mtb_kvstore_t* obj)
+{
+    CY_UNUSED_PARAMETER(obj);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_lock_shared
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_lock_shared(mtb_kvstore_t* obj)
+{
+    CY_UNUSED_PARAMETER(obj);
+    return CY_RSLT_SUCCESS;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_unlock_shared
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_unlock_shared(mtb_kvstore_t* obj)
+{
+    CY_UNUSED_PARAMETER(obj);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_queue_lock
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_queue_lock(mtb_kvstore_t* obj)
+{
+    CY_UNUSED_PARAMETER(obj);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_queue_unlock
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_queue_unlock(mtb_kvstore_t* obj)
+{
+    CY_UNUSED_PARAMETER(obj);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_cache_lock
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_cache_lock(mtb_kvstore_t* obj)
+{
+    CY_UNUSED_PARAMETER(obj);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_cache_unlock
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_cache_unlock(mtb_kvstore_t* obj)
+{
+    CY_UNUSED_PARAMETER(obj);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_hold_view
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_hold_view(mtb_kvstore_t* obj, uint32_t area)
+{
+    obj->num_views[area]++;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_drop_view
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_drop_view(mtb_kvstore_t* obj, uint32_t area)
+{
+    CY_ASSERT(obj->num_views[area] > 0);
+    obj->num_views[area]--;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_wait_for_views
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_wait_for_views(mtb_kvstore_t* obj, uint32_t area)
+{
+    // Without an RTOS the views can only be released by the caller of the modification.
+    return (obj->num_views[area] == 0) ? CY_RSLT_SUCCESS : MTB_KVSTORE_VIEW_BUSY_ERROR;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_init_registry
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_init_registry(void)
+{
+    return CY_RSLT_SUCCESS;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_registry_ready
+//--------------------------------------------------------------------------------------------------
+static bool _mtb_kvstore_registry_ready(void)
+{
+    return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_registry_lock
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_registry_lock(void)
+{
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_registry_unlock
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_registry_unlock(void)
+{
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_join_gc_group
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_join_gc_group(mtb_kvstore_t* obj)
+{
+    CY_UNUSED_PARAMETER(obj);
+    return CY_RSLT_SUCCESS;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_leave_gc_group
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_leave_gc_group(mtb_kvstore_t* obj)
+{
+    CY_UNUSED_PARAMETER(obj);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_gc_lock
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_gc_lock(mtb_kvstore_t* obj)
+{
+    CY_UNUSED_PARAMETER(obj);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_gc_unlock
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_gc_unlock(mtb_kvstore_t* obj)
+{
+    CY_UNUSED_PARAMETER(obj);
+}
+
+
+#endif // if defined(MTB_KVSTORE_RTOS_AWARE)
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_is_valid_key
+//--------------------------------------------------------------------------------------------------
+static inline bool _mtb_kvstore_is_valid_key(const char* key)
+{
+    if (NULL != key)
+    {
+        uint32_t key_size = strlen(key);
+        return (key_size > 0) && (key_size < MTB_KVSTORE_MAX_KEY_SIZE);
+    }
+    return false;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_is_valid_value_size
+//--------------------------------------------------------------------------------------------------
+static inline bool _mtb_kvstore_is_valid_value_size(uint32_t size)
+{
+    return (MTB_KVSTORE_MAX_VALUE_SIZE == 0U) || (size <= MTB_KVSTORE_MAX_VALUE_SIZE);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_align_up
+//--------------------------------------------------------------------------------------------------
+static inline uint32_t _mtb_kvstore_align_up(uint32_t val, uint32_t size)
+{
+    return (((val - 1) / size) + 1) * size;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_is_aligned
+//--------------------------------------------------------------------------------------------------
+static inline bool _mtb_kvstore_is_aligned(uint32_t val, uint32_t size)
+{
+    return ((val & (size - 1)) == 0);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_get_varint_size
+//--------------------------------------------------------------------------------------------------
+static inline uint32_t _mtb_kvstore_get_varint_size(uint32_t value)
+{
+    uint32_t size = 1;
+    while (value >= 0x80U)
+    {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_get_header_size
+//--------------------------------------------------------------------------------------------------
+static inline uint32_t _mtb_kvstore_get_header_size(uint8_t format_version, uint32_t key_size,
+                                                    uint32_t data_size)
+{
+    if (format_version == _MTB_KVSTORE_COMPACT_FORMAT_VERSION)
+    {
+        return 4U + _mtb_kvstore_get_varint_size(key_size) +
+               _mtb_kvstore_get_varint_size(data_size);
+    }
+    return sizeof(_mtb_kvstore_record_header_t);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_get_format_version
+//--------------------------------------------------------------------------------------------------
+static inline uint8_t _mtb_kvstore_get_format_version(mtb_kvstore_t* obj)
+{
+    // Format of the records that are written. Records of either format are read.
+    return (obj->config.compact_headers)
+           ? _MTB_KVSTORE_COMPACT_FORMAT_VERSION
+           : _MTB_KVSTORE_FORMAT_VERSION;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_get_record_alignment
+//--------------------------------------------------------------------------------------------------
+static uint32_t _mtb_kvstore_get_record_alignment(mtb_kvstore_t* obj, uint32_t record_address)
+{
+    // The active area keeps the layout it was written with, records copied into the GC area use
+    // the configured one.
+    bool packed = ((record_address - obj->active_area_addr) < _MTB_KVSTORE_AREA_SIZE(obj))
+                  ? obj->active_area_packed
+                  : obj->config.packed_records;
+    return packed
+           ? _MTB_KVSTORE_PACKED_ALIGNMENT
+           : obj->bd->program_size(obj->bd->context, record_address);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_get_record_size
+//--------------------------------------------------------------------------------------------------
+static uint32_t _mtb_kvstore_get_record_size(mtb_kvstore_t* obj, uint32_t record_offset,
+                                             uint32_t key_size, uint32_t data_size)
+{
+    // Size of a record that is written now, in the configured format.
+    uint32_t header_size = _mtb_kvstore_get_header_size(_mtb_kvstore_get_format_version(obj),
+                                                        key_size, data_size);
+    return _mtb_kvstore_align_up(header_size + key_size + data_size,
+                                 _mtb_kvstore_get_record_alignment(obj, record_offset));
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_get_stored_record_size
+//--------------------------------------------------------------------------------------------------
+static uint32_t _mtb_kvstore_get_stored_record_size(mtb_kvstore_t* obj, uint32_t record_offset,
+                                                    const _mtb_kvstore_record_header_t* header)
+{
+    return _mtb_kvstore_align_up(header->header_size + header->key_size + header->data_size,
+                                 _mtb_kvstore_get_record_alignment(obj, record_offset));
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_get_area_header_record_size
+//--------------------------------------------------------------------------------------------------
+static inline uint32_t _mtb_kvstore_get_area_header_record_size(mtb_kvstore_t* obj,
+                                                                uint32_t area_address)
+{
+    // The area header is always written in format 0 so that it is found by every version.
+    return _mtb_kvstore_align_up(sizeof(_mtb_kvstore_record_header_t) +
+                                 strlen(_mtb_kvstore_area_rec_key) +
+                                 sizeof(_mtb_kvstore_area_record_data_t),
+                                 _mtb_kvstore_get_record_alignment(obj, area_address));
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_alloc_buffer
+//--------------------------------------------------------------------------------------------------
+static uint8_t* _mtb_kvstore_alloc_buffer(uint32_t size, uint32_t alignment, void** mem)
+{
+    uint32_t padding = (alignment > 1) ? (alignment - 1) : 0;
+    *mem = malloc(size + padding);
+    if (*mem == NULL)
+    {
+        return NULL;
+    }
+    return (uint8_t*)(((uintptr_t)*mem + padding) & ~((uintptr_t)padding));
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_grow_buffer
+//--------------------------------------------------------------------------------------------------
+static bool _mtb_kvstore_grow_buffer(mtb_kvstore_t* obj, uint32_t size,
+                                     _mtb_kvstore_buffer_t* saved_buffer)
+{
+    if (size > obj->config.max_buffer_size)
+    {
+        size = obj->config.max_buffer_size;
+    }
+    uint32_t prog_size = obj->bd->program_size(obj->bd->context, obj->start_addr);
+    size = (size == 0) ? 0 : _mtb_kvstore_align_up(size, prog_size);
+    if (size <= obj->transaction_buffer_size)
+    {
+        return false;
+    }
+
+    // The larger buffer is only an optimization, so failing to allocate it is not an error.
+    void* mem;
+    uint8_t* buffer = _mtb_kvstore_alloc_buffer(size, obj->config.buffer_alignment, &mem);
+    if (buffer == NULL)
+    {
+        return false;
+    }
+
+    saved_buffer->buffer = obj->transaction_buffer;
+    saved_buffer->size = obj->transaction_buffer_size;
+    saved_buffer->mem = obj->transaction_buffer_mem;
+    obj->transaction_buffer = buffer;
+    obj->transaction_buffer_size = size;
+    obj->transaction_buffer_mem = mem;
+    return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_restore_buffer
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_restore_buffer(mtb_kvstore_t* obj,
+                                        const _mtb_kvstore_buffer_t* saved_buffer)
+{
+    free(obj->transaction_buffer_mem);
+    obj->transaction_buffer = saved_buffer->buffer;
+    obj->transaction_buffer_size = saved_buffer->size;
+    obj->transaction_buffer_mem = saved_buffer->mem;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_crc16
+//--------------------------------------------------------------------------------------------------
+uint16_t _mtb_kvstore_crc16(const uint8_t* data, uint32_t length, uint16_t init_crc)
+{
+    //Using CRC-16/CCITT-0 Algorithm
+    uint32_t crc = init_crc;
+    int i;
+    while (length--)
+    {
+        crc ^= ((uint32_t)*data++) << 8;
+        for (i = 0; i < 8; i++)
+        {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+        }
+    }
+    return crc & 0xffff;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_retire
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_retire(mtb_kvstore_t* obj, void* mem)
+{
+    // Frees memory that readers access without the lock, once it is no longer reachable. With lock
+    // free reads a reader may still be using it, so it is freed when the lock is released and no
+    // reader is in progress. If it cannot be tracked, the readers are waited for instead.
+    #if MTB_KVSTORE_LOCK_FREE_READS
+    if (mem != NULL)
+    {
+        mtb_kvstore_retired_t* retired = (mtb_kvstore_retired_t*)malloc(sizeof(*retired));
+        if (retired != NULL)
+        {
+            retired->mem = mem;
+            retired->next = obj->retired;
+            obj->retired = retired;
+        }
+        else
+        {
+            _mtb_kvstore_wait_for_lock_free_readers(obj);
+            free(mem);
+        }
+    }
+    #else
+    CY_UNUSED_PARAMETER(obj);
+    free(mem);
+    #endif
+}
+
+
+#if !MTB_KVSTORE_LOCK_FREE_READS
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_free_retired
+//--------------------------------------------------------------------------------------------------
+static inline void _mtb_kvstore_free_retired(mtb_kvstore_t* obj)
+{
+    CY_UNUSED_PARAMETER(obj);
+}
+
+
+#endif // if !MTB_KVSTORE_LOCK_FREE_READS
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_grow_shared
+//--------------------------------------------------------------------------------------------------
+static void* _mtb_kvstore_grow_shared(void* mem, size_t used_size, size_t new_size)
+{
+    // Copies memory that readers access without the lock to a larger allocation. The caller
+    // publishes the new memory before its new size, as readers load them in the opposite order,
+    // and then retires the old memory.
+    void* new_mem = malloc(new_size);
+    if ((new_mem != NULL) && (used_size > 0))
+    {
+        memcpy(new_mem, mem, used_size);
+    }
+    return new_mem;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_increment_max_keys
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_increment_max_keys(mtb_kvstore_t* obj)
+{
+    cy_rslt_t result = CY_RSLT_SUCCESS;
+    uint32_t new_entry_count = obj->max_entries * 2;
+    size_t entry_size = sizeof(mtb_kvstore_ram_table_entry_t);
+    mtb_kvstore_ram_table_entry_t* old_table = obj->ram_table;
+    void* new_table = _mtb_kvstore_grow_shared(old_table, obj->max_entries * entry_size,
+                                               new_entry_count * entry_size);
+    if (new_table != NULL)
+    {
+        _MTB_KVSTORE_PUBLISH(obj->ram_table, (mtb_kvstore_ram_table_entry_t*)new_table);
+        _MTB_KVSTORE_PUBLISH(obj->max_entries, new_entry_count);
+        _mtb_kvstore_retire(obj, old_table);
+    }
+    else
+    {
+        result = MTB_KVSTORE_MEM_ALLOC_ERROR;
+    }
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_encode_key_id
+//--------------------------------------------------------------------------------------------------
+static inline void _mtb_kvstore_encode_key_id(uint32_t id, char* id_key)
+{
+    // Both bytes have the top bit set so that the ID never contains a terminating zero.
+    CY_ASSERT(id < _MTB_KVSTORE_MAX_KEY_IDS);
+    id_key[0] = (char)(0x80U | (id & 0x7FU));
+    id_key[1] = (char)(0x80U | (id >> 7));
+    id_key[_MTB_KVSTORE_KEY_ID_SIZE] = '\0';
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_decode_key_id
+//--------------------------------------------------------------------------------------------------
+static inline bool _mtb_kvstore_decode_key_id(const char* id_key, uint32_t key_size,
+                                              uint32_t* id)
+{
+    uint8_t low = (uint8_t)id_key[0];
+    uint8_t high = (uint8_t)id_key[1];
+    if ((key_size != _MTB_KVSTORE_KEY_ID_SIZE) || ((low & 0x80U) == 0) || ((high & 0x80U) == 0))
+    {
+        return false;
+    }
+    *id = (low & 0x7FU) | ((uint32_t)(high & 0x7FU) << 7);
+    return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_find_key_id
+//--------------------------------------------------------------------------------------------------
+static bool _mtb_kvstore_find_key_id(mtb_kvstore_t* obj, const char* key, uint32_t* id)
+{
+    // The dictionary keeps a copy of each key, so it is searched without accessing the storage.
+    // Readers that do not hold the lock load the size, the dictionary and the count in this order.
+    uint32_t max_key_ids = _MTB_KVSTORE_LOAD(obj->max_key_ids);
+    const mtb_kvstore_key_dict_entry_t* key_dict = _MTB_KVSTORE_LOAD(obj->key_dict);
+    uint32_t num_key_ids = _MTB_KVSTORE_LOAD(obj->num_key_ids);
+    if (num_key_ids > max_key_ids)
+    {
+        num_key_ids = max_key_ids;
+    }
+
+    uint16_t hash = _mtb_kvstore_crc16((uint8_t*)key, strlen(key), _MTB_KVSTORE_CRC_INIT_VAL);
+    for (uint32_t idx = 0; idx < num_key_ids; idx++)
+    {
+        if ((key_dict[idx].hash == hash) && (strcmp(key_dict[idx].key, key) == 0))
+        {
+            *id = idx;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_get_key_flags
+//--------------------------------------------------------------------------------------------------
+static inline uint8_t _mtb_kvstore_get_key_flags(mtb_kvstore_t* obj, const char* key)
+{
+    // Records of keys that are in the dictionary always refer to them by their ID.
+    uint32_t id;
+    return _mtb_kvstore_find_key_id(obj, key, &id)
+           ? _MTB_KVSTORE_KEY_ID_FLAG
+           : _MTB_KVSTORE_NO_FLAG;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_get_stored_key
+//--------------------------------------------------------------------------------------------------
+static const char* _mtb_kvstore_get_stored_key(mtb_kvstore_t* obj, const char* key,
+                                               uint8_t flags, char* id_key)
+{
+    // Returns the key as it is stored in a record with the given flags, or NULL if the record
+    // refers to a key ID and the key has none.
+    uint32_t id;
+    if ((flags & _MTB_KVSTORE_KEY_ID_FLAG) == 0)
+    {
+        return key;
+    }
+    if (!_mtb_kvstore_find_key_id(obj, key, &id))
+    {
+        return NULL;
+    }
+    _mtb_kvstore_encode_key_id(id, id_key);
+    return id_key;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_get_stored_key_size
+//--------------------------------------------------------------------------------------------------
+static inline uint32_t _mtb_kvstore_get_stored_key_size(const char* key, uint8_t flags)
+{
+    return ((flags & _MTB_KVSTORE_KEY_ID_FLAG) != 0)
+           ? _MTB_KVSTORE_KEY_ID_SIZE
+           : strlen(key);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_add_key_id
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_add_key_id(mtb_kvstore_t* obj, const char* key, uint32_t offset)
+{
+    if (obj->num_key_ids >= obj->max_key_ids)
+    {
+        uint32_t new_count = (obj->max_key_ids == 0)
+                             ? _MTB_KVSTORE_INIT_MAX_KEY_IDS
+                             : (2U * obj->max_key_ids);
+        size_t entry_size = sizeof(mtb_kvstore_key_dict_entry_t);
+        mtb_kvstore_key_dict_entry_t* old_dict = obj->key_dict;
+        void* new_dict = _mtb_kvstore_grow_shared(old_dict, obj->num_key_ids * entry_size,
+                                                  new_count * entry_size);
+        if (new_dict == NULL)
+        {
+            return MTB_KVSTORE_MEM_ALLOC_ERROR;
+        }
+        _MTB_KVSTORE_PUBLISH(obj->key_dict, (mtb_kvstore_key_dict_entry_t*)new_dict);
+        _MTB_KVSTORE_PUBLISH(obj->max_key_ids, new_count);
+        _mtb_kvstore_retire(obj, old_dict);
+    }
+
+    size_t key_size = strlen(key);
+    char* key_copy = (char*)malloc(key_size + 1);
+    if (key_copy == NULL)
+    {
+        return MTB_KVSTORE_MEM_ALLOC_ERROR;
+    }
+    memcpy(key_copy, key, key_size + 1);
+
+    // The entry is complete before readers can see it
+    mtb_kvstore_key_dict_entry_t* entry = &obj->key_dict[obj->num_key_ids];
+    entry->hash = _mtb_kvstore_crc16((uint8_t*)key, key_size, _MTB_KVSTORE_CRC_INIT_VAL);
+    entry->offset = offset;
+    entry->gc_offset = offset;
+    entry->key = key_copy;
+    _MTB_KVSTORE_PUBLISH(obj->num_key_ids, obj->num_key_ids + 1U);
+    return CY_RSLT_SUCCESS;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_free_key_dict
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_free_key_dict(mtb_kvstore_t* obj)
+{
+    // The count is cleared first, as readers that do not hold the lock load it last.
+    mtb_kvstore_key_dict_entry_t* key_dict = obj->key_dict;
+    uint32_t num_key_ids = obj->num_key_ids;
+    _MTB_KVSTORE_PUBLISH(obj->num_key_ids, 0U);
+    _MTB_KVSTORE_PUBLISH(obj->max_key_ids, 0U);
+    _MTB_KVSTORE_PUBLISH(obj->key_dict, NULL);
+    for (uint32_t idx = 0; idx < num_key_ids; idx++)
+    {
+        _mtb_kvstore_retire(obj, key_dict[idx].key);
+    }
+    _mtb_kvstore_retire(obj, key_dict);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_hash_blob
+//--------------------------------------------------------------------------------------------------
+static uint64_t _mtb_kvstore_hash_blob(const uint8_t* data, uint32_t size)
+{
+    // 64-bit FNV-1a. Blobs with the same hash are compared before they are shared, so the hash
+    // only needs to make collisions rare. 0 is reserved for chunks that are not shared.
+    uint64_t hash = _MTB_KVSTORE_FNV_OFFSET_BASIS;
+    for (uint32_t idx = 0; idx < size; idx++)
+    {
+        hash = (hash ^ data[idx]) * _MTB_KVSTORE_FNV_PRIME;
+    }
+    return (hash == 0) ? 1 : hash;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_encode_blob_key
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_encode_blob_key(uint64_t hash, char* blob_key)
+{
+    // Blob records use the hash of their content as hexadecimal digits as their key.
+    static const char digits[] = "0123456789abcdef";
+    for (uint32_t idx = 0; idx < _MTB_KVSTORE_BLOB_KEY_SIZE; idx++)
+    {
+        blob_key[idx] = digits[(hash >> (4U * (_MTB_KVSTORE_BLOB_KEY_SIZE - 1U - idx))) & 0xFU];
+    }
+    blob_key[_MTB_KVSTORE_BLOB_KEY_SIZE] = '\0';
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_decode_blob_key
+//--------------------------------------------------------------------------------------------------
+static bool _mtb_kvstore_decode_blob_key(const char* blob_key, uint32_t key_size, uint64_t* hash)
+{
+    if (key_size != _MTB_KVSTORE_BLOB_KEY_SIZE)
+    {
+        return false;
+    }
+    *hash = 0;
+    for (uint32_t idx = 0; idx < _MTB_KVSTORE_BLOB_KEY_SIZE; idx++)
+    {
+        char digit = blob_key[idx];
+        uint32_t value;
+        if ((digit >= '0') && (digit <= '9'))
+        {
+            value = (uint32_t)(digit - '0');
+        }
+        else if ((digit >= 'a') && (digit <= 'f'))
+        {
+            value = (uint32_t)(digit - 'a') + 10U;
+        }
+        else
+        {
+            return false;
+        }
+        *hash = (*hash << 4) | value;
+    }
+    return (*hash != 0);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_find_blob
+//--------------------------------------------------------------------------------------------------
+static uint32_t _mtb_kvstore_find_blob(mtb_kvstore_t* obj, uint64_t hash)
+{
+    // Returns the index of the blob with the given hash or num_blobs if there is none.
+    uint32_t idx = 0;
+    while ((idx < obj->num_blobs) && (obj->blobs[idx].hash != hash))
+    {
+        idx++;
+    }
+    return idx;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_find_blob_at
+//--------------------------------------------------------------------------------------------------
+static uint32_t _mtb_kvstore_find_blob_at(mtb_kvstore_t* obj, uint32_t offset)
+{
+    // Returns the index of the blob stored at the given offset or num_blobs if there is none.
+    uint32_t idx = 0;
+    while ((idx < obj->num_blobs) && (obj->blobs[idx].offset != offset))
+    {
+        idx++;
+    }
+    return idx;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_reserve_blobs
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_reserve_blobs(mtb_kvstore_t* obj, uint32_t count)
+{
+    // Makes room for count more blob entries so that adding them cannot fail later.
+    if ((obj->num_blobs + count) > obj->max_blobs)
+    {
+        uint32_t new_count = (obj->max_blobs == 0) ? _MTB_KVSTORE_INIT_MAX_BLOBS : obj->max_blobs;
+        while (new_count < (obj->num_blobs + count))
+        {
+            new_count *= 2U;
+        }
+        mtb_kvstore_blob_entry_t* new_blobs = (mtb_kvstore_blob_entry_t*)realloc(
+            obj->blobs, new_count * sizeof(mtb_kvstore_blob_entry_t));
+        if (new_blobs == NULL)
+        {
+            return MTB_KVSTORE_MEM_ALLOC_ERROR;
+        }
+        obj->blobs = new_blobs;
+        obj->max_blobs = new_count;
+    }
+    return CY_RSLT_SUCCESS;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_free_blobs
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_free_blobs(mtb_kvstore_t* obj)
+{
+    free(obj->blobs);
+    obj->blobs = NULL;
+    obj->num_blobs = 0;
+    obj->max_blobs = 0;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_next_generation
+//--------------------------------------------------------------------------------------------------
+static inline uint32_t _mtb_kvstore_next_generation(mtb_kvstore_t* obj)
+{
+    // Generations are shared by all keys so that a key that is deleted and created again does not
+    // repeat a version that a reader may still hold.
+    obj->last_generation++;
+    if ((obj->last_generation == MTB_KVSTORE_VERSION_NONE) ||
+        (obj->last_generation == _MTB_KVSTORE_ANY_VERSION))
+    {
+        obj->last_generation = MTB_KVSTORE_VERSION_NONE + 1;
+    }
+    return obj->last_generation;
+}
+
+
+#if (MTB_KVSTORE_INLINE_VALUE_SIZE > 0)
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_is_inline
+//--------------------------------------------------------------------------------------------------
+static inline bool _mtb_kvstore_is_inline(const mtb_kvstore_ram_table_entry_t* entry)
+{
+    return (entry->inline_key != NULL);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_drop_inline
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_drop_inline(mtb_kvstore_ram_table_entry_t* entry)
+{
+    free(entry->inline_key);
+    _MTB_KVSTORE_STORE_FIELD(entry->inline_key, NULL);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_set_inline
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_set_inline(mtb_kvstore_t* obj, uint32_t ram_tbl_idx, const char* key,
+                                    uint8_t flags, const uint8_t* data, uint32_t data_size)
+{
+    // Only values that are stored as is are kept inline. If there is no memory for the key, the
+    // value is read from the storage instead.
+    mtb_kvstore_ram_table_entry_t* entry = &obj->ram_table[ram_tbl_idx];
+    _mtb_kvstore_drop_inline(entry);
+    if (((flags & _MTB_KVSTORE_VALUE_TYPE_FLAGS) == 0) &&
+        (data_size <= MTB_KVSTORE_INLINE_VALUE_SIZE))
+    {
+        size_t key_size = strlen(key) + 1U;
+        char* inline_key = (char*)malloc(key_size);
+        if (inline_key != NULL)
+        {
+            memcpy(inline_key, key, key_size);
+            entry->inline_size = (uint8_t)data_size;
+            if (data_size != 0)
+            {
+                memcpy(entry->inline_value, data, data_size);
+            }
+            _MTB_KVSTORE_STORE_FIELD(entry->inline_key, inline_key);
+        }
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_load_inline
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_load_inline(mtb_kvstore_t* obj, uint32_t ram_tbl_idx,
+                                          const char* key, uint32_t offset,
+                                          const _mtb_kvstore_record_header_t* header)
+{
+    // Called at initialization for a record that was found valid, to keep its value inline.
+    if (((header->flags & _MTB_KVSTORE_VALUE_TYPE_FLAGS) != 0) ||
+        (header->data_size > MTB_KVSTORE_INLINE_VALUE_SIZE))
+    {
+        return CY_RSLT_SUCCESS;
+    }
+
+    uint8_t value[MTB_KVSTORE_INLINE_VALUE_SIZE];
+    cy_rslt_t result = CY_RSLT_SUCCESS;
+    if (header->data_size != 0)
+    {
+        result = obj->bd->read(obj->bd->context, obj->active_area_addr + offset +
+                               header->header_size + header->key_size, header->data_size, value);
+    }
+    if (result == CY_RSLT_SUCCESS)
+    {
+        _mtb_kvstore_set_inline(obj, ram_tbl_idx, key, header->flags, value, header->data_size);
+    }
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_match_inline
+//--------------------------------------------------------------------------------------------------
+static bool _mtb_kvstore_match_inline(const mtb_kvstore_ram_table_entry_t* entry,
+                                      const char* key, uint32_t* data_size, cy_rslt_t* result)
+{
+    // Compares the key of an inline value in RAM. Returns false if the value is not inline.
+    if (!_mtb_kvstore_is_inline(entry))
+    {
+        return false;
+    }
+
+    *result = MTB_KVSTORE_ITEM_NOT_FOUND_ERROR;
+    if (strcmp(entry->inline_key, key) == 0)
+    {
+        *result = CY_RSLT_SUCCESS;
+        if (data_size != NULL)
+        {
+            *data_size = entry->inline_size;
+        }
+    }
+    return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_free_inline
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_free_inline(mtb_kvstore_t* obj)
+{
+    for (uint32_t ram_tbl_idx = 0; ram_tbl_idx < obj->num_entries; ram_tbl_idx++)
+    {
+        _mtb_kvstore_drop_inline(&obj->ram_table[ram_tbl_idx]);
+    }
+}
+
+
+#else // if (MTB_KVSTORE_INLINE_VALUE_SIZE > 0)
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_is_inline
+//--------------------------------------------------------------------------------------------------
+static inline bool _mtb_kvstore_is_inline(const mtb_kvstore_ram_table_entry_t* entry)
+{
+    CY_UNUSED_PARAMETER(entry);
+    return false;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_drop_inline
+//--------------------------------------------------------------------------------------------------
+static inline void _mtb_kvstore_drop_inline(mtb_kvstore_ram_table_entry_t* entry)
+{
+    CY_UNUSED_PARAMETER(entry);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_set_inline
+//--------------------------------------------------------------------------------------------------
+static inline void _mtb_kvstore_set_inline(mtb_kvstore_t* obj, uint32_t ram_tbl_idx,
+                                           const char* key, uint8_t flags, const uint8_t* data,
+                                           uint32_t data_size)
+{
+    CY_UNUSED_PARAMETER(obj);
+    CY_UNUSED_PARAMETER(ram_tbl_idx);
+    CY_UNUSED_PARAMETER(key);
+    CY_UNUSED_PARAMETER(flags);
+    CY_UNUSED_PARAMETER(data);
+    CY_UNUSED_PARAMETER(data_size);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_load_inline
+//--------------------------------------------------------------------------------------------------
+static inline cy_rslt_t _mtb_kvstore_load_inline(mtb_kvstore_t* obj, uint32_t ram_tbl_idx,
+                                                 const char* key, uint32_t offset,
+                                                 const _mtb_kvstore_record_header_t* header)
+{
+    CY_UNUSED_PARAMETER(obj);
+    CY_UNUSED_PARAMETER(ram_tbl_idx);
+    CY_UNUSED_PARAMETER(key);
+    CY_UNUSED_PARAMETER(offset);
+    CY_UNUSED_PARAMETER(header);
+    return CY_RSLT_SUCCESS;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_match_inline
+//--------------------------------------------------------------------------------------------------
+static inline bool _mtb_kvstore_match_inline(const mtb_kvstore_ram_table_entry_t* entry,
+                                             const char* key, uint32_t* data_size,
+                                             cy_rslt_t* result)
+{
+    CY_UNUSED_PARAMETER(entry);
+    CY_UNUSED_PARAMETER(key);
+    CY_UNUSED_PARAMETER(data_size);
+    CY_UNUSED_PARAMETER(result);
+    return false;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_free_inline
+//--------------------------------------------------------------------------------------------------
+static inline void _mtb_kvstore_free_inline(mtb_kvstore_t* obj)
+{
+    CY_UNUSED_PARAMETER(obj);
+}
+
+
+#endif // if (MTB_KVSTORE_INLINE_VALUE_SIZE > 0)
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_load_entry
+//--------------------------------------------------------------------------------------------------
+static inline void _mtb_kvstore_load_entry(mtb_kvstore_ram_table_entry_t* dst,
+                                           const mtb_kvstore_ram_table_entry_t* src)
+{
+    // Copies the fields of an entry that readers use without the lock.
+    dst->hash = _MTB_KVSTORE_LOAD_FIELD(src->hash);
+    dst->flags = _MTB_KVSTORE_LOAD_FIELD(src->flags);
+    dst->offset = _MTB_KVSTORE_LOAD_FIELD(src->offset);
+    dst->generation = _MTB_KVSTORE_LOAD_FIELD(src->generation);
+    #if (MTB_KVSTORE_INLINE_VALUE_SIZE > 0)
+    dst->inline_key = _MTB_KVSTORE_LOAD_FIELD(src->inline_key);
+    #endif
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_store_entry
+//--------------------------------------------------------------------------------------------------
+static inline void _mtb_kvstore_store_entry(mtb_kvstore_ram_table_entry_t* dst,
+                                            const mtb_kvstore_ram_table_entry_t* src)
+{
+    // Counterpart of _mtb_kvstore_load_entry for the RAM table that readers use. Inline values are
+    // only read with the lock held.
+    _MTB_KVSTORE_STORE_FIELD(dst->hash, src->hash);
+    _MTB_KVSTORE_STORE_FIELD(dst->flags, src->flags);
+    _MTB_KVSTORE_STORE_FIELD(dst->offset, src->offset);
+    _MTB_KVSTORE_STORE_FIELD(dst->generation, src->generation);
+    #if (MTB_KVSTORE_INLINE_VALUE_SIZE > 0)
+    _MTB_KVSTORE_STORE_FIELD(dst->inline_key, src->inline_key);
+    dst->inline_size = src->inline_size;
+    memcpy(dst->inline_value, src->inline_value, sizeof(dst->inline_value));
+    #endif
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_move_entries
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_move_entries(mtb_kvstore_ram_table_entry_t* dst,
+                                      const mtb_kvstore_ram_table_entry_t* src, uint32_t count)
+{
+    #if MTB_KVSTORE_LOCK_FREE_READS
+    // Entries are moved one field at a time, in the direction that does not overwrite the ones
+    // that still have to be moved.
+    if (dst < src)
+    {
+        for (uint32_t idx = 0; idx < count; idx++)
+        {
+            _mtb_kvstore_store_entry(&dst[idx], &src[idx]);
+        }
+    }
+    else
+    {
+        for (uint32_t idx = count; idx > 0; idx--)
+        {
+            _mtb_kvstore_store_entry(&dst[idx - 1U], &src[idx - 1U]);
+        }
+    }
+    #else
+    memmove(dst, src, count * sizeof(mtb_kvstore_ram_table_entry_t));
+    #endif
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_update_ram_table
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_update_ram_table(mtb_kvstore_t* obj, _mtb_kvstore_operation_t operation,
+                                          const _mtb_kvstore_update_ram_table_info_t* info)
+{
+    mtb_kvstore_ram_table_entry_t* entry;
+    switch (operation)
+    {
+        case _MTB_KVSTORE_OPER_DELETE:
+            CY_ASSERT(info->ram_tbl_idx < obj->num_entries);
+            _mtb_kvstore_drop_inline(&obj->ram_table[info->ram_tbl_idx]);
+            _MTB_KVSTORE_PUBLISH(obj->num_entries, obj->num_entries - 1U);
+            if (info->ram_tbl_idx < obj->num_entries)
+            {
+                _mtb_kvstore_move_entries(&obj->ram_table[info->ram_tbl_idx],
+                                          &obj->ram_table[info->ram_tbl_idx + 1],
+                                          obj->num_entries - info->ram_tbl_idx);
+            }
+            break;
+
+        case _MTB_KVSTORE_OPER_ADD:
+            CY_ASSERT(obj->num_entries < obj->max_entries);
+            CY_ASSERT(info->ram_tbl_idx <= obj->num_entries);
+            if (info->ram_tbl_idx < obj->num_entries)
+            {
+                _mtb_kvstore_move_entries(&obj->ram_table[info->ram_tbl_idx + 1],
+                                          &obj->ram_table[info->ram_tbl_idx],
+                                          obj->num_entries - info->ram_tbl_idx);
+            }
+            _MTB_KVSTORE_PUBLISH(obj->num_entries, obj->num_entries + 1U);
+            entry = &obj->ram_table[info->ram_tbl_idx];
+            _MTB_KVSTORE_STORE_FIELD(entry->hash, info->entry.hash);
+            _MTB_KVSTORE_STORE_FIELD(entry->flags, info->entry.flags);
+            _MTB_KVSTORE_STORE_FIELD(entry->offset, info->entry.offset);
+            _MTB_KVSTORE_STORE_FIELD(entry->generation, _mtb_kvstore_next_generation(obj));
+            #if (MTB_KVSTORE_INLINE_VALUE_SIZE > 0)
+            // The moved entry still owns the key that the new one was copied with.
+            _MTB_KVSTORE_STORE_FIELD(entry->inline_key, NULL);
+            #endif
+            break;
+
+        case _MTB_KVSTORE_OPER_UPDATE:
+            entry = &obj->ram_table[info->ram_tbl_idx];
+            _mtb_kvstore_drop_inline(entry);
+            _MTB_KVSTORE_STORE_FIELD(entry->hash, info->entry.hash);
+            _MTB_KVSTORE_STORE_FIELD(entry->flags, info->entry.flags);
+            _MTB_KVSTORE_STORE_FIELD(entry->offset, info->entry.offset);
+            _MTB_KVSTORE_STORE_FIELD(entry->generation, _mtb_kvstore_next_generation(obj));
+            break;
+
+        default:
+            CY_ASSERT(false);
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_update_consumed_size
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_update_consumed_size(mtb_kvstore_t* obj,
+                                              _mtb_kvstore_operation_t operation,
+                                              const _mtb_kvstore_update_consumed_size_info_t* info)
+{
+    switch (operation)
+    {
+        case _MTB_KVSTORE_OPER_DELETE:
+            obj->consumed_size -= info->old_record_size;
+            break;
+
+        case _MTB_KVSTORE_OPER_UPDATE:
+            obj->consumed_size = obj->consumed_size - info->old_record_size + info->new_record_size;
+            break;
+
+        case _MTB_KVSTORE_OPER_ADD:
+            obj->consumed_size += info->new_record_size;
+            break;
+
+        default:
+            CY_ASSERT(false);
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_area_index
+//--------------------------------------------------------------------------------------------------
+static inline uint32_t _mtb_kvstore_area_index(mtb_kvstore_t* obj, uint32_t area_address)
+{
+    return (area_address == obj->start_addr) ? 0U : 1U;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//_mtb_kvstore_erase_area
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_erase_area(mtb_kvstore_t* obj, uint32_t area_address)
+{
+    // This function operates on the assumption that erasing a sector is atomic. We first erase
+    // everything but the first sector.
+    uint32_t erase_size = obj->bd->erase_size(obj->bd->context, area_address);
+
+    // Erase from second sector to the end
+    cy_rslt_t result = CY_RSLT_SUCCESS;
+    if (erase_size < _MTB_KVSTORE_AREA_SIZE(obj))
+    {
+        result = obj->bd->erase(obj->bd->context, area_address + erase_size,
+                                _MTB_KVSTORE_AREA_SIZE(obj) - erase_size);
+    }
+
+    if (result == CY_RSLT_SUCCESS)
+    {
+        // Erase the first sector.
+        result = obj->bd->erase(obj->bd->context, area_address, erase_size);
+    }
+
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_get_header_crc
+//--------------------------------------------------------------------------------------------------
+static uint16_t _mtb_kvstore_get_header_crc(_mtb_kvstore_record_header_t* record_header,
+                                            uint16_t init_crc)
+{
+    uint16_t crc = init_crc;
+
+    // Compute CRC for header
+    crc = _mtb_kvstore_crc16((uint8_t*)&record_header->magic, sizeof(record_header->magic), crc);
+    crc =
+        _mtb_kvstore_crc16((uint8_t*)&record_header->format_version,
+                           sizeof(record_header->format_version), crc);
+    crc = _mtb_kvstore_crc16((uint8_t*)&record_header->flags, sizeof(record_header->flags), crc);
+    crc =
+        _mtb_kvstore_crc16((uint8_t*)&record_header->header_size,
+                           sizeof(record_header->header_size),
+                           crc);
+    crc = _mtb_kvstore_crc16((uint8_t*)&record_header->key_size, sizeof(record_header->key_size),
+                             crc);
+    crc = _mtb_kvstore_crc16((uint8_t*)&record_header->data_size, sizeof(record_header->data_size),
+                             crc);
+
+    return crc;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_get_crc_data_size
+//--------------------------------------------------------------------------------------------------
+static inline uint32_t _mtb_kvstore_get_crc_data_size(const _mtb_kvstore_record_header_t* header)
+{
+    // The tally region of a counter is modified in place, so only its base value is covered.
+    if (((header->flags & _MTB_KVSTORE_COUNTER_FLAG) != 0) &&
+        (header->data_size > sizeof(uint32_t)))
+    {
+        return sizeof(uint32_t);
+    }
+    return header->data_size;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_get_record_crc
+//--------------------------------------------------------------------------------------------------
+static uint16_t _mtb_kvstore_get_record_crc(_mtb_kvstore_record_header_t* record_header,
+                                            const char* key,
+                                            const uint8_t* data)
+{
+    CY_ASSERT(record_header != NULL);
+    CY_ASSERT(key != NULL);
+    uint16_t crc = _MTB_KVSTORE_CRC_INIT_VAL;
+
+    // Compute CRC for header
+    crc = _mtb_kvstore_get_header_crc(record_header, crc);
+    crc = _mtb_kvstore_crc16((uint8_t*)key, record_header->key_size, crc);
+    if ((data != NULL) && (record_header->data_size != 0))
+    {
+        crc = _mtb_kvstore_crc16(data, _mtb_kvstore_get_crc_data_size(record_header), crc);
+    }
+
+    return crc;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_encode_header
+//--------------------------------------------------------------------------------------------------
+static uint32_t _mtb_kvstore_encode_header(const _mtb_kvstore_record_header_t* record_header,
+                                           uint8_t* buffer)
+{
+    if (record_header->format_version != _MTB_KVSTORE_COMPACT_FORMAT_VERSION)
+    {
+        memcpy(buffer, record_header, sizeof(_mtb_kvstore_record_header_t));
+        return sizeof(_mtb_kvstore_record_header_t);
+    }
+
+    uint32_t pos = 0;
+    buffer[pos++] = _MTB_KVSTORE_COMPACT_HEADER_MAGIC;
+    buffer[pos++] = record_header->flags;
+    buffer[pos++] = (uint8_t)(record_header->crc & 0xFFU);
+    buffer[pos++] = (uint8_t)(record_header->crc >> 8);
+    uint32_t sizes[] = { record_header->key_size, record_header->data_size };
+    for (uint32_t i = 0; i < (sizeof(sizes) / sizeof(sizes[0])); i++)
+    {
+        uint32_t value = sizes[i];
+        while (value >= 0x80U)
+        {
+            buffer[pos++] = (uint8_t)(value | 0x80U);
+            value >>= 7;
+        }
+        buffer[pos++] = (uint8_t)value;
+    }
+    CY_ASSERT(pos == record_header->header_size);
+    return pos;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_decode_compact_header
+//--------------------------------------------------------------------------------------------------
+static bool _mtb_kvstore_decode_compact_header(const uint8_t* buffer, uint32_t size,
+                                               _mtb_kvstore_record_header_t* record_header)
+{
+    uint32_t pos = 4;
+    uint32_t sizes[2];
+    for (uint32_t i = 0; i < (sizeof(sizes) / sizeof(sizes[0])); i++)
+    {
+        sizes[i] = 0;
+        for (uint32_t shift = 0; ; shift += 7)
+        {
+            if ((pos >= size) || (shift > 28))
+            {
+                return false;
+            }
+            uint8_t byte = buffer[pos++];
+            sizes[i] |= (uint32_t)(byte & 0x7FU) << shift;
+            if ((byte & 0x80U) == 0)
+            {
+                break;
+            }
+        }
+    }
+    if (sizes[0] > UINT16_MAX)
+    {
+        return false;
+    }
+
+    record_header->magic = _MTB_KVSTORE_HEADER_MAGIC;
+    record_header->format_version = _MTB_KVSTORE_COMPACT_FORMAT_VERSION;
+    record_header->flags = buffer[1];
+    record_header->header_size = (uint16_t)pos;
+    record_header->key_size = (uint16_t)sizes[0];
+    record_header->data_size = sizes[1];
+    record_header->crc = (uint32_t)buffer[2] | ((uint32_t)buffer[3] << 8);
+    // A size that is not encoded in its shortest form would not match the CRC
+    return (pos == _mtb_kvstore_get_header_size(_MTB_KVSTORE_COMPACT_FORMAT_VERSION, sizes[0],
+                                                sizes[1]));
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_read_header
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_read_header(mtb_kvstore_t* obj, uint32_t record_addr,
+                                          _mtb_kvstore_record_header_t* record_header)
+{
+    // Reads the header of a record of either format. A compact header is shorter than the
+    // structure, so the read is limited to the end of the area the record is in.
+    uint8_t buffer[sizeof(_mtb_kvstore_record_header_t)];
+    uint32_t area_left = _MTB_KVSTORE_AREA_SIZE(obj) -
+                         ((record_addr - obj->start_addr) % _MTB_KVSTORE_AREA_SIZE(obj));
+    uint32_t read_size = (area_left < sizeof(buffer)) ? area_left : sizeof(buffer);
+
+    cy_rslt_t result = obj->bd->read(obj->bd->context, record_addr, read_size, buffer);
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
+    // Erased or zeroed data stays recognizable as such
+    memset(&buffer[read_size], buffer[0], sizeof(buffer) - read_size);
+
+    if ((buffer[0] != _MTB_KVSTORE_COMPACT_HEADER_MAGIC) ||
+        !_mtb_kvstore_decode_compact_header(buffer, read_size, record_header))
+    {
+        // Anything that is not a valid compact header is checked as a format 0 header
+        memcpy(record_header, buffer, sizeof(buffer));
+    }
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_is_record_in_area
+//--------------------------------------------------------------------------------------------------
+static inline bool _mtb_kvstore_is_record_in_area(mtb_kvstore_t* obj, uint32_t offset,
+                                                  const _mtb_kvstore_record_header_t* header)
+{
+    uint32_t area_size = _MTB_KVSTORE_AREA_SIZE(obj);
+    uint32_t size = (uint32_t)header->header_size + header->key_size;
+    return (offset < area_size) && (size <= (area_size - offset)) &&
+           (header->data_size <= (area_size - offset - size));
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_buffered_crc_compute
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_buffered_crc_compute(mtb_kvstore_t* obj, uint32_t address,
+                                                   uint32_t size, uint16_t* crc)
+{
+    CY_ASSERT(obj != NULL);
+    // Readers run in parallel, so they use a buffer of their own instead of the staging buffer.
+    cy_rslt_t result = CY_RSLT_SUCCESS;
+    uint8_t buffer[_MTB_KVSTORE_READ_BUFFER_SIZE];
+    uint32_t remaining_size = size;
+    while (remaining_size > 0)
+    {
+        uint32_t transfer_size = (sizeof(buffer) >= remaining_size)
+                                ? remaining_size
+                                : sizeof(buffer);
+
+        result = obj->bd->read(obj->bd->context, address, transfer_size, buffer);
+        if (result != CY_RSLT_SUCCESS)
+        {
+            return result;
+        }
+
+        *crc = _mtb_kvstore_crc16(buffer, transfer_size, *crc);
+
+        address += transfer_size;
+        remaining_size -= transfer_size;
+    }
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_validate_key
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_validate_key(mtb_kvstore_t* obj, uint32_t key_addr,
+                                           const char* user_key, uint32_t key_size)
+{
+    CY_ASSERT(obj != NULL);
+
+    if (strlen(user_key) != key_size)
+    {
+        return MTB_KVSTORE_ITEM_NOT_FOUND_ERROR;
+    }
+
+    cy_rslt_t result = CY_RSLT_SUCCESS;
+    uint8_t buffer[_MTB_KVSTORE_READ_BUFFER_SIZE];
+    uint32_t remaining_size = key_size;
+    while (remaining_size > 0)
+    {
+        uint32_t transfer_size =
+            (sizeof(buffer) >= remaining_size) ? remaining_size : sizeof(buffer);
+        result = obj->bd->read(obj->bd->context, key_addr, transfer_size, buffer);
+        if (result != CY_RSLT_SUCCESS)
+        {
+            return result;
+        }
+
+        if (memcmp((uint8_t*)user_key, buffer, transfer_size) != 0)
+        {
+            return MTB_KVSTORE_ITEM_NOT_FOUND_ERROR;
+        }
+
+        user_key += transfer_size;
+        key_addr += transfer_size;
+        remaining_size -= transfer_size;
+    }
+
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_read_record
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_read_record(mtb_kvstore_t* obj,
+                                          uint32_t area_address,
+                                          uint32_t offset,
+                                          _mtb_kvstore_record_header_t* record_header,
+                                          const char* key,
+                                          bool validate_key,
+                                          uint8_t* data,
+                                          uint32_t* data_size)
+{
+    CY_ASSERT(obj != NULL);
+    cy_rslt_t result = CY_RSLT_SUCCESS;
+    uint16_t crc = _MTB_KVSTORE_CRC_INIT_VAL;
+
+    uint32_t record_start_addr = area_address + offset;
+
+    CY_ASSERT(record_header != NULL);
+
+    // Read header for the record
+    result = _mtb_kvstore_read_header(obj, record_start_addr, record_header);
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
+
+    if ((record_header->magic == 0xFFFFFFFFU) || (record_header->magic == 0))
+    {
+        return MTB_KVSTORE_ERASED_DATA_ERROR;
+    }
+
+    if (record_header->magic != _MTB_KVSTORE_HEADER_MAGIC)
+    {
+        return MTB_KVSTORE_INVALID_DATA_ERROR;
+    }
+
+    if ((record_header->key_size == 0) || (record_header->key_size >= MTB_KVSTORE_MAX_KEY_SIZE) ||
+        !_mtb_kvstore_is_record_in_area(obj, offset, record_header))
+    {
+        return MTB_KVSTORE_INVALID_DATA_ERROR;
+    }
+
+    // If a data buffer is provided and the size is less that what is in the storage
+    // return error.
+    if ((data != NULL) && (data_size != NULL) && (*data_size < record_header->data_size))
+    {
+        *data_size = record_header->data_size;
+        return MTB_KVSTORE_BUFFER_TOO_SMALL;
+    }
+
+    crc = _mtb_kvstore_get_header_crc(record_header, crc);
+
+    // Records of interned keys are validated against the ID of the key.
+    char id_key[_MTB_KVSTORE_KEY_ID_SIZE + 1];
+    if ((key != NULL) && validate_key)
+    {
+        key = _mtb_kvstore_get_stored_key(obj, key, record_header->flags, id_key);
+        if (key == NULL)
+        {
+            return MTB_KVSTORE_ITEM_NOT_FOUND_ERROR;
+        }
+    }
+
+    // Copy key into the provided key area
+    uint32_t key_addr = record_start_addr + record_header->header_size;
+    if (key != NULL)
+    {
+        if (validate_key)
+        {
+            result = _mtb_kvstore_validate_key(obj, key_addr, key, record_header->key_size);
+            if (result != CY_RSLT_SUCCESS)
+            {
+                return result;
+            }
+        }
+        else
+        {
+            result = obj->bd->read(obj->bd->context, key_addr, record_header->key_size,
+                                   (uint8_t*)key);
+            if (result != CY_RSLT_SUCCESS)
+            {
+                return result;
+            }
+        }
+
+        // If the user passes in a key for validation since at this point we have
+        // validated that the key on the storage is the same as what was passes in
+        // it should be ok to use the key passed in by the user for CRC calculation.
+        crc = _mtb_kvstore_crc16((uint8_t*)key, record_header->key_size, crc);
+    }
+    else
+    {
+        // Start buffered CRC
+        result = _mtb_kvstore_buffered_crc_compute(obj, key_addr, record_header->key_size, &crc);
+        if (result != CY_RSLT_SUCCESS)
+        {
+            return result;
+        }
+    }
+
+    uint32_t data_addr = key_addr + record_header->key_size;
+    if ((data != NULL) && (data_size != NULL))
+    {
+        // Copy data into the data buffer provided
+        result = obj->bd->read(obj->bd->context, data_addr, record_header->data_size, data);
+        if (result != CY_RSLT_SUCCESS)
+        {
+            return result;
+        }
+
+        crc = _mtb_kvstore_crc16(data, _mtb_kvstore_get_crc_data_size(record_header), crc);
+    }
+    else
+    {
+        result = _mtb_kvstore_buffered_crc_compute(obj, data_addr,
+                                                   _mtb_kvstore_get_crc_data_size(record_header),
+                                                   &crc);
+        if (result != CY_RSLT_SUCCESS)
+        {
+            return result;
+        }
+    }
+
+    // If the CRC did not match then record is corrupted.
+    if (record_header->crc != crc)
+    {
+        return MTB_KVSTORE_INVALID_DATA_ERROR;
+    }
+
+    if (data_size != NULL)
+    {
+        *data_size = record_header->data_size;
+    }
+
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_read_partial_record
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_read_partial_record(mtb_kvstore_t* obj,
+                                                  uint32_t area_address,
+                                                  uint32_t offset,
+                                                  _mtb_kvstore_record_header_t* record_header,
+                                                  const char* key,
+                                                  bool validate_key,
+                                                  uint8_t* data,
+                                                  uint32_t* data_size,
+                                                  const uint32_t offset_bytes)
+{
+    CY_ASSERT(obj != NULL);
+    cy_rslt_t result = CY_RSLT_SUCCESS;
+
+    uint32_t record_start_addr = area_address + offset;
+
+    CY_ASSERT(record_header != NULL);
 
     // Read header for the record
-    result =
-        obj->bd->read(obj->bd->context, record_start_addr, header_size, (uint8_t*)record_header);
+    result = _mtb_kvstore_read_header(obj, record_start_addr, record_header);
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
+
+    // Improper use case: reading after the value ended
+    if (offset_bytes > record_header->data_size)
+    {
+        return MTB_KVSTORE_BAD_PARAM_ERROR;
+    }
+
+    if ((record_header->magic == 0xFFFFFFFFU) || (record_header->magic == 0U))
+    {
+        return MTB_KVSTORE_ERASED_DATA_ERROR;
+    }
+
+    if (record_header->magic != _MTB_KVSTORE_HEADER_MAGIC)
+    {
+        return MTB_KVSTORE_INVALID_DATA_ERROR;
+    }
+
+    if ((record_header->key_size == 0U) ||
+        (record_header->key_size >= MTB_KVSTORE_MAX_KEY_SIZE) ||
+        !_mtb_kvstore_is_record_in_area(obj, offset, record_header))
+    {
+        return MTB_KVSTORE_INVALID_DATA_ERROR;
+    }
+
+    // Records of interned keys are validated against the ID of the key.
+    char id_key[_MTB_KVSTORE_KEY_ID_SIZE + 1];
+    if ((key != NULL) && validate_key)
+    {
+        key = _mtb_kvstore_get_stored_key(obj, key, record_header->flags, id_key);
+        if (key == NULL)
+        {
+            return MTB_KVSTORE_ITEM_NOT_FOUND_ERROR;
+        }
+    }
+
+    // Copy key into the provided key area
+    uint32_t key_addr = record_start_addr + record_header->header_size;
+    if (key != NULL)
+    {
+        if (validate_key)
+        {
+            result = _mtb_kvstore_validate_key(obj, key_addr, key, record_header->key_size);
+            if (result != CY_RSLT_SUCCESS)
+            {
+                return result;
+            }
+        }
+        else
+        {
+            result = obj->bd->read(obj->bd->context, key_addr, record_header->key_size,
+                                   (uint8_t*)key);
+            if (result != CY_RSLT_SUCCESS)
+            {
+                return result;
+            }
+        }
+    }
+
+    uint32_t data_addr = key_addr + record_header->key_size;
+    if ((data != NULL) && (data_size != NULL))
+    {
+        // Don't read past the value in memory
+        if (*data_size > (record_header->data_size - offset_bytes))
+        {
+            *data_size = (record_header->data_size - offset_bytes);
+        }
+
+        // Copy data into the data buffer provided
+        result = obj->bd->read(obj->bd->context, (data_addr + offset_bytes), *data_size, data);
+        if (result != CY_RSLT_SUCCESS)
+        {
+            return result;
+        }
+    }
+
+    if (data_size != NULL)
+    {
+        *data_size = record_header->data_size;
+    }
+
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_read_chunk_table
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_read_chunk_table(mtb_kvstore_t* obj, uint32_t area_addr,
+                                               uint32_t offset, _mtb_kvstore_chunked_info_t* info,
+                                               uint32_t** chunk_offsets)
+{
+    // Reads the data of a manifest record. The returned chunk offsets must be freed by the caller.
+    _mtb_kvstore_record_header_t header;
+    cy_rslt_t result = _mtb_kvstore_read_header(obj, area_addr + offset, &header);
+    if ((result == CY_RSLT_SUCCESS) && (header.data_size < sizeof(*info)))
+    {
+        result = MTB_KVSTORE_INVALID_DATA_ERROR;
+    }
+    uint32_t data_addr = area_addr + offset + header.header_size + header.key_size;
+    if (result == CY_RSLT_SUCCESS)
+    {
+        result = obj->bd->read(obj->bd->context, data_addr, sizeof(*info), (uint8_t*)info);
+    }
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
+
+    uint32_t num_chunks = (info->chunk_size == 0)
+                          ? 0
+                          : ((info->value_size + info->chunk_size - 1) / info->chunk_size);
+    if ((num_chunks == 0) ||
+        (header.data_size != (sizeof(*info) + (num_chunks * sizeof(uint32_t)))))
+    {
+        return MTB_KVSTORE_INVALID_DATA_ERROR;
+    }
+
+    *chunk_offsets = (uint32_t*)malloc(num_chunks * sizeof(uint32_t));
+    if (*chunk_offsets == NULL)
+    {
+        return MTB_KVSTORE_MEM_ALLOC_ERROR;
+    }
+    result = obj->bd->read(obj->bd->context, data_addr + sizeof(*info),
+                           num_chunks * sizeof(uint32_t), (uint8_t*)*chunk_offsets);
+    if (result != CY_RSLT_SUCCESS)
+    {
+        free(*chunk_offsets);
+        *chunk_offsets = NULL;
+    }
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_ref_blobs
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_ref_blobs(mtb_kvstore_t* obj, uint32_t offset, bool add)
+{
+    // Adds or removes the references of a manifest record in the active area to the shared blobs
+    // among its chunks. A blob is counted as consumed space while it is referenced and is dropped
+    // from the blob table with its last reference.
+    _mtb_kvstore_chunked_info_t info;
+    uint32_t* chunk_offsets;
+    cy_rslt_t result = _mtb_kvstore_read_chunk_table(obj, obj->active_area_addr, offset, &info,
+                                                     &chunk_offsets);
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
+
+    uint32_t num_chunks = (info.value_size + info.chunk_size - 1) / info.chunk_size;
+    for (uint32_t chunk = 0; (chunk < num_chunks) && (result == CY_RSLT_SUCCESS); chunk++)
+    {
+        _mtb_kvstore_record_header_t header;
+        uint32_t chunk_addr = obj->active_area_addr + chunk_offsets[chunk];
+        if (chunk_offsets[chunk] >= _MTB_KVSTORE_AREA_SIZE(obj))
+        {
+            result = MTB_KVSTORE_INVALID_DATA_ERROR;
+            break;
+        }
+        result = _mtb_kvstore_read_header(obj, chunk_addr, &header);
+        if ((result != CY_RSLT_SUCCESS) || (header.flags != _MTB_KVSTORE_BLOB_FLAGS))
+        {
+            continue;
+        }
+
+        uint32_t idx = _mtb_kvstore_find_blob_at(obj, chunk_offsets[chunk]);
+        if (add)
+        {
+            if (idx == obj->num_blobs)
+            {
+                char blob_key[_MTB_KVSTORE_BLOB_KEY_SIZE + 1];
+                uint64_t hash;
+                if (header.key_size != _MTB_KVSTORE_BLOB_KEY_SIZE)
+                {
+                    result = MTB_KVSTORE_INVALID_DATA_ERROR;
+                    break;
+                }
+                result = obj->bd->read(obj->bd->context, chunk_addr + header.header_size,
+                                       _MTB_KVSTORE_BLOB_KEY_SIZE, (uint8_t*)blob_key);
+                if ((result == CY_RSLT_SUCCESS) &&
+                    !_mtb_kvstore_decode_blob_key(blob_key, header.key_size, &hash))
+                {
+                    result = MTB_KVSTORE_INVALID_DATA_ERROR;
+                }
+                if (result == CY_RSLT_SUCCESS)
+                {
+                    result = _mtb_kvstore_reserve_blobs(obj, 1);
+                }
+                if (result != CY_RSLT_SUCCESS)
+                {
+                    break;
+                }
+                obj->blobs[idx].hash = hash;
+                obj->blobs[idx].offset = chunk_offsets[chunk];
+                obj->blobs[idx].gc_offset = _MTB_KVSTORE_NO_SEGMENT;
+                obj->blobs[idx].refcount = 0;
+                obj->num_blobs++;
+            }
+            if (obj->blobs[idx].refcount == 0)
+            {
+                obj->consumed_size += _mtb_kvstore_get_stored_record_size(obj, chunk_addr,
+                                                                          &header);
+            }
+            obj->blobs[idx].refcount++;
+        }
+        else if (idx < obj->num_blobs)
+        {
+            obj->blobs[idx].refcount--;
+            if (obj->blobs[idx].refcount == 0)
+            {
+                obj->consumed_size -= _mtb_kvstore_get_stored_record_size(obj, chunk_addr,
+                                                                          &header);
+                obj->blobs[idx] = obj->blobs[--obj->num_blobs];
+            }
+        }
+    }
+
+    free(chunk_offsets);
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_update_blob_refs
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_update_blob_refs(mtb_kvstore_t* obj,
+                                               _mtb_kvstore_operation_t operation,
+                                               const _mtb_kvstore_update_ram_table_info_t* info)
+{
+    // Must be called before the RAM table is updated. The references of the new value are added
+    // first so that blobs shared by the old and the new value are kept.
+    cy_rslt_t result = CY_RSLT_SUCCESS;
+    if ((operation != _MTB_KVSTORE_OPER_DELETE) &&
+        ((info->entry.flags & _MTB_KVSTORE_CHUNKED_FLAG) != 0))
+    {
+        result = _mtb_kvstore_ref_blobs(obj, info->entry.offset, true);
+    }
+    if ((result == CY_RSLT_SUCCESS) && (operation != _MTB_KVSTORE_OPER_ADD) &&
+        ((obj->ram_table[info->ram_tbl_idx].flags & _MTB_KVSTORE_CHUNKED_FLAG) != 0))
+    {
+        result = _mtb_kvstore_ref_blobs(obj, obj->ram_table[info->ram_tbl_idx].offset, false);
+    }
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_get_chunks_size
+//--------------------------------------------------------------------------------------------------
+static uint32_t _mtb_kvstore_get_chunks_size(mtb_kvstore_t* obj, uint32_t offset)
+{
+    // Size of the chunk records that a manifest record in the active area refers to, as they are
+    // stored, without the shared blobs.
+    _mtb_kvstore_chunked_info_t info;
+    uint32_t* chunk_offsets;
+    if (_mtb_kvstore_read_chunk_table(obj, obj->active_area_addr, offset, &info,
+                                      &chunk_offsets) != CY_RSLT_SUCCESS)
+    {
+        return 0;
+    }
+
+    uint32_t size = 0;
+    uint32_t num_chunks = (info.value_size + info.chunk_size - 1) / info.chunk_size;
+    for (uint32_t chunk = 0; chunk < num_chunks; chunk++)
+    {
+        _mtb_kvstore_record_header_t header;
+        uint32_t chunk_addr = obj->active_area_addr + chunk_offsets[chunk];
+        if ((chunk_offsets[chunk] >= _MTB_KVSTORE_AREA_SIZE(obj)) ||
+            (_mtb_kvstore_read_header(obj, chunk_addr, &header) != CY_RSLT_SUCCESS))
+        {
+            break;
+        }
+        // Shared blobs are accounted for by _mtb_kvstore_ref_blobs
+        if (header.flags != _MTB_KVSTORE_BLOB_FLAGS)
+        {
+            size += _mtb_kvstore_get_stored_record_size(obj, chunk_addr, &header);
+        }
+    }
+
+    free(chunk_offsets);
+    return size;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_setup_record_header
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_setup_record_header(const char* key,
+                                             const uint8_t* data,
+                                             uint32_t data_size,
+                                             uint8_t format_version,
+                                             _mtb_kvstore_operation_t operation,
+                                             uint8_t flags,
+                                             _mtb_kvstore_record_header_t* record_header)
+{
+    CY_ASSERT(key != NULL);
+
+    memset(record_header, 0, sizeof(_mtb_kvstore_record_header_t));
+
+    record_header->magic = _MTB_KVSTORE_HEADER_MAGIC;
+    record_header->format_version = format_version;
+    record_header->flags = (operation == _MTB_KVSTORE_OPER_DELETE)
+                            ? (_MTB_KVSTORE_DELETE_FLAG | (flags & _MTB_KVSTORE_KEY_ID_FLAG))
+                            : flags;
+    record_header->key_size = strlen(key);
+    record_header->data_size = data_size;
+    record_header->header_size = _mtb_kvstore_get_header_size(format_version,
+                                                              record_header->key_size,
+                                                              data_size);
+    record_header->crc = _mtb_kvstore_get_record_crc(record_header, key, data);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_start_buffered_write
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_start_buffered_write(mtb_kvstore_t* obj, uint32_t record_address,
+                                              uint32_t* write_address,
+                                              uint32_t* buffer_space_left)
+{
+    // A packed record may start within the program unit that holds the end of the previous one.
+    // The unit is programmed again from its start, with the erased value in place of the bytes
+    // that are already programmed.
+    uint32_t prog_size = obj->bd->program_size(obj->bd->context, record_address);
+    uint32_t lead_size = record_address % prog_size;
+    memset(obj->transaction_buffer, 0xFF, lead_size);
+    *write_address = record_address - lead_size;
+    *buffer_space_left = obj->transaction_buffer_size - lead_size;
+}
+
+
+#if (MTB_KVSTORE_DIRECT_PROGRAM_ALIGNMENT > 0)
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_direct_program
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_direct_program(mtb_kvstore_t* obj,
+                                             const uint8_t** data,
+                                             uint32_t* remaining_size,
+                                             uint32_t* write_address,
+                                             uint32_t* buffer_space_left)
+{
+    uint32_t prog_size = obj->bd->program_size(obj->bd->context, *write_address);
+    uint32_t staged_size = obj->transaction_buffer_size - *buffer_space_left;
+    uint32_t head_size = (prog_size - (staged_size % prog_size)) % prog_size;
+    uintptr_t alignment = (obj->config.buffer_alignment > MTB_KVSTORE_DIRECT_PROGRAM_ALIGNMENT)
+                          ? obj->config.buffer_alignment
+                          : MTB_KVSTORE_DIRECT_PROGRAM_ALIGNMENT;
+
+    // Programming the head, the middle and the tail separately takes up to three calls, so this is
+    // only worth it if the middle spans at least two staging buffers. The caller's data following
+    // the head must also be aligned well enough to be handed to the block device.
+    if (((*remaining_size - head_size) < (2 * obj->transaction_buffer_size)) ||
+        ((((uintptr_t)(*data + head_size)) & (alignment - 1)) != 0))
+    {
+        return CY_RSLT_SUCCESS;
+    }
+
+    // Complete the partially staged program unit with the head and program it.
+    memcpy(obj->transaction_buffer + staged_size, *data, head_size);
+    staged_size += head_size;
+    *data += head_size;
+    *remaining_size -= head_size;
+    cy_rslt_t result = CY_RSLT_SUCCESS;
+    if (staged_size > 0)
+    {
+        result = obj->bd->program(obj->bd->context, *write_address, staged_size,
+                                  obj->transaction_buffer);
+        if (result != CY_RSLT_SUCCESS)
+        {
+            return result;
+        }
+        *write_address += staged_size;
+        *buffer_space_left = obj->transaction_buffer_size;
+    }
+
+    // Program the aligned middle straight from the caller's buffer. The tail is left for staging.
+    uint32_t direct_size = (*remaining_size / prog_size) * prog_size;
+    result = obj->bd->program(obj->bd->context, *write_address, direct_size, *data);
+    if (result == CY_RSLT_SUCCESS)
+    {
+        *write_address += direct_size;
+        *data += direct_size;
+        *remaining_size -= direct_size;
+    }
+    return result;
+}
+
+
+#endif // if (MTB_KVSTORE_DIRECT_PROGRAM_ALIGNMENT > 0)
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_buffered_write
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_buffered_write(mtb_kvstore_t* obj,
+                                             const uint8_t* data,
+                                             uint32_t data_size,
+                                             uint32_t* write_address,
+                                             uint32_t* buffer_space_left,
+                                             bool flush)
+{
+    CY_ASSERT(obj != NULL);
+    cy_rslt_t result = CY_RSLT_SUCCESS;
+    uint8_t* buffer_offset_ptr = obj->transaction_buffer +
+                                 (obj->transaction_buffer_size - *buffer_space_left);
+    const uint8_t* current_data_ptr = data;
+    uint32_t remaining_size = data_size;
+    while (remaining_size > 0)
+    {
+        #if (MTB_KVSTORE_DIRECT_PROGRAM_ALIGNMENT > 0)
+        if ((current_data_ptr != NULL) && (remaining_size > (2 * obj->transaction_buffer_size)))
+        {
+            result = _mtb_kvstore_direct_program(obj, &current_data_ptr, &remaining_size,
+                                                 write_address, buffer_space_left);
+            if (result != CY_RSLT_SUCCESS)
+            {
+                return result;
+            }
+            buffer_offset_ptr = obj->transaction_buffer +
+                                (obj->transaction_buffer_size - *buffer_space_left);
+            if (remaining_size == 0)
+            {
+                break;
+            }
+        }
+        #endif // if (MTB_KVSTORE_DIRECT_PROGRAM_ALIGNMENT > 0)
+
+        uint32_t transfer_size =
+            (*buffer_space_left >= remaining_size) ? remaining_size : *buffer_space_left;
+        // Without data the record is padded, e.g. to start the next record on a program boundary.
+        if (current_data_ptr != NULL)
+        {
+            memcpy(buffer_offset_ptr, current_data_ptr, transfer_size);
+            current_data_ptr += transfer_size;
+        }
+        else
+        {
+            memset(buffer_offset_ptr, 0xFF, transfer_size);
+        }
+        *buffer_space_left -= transfer_size;
+        buffer_offset_ptr += transfer_size;
+        remaining_size -= transfer_size;
+        if (*buffer_space_left == 0)
+        {
+            result = obj->bd->program(obj->bd->context, *write_address,
+                                      obj->transaction_buffer_size,
+                                      obj->transaction_buffer);
+            if (result != CY_RSLT_SUCCESS)
+            {
+                return result;
+            }
+            *buffer_space_left = obj->transaction_buffer_size;
+            buffer_offset_ptr = obj->transaction_buffer;
+            *write_address += obj->transaction_buffer_size;
+        }
+    }
+
+    if ((*buffer_space_left != obj->transaction_buffer_size) && flush)
+    {
+        uint32_t prog_size = obj->bd->program_size(obj->bd->context, *write_address);
+        uint32_t staged_size = obj->transaction_buffer_size - *buffer_space_left;
+        uint32_t size = _mtb_kvstore_align_up(staged_size, prog_size);
+        // The rest of the last program unit is left erased for the next packed record.
+        memset(obj->transaction_buffer + staged_size, 0xFF, size - staged_size);
+        result = obj->bd->program(obj->bd->context, *write_address,
+                                  size,
+                                  obj->transaction_buffer);
+        if (result != CY_RSLT_SUCCESS)
+        {
+            return result;
+        }
+        *buffer_space_left = obj->transaction_buffer_size;
+    }
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_write_record
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_write_record(mtb_kvstore_t* obj,
+                                           uint32_t area_address,
+                                           uint32_t offset,
+                                           const char* key,
+                                           const uint8_t* data,
+                                           uint32_t data_size,
+                                           _mtb_kvstore_operation_t operation,
+                                           uint8_t flags,
+                                           const _mtb_kvstore_update_ram_table_info_t* ram_tbl_info,
+                                           const _mtb_kvstore_update_consumed_size_info_t* size_info)
+{
+    CY_ASSERT(obj != NULL);
+    CY_ASSERT(key != NULL);
+    cy_rslt_t result = CY_RSLT_SUCCESS;
+
+    const char* value_key = key;
+    char id_key[_MTB_KVSTORE_KEY_ID_SIZE + 1];
+    key = _mtb_kvstore_get_stored_key(obj, key, flags, id_key);
+    CY_ASSERT(key != NULL);
+
+    // Calculate write size
+    uint32_t record_address = area_address + offset;
+    uint32_t prog_size = obj->bd->program_size(obj->bd->context, record_address);
+
+    // Ensure that the buffer is large enough
+    CY_ASSERT(obj->transaction_buffer_size >= sizeof(_mtb_kvstore_record_header_t));
+    // Check that the address written to is aligned to program page boundary
+    CY_ASSERT(_mtb_kvstore_is_aligned(area_address, prog_size));
+    // The following transactions assume that the buffer size is aligned to the program
+    // size. We do that in init but just to make sure we check it below.
+    CY_ASSERT((obj->transaction_buffer_size % prog_size) == 0);
+
+    // Setup the area header. The area header record itself is always written in format 0.
+    _mtb_kvstore_record_header_t record_header;
+    _mtb_kvstore_setup_record_header(key, data, data_size,
+                                     (offset == _MTB_KVSTORE_AREA_HEADER_OFFSET)
+                                     ? _MTB_KVSTORE_FORMAT_VERSION
+                                     : _mtb_kvstore_get_format_version(obj),
+                                     operation, flags, &record_header);
+
+    // Check that total size does not exceed size of area.
+    uint32_t record_size = _mtb_kvstore_get_stored_record_size(obj, record_address,
+                                                               &record_header);
+    CY_ASSERT((offset + record_size) <= _MTB_KVSTORE_AREA_SIZE(obj));
+    CY_UNUSED_PARAMETER(prog_size);
+    CY_UNUSED_PARAMETER(record_size);
+
+    uint8_t encoded_header[sizeof(_mtb_kvstore_record_header_t)];
+    uint32_t header_size = _mtb_kvstore_encode_header(&record_header, encoded_header);
+
+    uint32_t buffer_space_left;
+    _mtb_kvstore_start_buffered_write(obj, record_address, &record_address, &buffer_space_left);
+    result = _mtb_kvstore_buffered_write(obj, encoded_header, header_size,
+                                         &record_address,
+                                         &buffer_space_left, false);
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
+
+    result = _mtb_kvstore_buffered_write(obj, (uint8_t*)key, record_header.key_size,
+                                         &record_address, &buffer_space_left, false);
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
+
+    result = _mtb_kvstore_buffered_write(obj, data, record_header.data_size, &record_address,
+                                         &buffer_space_left, true);
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
+
+    // The area header and the key dictionary records are not tracked by the RAM table.
+    if (ram_tbl_info != NULL)
+    {
+        CY_ASSERT(size_info != NULL);
+        // If we wrote the record successfully then update the ram table and consumed size
+        result = _mtb_kvstore_update_blob_refs(obj, operation, ram_tbl_info);
+        if (result != CY_RSLT_SUCCESS)
+        {
+            return result;
+        }
+        _mtb_kvstore_update_ram_table(obj, operation, ram_tbl_info);
+        _mtb_kvstore_update_consumed_size(obj, operation, size_info);
+        if (operation != _MTB_KVSTORE_OPER_DELETE)
+        {
+            _mtb_kvstore_set_inline(obj, ram_tbl_info->ram_tbl_idx, value_key, flags, data,
+                                    data_size);
+        }
+    }
+
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_check_area_valid
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_check_area_valid(mtb_kvstore_t* obj, uint32_t area_address,
+                                               uint16_t* version, bool* packed,
+                                               uint8_t* num_shards)
+{
+    CY_ASSERT(obj != NULL);
+    _mtb_kvstore_record_header_t header;
+    _mtb_kvstore_area_record_data_t area_header_data;
+    uint32_t data_size = sizeof(_mtb_kvstore_area_record_data_t);
+    cy_rslt_t result = _mtb_kvstore_read_record(obj, area_address, 0, &header,
+                                                _mtb_kvstore_area_rec_key, true,
+                                                (uint8_t*)&area_header_data, &data_size);
+    if (result == CY_RSLT_SUCCESS)
+    {
+        *version = area_header_data.version;
+        *packed = ((area_header_data.format_version & _MTB_KVSTORE_AREA_FORMAT_MASK) ==
+                   _MTB_KVSTORE_AREA_FORMAT_PACKED);
+        *num_shards = (uint8_t)(area_header_data.format_version >> _MTB_KVSTORE_AREA_SHARDS_SHIFT);
+    }
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_write_area_record
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_write_area_record(mtb_kvstore_t* obj, uint32_t area_address,
+                                                uint32_t area_version)
+{
+    CY_ASSERT(obj != NULL);
+
+    // The upper byte of the format version holds the number of shards of a sharded kv-store.
+    _mtb_kvstore_area_record_data_t area_header_data;
+    area_header_data.format_version = (obj->config.packed_records)
+                                      ? _MTB_KVSTORE_AREA_FORMAT_PACKED
+                                      : _MTB_KVSTORE_FORMAT_VERSION;
+    area_header_data.format_version |= (uint16_t)(obj->num_shards <<
+                                                  _MTB_KVSTORE_AREA_SHARDS_SHIFT);
+    area_header_data.version = area_version;
+
+    return _mtb_kvstore_write_record(obj, area_address, _MTB_KVSTORE_AREA_HEADER_OFFSET,
+                                     _mtb_kvstore_area_rec_key, (uint8_t*)&area_header_data,
+                                     sizeof(_mtb_kvstore_area_record_data_t),
+                                     _MTB_KVSTORE_OPER_ADD, _MTB_KVSTORE_NO_FLAG, NULL, NULL);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_find_record_in_ram_table
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_find_record_in_ram_table(mtb_kvstore_t* obj, const char* key,
+                                                       uint32_t* ram_table_idx, uint16_t* key_hash,
+                                                       uint32_t* data_size)
+{
+    CY_ASSERT(obj != NULL);
+    cy_rslt_t result = MTB_KVSTORE_ITEM_NOT_FOUND_ERROR;
+
+    *key_hash = _mtb_kvstore_crc16((uint8_t*)key, strlen(key), _MTB_KVSTORE_CRC_INIT_VAL);
+
+    for (*ram_table_idx = 0; *ram_table_idx < obj->num_entries; (*ram_table_idx)++)
+    {
+        mtb_kvstore_ram_table_entry_t entry = obj->ram_table[*ram_table_idx];
+        if (*key_hash < entry.hash)
+        {
+            continue;
+        }
+
+        if (*key_hash > entry.hash)
+        {
+            result = MTB_KVSTORE_ITEM_NOT_FOUND_ERROR;
+            break;
+        }
+
+        _mtb_kvstore_record_header_t header;
+        if (!_mtb_kvstore_match_inline(&entry, key, data_size, &result))
+        {
+            result = _mtb_kvstore_read_record(obj, obj->active_area_addr, entry.offset, &header,
+                                              key, true, NULL, data_size);
+        }
+        // If there was a key mismatch then keep searching.
+        if (result != MTB_KVSTORE_ITEM_NOT_FOUND_ERROR)
+        {
+            break;
+        }
+    }
+
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_buffered_copy
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_buffered_copy(mtb_kvstore_t* obj, uint32_t src_addr, uint32_t size,
+                                            uint32_t* write_address, uint32_t* buffer_space_left)
+{
+    // Same as _mtb_kvstore_buffered_write, but the data is read from the device straight into the
+    // staging buffer.
+    cy_rslt_t result = CY_RSLT_SUCCESS;
+    while (size > 0)
+    {
+        uint32_t transfer_size = (*buffer_space_left >= size) ? size : *buffer_space_left;
+        result = obj->bd->read(obj->bd->context, src_addr, transfer_size,
+                               obj->transaction_buffer +
+                               (obj->transaction_buffer_size - *buffer_space_left));
+        if (result != CY_RSLT_SUCCESS)
+        {
+            return result;
+        }
+
+        src_addr += transfer_size;
+        size -= transfer_size;
+        *buffer_space_left -= transfer_size;
+        if (*buffer_space_left == 0)
+        {
+            result = obj->bd->program(obj->bd->context, *write_address,
+                                      obj->transaction_buffer_size, obj->transaction_buffer);
+            if (result != CY_RSLT_SUCCESS)
+            {
+                return result;
+            }
+            *buffer_space_left = obj->transaction_buffer_size;
+            *write_address += obj->transaction_buffer_size;
+        }
+    }
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_copy_record
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_copy_record(mtb_kvstore_t* obj,
+                                          uint32_t src_area_addr,
+                                          uint32_t src_offset,
+                                          uint32_t dst_area_addr,
+                                          uint32_t dst_offset,
+                                          uint32_t* next_dst_offset)
+{
+    CY_ASSERT(obj != NULL);
+    cy_rslt_t result = CY_RSLT_SUCCESS;
+
+    uint32_t src_record_addr = src_area_addr + src_offset;
+    uint32_t dst_record_addr = dst_area_addr + dst_offset;
+
+    _mtb_kvstore_record_header_t header;
+    // Read header for the record. The record keeps the format it was written in.
+    result = _mtb_kvstore_read_header(obj, src_record_addr, &header);
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
+
+    uint32_t record_size = _mtb_kvstore_get_stored_record_size(obj, dst_record_addr, &header);
+    if ((dst_offset + record_size) > (_MTB_KVSTORE_AREA_SIZE(obj)))
+    {
+        return MTB_KVSTORE_STORAGE_FULL_ERROR;
+    }
+
+    // Only the record itself is copied, the padding depends on the layout of the destination.
+    uint32_t write_addr;
+    uint32_t buffer_space_left;
+    _mtb_kvstore_start_buffered_write(obj, dst_record_addr, &write_addr, &buffer_space_left);
+    result = _mtb_kvstore_buffered_copy(obj, src_record_addr,
+                                        header.header_size + header.key_size + header.data_size,
+                                        &write_addr, &buffer_space_left);
+    if (result == CY_RSLT_SUCCESS)
+    {
+        result = _mtb_kvstore_buffered_write(obj, NULL, 0, &write_addr, &buffer_space_left,
+                                             true);
+    }
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
+
+    *next_dst_offset = dst_offset + record_size;
+
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_read_segment
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_read_segment(mtb_kvstore_t* obj, uint32_t offset, const char* key,
+                                           _mtb_kvstore_record_header_t* header,
+                                           _mtb_kvstore_segment_info_t* info,
+                                           _mtb_kvstore_segment_t* segment)
+{
+    // With a key the record is validated (key and CRC), otherwise only its header is read.
+    uint32_t record_addr = obj->active_area_addr + offset;
+    cy_rslt_t result = (key != NULL)
+                       ? _mtb_kvstore_read_record(obj, obj->active_area_addr, offset, header, key,
+                                                  true, NULL, NULL)
+                       : _mtb_kvstore_read_header(obj, record_addr, header);
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
+
+    if ((header->magic != _MTB_KVSTORE_HEADER_MAGIC) || (header->key_size == 0) ||
+        (header->key_size >= MTB_KVSTORE_MAX_KEY_SIZE))
+    {
+        return MTB_KVSTORE_INVALID_DATA_ERROR;
+    }
+
+    segment->payload_addr = record_addr + header->header_size + header->key_size;
+    segment->payload_size = header->data_size;
+    if ((header->flags & _MTB_KVSTORE_APPEND_FLAG) == 0)
+    {
+        info->prev_offset = _MTB_KVSTORE_NO_SEGMENT;
+        info->total_size = header->data_size;
+        info->max_size = 0;
+        return result;
+    }
+
+    if (header->data_size < sizeof(*info))
+    {
+        return MTB_KVSTORE_INVALID_DATA_ERROR;
+    }
+
+    result = obj->bd->read(obj->bd->context, segment->payload_addr, sizeof(*info),
+                           (uint8_t*)info);
+    segment->payload_addr += sizeof(*info);
+    segment->payload_size -= sizeof(*info);
+    if ((result == CY_RSLT_SUCCESS) && (info->total_size < segment->payload_size))
+    {
+        result = MTB_KVSTORE_INVALID_DATA_ERROR;
+    }
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_get_live_size
+//--------------------------------------------------------------------------------------------------
+static uint32_t _mtb_kvstore_get_live_size(mtb_kvstore_t* obj, uint32_t ram_tbl_idx)
+{
+    // Size of all records that hold the value of a RAM table entry, as they are stored.
+    uint32_t size = 0;
+    uint32_t offset = obj->ram_table[ram_tbl_idx].offset;
+    while (offset != _MTB_KVSTORE_NO_SEGMENT)
+    {
+        _mtb_kvstore_record_header_t header;
+        _mtb_kvstore_segment_info_t info;
+        _mtb_kvstore_segment_t segment;
+        if (_mtb_kvstore_read_segment(obj, offset, NULL, &header, &info, &segment) !=
+            CY_RSLT_SUCCESS)
+        {
+            break;
+        }
+        size += _mtb_kvstore_get_stored_record_size(obj, obj->active_area_addr, &header);
+        offset = info.prev_offset;
+    }
+    if ((obj->ram_table[ram_tbl_idx].flags & _MTB_KVSTORE_CHUNKED_FLAG) != 0)
+    {
+        size += _mtb_kvstore_get_chunks_size(obj, obj->ram_table[ram_tbl_idx].offset);
+    }
+    return size;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_coalesce_segments
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_coalesce_segments(mtb_kvstore_t* obj,
+                                                mtb_kvstore_ram_table_entry_t* entry,
+                                                uint32_t dst_offset, uint32_t* next_dst_offset)
+{
+    // Rewrites an appended value as a single record in the GC area, dropping the oldest segments
+    // that exceed the retained size requested by the last append.
+    cy_rslt_t result = CY_RSLT_SUCCESS;
+    _mtb_kvstore_record_header_t header;
+    _mtb_kvstore_segment_info_t info;
+    _mtb_kvstore_segment_t segment;
+    _mtb_kvstore_segment_t* segments = NULL;
+    uint32_t num_segments = 0;
+    uint32_t max_segments = 0;
+    uint32_t retained_size = 0;
+    uint32_t max_size = 0;
+    bool dropped = false;
+    // The key is copied as it is stored, which may be a key ID.
+    char key[MTB_KVSTORE_MAX_KEY_SIZE];
+    uint8_t key_flags = entry->flags & _MTB_KVSTORE_KEY_ID_FLAG;
+
+    uint32_t offset = entry->offset;
+    while ((result == CY_RSLT_SUCCESS) && (offset != _MTB_KVSTORE_NO_SEGMENT))
+    {
+        result = _mtb_kvstore_read_segment(obj, offset, NULL, &header, &info, &segment);
+        if (result != CY_RSLT_SUCCESS)
+        {
+            break;
+        }
+
+        if (num_segments == 0)
+        {
+            max_size = info.max_size;
+            result = obj->bd->read(obj->bd->context, obj->active_area_addr + offset +
+                                   header.header_size, header.key_size, (uint8_t*)key);
+            key[header.key_size] = '\0';
+        }
+        else if ((max_size != 0) && ((retained_size + segment.payload_size) > max_size))
+        {
+            dropped = true;
+            break;
+        }
+
+        if (num_segments == max_segments)
+        {
+            max_segments = (max_segments == 0) ? 8U : (2U * max_segments);
+            _mtb_kvstore_segment_t* grown =
+                (_mtb_kvstore_segment_t*)realloc(segments, max_segments * sizeof(*segments));
+            if (grown == NULL)
+            {
+                result = MTB_KVSTORE_MEM_ALLOC_ERROR;
+                break;
+            }
+            segments = grown;
+        }
+
+        segments[num_segments++] = segment;
+        retained_size += segment.payload_size;
+        offset = info.prev_offset;
+    }
+
+    uint32_t record_size = 0;
+    _mtb_kvstore_record_header_t record_header;
+    uint8_t encoded_header[sizeof(_mtb_kvstore_record_header_t)];
+    uint32_t header_size = 0;
+    if (result == CY_RSLT_SUCCESS)
+    {
+        record_size = _mtb_kvstore_get_record_size(obj, obj->gc_area_addr, strlen(key),
+                                                   retained_size);
+        if ((dst_offset + record_size) > _MTB_KVSTORE_AREA_SIZE(obj))
+        {
+            result = MTB_KVSTORE_STORAGE_FULL_ERROR;
+        }
+    }
+
+    // The segments are linked from the newest to the oldest, so the array is walked backwards to
+    // compute the CRC and to copy the value in order.
+    if (result == CY_RSLT_SUCCESS)
+    {
+        _mtb_kvstore_setup_record_header(key, NULL, retained_size,
+                                         _mtb_kvstore_get_format_version(obj),
+                                         _MTB_KVSTORE_OPER_ADD, key_flags, &record_header);
+        uint16_t crc = (uint16_t)record_header.crc;
+        for (uint32_t i = num_segments; (i > 0) && (result == CY_RSLT_SUCCESS); i--)
+        {
+            result = _mtb_kvstore_buffered_crc_compute(obj, segments[i - 1].payload_addr,
+                                                       segments[i - 1].payload_size, &crc);
+        }
+        record_header.crc = crc;
+        header_size = _mtb_kvstore_encode_header(&record_header, encoded_header);
+    }
+
+    uint32_t write_address;
+    uint32_t buffer_space_left;
+    _mtb_kvstore_start_buffered_write(obj, obj->gc_area_addr + dst_offset, &write_address,
+                                      &buffer_space_left);
+    if (result == CY_RSLT_SUCCESS)
+    {
+        result = _mtb_kvstore_buffered_write(obj, encoded_header, header_size, &write_address,
+                                             &buffer_space_left, false);
+    }
+    if (result == CY_RSLT_SUCCESS)
+    {
+        result = _mtb_kvstore_buffered_write(obj, (uint8_t*)key, record_header.key_size,
+                                             &write_address, &buffer_space_left, false);
+    }
+    for (uint32_t i = num_segments; (i > 0) && (result == CY_RSLT_SUCCESS); i--)
+    {
+        result = _mtb_kvstore_buffered_copy(obj, segments[i - 1].payload_addr,
+                                            segments[i - 1].payload_size, &write_address,
+                                            &buffer_space_left);
+    }
+    if (result == CY_RSLT_SUCCESS)
+    {
+        result = _mtb_kvstore_buffered_write(obj, NULL, 0, &write_address, &buffer_space_left,
+                                             true);
+    }
+
+    free(segments);
+
+    if (result == CY_RSLT_SUCCESS)
+    {
+        _MTB_KVSTORE_STORE_FIELD(entry->flags, key_flags);
+        _MTB_KVSTORE_STORE_FIELD(entry->offset, dst_offset);
+        if (dropped)
+        {
+            _MTB_KVSTORE_STORE_FIELD(entry->generation, _mtb_kvstore_next_generation(obj));
+        }
+        *next_dst_offset = dst_offset + record_size;
+    }
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_copy_chunked
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_copy_chunked(mtb_kvstore_t* obj,
+                                           mtb_kvstore_ram_table_entry_t* entry,
+                                           uint32_t dst_offset, uint32_t* next_dst_offset)
+{
+    // Copies the chunks of a value into the GC area, followed by a manifest record that refers to
+    // their new offsets. Chunks that were superseded are not referenced and are left behind. A
+    // shared blob is only copied by the first value that refers to it.
+    uint32_t offset = entry->offset;
+    _mtb_kvstore_chunked_info_t info;
+    uint32_t* chunk_offsets;
+    cy_rslt_t result = _mtb_kvstore_read_chunk_table(obj, obj->active_area_addr, offset, &info,
+                                                     &chunk_offsets);
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
+
+    uint32_t num_chunks = (info.value_size + info.chunk_size - 1) / info.chunk_size;
+    for (uint32_t chunk = 0; (chunk < num_chunks) && (result == CY_RSLT_SUCCESS); chunk++)
+    {
+        uint32_t blob = _mtb_kvstore_find_blob_at(obj, chunk_offsets[chunk]);
+        if ((blob < obj->num_blobs) && (obj->blobs[blob].gc_offset != _MTB_KVSTORE_NO_SEGMENT))
+        {
+            chunk_offsets[chunk] = obj->blobs[blob].gc_offset;
+            continue;
+        }
+
+        uint32_t dst_next_offset;
+        result = _mtb_kvstore_copy_record(obj, obj->active_area_addr, chunk_offsets[chunk],
+                                          obj->gc_area_addr, dst_offset, &dst_next_offset);
+        if (result == CY_RSLT_SUCCESS)
+        {
+            // A blob only gets its new offset once it has been copied, and the offset only takes
+            // effect once the area header is written.
+            if (blob < obj->num_blobs)
+            {
+                obj->blobs[blob].gc_offset = dst_offset;
+            }
+            chunk_offsets[chunk] = dst_offset;
+            dst_offset = dst_next_offset;
+        }
+    }
+
+    // The manifest is written for the key of the value, which is stored again as its key ID.
+    uint32_t manifest_size = sizeof(info) + (num_chunks * sizeof(uint32_t));
+    uint8_t* manifest = NULL;
+    _mtb_kvstore_record_header_t header;
+    char key[MTB_KVSTORE_MAX_KEY_SIZE];
+    uint32_t id;
+    if (result == CY_RSLT_SUCCESS)
+    {
+        result = _mtb_kvstore_read_header(obj, obj->active_area_addr + offset, &header);
+    }
+    if (result == CY_RSLT_SUCCESS)
+    {
+        CY_ASSERT(header.key_size < MTB_KVSTORE_MAX_KEY_SIZE);
+        result = obj->bd->read(obj->bd->context, obj->active_area_addr + offset +
+                               header.header_size, header.key_size, (uint8_t*)key);
+        key[header.key_size] = '\0';
+    }
+    if ((result == CY_RSLT_SUCCESS) && ((header.flags & _MTB_KVSTORE_KEY_ID_FLAG) != 0))
+    {
+        if (!_mtb_kvstore_decode_key_id(key, header.key_size, &id) || (id >= obj->num_key_ids))
+        {
+            result = MTB_KVSTORE_INVALID_DATA_ERROR;
+        }
+        else
+        {
+            memcpy(key, obj->key_dict[id].key, strlen(obj->key_dict[id].key) + 1);
+        }
+    }
+
+    uint32_t record_size = 0;
+    if (result == CY_RSLT_SUCCESS)
+    {
+        record_size = _mtb_kvstore_get_record_size(obj, obj->gc_area_addr,
+                                                   _mtb_kvstore_get_stored_key_size(key,
+                                                                                    header.flags),
+                                                   manifest_size);
+        manifest = (uint8_t*)malloc(manifest_size);
+        if (manifest == NULL)
+        {
+            result = MTB_KVSTORE_MEM_ALLOC_ERROR;
+        }
+        else if ((dst_offset + record_size) > _MTB_KVSTORE_AREA_SIZE(obj))
+        {
+            result = MTB_KVSTORE_STORAGE_FULL_ERROR;
+        }
+    }
+    if (result == CY_RSLT_SUCCESS)
+    {
+        memcpy(manifest, &info, sizeof(info));
+        memcpy(&manifest[sizeof(info)], chunk_offsets, num_chunks * sizeof(uint32_t));
+        result = _mtb_kvstore_write_record(obj, obj->gc_area_addr, dst_offset, key, manifest,
+                                           manifest_size, _MTB_KVSTORE_OPER_ADD, header.flags,
+                                           NULL, NULL);
+    }
+
+    free(manifest);
+    free(chunk_offsets);
+
+    if (result == CY_RSLT_SUCCESS)
+    {
+        _MTB_KVSTORE_STORE_FIELD(entry->offset, dst_offset);
+        *next_dst_offset = dst_offset + record_size;
+    }
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_copy_live_records
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_copy_live_records(mtb_kvstore_t* obj,
+                                                mtb_kvstore_ram_table_entry_t* ram_table,
+                                                const _mtb_kvstore_record_info_t* record_info,
+                                                uint32_t* next_dst_offset)
+{
+    // Copies the key dictionary and the records of the given RAM table into the erased GC area,
+    // and updates the offsets in the table, except for the record that is injected or deleted.
+
+    /* Erase the GC area */
+    cy_rslt_t result = _mtb_kvstore_erase_area(obj, obj->gc_area_addr);
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
+
+    uint32_t dst_offset = _mtb_kvstore_get_area_header_record_size(obj, obj->gc_area_addr);
+
+    // The key dictionary is copied first, so that it precedes the records that refer to it. The new
+    // offsets take effect once the area header is written.
+    for (uint32_t id = 0; id < obj->num_key_ids; id++)
+    {
+        uint32_t dst_next_offset;
+        result = _mtb_kvstore_copy_record(obj, obj->active_area_addr, obj->key_dict[id].offset,
+                                          obj->gc_area_addr, dst_offset, &dst_next_offset);
+        if (result != CY_RSLT_SUCCESS)
+        {
+            return result;
+        }
+
+        obj->key_dict[id].gc_offset = dst_offset;
+        dst_offset = dst_next_offset;
+    }
+
+    // Shared blobs are copied with the first value that refers to them.
+    for (uint32_t blob = 0; blob < obj->num_blobs; blob++)
+    {
+        obj->blobs[blob].gc_offset = _MTB_KVSTORE_NO_SEGMENT;
+    }
+
+    for (uint32_t idx = 0; idx < obj->num_entries; idx++)
+    {
+        if ((record_info != NULL) &&
+            ((record_info->marked != NULL)
+             ? record_info->marked[idx]
+             : (idx == record_info->ram_tbl_idx)))
+        {
+            continue;
+        }
+
+        uint32_t dst_next_offset;
+        uint32_t src_offset = ram_table[idx].offset;
+        if ((ram_table[idx].flags & _MTB_KVSTORE_APPEND_FLAG) != 0)
+        {
+            result = _mtb_kvstore_coalesce_segments(obj, &ram_table[idx], dst_offset,
+                                                    &dst_next_offset);
+            if (result != CY_RSLT_SUCCESS)
+            {
+                return result;
+            }
+            dst_offset = dst_next_offset;
+            continue;
+        }
+
+        if ((ram_table[idx].flags & _MTB_KVSTORE_CHUNKED_FLAG) != 0)
+        {
+            result = _mtb_kvstore_copy_chunked(obj, &ram_table[idx], dst_offset, &dst_next_offset);
+            if (result != CY_RSLT_SUCCESS)
+            {
+                return result;
+            }
+            dst_offset = dst_next_offset;
+            continue;
+        }
+
+        result = _mtb_kvstore_copy_record(obj, obj->active_area_addr, src_offset, obj->gc_area_addr,
+                                          dst_offset, &dst_next_offset);
+        if (result != CY_RSLT_SUCCESS)
+        {
+            return result;
+        }
+
+        _MTB_KVSTORE_STORE_FIELD(ram_table[idx].offset, dst_offset);
+        dst_offset = dst_next_offset;
+    }
+
+    *next_dst_offset = dst_offset;
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_remove_marked_entries
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_remove_marked_entries(mtb_kvstore_t* obj, const bool* marked)
+{
+    // Must only be called once the storage no longer holds the marked keys. All of them are
+    // removed even if the references of one of them to shared blobs cannot be dropped, so that
+    // the RAM table matches the storage. The first such error is returned.
+    cy_rslt_t result = CY_RSLT_SUCCESS;
+
+    // Going backwards keeps the indices of the remaining marked entries valid.
+    for (uint32_t idx = obj->num_entries; idx > 0; idx--)
+    {
+        if (!marked[idx - 1])
+        {
+            continue;
+        }
+
+        _mtb_kvstore_update_ram_table_info_t ram_tbl_info =
+        {
+            .ram_tbl_idx  = idx - 1,
+            .entry.hash   = 0,
+            .entry.offset = 0
+        };
+        _mtb_kvstore_update_consumed_size_info_t size_info =
+        {
+            .old_record_size = _mtb_kvstore_get_live_size(obj, idx - 1),
+            .new_record_size = 0
+        };
+        cy_rslt_t blob_result = _mtb_kvstore_update_blob_refs(obj, _MTB_KVSTORE_OPER_DELETE,
+                                                              &ram_tbl_info);
+        if (result == CY_RSLT_SUCCESS)
+        {
+            result = blob_result;
+        }
+        _mtb_kvstore_update_ram_table(obj, _MTB_KVSTORE_OPER_DELETE, &ram_tbl_info);
+        _mtb_kvstore_update_consumed_size(obj, _MTB_KVSTORE_OPER_DELETE, &size_info);
+    }
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_apply_gc_record
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_apply_gc_record(mtb_kvstore_t* obj,
+                                              const _mtb_kvstore_record_info_t* record_info,
+                                              uint32_t offset)
+{
+    // Updates the RAM table for the records that a garbage collection dropped, or for the record
+    // that it injected at the given offset, once the new area is in place. As the storage already
+    // reflects the change, the RAM table is updated even if the references to shared blobs cannot
+    // be, and that error is returned.
+    if (record_info->marked != NULL)
+    {
+        // The marked records were not copied, so the new area no longer holds their keys.
+        return _mtb_kvstore_remove_marked_entries(obj, record_info->marked);
+    }
+
+    const _mtb_kvstore_update_record_info_t* update_rec_info = record_info->update_rec_info;
+    _mtb_kvstore_operation_t operation = _MTB_KVSTORE_OPER_DELETE;
+    _mtb_kvstore_update_ram_table_info_t ram_tbl_info =
+    {
+        .ram_tbl_idx  = record_info->ram_tbl_idx,
+        .entry.hash   = 0,
+        .entry.offset = 0
+    };
+    if (update_rec_info != NULL)
+    {
+        operation = _MTB_KVSTORE_OPER_UPDATE;
+        ram_tbl_info.entry.hash = update_rec_info->key_hash;
+        ram_tbl_info.entry.flags = update_rec_info->flags;
+        ram_tbl_info.entry.offset = offset;
+    }
+
+    cy_rslt_t result = _mtb_kvstore_update_blob_refs(obj, operation, &ram_tbl_info);
+    _mtb_kvstore_update_ram_table(obj, operation, &ram_tbl_info);
+    _mtb_kvstore_update_consumed_size(obj, operation, &record_info->consumed_size_info);
+    if (update_rec_info != NULL)
+    {
+        _mtb_kvstore_set_inline(obj, record_info->ram_tbl_idx, update_rec_info->key,
+                                update_rec_info->flags, update_rec_info->data,
+                                update_rec_info->data_size);
+    }
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_compact_into_gc_area
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_compact_into_gc_area(mtb_kvstore_t* obj,
+                                                   const _mtb_kvstore_record_info_t* record_info)
+{
+    CY_ASSERT(obj != NULL);
+    cy_rslt_t result = CY_RSLT_SUCCESS;
+
+    // If we need to update a record then that the new size fits the space remaining space.
+    // Otherwise return area full error before copying over. We can do this because we track
+    // the actual consumed size so we use that to check if there is enough space to accommodate
+    // the updated record.
+    if ((record_info != NULL) && (record_info->update_rec_info != NULL))
+    {
+        // Note that the consumed size is not yet updated so we need to subtract the old record size
+        // while checking for space left.
+        uint32_t total_size = obj->consumed_size - record_info->consumed_size_info.old_record_size +
+                              record_info->consumed_size_info.new_record_size;
+        if (total_size > _MTB_KVSTORE_AREA_SIZE(obj))
+        {
+            return MTB_KVSTORE_STORAGE_FULL_ERROR;
+        }
+    }
+
+    // Views only point into the active area, so they stay valid until the next garbage collection
+    // erases it.
+    result = _mtb_kvstore_wait_for_views(obj, _mtb_kvstore_area_index(obj, obj->gc_area_addr));
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
+
+    // The new offsets are staged in a copy of the RAM table, so that the RAM table still matches
+    // the active area if the garbage collection fails part way. Readers keep using the RAM table
+    // and the active area while the records are copied, unless the block device cannot be read by
+    // readers while garbage collection reads, programs and erases it.
+    mtb_kvstore_ram_table_entry_t* ram_table = obj->ram_table;
+    if (obj->num_entries != 0)
+    {
+        ram_table = (mtb_kvstore_ram_table_entry_t*)malloc(
+            obj->num_entries * sizeof(mtb_kvstore_ram_table_entry_t));
+        if (ram_table == NULL)
+        {
+            return MTB_KVSTORE_MEM_ALLOC_ERROR;
+        }
+        memcpy(ram_table, obj->ram_table, obj->num_entries * sizeof(mtb_kvstore_ram_table_entry_t));
+    }
+
+    bool admit_readers = _mtb_kvstore_has_concurrent_reads(obj);
+    if (admit_readers)
+    {
+        _mtb_kvstore_admit_readers(obj);
+    }
+    // Only one instance per block device erases and copies at a time, so that instances on the same
+    // storage device do not stall each other.
+    uint32_t dst_offset = 0;
+    _mtb_kvstore_gc_lock(obj);
+    result = _mtb_kvstore_copy_live_records(obj, ram_table, record_info, &dst_offset);
+    _mtb_kvstore_gc_unlock(obj);
+    if (admit_readers)
+    {
+        _mtb_kvstore_exclude_readers(obj);
+    }
+
+    // We need to inject a record in the case where there may not be enough space to add a new
+    // record for an update operation. Only the storage is written here, the RAM table is updated
+    // once the new area is in place.
+    if ((result == CY_RSLT_SUCCESS) && (record_info != NULL) &&
+        (record_info->update_rec_info != NULL))
+    {
+        const _mtb_kvstore_update_record_info_t* update_rec_info = record_info->update_rec_info;
+        result = _mtb_kvstore_write_record(obj, obj->gc_area_addr, dst_offset, update_rec_info->key,
+                                           update_rec_info->data, update_rec_info->data_size,
+                                           _MTB_KVSTORE_OPER_UPDATE, update_rec_info->flags, NULL,
+                                           NULL);
+    }
+
+    if (result == CY_RSLT_SUCCESS)
+    {
+        obj->active_area_version++;
+        result = _mtb_kvstore_write_area_record(obj, obj->gc_area_addr, obj->active_area_version);
+    }
+    if (result != CY_RSLT_SUCCESS)
+    {
+        // The active area and the RAM table are unchanged.
+        if (ram_table != obj->ram_table)
+        {
+            free(ram_table);
+        }
+        return result;
+    }
+
+    // The new area is complete, so the RAM table now refers to it. Readers are kept out until
+    // the active area has been switched.
+    if (ram_table != obj->ram_table)
+    {
+        _mtb_kvstore_move_entries(obj->ram_table, ram_table, obj->num_entries);
+        free(ram_table);
+    }
+
+    // The blobs are looked up in the old area until the injected or deleted record has been
+    // accounted for.
+    cy_rslt_t delete_result = CY_RSLT_SUCCESS;
+    if (record_info != NULL)
+    {
+        delete_result = _mtb_kvstore_apply_gc_record(obj, record_info, dst_offset);
+        if (record_info->update_rec_info != NULL)
+        {
+            dst_offset += _mtb_kvstore_get_record_size(obj, obj->gc_area_addr,
+                                                       _mtb_kvstore_get_stored_key_size(
+                                                           record_info->update_rec_info->key,
+                                                           record_info->update_rec_info->flags),
+                                                       record_info->update_rec_info->data_size);
+        }
+    }
+
+    obj->free_space_offset = dst_offset;
+    // Appended values shrink when their segments are coalesced, so the consumed size is taken
+    // from the compacted area instead of being adjusted record by record.
+    obj->consumed_size = dst_offset;
+
+    for (uint32_t id = 0; id < obj->num_key_ids; id++)
+    {
+        obj->key_dict[id].offset = obj->key_dict[id].gc_offset;
+    }
+    for (uint32_t blob = 0; blob < obj->num_blobs; blob++)
+    {
+        obj->blobs[blob].offset = obj->blobs[blob].gc_offset;
+    }
+
+    uint32_t new_gc_area_addr = obj->active_area_addr;
+    _MTB_KVSTORE_PUBLISH(obj->active_area_addr, obj->gc_area_addr);
+    obj->active_area_packed = obj->config.packed_records;
+    obj->gc_area_addr = new_gc_area_addr;
+
+    return delete_result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_garbage_collection
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_garbage_collection(mtb_kvstore_t* obj,
+                                                 const _mtb_kvstore_record_info_t* record_info)
+{
+    // GC copies every live record, so it benefits the most from a larger staging buffer.
+    _mtb_kvstore_buffer_t saved_buffer;
+    bool grown = _mtb_kvstore_grow_buffer(obj, obj->consumed_size, &saved_buffer);
+
+    cy_rslt_t result = _mtb_kvstore_compact_into_gc_area(obj, record_info);
+
+    if (grown)
+    {
+        _mtb_kvstore_restore_buffer(obj, &saved_buffer);
+    }
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_register
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_register(mtb_kvstore_t* obj)
+{
+    _mtb_kvstore_registry_lock();
+    obj->next_instance = _mtb_kvstore_instances;
+    _mtb_kvstore_instances = obj;
+    _mtb_kvstore_registry_unlock();
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_unregister
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_unregister(mtb_kvstore_t* obj)
+{
+    _mtb_kvstore_registry_lock();
+    mtb_kvstore_t** link = &_mtb_kvstore_instances;
+    while ((*link != NULL) && (*link != obj))
+    {
+        link = &(*link)->next_instance;
+    }
+    if (*link != NULL)
+    {
+        *link = obj->next_instance;
+    }
+    obj->next_instance = NULL;
+    _mtb_kvstore_registry_unlock();
+    _mtb_kvstore_leave_gc_group(obj);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_intern_key
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_intern_key(mtb_kvstore_t* obj, const char* key, uint8_t* key_flags)
+{
+    // Adds the key to the dictionary if that is enabled and it is not in it yet. Returns the flag
+    // that the records of the key are written with.
+    *key_flags = _mtb_kvstore_get_key_flags(obj, key);
+    if (!obj->config.key_dictionary || (*key_flags != _MTB_KVSTORE_NO_FLAG) ||
+        (obj->num_key_ids >= _MTB_KVSTORE_MAX_KEY_IDS))
+    {
+        return CY_RSLT_SUCCESS;
+    }
+
+    uint16_t id = (uint16_t)obj->num_key_ids;
+    uint32_t record_size = _mtb_kvstore_get_record_size(obj, obj->active_area_addr, strlen(key),
+                                                        sizeof(id));
+    if ((obj->consumed_size + record_size) > _MTB_KVSTORE_AREA_SIZE(obj))
+    {
+        return MTB_KVSTORE_STORAGE_FULL_ERROR;
+    }
+
+    cy_rslt_t result = CY_RSLT_SUCCESS;
+    if ((obj->free_space_offset + record_size) > _MTB_KVSTORE_AREA_SIZE(obj))
+    {
+        result = _mtb_kvstore_garbage_collection(obj, NULL);
+        if (result != CY_RSLT_SUCCESS)
+        {
+            return result;
+        }
+    }
+
+    result = _mtb_kvstore_add_key_id(obj, key, obj->free_space_offset);
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
+
+    result = _mtb_kvstore_write_record(obj, obj->active_area_addr, obj->free_space_offset, key,
+                                       (uint8_t*)&id, sizeof(id), _MTB_KVSTORE_OPER_ADD,
+                                       _MTB_KVSTORE_KEY_DEF_FLAG, NULL, NULL);
+    if (result != CY_RSLT_SUCCESS)
+    {
+        _MTB_KVSTORE_PUBLISH(obj->num_key_ids, obj->num_key_ids - 1U);
+        _mtb_kvstore_retire(obj, obj->key_dict[obj->num_key_ids].key);
+        return result;
+    }
+
+    obj->free_space_offset += record_size;
+    obj->consumed_size += record_size;
+    *key_flags = _MTB_KVSTORE_KEY_ID_FLAG;
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_build_ram_table
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_build_ram_table(mtb_kvstore_t* obj)
+{
+    CY_ASSERT(obj != NULL);
+    cy_rslt_t result = CY_RSLT_SUCCESS;
+
+    // Each key will occupy at least a page hence the max number of keys
+    // that fit in the space would be area size / page size.
+    obj->num_entries = 0;
+    obj->last_generation = MTB_KVSTORE_VERSION_NONE;
+    obj->max_entries = _MTB_KVSTORE_INIT_MAX_KEYS;
+    obj->free_space_offset = _MTB_KVSTORE_AREA_SIZE(obj);
+
+    //We initially allocate ram table for 32 entries
+    obj->ram_table =
+        (mtb_kvstore_ram_table_entry_t*)malloc(obj->max_entries *
+                                               sizeof(mtb_kvstore_ram_table_entry_t));
+    if (NULL == obj->ram_table)
+    {
+        return MTB_KVSTORE_MEM_ALLOC_ERROR;
+    }
+
+    // Start looking from the end of the area header.
+    uint32_t record_size = _mtb_kvstore_get_area_header_record_size(obj, obj->active_area_addr);
+    // Add area header size to consumed size.
+    obj->consumed_size = record_size;
+
+    uint32_t offset = record_size;
+    while ((offset + _MTB_KVSTORE_COMPACT_HEADER_MIN_SIZE) < obj->free_space_offset)
+    {
+        _mtb_kvstore_record_header_t header;
+        result = _mtb_kvstore_read_record(obj, obj->active_area_addr, offset, &header,
+                                          obj->key_buffer, false, NULL, NULL);
+        if (result != CY_RSLT_SUCCESS)
+        {
+            if (MTB_KVSTORE_ERASED_DATA_ERROR == result)
+            {
+                // This is a special case since it is expected that we stop populating
+                // the ram table when we encounter free space.
+                // Hence we return success even though read record return an error.
+                result = CY_RSLT_SUCCESS;
+            }
+            else if (MTB_KVSTORE_INVALID_DATA_ERROR == result)
+            {
+                // If a corrupted record was found we run GC operation
+                // which will copy all valid record until the current corrupted
+                // record was encountered.
+                result = _mtb_kvstore_garbage_collection(obj, NULL);
+                // The above function will set the free space offset in the new area
+                // so we directly return the result. The consumed size
+                // is already updated in this loop and will not change even after the
+                // GC operation.
+                return result;
+            }
+            break;
+        }
+
+        // This should be safe as we allocate 1 extra byte in the key buffer than the max key size.
+        obj->key_buffer[header.key_size] = '\0';
+
+        uint32_t curr_offset = offset;
+        // Add the current record size to the offset to set the next offset.
+        record_size = _mtb_kvstore_get_stored_record_size(obj,
+                                                          obj->active_area_addr + curr_offset,
+                                                          &header);
+        offset += record_size;
+
+        // Chunk records, including shared blobs, are accounted for with the manifest records that
+        // refer to them.
+        if ((header.flags & _MTB_KVSTORE_CHUNK_FLAG) != 0)
+        {
+            continue;
+        }
+
+        // Key dictionary records are not tracked by the RAM table. The IDs are assigned in the
+        // order in which the records were written.
+        if ((header.flags & _MTB_KVSTORE_KEY_DEF_FLAG) != 0)
+        {
+            uint16_t id;
+            if (header.data_size != sizeof(id))
+            {
+                continue;
+            }
+            result = obj->bd->read(obj->bd->context, obj->active_area_addr + curr_offset +
+                                   header.header_size + header.key_size, sizeof(id),
+                                   (uint8_t*)&id);
+            if ((result == CY_RSLT_SUCCESS) && (id == obj->num_key_ids))
+            {
+                result = _mtb_kvstore_add_key_id(obj, obj->key_buffer, curr_offset);
+                obj->consumed_size += record_size;
+            }
+            if (result != CY_RSLT_SUCCESS)
+            {
+                break;
+            }
+            continue;
+        }
+
+        // Records that refer to a key ID are tracked under the key itself.
+        if ((header.flags & _MTB_KVSTORE_KEY_ID_FLAG) != 0)
+        {
+            uint32_t id;
+            if (!_mtb_kvstore_decode_key_id(obj->key_buffer, header.key_size, &id) ||
+                (id >= obj->num_key_ids))
+            {
+                continue;
+            }
+            memcpy(obj->key_buffer, obj->key_dict[id].key, strlen(obj->key_dict[id].key) + 1);
+        }
+
+        uint32_t ram_tbl_idx;
+        uint16_t hash;
+        result = _mtb_kvstore_find_record_in_ram_table(obj, obj->key_buffer, &ram_tbl_idx, &hash,
+                                                       NULL);
+        if ((result != CY_RSLT_SUCCESS) && (result != MTB_KVSTORE_ITEM_NOT_FOUND_ERROR))
+        {
+            break;
+        }
+
+        bool delete = (header.flags & _MTB_KVSTORE_DELETE_FLAG) != 0;
+        bool append = (header.flags & _MTB_KVSTORE_APPEND_FLAG) != 0;
+        bool found_in_table = (result != MTB_KVSTORE_ITEM_NOT_FOUND_ERROR);
+
+        // If key was not found in the RAM table and is marked for deletion
+        // then do nothing.
+        if (delete && !found_in_table)
+        {
+            continue;
+        }
+
+        _mtb_kvstore_operation_t operation = (delete)
+                                            ? _MTB_KVSTORE_OPER_DELETE
+                                            : (found_in_table) ? _MTB_KVSTORE_OPER_UPDATE :
+                                             _MTB_KVSTORE_OPER_ADD;
+
+        // If we have to add an entry to the ram table then check
+        // if we need to increment keys.
+        if ((operation == _MTB_KVSTORE_OPER_ADD) && (obj->num_entries >= obj->max_entries))
+        {
+            result = _mtb_kvstore_increment_max_keys(obj);
+            if (result != CY_RSLT_SUCCESS)
+            {
+                break;
+            }
+        }
+
+        // An appended segment adds to the value instead of replacing the records that hold it.
+        uint32_t old_record_size = ((operation == _MTB_KVSTORE_OPER_ADD) || append)
+                                ? 0
+                                : _mtb_kvstore_get_live_size(obj, ram_tbl_idx);
+
+        _mtb_kvstore_update_ram_table_info_t ram_tbl_info =
+        {
+            .ram_tbl_idx  = ram_tbl_idx,
+            .entry.hash   = hash,
+            .entry.flags  = header.flags,
+            .entry.offset = curr_offset
+        };
+        result = _mtb_kvstore_update_blob_refs(obj, operation, &ram_tbl_info);
+        if (result != CY_RSLT_SUCCESS)
+        {
+            break;
+        }
+        _mtb_kvstore_update_ram_table(obj, operation, &ram_tbl_info);
+        if (operation != _MTB_KVSTORE_OPER_DELETE)
+        {
+            result = _mtb_kvstore_load_inline(obj, ram_tbl_idx, obj->key_buffer, curr_offset,
+                                              &header);
+            if (result != CY_RSLT_SUCCESS)
+            {
+                break;
+            }
+        }
+
+        _mtb_kvstore_update_consumed_size_info_t size_info =
+        {
+            .old_record_size = old_record_size,
+            .new_record_size = ((header.flags & _MTB_KVSTORE_CHUNKED_FLAG) != 0)
+                               ? (record_size + _mtb_kvstore_get_chunks_size(obj, curr_offset))
+                               : record_size
+        };
+        _mtb_kvstore_update_consumed_size(obj, operation, &size_info);
+
+
+        result = CY_RSLT_SUCCESS;
+    }
+
+    obj->free_space_offset = offset;
+
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_setup_areas
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_setup_areas(mtb_kvstore_t* obj)
+{
+    CY_ASSERT(obj != NULL);
+    cy_rslt_t result = CY_RSLT_SUCCESS;
+
+    // Divide the space into 2 equal sizes.
+    uint32_t area1_start_addr = obj->start_addr;
+    uint32_t area2_start_addr = obj->start_addr + _MTB_KVSTORE_AREA_SIZE(obj);
+
+    bool area1_valid;
+    bool area2_valid;
+    uint16_t area1_version;
+    uint16_t area2_version;
+    bool area1_packed;
+    bool area2_packed;
+    uint8_t area1_shards;
+    uint8_t area2_shards;
+
+    // Read area 1 header
+    cy_rslt_t area_valid_result = _mtb_kvstore_check_area_valid(obj, area1_start_addr,
+                                                                &area1_version, &area1_packed,
+                                                                &area1_shards);
+    if ((CY_RSLT_SUCCESS != area_valid_result) &&
+        (MTB_KVSTORE_ERASED_DATA_ERROR != area_valid_result) &&
+        (MTB_KVSTORE_INVALID_DATA_ERROR != area_valid_result) &&
+        (MTB_KVSTORE_ITEM_NOT_FOUND_ERROR != area_valid_result))
+    {
+        return area_valid_result;
+    }
+    area1_valid = (CY_RSLT_SUCCESS == area_valid_result);
+
+    area_valid_result = _mtb_kvstore_check_area_valid(obj, area2_start_addr, &area2_version,
+                                                      &area2_packed, &area2_shards);
+    if ((CY_RSLT_SUCCESS != area_valid_result) &&
+        (MTB_KVSTORE_ERASED_DATA_ERROR != area_valid_result) &&
+        (MTB_KVSTORE_INVALID_DATA_ERROR != area_valid_result) &&
+        (MTB_KVSTORE_ITEM_NOT_FOUND_ERROR != area_valid_result))
+    {
+        return area_valid_result;
+    }
+    area2_valid = (CY_RSLT_SUCCESS == area_valid_result);
+
+    // Storage that was split into a different number of shards would be read and garbage
+    // collected at the wrong addresses. Areas written before the count was recorded hold 0.
+    if ((area1_valid && (area1_shards != 0) && (area1_shards != obj->num_shards)) ||
+        (area2_valid && (area2_shards != 0) && (area2_shards != obj->num_shards)))
+    {
+        return MTB_KVSTORE_BAD_PARAM_ERROR;
+    }
+
+    // If both are valid, set the one area whose master record has the
+    // higher version as active_area. Erase first sector of the other one.
+    if (area1_valid && area2_valid)
+    {
+        // The versions should never be equal.
+        CY_ASSERT(area1_version != area2_version);
+
+        // Check if the area1 version is greater or 0 in case of wrap around.
+        if ((area1_version > area2_version) || (area1_version == 0))
+        {
+            obj->active_area_addr = area1_start_addr;
+            obj->active_area_version = area1_version;
+            obj->active_area_packed = area1_packed;
+            obj->gc_area_addr = area2_start_addr;
+        }
+        else
+        {
+            obj->active_area_addr = area2_start_addr;
+            obj->active_area_version = area2_version;
+            obj->active_area_packed = area2_packed;
+            obj->gc_area_addr = area1_start_addr;
+        }
+    }
+    // If one is valid, set its area as active_area.
+    else if (area1_valid)
+    {
+        obj->active_area_addr = area1_start_addr;
+        obj->active_area_version = area1_version;
+        obj->active_area_packed = area1_packed;
+        obj->gc_area_addr = area2_start_addr;
+    }
+    else if (area2_valid)
+    {
+        obj->active_area_addr = area2_start_addr;
+        obj->active_area_version = area2_version;
+        obj->active_area_packed = area2_packed;
+        obj->gc_area_addr = area1_start_addr;
+    }
+    // If none are valid, set area1 as active_area, and program area record
+    //with version 1.
+    else
+    {
+        // Erase first sector of area 1 to be able to write the header.
+        result = _mtb_kvstore_erase_area(obj, area1_start_addr);
+        if (result != CY_RSLT_SUCCESS)
+        {
+            return result;
+        }
+
+        // Write the area header into the area 1.
+        result = _mtb_kvstore_write_area_record(obj, area1_start_addr,
+                                                _MTB_KVSTORE_INITIAL_AREA_VERSION);
+        if (result != CY_RSLT_SUCCESS)
+        {
+            return result;
+        }
+        obj->active_area_addr = area1_start_addr;
+        obj->active_area_version = _MTB_KVSTORE_INITIAL_AREA_VERSION;
+        obj->active_area_packed = obj->config.packed_records;
+        obj->gc_area_addr = area2_start_addr;
+    }
+
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_lz_emit_literals
+//--------------------------------------------------------------------------------------------------
+static bool _mtb_kvstore_lz_emit_literals(const uint8_t* literals, uint32_t count, uint8_t* out,
+                                          uint32_t* out_size, uint32_t capacity)
+{
+    while (count > 0)
+    {
+        uint32_t run = (count > _MTB_KVSTORE_LZ_MAX_LITERALS) ? _MTB_KVSTORE_LZ_MAX_LITERALS : count;
+        if ((*out_size + 1 + run) > capacity)
+        {
+            return false;
+        }
+        out[(*out_size)++] = (uint8_t)(run - 1);
+        memcpy(&out[*out_size], literals, run);
+        *out_size += run;
+        literals += run;
+        count -= run;
+    }
+    return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_lz_compress
+//--------------------------------------------------------------------------------------------------
+static uint32_t _mtb_kvstore_lz_compress(const uint8_t* in, uint32_t in_size, uint8_t* out,
+                                         uint32_t capacity)
+{
+    // Byte oriented LZ77. A token below 0x80 is followed by token + 1 literal bytes, otherwise it is
+    // a match of (token & 0x7F) + 3 bytes at the 16-bit little endian distance that follows.
+    // Returns the compressed size, or 0 if it does not fit into capacity.
+    uint16_t last_pos[1U << _MTB_KVSTORE_LZ_HASH_BITS];
+    memset(last_pos, 0, sizeof(last_pos));
+    uint32_t out_size = 0;
+    uint32_t literal_start = 0;
+    uint32_t pos = 0;
+    while ((pos + _MTB_KVSTORE_LZ_MIN_MATCH) <= in_size)
+    {
+        uint32_t seq = in[pos] | ((uint32_t)in[pos + 1] << 8) | ((uint32_t)in[pos + 2] << 16);
+        uint32_t hash = (seq * 2654435761U) >> (32U - _MTB_KVSTORE_LZ_HASH_BITS);
+        uint32_t candidate = last_pos[hash];
+        last_pos[hash] = (uint16_t)(pos + 1);
+        if ((candidate == 0) ||
+            (memcmp(&in[candidate - 1], &in[pos], _MTB_KVSTORE_LZ_MIN_MATCH) != 0))
+        {
+            pos++;
+            continue;
+        }
+
+        uint32_t match = candidate - 1;
+        uint32_t length = _MTB_KVSTORE_LZ_MIN_MATCH;
+        while (((pos + length) < in_size) && (length < _MTB_KVSTORE_LZ_MAX_MATCH) &&
+               (in[match + length] == in[pos + length]))
+        {
+            length++;
+        }
+
+        if (!_mtb_kvstore_lz_emit_literals(&in[literal_start], pos - literal_start, out,
+                                           &out_size, capacity) || ((out_size + 3) > capacity))
+        {
+            return 0;
+        }
+        uint32_t distance = pos - match;
+        out[out_size++] = (uint8_t)(_MTB_KVSTORE_LZ_MATCH_FLAG |
+                                    (length - _MTB_KVSTORE_LZ_MIN_MATCH));
+        out[out_size++] = (uint8_t)distance;
+        out[out_size++] = (uint8_t)(distance >> 8);
+        pos += length;
+        literal_start = pos;
+    }
+
+    if (!_mtb_kvstore_lz_emit_literals(&in[literal_start], in_size - literal_start, out,
+                                       &out_size, capacity))
+    {
+        return 0;
+    }
+    return out_size;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_lz_decompress
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_lz_decompress(const uint8_t* in, uint32_t in_size, uint8_t* out,
+                                            uint32_t out_size)
+{
+    uint32_t in_pos = 0;
+    uint32_t out_pos = 0;
+    while (in_pos < in_size)
+    {
+        uint8_t token = in[in_pos++];
+        if ((token & _MTB_KVSTORE_LZ_MATCH_FLAG) == 0)
+        {
+            uint32_t run = (uint32_t)token + 1;
+            if (((in_pos + run) > in_size) || ((out_pos + run) > out_size))
+            {
+                return MTB_KVSTORE_INVALID_DATA_ERROR;
+            }
+            memcpy(&out[out_pos], &in[in_pos], run);
+            in_pos += run;
+            out_pos += run;
+        }
+        else
+        {
+            if ((in_pos + 2) > in_size)
+            {
+                return MTB_KVSTORE_INVALID_DATA_ERROR;
+            }
+            uint32_t length = (token & (uint8_t)~_MTB_KVSTORE_LZ_MATCH_FLAG) +
+                              _MTB_KVSTORE_LZ_MIN_MATCH;
+            uint32_t distance = in[in_pos] | ((uint32_t)in[in_pos + 1] << 8);
+            in_pos += 2;
+            if ((distance == 0) || (distance > out_pos) || ((out_pos + length) > out_size))
+            {
+                return MTB_KVSTORE_INVALID_DATA_ERROR;
+            }
+            // Matches may overlap the bytes they produce, so they are copied byte by byte.
+            for (uint32_t i = 0; i < length; i++, out_pos++)
+            {
+                out[out_pos] = out[out_pos - distance];
+            }
+        }
+    }
+    return (out_pos == out_size) ? CY_RSLT_SUCCESS : MTB_KVSTORE_INVALID_DATA_ERROR;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_compress_value
+//--------------------------------------------------------------------------------------------------
+static bool _mtb_kvstore_compress_value(const uint8_t* data, uint32_t size, uint8_t** compressed,
+                                        uint32_t* compressed_size)
+{
+    // Returns false, leaving nothing allocated, if the value does not become smaller. Otherwise the
+    // caller frees the compressed value.
+    uint32_t num_blocks = (size + MTB_KVSTORE_COMPRESSION_BLOCK_SIZE - 1) /
+                          MTB_KVSTORE_COMPRESSION_BLOCK_SIZE;
+    uint32_t out_size = sizeof(_mtb_kvstore_compressed_info_t) + (num_blocks * sizeof(uint16_t));
+    if (out_size >= size)
+    {
+        return false;
+    }
+
+    // Only a result smaller than the value is kept, so the value size bounds the buffer.
+    uint8_t* buffer = (uint8_t*)malloc(size);
+    if (buffer == NULL)
+    {
+        return false;
+    }
+
+    _mtb_kvstore_compressed_info_t info =
+    {
+        .value_size = size,
+        .block_size = MTB_KVSTORE_COMPRESSION_BLOCK_SIZE
+    };
+    memcpy(buffer, &info, sizeof(info));
+    for (uint32_t block = 0; block < num_blocks; block++)
+    {
+        uint32_t block_start = block * MTB_KVSTORE_COMPRESSION_BLOCK_SIZE;
+        uint32_t raw_size = ((size - block_start) < MTB_KVSTORE_COMPRESSION_BLOCK_SIZE)
+                            ? (size - block_start)
+                            : MTB_KVSTORE_COMPRESSION_BLOCK_SIZE;
+        uint32_t capacity = (raw_size - 1) < (size - out_size)
+                            ? (raw_size - 1)
+                            : (size - out_size);
+        uint32_t stored_size = _mtb_kvstore_lz_compress(&data[block_start], raw_size,
+                                                        &buffer[out_size], capacity);
+        if (stored_size == 0)
+        {
+            if ((out_size + raw_size) >= size)
+            {
+                free(buffer);
+                return false;
+            }
+            memcpy(&buffer[out_size], &data[block_start], raw_size);
+            stored_size = raw_size;
+        }
+
+        uint16_t table_entry = (uint16_t)stored_size;
+        memcpy(&buffer[sizeof(info) + (block * sizeof(uint16_t))], &table_entry,
+               sizeof(table_entry));
+        out_size += stored_size;
+    }
+
+    if (out_size >= size)
+    {
+        free(buffer);
+        return false;
+    }
+
+    *compressed = buffer;
+    *compressed_size = out_size;
+    return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_is_record_unchanged
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_is_record_unchanged(mtb_kvstore_t* obj, uint32_t offset,
+                                                  const char* key, const uint8_t* data,
+                                                  uint32_t size, uint8_t flags, bool* unchanged)
+{
+    CY_ASSERT(obj != NULL);
+    *unchanged = false;
+
+    _mtb_kvstore_record_header_t stored_header;
+    uint32_t record_addr = obj->active_area_addr + offset;
+    cy_rslt_t result = _mtb_kvstore_read_header(obj, record_addr, &stored_header);
+    if ((result != CY_RSLT_SUCCESS) || (stored_header.flags != flags) ||
+        (stored_header.data_size != size))
+    {
+        return result;
+    }
+
+    char id_key[_MTB_KVSTORE_KEY_ID_SIZE + 1];
+    key = _mtb_kvstore_get_stored_key(obj, key, flags, id_key);
+    if (key == NULL)
+    {
+        return result;
+    }
+
+    // Compare the CRC first, the data is only read back if it matches.
+    _mtb_kvstore_record_header_t new_header;
+    _mtb_kvstore_setup_record_header(key, data, size, stored_header.format_version,
+                                     _MTB_KVSTORE_OPER_UPDATE, flags, &new_header);
+    if (new_header.crc != stored_header.crc)
+    {
+        return result;
+    }
+
+    uint32_t data_addr = record_addr + stored_header.header_size + stored_header.key_size;
+    uint32_t remaining_size = size;
+    while (remaining_size > 0)
+    {
+        uint32_t transfer_size =
+            (obj->transaction_buffer_size >=
+             remaining_size) ? remaining_size : obj->transaction_buffer_size;
+        result = obj->bd->read(obj->bd->context, data_addr, transfer_size, obj->transaction_buffer);
+        if (result != CY_RSLT_SUCCESS)
+        {
+            return result;
+        }
+
+        if (memcmp(data, obj->transaction_buffer, transfer_size) != 0)
+        {
+            return result;
+        }
+
+        data += transfer_size;
+        data_addr += transfer_size;
+        remaining_size -= transfer_size;
+    }
+
+    *unchanged = true;
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_append_record
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_append_record(mtb_kvstore_t* obj, const char* key,
+                                            const uint8_t* data, uint32_t size,
+                                            _mtb_kvstore_operation_t operation, uint8_t flags,
+                                            uint32_t ram_tbl_idx, uint16_t hash)
+{
+    CY_ASSERT(obj != NULL);
+    cy_rslt_t result = CY_RSLT_SUCCESS;
+    bool found_in_table = (operation != _MTB_KVSTORE_OPER_ADD);
+
+    // The key is added to the dictionary before the record that refers to it is written.
+    uint8_t key_flags = _mtb_kvstore_get_key_flags(obj, key);
+    if (operation != _MTB_KVSTORE_OPER_DELETE)
+    {
+        result = _mtb_kvstore_intern_key(obj, key, &key_flags);
+        if (result != CY_RSLT_SUCCESS)
+        {
+            return result;
+        }
+    }
+    flags |= key_flags;
+
+    // We will be adding a new entry if its not found in the table so
+    // check if max keys need to be expanded before we write anything
+    // to flash.
+    if ((operation == _MTB_KVSTORE_OPER_ADD) && (obj->num_entries >= obj->max_entries))
+    {
+        result = _mtb_kvstore_increment_max_keys(obj);
+        if (result != CY_RSLT_SUCCESS)
+        {
+            return result;
+        }
+    }
+
+    // Check if space enough for KV record. If not run GC
+    uint32_t record_size = _mtb_kvstore_get_record_size(obj, obj->active_area_addr,
+                                                        _mtb_kvstore_get_stored_key_size(key,
+                                                                                         flags),
+                                                        size);
+    uint32_t old_record_size = (operation == _MTB_KVSTORE_OPER_ADD)
+                                ? 0
+                                : _mtb_kvstore_get_live_size(obj, ram_tbl_idx);
+
+    if (((operation == _MTB_KVSTORE_OPER_UPDATE) || (operation == _MTB_KVSTORE_OPER_ADD)) &&
+        ((obj->consumed_size - old_record_size + record_size) > _MTB_KVSTORE_AREA_SIZE(obj)))
+    {
+        return MTB_KVSTORE_STORAGE_FULL_ERROR;
+    }
+
+    if ((obj->free_space_offset + record_size) > _MTB_KVSTORE_AREA_SIZE(obj))
+    {
+        // If we need to update or delete a key and we do not enough space left. We can do the
+        // update or
+        // deletion when we run garbage collection by removing the value from the ram table before
+        // GC operation
+        // and injecting new updated entry if it is a update operation.
+        _mtb_kvstore_record_info_t record_info;
+        _mtb_kvstore_update_record_info_t update_rec;
+        record_info.marked = NULL;
+
+        if ((operation == _MTB_KVSTORE_OPER_DELETE) || (operation == _MTB_KVSTORE_OPER_UPDATE))
+        {
+            record_info.ram_tbl_idx = ram_tbl_idx;
+            record_info.consumed_size_info.new_record_size = record_size;
+            record_info.consumed_size_info.old_record_size = old_record_size;
+        }
+
+        if (operation == _MTB_KVSTORE_OPER_DELETE)
+        {
+            record_info.update_rec_info = NULL;
+        }
+        else if (operation == _MTB_KVSTORE_OPER_UPDATE)
+        {
+            update_rec.key = key;
+            update_rec.data = data;
+            update_rec.data_size = size;
+            update_rec.key_hash = hash;
+            update_rec.flags = flags;
+
+            record_info.update_rec_info = &update_rec;
+        }
+
+        result = _mtb_kvstore_garbage_collection(obj,
+                                                 (operation == _MTB_KVSTORE_OPER_ADD)
+                                                  ? NULL
+                                                  : &record_info);
+        if ((result != CY_RSLT_SUCCESS) || found_in_table)
+        {
+            return result;
+        }
+    }
+
+    // We check that we have enough space earlier so when we get here we must
+    // have enough space.
+    CY_ASSERT((obj->free_space_offset + record_size) <= _MTB_KVSTORE_AREA_SIZE(obj));
+
+    _mtb_kvstore_update_ram_table_info_t ram_tbl_info =
+    {
+        .ram_tbl_idx  = ram_tbl_idx,
+        .entry.hash   = hash,
+        .entry.flags  = flags,
+        .entry.offset = obj->free_space_offset
+    };
+
+    _mtb_kvstore_update_consumed_size_info_t size_info =
+    {
+        .old_record_size = old_record_size,
+        .new_record_size = record_size
+    };
+
+    result = _mtb_kvstore_write_record(obj, obj->active_area_addr, obj->free_space_offset,
+                                       key, data, size, operation, flags, &ram_tbl_info,
+                                       &size_info);
+    if (result == CY_RSLT_SUCCESS)
+    {
+        obj->free_space_offset += record_size;
+    }
+
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_reuse_chunks
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_reuse_chunks(mtb_kvstore_t* obj, uint32_t ram_tbl_idx,
+                                           const char* key, const uint8_t* data, uint32_t size,
+                                           uint8_t key_flags, bool compare,
+                                           uint32_t* chunk_offsets)
+{
+    // Sets the offset of each chunk of the new value that is identical to the chunk at the same
+    // position of the current value, which is left as _MTB_KVSTORE_NO_SEGMENT otherwise. Without
+    // compare the chunks found before are only looked up again, as garbage collection moved them.
+    _mtb_kvstore_chunked_info_t info;
+    uint32_t* old_offsets;
+    cy_rslt_t result = _mtb_kvstore_read_chunk_table(obj, obj->active_area_addr,
+                                                     obj->ram_table[ram_tbl_idx].offset, &info,
+                                                     &old_offsets);
+    if ((result != CY_RSLT_SUCCESS) || (info.chunk_size != MTB_KVSTORE_CHUNK_SIZE))
+    {
+        if (result == CY_RSLT_SUCCESS)
+        {
+            free(old_offsets);
+        }
+        return result;
+    }
+
+    uint32_t num_chunks = (size + MTB_KVSTORE_CHUNK_SIZE - 1) / MTB_KVSTORE_CHUNK_SIZE;
+    uint32_t num_old_chunks = (info.value_size + info.chunk_size - 1) / info.chunk_size;
+    for (uint32_t chunk = 0; (chunk < num_chunks) && (chunk < num_old_chunks) &&
+         (result == CY_RSLT_SUCCESS); chunk++)
+    {
+        uint32_t chunk_start = chunk * MTB_KVSTORE_CHUNK_SIZE;
+        uint32_t chunk_size = ((size - chunk_start) < MTB_KVSTORE_CHUNK_SIZE)
+                              ? (size - chunk_start)
+                              : MTB_KVSTORE_CHUNK_SIZE;
+        bool unchanged = (chunk_offsets[chunk] != _MTB_KVSTORE_NO_SEGMENT);
+        if (compare)
+        {
+            result = _mtb_kvstore_is_record_unchanged(obj, old_offsets[chunk], key,
+                                                      &data[chunk_start], chunk_size,
+                                                      _MTB_KVSTORE_CHUNK_FLAG | key_flags,
+                                                      &unchanged);
+        }
+        chunk_offsets[chunk] = (unchanged) ? old_offsets[chunk] : _MTB_KVSTORE_NO_SEGMENT;
+    }
+
+    free(old_offsets);
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_is_chunked_size
+//--------------------------------------------------------------------------------------------------
+static inline bool _mtb_kvstore_is_chunked_size(mtb_kvstore_t* obj, uint32_t size)
+{
+    return ((obj->config.chunk_min_size != 0) && (size >= obj->config.chunk_min_size)) ||
+           ((obj->config.dedup_min_size != 0) && (size >= obj->config.dedup_min_size));
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_find_chunk_hash
+//--------------------------------------------------------------------------------------------------
+static inline uint32_t _mtb_kvstore_find_chunk_hash(const uint64_t* blob_hashes, uint32_t count,
+                                                    uint64_t hash)
+{
+    // Returns the first of count chunks that is shared as a blob with the given hash, or count.
+    uint32_t chunk = 0;
+    while ((chunk < count) && ((hash == 0) || (blob_hashes[chunk] != hash)))
+    {
+        chunk++;
+    }
+    return chunk;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_share_chunks
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_share_chunks(mtb_kvstore_t* obj, const uint8_t* data,
+                                           uint32_t size, bool compare, uint32_t* chunk_offsets,
+                                           uint64_t* blob_hashes)
+{
+    // Sets the offset of each chunk of the new value that is already stored as a blob, and the
+    // hash of each chunk that is shared as a blob. Chunks whose hash is taken by a blob or by an
+    // earlier chunk with different content are not shared and get a hash of 0. Without compare the
+    // blobs found before are only looked up again, as garbage collection moved them.
+    cy_rslt_t result = CY_RSLT_SUCCESS;
+    uint32_t num_chunks = (size + MTB_KVSTORE_CHUNK_SIZE - 1) / MTB_KVSTORE_CHUNK_SIZE;
+    for (uint32_t chunk = 0; (chunk < num_chunks) && (result == CY_RSLT_SUCCESS); chunk++)
+    {
+        if (!compare)
+        {
+            if (chunk_offsets[chunk] != _MTB_KVSTORE_NO_SEGMENT)
+            {
+                uint32_t blob = _mtb_kvstore_find_blob(obj, blob_hashes[chunk]);
+                CY_ASSERT(blob < obj->num_blobs);
+                chunk_offsets[chunk] = obj->blobs[blob].offset;
+            }
+            continue;
+        }
+
+        uint32_t chunk_start = chunk * MTB_KVSTORE_CHUNK_SIZE;
+        uint32_t chunk_size = ((size - chunk_start) < MTB_KVSTORE_CHUNK_SIZE)
+                              ? (size - chunk_start)
+                              : MTB_KVSTORE_CHUNK_SIZE;
+        uint64_t hash = _mtb_kvstore_hash_blob(&data[chunk_start], chunk_size);
+        uint32_t blob = _mtb_kvstore_find_blob(obj, hash);
+        uint32_t prev = _mtb_kvstore_find_chunk_hash(blob_hashes, chunk, hash);
+        bool unchanged = false;
+        if (blob < obj->num_blobs)
+        {
+            char blob_key[_MTB_KVSTORE_BLOB_KEY_SIZE + 1];
+            _mtb_kvstore_encode_blob_key(hash, blob_key);
+            result = _mtb_kvstore_is_record_unchanged(obj, obj->blobs[blob].offset, blob_key,
+                                                      &data[chunk_start], chunk_size,
+                                                      _MTB_KVSTORE_BLOB_FLAGS, &unchanged);
+            chunk_offsets[chunk] = (unchanged) ? obj->blobs[blob].offset : _MTB_KVSTORE_NO_SEGMENT;
+        }
+        else if (prev < chunk)
+        {
+            // A chunk that repeats an earlier chunk of the value refers to the same new blob. Only
+            // the last chunk can be shorter than the earlier ones.
+            unchanged = (chunk_size == MTB_KVSTORE_CHUNK_SIZE) &&
+                        (memcmp(&data[prev * MTB_KVSTORE_CHUNK_SIZE], &data[chunk_start],
+                                chunk_size) == 0);
+        }
+        else
+        {
+            unchanged = true;
+        }
+        blob_hashes[chunk] = (unchanged) ? hash : 0;
+    }
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_write_chunked
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_write_chunked(mtb_kvstore_t* obj, const char* key,
+                                            const uint8_t* data, uint32_t size,
+                                            bool found_in_table, uint32_t ram_tbl_idx,
+                                            uint16_t hash, bool skip_unchanged)
+{
+    // Writes a value that is larger than a chunk or deduplicated as chunk records followed by the
+    // manifest record that refers to them. The current value stays live until the manifest is
+    // written, so a write that is interrupted leaves it intact and only the chunks that changed
+    // or that are not stored as blobs yet are written.
+    uint8_t key_flags;
+    cy_rslt_t result = _mtb_kvstore_intern_key(obj, key, &key_flags);
+    if ((result == CY_RSLT_SUCCESS) && !found_in_table && (obj->num_entries >= obj->max_entries))
+    {
+        result = _mtb_kvstore_increment_max_keys(obj);
+    }
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
+
+    uint32_t num_chunks = (size + MTB_KVSTORE_CHUNK_SIZE - 1) / MTB_KVSTORE_CHUNK_SIZE;
+    uint32_t manifest_size = sizeof(_mtb_kvstore_chunked_info_t) +
+                             (num_chunks * sizeof(uint32_t));
+    uint8_t* manifest = (uint8_t*)malloc(manifest_size);
+    if (manifest == NULL)
+    {
+        return MTB_KVSTORE_MEM_ALLOC_ERROR;
+    }
+    _mtb_kvstore_chunked_info_t info =
+    {
+        .value_size = size,
+        .chunk_size = MTB_KVSTORE_CHUNK_SIZE
+    };
+    memcpy(manifest, &info, sizeof(info));
+    uint32_t* chunk_offsets = (uint32_t*)&manifest[sizeof(info)];
+    memset(chunk_offsets, 0xFF, num_chunks * sizeof(uint32_t));
+
+    // Deduplicated values share their chunks with any value, the others only reuse the chunks
+    // of the current value. The blob table is grown up front so that adding references cannot
+    // fail once the manifest is written.
+    uint64_t* blob_hashes = NULL;
+    bool reuse = found_in_table &&
+                 ((obj->ram_table[ram_tbl_idx].flags & _MTB_KVSTORE_CHUNKED_FLAG) != 0);
+    if ((obj->config.dedup_min_size != 0) && (size >= obj->config.dedup_min_size))
+    {
+        blob_hashes = (uint64_t*)calloc(num_chunks, sizeof(uint64_t));
+        result = (blob_hashes == NULL)
+                 ? MTB_KVSTORE_MEM_ALLOC_ERROR
+                 : _mtb_kvstore_reserve_blobs(obj, num_chunks);
+        if (result == CY_RSLT_SUCCESS)
+        {
+            result = _mtb_kvstore_share_chunks(obj, data, size, true, chunk_offsets,
+                                               blob_hashes);
+        }
+    }
+    else if (reuse)
+    {
+        result = _mtb_kvstore_reuse_chunks(obj, ram_tbl_idx, key, data, size, key_flags, true,
+                                           chunk_offsets);
+    }
+
+    // Only the chunks that changed and the manifest are written. The space for all of them is
+    // reserved at once so that garbage collection does not run in between. Blobs are accounted
+    // for by their references instead of by the value.
+    uint32_t stored_key_size = _mtb_kvstore_get_stored_key_size(key, key_flags);
+    uint32_t write_size = _mtb_kvstore_get_record_size(obj, obj->active_area_addr,
+                                                       stored_key_size, manifest_size);
+    uint32_t new_live_size = write_size;
+    uint32_t new_blobs_size = 0;
+    uint32_t num_written = 0;
+    for (uint32_t chunk = 0; chunk < num_chunks; chunk++)
+    {
+        uint32_t chunk_start = chunk * MTB_KVSTORE_CHUNK_SIZE;
+        uint32_t chunk_size = ((size - chunk_start) < MTB_KVSTORE_CHUNK_SIZE)
+                              ? (size - chunk_start)
+                              : MTB_KVSTORE_CHUNK_SIZE;
+        bool shared = (blob_hashes != NULL) && (blob_hashes[chunk] != 0);
+        uint32_t chunk_record_size = _mtb_kvstore_get_record_size(obj, obj->active_area_addr,
+                                                                  (shared)
+                                                                  ? _MTB_KVSTORE_BLOB_KEY_SIZE
+                                                                  : stored_key_size,
+                                                                  chunk_size);
+        bool written = (chunk_offsets[chunk] == _MTB_KVSTORE_NO_SEGMENT) &&
+                       (!shared || (_mtb_kvstore_find_chunk_hash(blob_hashes, chunk,
+                                                                 blob_hashes[chunk]) == chunk));
+        if (!shared)
+        {
+            new_live_size += chunk_record_size;
+        }
+        else if (written)
+        {
+            new_blobs_size += chunk_record_size;
+        }
+        if (written)
+        {
+            write_size += chunk_record_size;
+            num_written++;
+        }
+    }
+
+    uint32_t old_live_size = (found_in_table) ? _mtb_kvstore_get_live_size(obj, ram_tbl_idx) : 0;
+    if ((result == CY_RSLT_SUCCESS) && reuse && (num_written == 0) && skip_unchanged)
+    {
+        bool unchanged;
+        result = _mtb_kvstore_is_record_unchanged(obj, obj->ram_table[ram_tbl_idx].offset, key,
+                                                  manifest, manifest_size,
+                                                  _MTB_KVSTORE_CHUNKED_FLAG | key_flags,
+                                                  &unchanged);
+        if ((result == CY_RSLT_SUCCESS) && unchanged)
+        {
+            obj->stats.skipped_writes++;
+            free(blob_hashes);
+            free(manifest);
+            return result;
+        }
+    }
+
+    // The current value is still live while the new one is written.
+    if ((result == CY_RSLT_SUCCESS) &&
+        ((obj->consumed_size - old_live_size + new_live_size + new_blobs_size) >
+         _MTB_KVSTORE_AREA_SIZE(obj)))
+    {
+        result = MTB_KVSTORE_STORAGE_FULL_ERROR;
+    }
+    if ((result == CY_RSLT_SUCCESS) &&
+        ((obj->free_space_offset + write_size) > _MTB_KVSTORE_AREA_SIZE(obj)))
+    {
+        result = _mtb_kvstore_garbage_collection(obj, NULL);
+        if ((result == CY_RSLT_SUCCESS) && (blob_hashes != NULL))
+        {
+            result = _mtb_kvstore_share_chunks(obj, data, size, false, chunk_offsets,
+                                               blob_hashes);
+        }
+        else if ((result == CY_RSLT_SUCCESS) && reuse)
+        {
+            result = _mtb_kvstore_reuse_chunks(obj, ram_tbl_idx, key, data, size, key_flags, false,
+                                               chunk_offsets);
+        }
+        if ((result == CY_RSLT_SUCCESS) &&
+            ((obj->free_space_offset + write_size) > _MTB_KVSTORE_AREA_SIZE(obj)))
+        {
+            result = MTB_KVSTORE_STORAGE_FULL_ERROR;
+        }
+    }
+
+    for (uint32_t chunk = 0; (chunk < num_chunks) && (result == CY_RSLT_SUCCESS); chunk++)
+    {
+        if (chunk_offsets[chunk] != _MTB_KVSTORE_NO_SEGMENT)
+        {
+            continue;
+        }
+
+        // Blobs are stored under the hash of their content.
+        char blob_key[_MTB_KVSTORE_BLOB_KEY_SIZE + 1];
+        const char* chunk_key = key;
+        uint8_t chunk_flags = _MTB_KVSTORE_CHUNK_FLAG | key_flags;
+        if ((blob_hashes != NULL) && (blob_hashes[chunk] != 0))
+        {
+            uint32_t prev = _mtb_kvstore_find_chunk_hash(blob_hashes, chunk, blob_hashes[chunk]);
+            if (prev < chunk)
+            {
+                chunk_offsets[chunk] = chunk_offsets[prev];
+                continue;
+            }
+            _mtb_kvstore_encode_blob_key(blob_hashes[chunk], blob_key);
+            chunk_key = blob_key;
+            chunk_flags = _MTB_KVSTORE_BLOB_FLAGS;
+        }
+
+        uint32_t chunk_start = chunk * MTB_KVSTORE_CHUNK_SIZE;
+        uint32_t chunk_size = ((size - chunk_start) < MTB_KVSTORE_CHUNK_SIZE)
+                              ? (size - chunk_start)
+                              : MTB_KVSTORE_CHUNK_SIZE;
+        result = _mtb_kvstore_write_record(obj, obj->active_area_addr, obj->free_space_offset,
+                                           chunk_key, &data[chunk_start], chunk_size,
+                                           _MTB_KVSTORE_OPER_ADD, chunk_flags, NULL, NULL);
+        if (result == CY_RSLT_SUCCESS)
+        {
+            chunk_offsets[chunk] = obj->free_space_offset;
+            obj->free_space_offset += _mtb_kvstore_get_record_size(obj, obj->active_area_addr,
+                                                                   _mtb_kvstore_get_stored_key_size(
+                                                                       chunk_key, chunk_flags),
+                                                                   chunk_size);
+        }
+    }
+
+    if (result == CY_RSLT_SUCCESS)
+    {
+        uint32_t record_size = _mtb_kvstore_get_record_size(obj, obj->active_area_addr,
+                                                            stored_key_size, manifest_size);
+        _mtb_kvstore_update_ram_table_info_t ram_tbl_info =
+        {
+            .ram_tbl_idx  = ram_tbl_idx,
+            .entry.hash   = hash,
+            .entry.flags  = _MTB_KVSTORE_CHUNKED_FLAG | key_flags,
+            .entry.offset = obj->free_space_offset
+        };
+        _mtb_kvstore_update_consumed_size_info_t size_info =
+        {
+            .old_record_size = old_live_size,
+            .new_record_size = new_live_size
+        };
+        result = _mtb_kvstore_write_record(obj, obj->active_area_addr, obj->free_space_offset,
+                                           key, manifest, manifest_size,
+                                           (found_in_table)
+                                           ? _MTB_KVSTORE_OPER_UPDATE
+                                           : _MTB_KVSTORE_OPER_ADD,
+                                           ram_tbl_info.entry.flags, &ram_tbl_info, &size_info);
+        if (result == CY_RSLT_SUCCESS)
+        {
+            obj->free_space_offset += record_size;
+        }
+    }
+
+    free(blob_hashes);
+    free(manifest);
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_write_with_flags
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_write_with_flags(mtb_kvstore_t* obj, const char* key,
+                                               const uint8_t* data,
+                                               uint32_t size, bool delete, uint32_t write_flags,
+                                               uint32_t expected_version)
+{
+    CY_ASSERT(obj != NULL);
+    cy_rslt_t result = CY_RSLT_SUCCESS;
+
+    uint32_t ram_tbl_idx;
+    uint16_t hash;
+    uint32_t old_record_data_size = 0;
+    result = _mtb_kvstore_find_record_in_ram_table(obj, key, &ram_tbl_idx, &hash,
+                                                   &old_record_data_size);
+    if ((result != CY_RSLT_SUCCESS) && (result != MTB_KVSTORE_ITEM_NOT_FOUND_ERROR))
+    {
+        return result;
+    }
+
+    bool found_in_table = (result != MTB_KVSTORE_ITEM_NOT_FOUND_ERROR);
+
+    if (expected_version != _MTB_KVSTORE_ANY_VERSION)
+    {
+        uint32_t version = (found_in_table)
+                           ? obj->ram_table[ram_tbl_idx].generation
+                           : MTB_KVSTORE_VERSION_NONE;
+        if (version != expected_version)
+        {
+            return MTB_KVSTORE_VERSION_MISMATCH_ERROR;
+        }
+    }
+
+    // If we are trying to delete a record and it is not found in the RAM table then it
+    // is already been removed or does not exist. Hence we return success.
+    if (delete && !found_in_table)
+    {
+        return CY_RSLT_SUCCESS;
+    }
+
+    // Values larger than a chunk and deduplicated values are stored uncompressed in chunks.
+    if (!delete && _mtb_kvstore_is_chunked_size(obj, size))
+    {
+        return _mtb_kvstore_write_chunked(obj, key, data, size, found_in_table, ram_tbl_idx, hash,
+                                          (write_flags & MTB_KVSTORE_WRITE_SKIP_UNCHANGED) != 0);
+    }
+
+    // The value is compressed first so that an unchanged value is recognized by its stored form.
+    uint8_t record_flags = _MTB_KVSTORE_NO_FLAG;
+    uint8_t* compressed = NULL;
+    uint32_t compressed_size;
+    if (!delete && ((write_flags & MTB_KVSTORE_WRITE_COMPRESS) != 0) &&
+        _mtb_kvstore_compress_value(data, size, &compressed, &compressed_size))
+    {
+        data = compressed;
+        size = compressed_size;
+        record_flags = _MTB_KVSTORE_COMPRESSED_FLAG;
+    }
+
+    // Appending a record identical to the current one would only consume space.
+    record_flags |= _mtb_kvstore_get_key_flags(obj, key);
+    if (!delete && found_in_table && (old_record_data_size == size) &&
+        ((write_flags & MTB_KVSTORE_WRITE_SKIP_UNCHANGED) != 0))
+    {
+        bool unchanged;
+        result = _mtb_kvstore_is_record_unchanged(obj, obj->ram_table[ram_tbl_idx].offset, key,
+                                                  data, size, record_flags, &unchanged);
+        if ((result != CY_RSLT_SUCCESS) || unchanged)
+        {
+            if (unchanged)
+            {
+                obj->stats.skipped_writes++;
+            }
+            free(compressed);
+            return result;
+        }
+    }
+
+    _mtb_kvstore_operation_t operation = (delete)
+                                        ? _MTB_KVSTORE_OPER_DELETE
+                                        : (found_in_table) ? _MTB_KVSTORE_OPER_UPDATE :
+                                         _MTB_KVSTORE_OPER_ADD;
+
+    result = _mtb_kvstore_append_record(obj, key, data, size, operation, record_flags,
+                                        ram_tbl_idx, hash);
+    free(compressed);
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_write_locked
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_write_locked(mtb_kvstore_t* obj, const char* key,
+                                           const uint8_t* data, uint32_t size, uint32_t flags,
+                                           uint32_t expected_version)
+{
+    // Stage large records in as few block device calls as the configuration allows.
+    _mtb_kvstore_buffer_t saved_buffer;
+    bool grown = _mtb_kvstore_grow_buffer(obj,
+                                          _mtb_kvstore_get_record_size(obj, obj->active_area_addr,
+                                                                       strlen(key), size),
+                                          &saved_buffer);
+
+    cy_rslt_t result = _mtb_kvstore_write_with_flags(obj, key, data, size, false, flags,
+                                                     expected_version);
+
+    if (grown)
+    {
+        _mtb_kvstore_restore_buffer(obj, &saved_buffer);
+    }
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_read_ram_value
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_read_ram_value(const uint8_t* value, uint32_t value_size,
+                                             uint8_t* data, uint32_t* data_size)
+{
+    // Same semantics as _mtb_kvstore_read_record for a value that is held in RAM.
+    if ((data != NULL) && (data_size != NULL))
+    {
+        if (*data_size < value_size)
+        {
+            *data_size = value_size;
+            return MTB_KVSTORE_BUFFER_TOO_SMALL;
+        }
+        memcpy(data, value, value_size);
+    }
+
+    if (data_size != NULL)
+    {
+        *data_size = value_size;
+    }
+    return CY_RSLT_SUCCESS;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_read_partial_ram_value
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_read_partial_ram_value(const uint8_t* value, uint32_t value_size,
+                                                     uint8_t* data, uint32_t* data_size,
+                                                     const uint32_t offset_bytes)
+{
+    // Same semantics as _mtb_kvstore_read_partial_record for a value that is held in RAM.
+    if (offset_bytes > value_size)
+    {
+        return MTB_KVSTORE_BAD_PARAM_ERROR;
+    }
+
+    if ((data != NULL) && (data_size != NULL))
+    {
+        if (*data_size > (value_size - offset_bytes))
+        {
+            *data_size = (value_size - offset_bytes);
+        }
+        memcpy(data, &value[offset_bytes], *data_size);
+    }
+
+    if (data_size != NULL)
+    {
+        *data_size = value_size;
+    }
+    return CY_RSLT_SUCCESS;
+}
+
+
+#if (MTB_KVSTORE_INLINE_VALUE_SIZE > 0)
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_read_inline
+//--------------------------------------------------------------------------------------------------
+static bool _mtb_kvstore_read_inline(const mtb_kvstore_ram_table_entry_t* entry, uint8_t* data,
+                                     uint32_t* data_size, uint32_t offset_bytes, bool partial,
+                                     cy_rslt_t* result)
+{
+    // Returns false if the value is not inline.
+    if (!_mtb_kvstore_is_inline(entry))
+    {
+        return false;
+    }
+
+    *result = (partial)
+              ? _mtb_kvstore_read_partial_ram_value(entry->inline_value, entry->inline_size, data,
+                                                    data_size, offset_bytes)
+              : _mtb_kvstore_read_ram_value(entry->inline_value, entry->inline_size, data,
+                                            data_size);
+    return true;
+}
+
+
+#else // if (MTB_KVSTORE_INLINE_VALUE_SIZE > 0)
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_read_inline
+//--------------------------------------------------------------------------------------------------
+static inline bool _mtb_kvstore_read_inline(const mtb_kvstore_ram_table_entry_t* entry,
+                                            uint8_t* data, uint32_t* data_size,
+                                            uint32_t offset_bytes, bool partial,
+                                            cy_rslt_t* result)
+{
+    CY_UNUSED_PARAMETER(entry);
+    CY_UNUSED_PARAMETER(data);
+    CY_UNUSED_PARAMETER(data_size);
+    CY_UNUSED_PARAMETER(offset_bytes);
+    CY_UNUSED_PARAMETER(partial);
+    CY_UNUSED_PARAMETER(result);
+    return false;
+}
+
+
+#endif // if (MTB_KVSTORE_INLINE_VALUE_SIZE > 0)
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_cache_find
+//--------------------------------------------------------------------------------------------------
+static mtb_kvstore_cache_entry_t* _mtb_kvstore_cache_find(mtb_kvstore_t* obj, const char* key,
+                                                          uint16_t hash)
+{
+    mtb_kvstore_cache_entry_t* entry = obj->cache_head;
+    while ((entry != NULL) && ((entry->hash != hash) || (strcmp(entry->key, key) != 0)))
+    {
+        entry = entry->next;
+    }
+    return entry;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_cache_unlink
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_cache_unlink(mtb_kvstore_t* obj, mtb_kvstore_cache_entry_t* entry)
+{
+    if (entry->prev != NULL)
+    {
+        entry->prev->next = entry->next;
+    }
+    else
+    {
+        obj->cache_head = entry->next;
+    }
+    if (entry->next != NULL)
+    {
+        entry->next->prev = entry->prev;
+    }
+    else
+    {
+        obj->cache_tail = entry->prev;
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_cache_push_front
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_cache_push_front(mtb_kvstore_t* obj, mtb_kvstore_cache_entry_t* entry)
+{
+    // The list is kept in order of use, so the least recently used entry is the tail.
+    entry->prev = NULL;
+    entry->next = obj->cache_head;
+    if (obj->cache_head != NULL)
+    {
+        obj->cache_head->prev = entry;
+    }
+    else
+    {
+        obj->cache_tail = entry;
+    }
+    obj->cache_head = entry;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_cache_entry_size
+//--------------------------------------------------------------------------------------------------
+static inline uint32_t _mtb_kvstore_cache_entry_size(const mtb_kvstore_cache_entry_t* entry)
+{
+    return sizeof(mtb_kvstore_cache_entry_t) + entry->size + strlen(entry->key) + 1U;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_cache_remove
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_cache_remove(mtb_kvstore_t* obj, mtb_kvstore_cache_entry_t* entry)
+{
+    _mtb_kvstore_cache_unlink(obj, entry);
+    obj->cache_used -= _mtb_kvstore_cache_entry_size(entry);
+    free(entry);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_cache_invalidate
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_cache_invalidate(mtb_kvstore_t* obj, bool unpin)
+{
+    // Pinned entries are kept to be filled again by the next read, but their generation can no
+    // longer match a RAM table entry.
+    _mtb_kvstore_cache_lock(obj);
+    mtb_kvstore_cache_entry_t* entry = obj->cache_head;
+    while (entry != NULL)
+    {
+        mtb_kvstore_cache_entry_t* next = entry->next;
+        if (unpin || !entry->pinned)
+        {
+            _mtb_kvstore_cache_remove(obj, entry);
+        }
+        else
+        {
+            entry->generation = MTB_KVSTORE_VERSION_NONE;
+        }
+        entry = next;
+    }
+    _mtb_kvstore_cache_unlock(obj);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_cache_is_current
+//--------------------------------------------------------------------------------------------------
+static bool _mtb_kvstore_cache_is_current(mtb_kvstore_t* obj, uint16_t hash, uint32_t generation)
+{
+    // Every modification of a value gives its RAM table entry a new generation, and garbage
+    // collection keeps them, so a cached value is current as long as an entry with its hash still
+    // has its generation. This needs no access to the storage.
+    for (uint32_t ram_tbl_idx = 0; ram_tbl_idx < obj->num_entries; ram_tbl_idx++)
+    {
+        const mtb_kvstore_ram_table_entry_t* entry = &obj->ram_table[ram_tbl_idx];
+        if (hash < entry->hash)
+        {
+            continue;
+        }
+        if (hash > entry->hash)
+        {
+            break;
+        }
+        if (entry->generation == generation)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_cache_read
+//--------------------------------------------------------------------------------------------------
+static bool _mtb_kvstore_cache_read(mtb_kvstore_t* obj, const char* key, uint8_t* data,
+                                    uint32_t* data_size, uint32_t offset_bytes, bool partial,
+                                    cy_rslt_t* result)
+{
+    // Must be called with the lock held. Returns false if the value is not cached.
+    if (obj->config.cache_size == 0)
+    {
+        return false;
+    }
+
+    uint16_t hash = _mtb_kvstore_crc16((uint8_t*)key, strlen(key), _MTB_KVSTORE_CRC_INIT_VAL);
+    _mtb_kvstore_cache_lock(obj);
+    mtb_kvstore_cache_entry_t* entry = _mtb_kvstore_cache_find(obj, key, hash);
+    bool hit = (entry != NULL) && (entry->generation != MTB_KVSTORE_VERSION_NONE) &&
+               _mtb_kvstore_cache_is_current(obj, hash, entry->generation);
+    if (hit)
+    {
+        *result = (partial)
+                  ? _mtb_kvstore_read_partial_ram_value(entry->data, entry->size, data, data_size,
+                                                        offset_bytes)
+                  : _mtb_kvstore_read_ram_value(entry->data, entry->size, data, data_size);
+        _mtb_kvstore_cache_unlink(obj, entry);
+        _mtb_kvstore_cache_push_front(obj, entry);
+        obj->stats.cache_hits++;
+    }
+    else
+    {
+        if ((entry != NULL) && !entry->pinned)
+        {
+            _mtb_kvstore_cache_remove(obj, entry);
+        }
+        obj->stats.cache_misses++;
+    }
+    _mtb_kvstore_cache_unlock(obj);
+    return hit;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_cache_fill
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_cache_fill(mtb_kvstore_t* obj, const char* key, uint16_t hash,
+                                         uint32_t generation, const uint8_t* data, uint32_t size,
+                                         bool pin)
+{
+    if ((obj->config.cache_size == 0) || (size > obj->config.cache_size))
+    {
+        return MTB_KVSTORE_MEM_ALLOC_ERROR;
+    }
+
+    size_t key_size = strlen(key);
+    uint32_t entry_size = sizeof(mtb_kvstore_cache_entry_t) + size + key_size + 1U;
+    cy_rslt_t result = MTB_KVSTORE_MEM_ALLOC_ERROR;
+
+    _mtb_kvstore_cache_lock(obj);
+    mtb_kvstore_cache_entry_t* entry = _mtb_kvstore_cache_find(obj, key, hash);
+    if (entry != NULL)
+    {
+        pin = pin || entry->pinned;
+        _mtb_kvstore_cache_remove(obj, entry);
+    }
+
+    // Evict the least recently used values that are not pinned until the new one fits.
+    entry = obj->cache_tail;
+    while ((entry != NULL) && ((obj->cache_used + entry_size) > obj->config.cache_size))
+    {
+        mtb_kvstore_cache_entry_t* prev = entry->prev;
+        if (!entry->pinned)
+        {
+            _mtb_kvstore_cache_remove(obj, entry);
+        }
+        entry = prev;
+    }
+
+    if ((obj->cache_used + entry_size) <= obj->config.cache_size)
+    {
+        entry = (mtb_kvstore_cache_entry_t*)malloc(entry_size);
+        if (entry != NULL)
+        {
+            entry->generation = generation;
+            entry->size = size;
+            entry->hash = hash;
+            entry->pinned = pin;
+            entry->key = (char*)&entry->data[size];
+            memcpy(entry->data, data, size);
+            memcpy(entry->key, key, key_size + 1U);
+            _mtb_kvstore_cache_push_front(obj, entry);
+            obj->cache_used += entry_size;
+            result = CY_RSLT_SUCCESS;
+        }
+    }
+    _mtb_kvstore_cache_unlock(obj);
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_count_tally
+//--------------------------------------------------------------------------------------------------
+static uint32_t _mtb_kvstore_count_tally(const uint8_t* tally, uint32_t size, uint32_t* next_idx)
+{
+    // Increments clear the bits of the tally region in order, so the count is the number of
+    // cleared bits and the next increment goes to the first byte that still has a set bit.
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < size; i++)
+    {
+        if ((tally[i] != 0) && (*next_idx == UINT32_MAX))
+        {
+            *next_idx = i;
+        }
+        for (uint8_t cleared = (uint8_t)~tally[i]; cleared != 0; cleared &= (cleared - 1U))
+        {
+            count++;
+        }
+    }
+    return count;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_read_counter
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_read_counter(mtb_kvstore_t* obj, uint32_t offset, const char* key,
+                                           uint32_t* value, uint32_t* next_bit_addr)
+{
+    _mtb_kvstore_record_header_t header;
+    cy_rslt_t result = _mtb_kvstore_read_record(obj, obj->active_area_addr, offset, &header, key,
+                                                true, NULL, NULL);
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
+
+    if (header.data_size < sizeof(*value))
+    {
+        return MTB_KVSTORE_INVALID_DATA_ERROR;
+    }
+
+    uint32_t data_addr = obj->active_area_addr + offset + header.header_size + header.key_size;
+    result = obj->bd->read(obj->bd->context, data_addr, sizeof(*value), (uint8_t*)value);
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
+
+    uint32_t tally_addr = data_addr + sizeof(*value);
+    uint32_t remaining_size = header.data_size - sizeof(*value);
+    uint32_t next_idx = UINT32_MAX;
+    uint32_t tally_idx = 0;
+    uint8_t buffer[_MTB_KVSTORE_READ_BUFFER_SIZE];
+    while (remaining_size > 0)
+    {
+        uint32_t transfer_size =
+            (sizeof(buffer) >= remaining_size) ? remaining_size : sizeof(buffer);
+        result = obj->bd->read(obj->bd->context, tally_addr + tally_idx, transfer_size, buffer);
+        if (result != CY_RSLT_SUCCESS)
+        {
+            return result;
+        }
+
+        uint32_t chunk_next_idx = UINT32_MAX;
+        *value += _mtb_kvstore_count_tally(buffer, transfer_size, &chunk_next_idx);
+        if ((next_idx == UINT32_MAX) && (chunk_next_idx != UINT32_MAX))
+        {
+            next_idx = tally_idx + chunk_next_idx;
+        }
+
+        tally_idx += transfer_size;
+        remaining_size -= transfer_size;
+    }
+
+    if (next_bit_addr != NULL)
+    {
+        *next_bit_addr = (next_idx == UINT32_MAX) ? UINT32_MAX : (tally_addr + next_idx);
+    }
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_read_segments
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_read_segments(mtb_kvstore_t* obj, uint32_t offset, const char* key,
+                                            bool validate, uint8_t* data, uint32_t start,
+                                            uint32_t size, uint32_t* total_size)
+{
+    // Copies size bytes from start of an appended value whose newest segment is at offset, walking
+    // back only as far as the oldest segment that is needed.
+    cy_rslt_t result = CY_RSLT_SUCCESS;
+    uint32_t end = start + size;
+    bool newest = true;
+    while (offset != _MTB_KVSTORE_NO_SEGMENT)
+    {
+        _mtb_kvstore_record_header_t header;
+        _mtb_kvstore_segment_info_t info;
+        _mtb_kvstore_segment_t segment;
+        result = _mtb_kvstore_read_segment(obj, offset, (validate) ? key : NULL, &header, &info,
+                                           &segment);
+        if (result != CY_RSLT_SUCCESS)
+        {
+            return result;
+        }
+
+        if (newest)
+        {
+            *total_size = info.total_size;
+            if ((data == NULL) || (start >= end))
+            {
+                return result;
+            }
+            newest = false;
+        }
+
+        uint32_t segment_start = info.total_size - segment.payload_size;
+        uint32_t copy_start = (start > segment_start) ? start : segment_start;
+        uint32_t copy_end = (end < info.total_size) ? end : info.total_size;
+        if (copy_start < copy_end)
+        {
+            result = obj->bd->read(obj->bd->context,
+                                   segment.payload_addr + (copy_start - segment_start),
+                                   copy_end - copy_start, &data[copy_start - start]);
+            if (result != CY_RSLT_SUCCESS)
+            {
+                return result;
+            }
+        }
+
+        if (segment_start <= start)
+        {
+            return result;
+        }
+        offset = info.prev_offset;
+    }
+
+    // The oldest segment was reached before the start of the requested range.
+    return MTB_KVSTORE_INVALID_DATA_ERROR;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_read_compressed
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_read_compressed(mtb_kvstore_t* obj, uint32_t offset, const char* key,
+                                              bool validate, uint8_t* data, uint32_t start,
+                                              uint32_t size, uint32_t* value_size)
+{
+    // Decompresses size bytes from start of a compressed value. Blocks before the requested range
+    // are skipped using their stored sizes and blocks after it are not read.
+    _mtb_kvstore_record_header_t header;
+    cy_rslt_t result = (validate)
+                       ? _mtb_kvstore_read_record(obj, obj->active_area_addr, offset, &header,
+                                                  key, true, NULL, NULL)
+                       : _mtb_kvstore_read_partial_record(obj, obj->active_area_addr, offset,
+                                                          &header, key, true, NULL, NULL, 0);
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
+
+    _mtb_kvstore_compressed_info_t info;
+    uint32_t data_addr = obj->active_area_addr + offset + header.header_size + header.key_size;
+    if (header.data_size < sizeof(info))
+    {
+        return MTB_KVSTORE_INVALID_DATA_ERROR;
+    }
+    result = obj->bd->read(obj->bd->context, data_addr, sizeof(info), (uint8_t*)&info);
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
+    if ((info.block_size == 0) || (info.block_size > UINT16_MAX))
+    {
+        return MTB_KVSTORE_INVALID_DATA_ERROR;
+    }
+
+    *value_size = info.value_size;
+    uint32_t end = start + size;
+    if ((data == NULL) || (start >= end))
+    {
+        return result;
+    }
+
+    // One half of the scratch buffer holds a stored block, the other one a decompressed block that
+    // is only partially requested.
+    uint8_t* scratch = (uint8_t*)malloc(2 * info.block_size);
+    if (scratch == NULL)
+    {
+        return MTB_KVSTORE_MEM_ALLOC_ERROR;
+    }
+
+    uint32_t num_blocks = (info.value_size + info.block_size - 1) / info.block_size;
+    uint32_t table_addr = data_addr + sizeof(info);
+    uint32_t block_addr = table_addr + (num_blocks * sizeof(uint16_t));
+    uint32_t data_end_addr = data_addr + header.data_size;
+    for (uint32_t block = 0; (block < num_blocks) && (result == CY_RSLT_SUCCESS); block++)
+    {
+        uint32_t block_start = block * info.block_size;
+        if (block_start >= end)
+        {
+            break;
+        }
+
+        uint16_t stored_size;
+        result = obj->bd->read(obj->bd->context, table_addr + (block * sizeof(uint16_t)),
+                               sizeof(stored_size), (uint8_t*)&stored_size);
+        uint32_t raw_size = ((info.value_size - block_start) < info.block_size)
+                            ? (info.value_size - block_start)
+                            : info.block_size;
+        if ((result == CY_RSLT_SUCCESS) &&
+            ((stored_size > raw_size) || ((block_addr + stored_size) > data_end_addr)))
+        {
+            result = MTB_KVSTORE_INVALID_DATA_ERROR;
+        }
+
+        if ((result == CY_RSLT_SUCCESS) && ((block_start + raw_size) > start))
+        {
+            // A block that is requested as a whole is decompressed straight into the caller's
+            // buffer.
+            bool whole = (block_start >= start) && ((block_start + raw_size) <= end);
+            uint8_t* out = (whole) ? &data[block_start - start] : &scratch[info.block_size];
+            if (stored_size == raw_size)
+            {
+                result = obj->bd->read(obj->bd->context, block_addr, raw_size, out);
+            }
+            else
+            {
+                result = obj->bd->read(obj->bd->context, block_addr, stored_size, scratch);
+                if (result == CY_RSLT_SUCCESS)
+                {
+                    result = _mtb_kvstore_lz_decompress(scratch, stored_size, out, raw_size);
+                }
+            }
+
+            if ((result == CY_RSLT_SUCCESS) && !whole)
+            {
+                uint32_t copy_start = (start > block_start) ? start : block_start;
+                uint32_t copy_end = (end < (block_start + raw_size))
+                                    ? end
+                                    : (block_start + raw_size);
+                memcpy(&data[copy_start - start], &out[copy_start - block_start],
+                       copy_end - copy_start);
+            }
+        }
+        block_addr += stored_size;
+    }
+
+    free(scratch);
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_read_chunked
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_read_chunked(mtb_kvstore_t* obj, uint32_t offset, const char* key,
+                                           bool validate, uint8_t* data, uint32_t start,
+                                           uint32_t size, uint32_t* value_size)
+{
+    // Reads size bytes from start of a chunked value. Only the chunks that overlap the requested
+    // range are read, and with validate their CRC is checked. The key is only validated against
+    // the manifest, as shared blobs are stored under the hash of their content.
+    _mtb_kvstore_record_header_t header;
+    cy_rslt_t result = (validate)
+                       ? _mtb_kvstore_read_record(obj, obj->active_area_addr, offset, &header,
+                                                  key, true, NULL, NULL)
+                       : _mtb_kvstore_read_partial_record(obj, obj->active_area_addr, offset,
+                                                          &header, key, true, NULL, NULL, 0);
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
+
+    _mtb_kvstore_chunked_info_t info;
+    uint32_t* chunk_offsets;
+    result = _mtb_kvstore_read_chunk_table(obj, obj->active_area_addr, offset, &info,
+                                           &chunk_offsets);
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
+
+    *value_size = info.value_size;
+    uint32_t end = start + size;
+    uint32_t num_chunks = (info.value_size + info.chunk_size - 1) / info.chunk_size;
+    for (uint32_t chunk = start / info.chunk_size;
+         (data != NULL) && (chunk < num_chunks) && (result == CY_RSLT_SUCCESS); chunk++)
+    {
+        uint32_t chunk_start = chunk * info.chunk_size;
+        if (chunk_start >= end)
+        {
+            break;
+        }
+        if (chunk_offsets[chunk] >= _MTB_KVSTORE_AREA_SIZE(obj))
+        {
+            result = MTB_KVSTORE_INVALID_DATA_ERROR;
+            break;
+        }
+
+        uint32_t chunk_size = ((info.value_size - chunk_start) < info.chunk_size)
+                              ? (info.value_size - chunk_start)
+                              : info.chunk_size;
+        uint32_t copy_start = (start > chunk_start) ? start : chunk_start;
+        uint32_t copy_size = ((end < (chunk_start + chunk_size)) ? end : (chunk_start + chunk_size))
+                             - copy_start;
+        uint32_t stored_size = copy_size;
+        result = (validate)
+                 ? _mtb_kvstore_read_record(obj, obj->active_area_addr, chunk_offsets[chunk],
+                                            &header, NULL, false, &data[copy_start - start],
+                                            &stored_size)
+                 : _mtb_kvstore_read_partial_record(obj, obj->active_area_addr,
+                                                    chunk_offsets[chunk], &header, NULL, false,
+                                                    &data[copy_start - start], &stored_size,
+                                                    copy_start - chunk_start);
+        if ((result == MTB_KVSTORE_BUFFER_TOO_SMALL) ||
+            ((result == CY_RSLT_SUCCESS) &&
+             (((header.flags & _MTB_KVSTORE_CHUNK_FLAG) == 0) || (stored_size != chunk_size))))
+        {
+            result = MTB_KVSTORE_INVALID_DATA_ERROR;
+        }
+    }
+
+    free(chunk_offsets);
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_read_value
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_read_value(mtb_kvstore_t* obj, uint32_t ram_tbl_idx, const char* key,
+                                         uint8_t* data, uint32_t* data_size)
+{
+    // Same semantics as _mtb_kvstore_read_record, for the value as seen by the application.
+    const mtb_kvstore_ram_table_entry_t* entry = &obj->ram_table[ram_tbl_idx];
+    cy_rslt_t inline_result;
+    if (_mtb_kvstore_read_inline(entry, data, data_size, 0, false, &inline_result))
+    {
+        return inline_result;
+    }
+
+    if ((entry->flags & _MTB_KVSTORE_COUNTER_FLAG) != 0)
+    {
+        uint32_t value;
+        cy_rslt_t result = _mtb_kvstore_read_counter(obj, entry->offset, key, &value, NULL);
+        if (result == CY_RSLT_SUCCESS)
+        {
+            result = _mtb_kvstore_read_ram_value((uint8_t*)&value, sizeof(value), data, data_size);
+        }
+        return result;
+    }
+
+    if ((entry->flags & _MTB_KVSTORE_APPEND_FLAG) != 0)
+    {
+        uint32_t total_size;
+        cy_rslt_t result = _mtb_kvstore_read_segments(obj, entry->offset, key, false, NULL, 0, 0,
+                                                      &total_size);
+        if ((result == CY_RSLT_SUCCESS) && (data != NULL) && (data_size != NULL))
+        {
+            if (*data_size < total_size)
+            {
+                *data_size = total_size;
+                return MTB_KVSTORE_BUFFER_TOO_SMALL;
+            }
+            result = _mtb_kvstore_read_segments(obj, entry->offset, key, true, data, 0,
+                                                total_size, &total_size);
+        }
+        if ((result == CY_RSLT_SUCCESS) && (data_size != NULL))
+        {
+            *data_size = total_size;
+        }
+        return result;
+    }
+
+    if ((entry->flags & _MTB_KVSTORE_COMPRESSED_FLAG) != 0)
+    {
+        // The logical size is in the record, so the value is only decompressed if it fits.
+        uint32_t value_size;
+        cy_rslt_t result = _mtb_kvstore_read_compressed(obj, entry->offset, key, false, NULL, 0,
+                                                        0, &value_size);
+        if ((result == CY_RSLT_SUCCESS) && (data != NULL) && (data_size != NULL))
+        {
+            if (*data_size < value_size)
+            {
+                *data_size = value_size;
+                return MTB_KVSTORE_BUFFER_TOO_SMALL;
+            }
+            result = _mtb_kvstore_read_compressed(obj, entry->offset, key, true, data, 0,
+                                                  value_size, &value_size);
+        }
+        if ((result == CY_RSLT_SUCCESS) && (data_size != NULL))
+        {
+            *data_size = value_size;
+        }
+        return result;
+    }
+
+    if ((entry->flags & _MTB_KVSTORE_CHUNKED_FLAG) != 0)
+    {
+        uint32_t value_size;
+        cy_rslt_t result = _mtb_kvstore_read_chunked(obj, entry->offset, key, false, NULL, 0, 0,
+                                                     &value_size);
+        if ((result == CY_RSLT_SUCCESS) && (data != NULL) && (data_size != NULL))
+        {
+            if (*data_size < value_size)
+            {
+                *data_size = value_size;
+                return MTB_KVSTORE_BUFFER_TOO_SMALL;
+            }
+            result = _mtb_kvstore_read_chunked(obj, entry->offset, key, true, data, 0, value_size,
+                                               &value_size);
+        }
+        if ((result == CY_RSLT_SUCCESS) && (data_size != NULL))
+        {
+            *data_size = value_size;
+        }
+        return result;
+    }
+
+    _mtb_kvstore_record_header_t header;
+    return _mtb_kvstore_read_record(obj, obj->active_area_addr, entry->offset, &header, key, true,
+                                    data, data_size);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_read_partial_value
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_read_partial_value(mtb_kvstore_t* obj, uint32_t ram_tbl_idx,
+                                                 const char* key, uint8_t* data,
+                                                 uint32_t* data_size, const uint32_t offset_bytes)
+{
+    // Same semantics as _mtb_kvstore_read_partial_record, for the value as seen by the application.
+    const mtb_kvstore_ram_table_entry_t* entry = &obj->ram_table[ram_tbl_idx];
+    cy_rslt_t inline_result;
+    if (_mtb_kvstore_read_inline(entry, data, data_size, offset_bytes, true, &inline_result))
+    {
+        return inline_result;
+    }
+
+    if ((entry->flags & _MTB_KVSTORE_COUNTER_FLAG) != 0)
+    {
+        uint32_t value;
+        cy_rslt_t result = _mtb_kvstore_read_counter(obj, entry->offset, key, &value, NULL);
+        if (result == CY_RSLT_SUCCESS)
+        {
+            result = _mtb_kvstore_read_partial_ram_value((uint8_t*)&value, sizeof(value), data,
+                                                         data_size, offset_bytes);
+        }
+        return result;
+    }
+
+    if ((entry->flags & _MTB_KVSTORE_APPEND_FLAG) != 0)
+    {
+        uint32_t total_size;
+        cy_rslt_t result = _mtb_kvstore_read_segments(obj, entry->offset, key, false, NULL, 0, 0,
+                                                      &total_size);
+        if ((result == CY_RSLT_SUCCESS) && (offset_bytes > total_size))
+        {
+            return MTB_KVSTORE_BAD_PARAM_ERROR;
+        }
+        if ((result == CY_RSLT_SUCCESS) && (data != NULL) && (data_size != NULL))
+        {
+            if (*data_size > (total_size - offset_bytes))
+            {
+                *data_size = (total_size - offset_bytes);
+            }
+            result = _mtb_kvstore_read_segments(obj, entry->offset, key, false, data,
+                                                offset_bytes, *data_size, &total_size);
+        }
+        if ((result == CY_RSLT_SUCCESS) && (data_size != NULL))
+        {
+            *data_size = total_size;
+        }
+        return result;
+    }
+
+    if ((entry->flags & _MTB_KVSTORE_COMPRESSED_FLAG) != 0)
+    {
+        uint32_t value_size;
+        cy_rslt_t result = _mtb_kvstore_read_compressed(obj, entry->offset, key, false, NULL, 0,
+                                                        0, &value_size);
+        if ((result == CY_RSLT_SUCCESS) && (offset_bytes > value_size))
+        {
+            return MTB_KVSTORE_BAD_PARAM_ERROR;
+        }
+        if ((result == CY_RSLT_SUCCESS) && (data != NULL) && (data_size != NULL))
+        {
+            if (*data_size > (value_size - offset_bytes))
+            {
+                *data_size = (value_size - offset_bytes);
+            }
+            result = _mtb_kvstore_read_compressed(obj, entry->offset, key, false, data,
+                                                  offset_bytes, *data_size, &value_size);
+        }
+        if ((result == CY_RSLT_SUCCESS) && (data_size != NULL))
+        {
+            *data_size = value_size;
+        }
+        return result;
+    }
+
+    if ((entry->flags & _MTB_KVSTORE_CHUNKED_FLAG) != 0)
+    {
+        uint32_t value_size;
+        cy_rslt_t result = _mtb_kvstore_read_chunked(obj, entry->offset, key, false, NULL, 0, 0,
+                                                     &value_size);
+        if ((result == CY_RSLT_SUCCESS) && (offset_bytes > value_size))
+        {
+            return MTB_KVSTORE_BAD_PARAM_ERROR;
+        }
+        if ((result == CY_RSLT_SUCCESS) && (data != NULL) && (data_size != NULL))
+        {
+            if (*data_size > (value_size - offset_bytes))
+            {
+                *data_size = (value_size - offset_bytes);
+            }
+            result = _mtb_kvstore_read_chunked(obj, entry->offset, key, false, data, offset_bytes,
+                                               *data_size, &value_size);
+        }
+        if ((result == CY_RSLT_SUCCESS) && (data_size != NULL))
+        {
+            *data_size = value_size;
+        }
+        return result;
+    }
+
+    _mtb_kvstore_record_header_t header;
+    return _mtb_kvstore_read_partial_record(obj, obj->active_area_addr, entry->offset, &header,
+                                            key, true, data, data_size, offset_bytes);
+}
+
+
+#if MTB_KVSTORE_LOCK_FREE_READS
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_find_entry_lock_free
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_find_entry_lock_free(mtb_kvstore_t* obj, const char* key,
+                                                   mtb_kvstore_ram_table_entry_t* entry)
+{
+    // Same search as _mtb_kvstore_find_record_in_ram_table, on copies of the entries as a
+    // modification may change them at any time. The size of the table is loaded before the table,
+    // so it is never indexed past its end.
+    uint32_t max_entries = _MTB_KVSTORE_LOAD(obj->max_entries);
+    const mtb_kvstore_ram_table_entry_t* ram_table = _MTB_KVSTORE_LOAD(obj->ram_table);
+    uint32_t num_entries = _MTB_KVSTORE_LOAD(obj->num_entries);
+    if (num_entries > max_entries)
+    {
+        num_entries = max_entries;
+    }
+
+    cy_rslt_t result = MTB_KVSTORE_ITEM_NOT_FOUND_ERROR;
+    uint16_t key_hash = _mtb_kvstore_crc16((uint8_t*)key, strlen(key), _MTB_KVSTORE_CRC_INIT_VAL);
+    for (uint32_t idx = 0; idx < num_entries; idx++)
+    {
+        _mtb_kvstore_load_entry(entry, &ram_table[idx]);
+        if (key_hash < entry->hash)
+        {
+            continue;
+        }
+
+        if ((key_hash > entry->hash) || (entry->offset >= _MTB_KVSTORE_AREA_SIZE(obj)))
+        {
+            result = (key_hash > entry->hash)
+                     ? MTB_KVSTORE_ITEM_NOT_FOUND_ERROR
+                     : MTB_KVSTORE_INVALID_DATA_ERROR;
+            break;
+        }
+
+        // The key of an inline value is not read here, the caller takes the lock for it instead.
+        if (_mtb_kvstore_is_inline(entry))
+        {
+            result = CY_RSLT_SUCCESS;
+            break;
+        }
+
+        _mtb_kvstore_record_header_t header;
+        result = _mtb_kvstore_read_record(obj, _MTB_KVSTORE_LOAD(obj->active_area_addr),
+                                          entry->offset, &header, key, true, NULL, NULL);
+        // If there was a key mismatch then keep searching.
+        if (result != MTB_KVSTORE_ITEM_NOT_FOUND_ERROR)
+        {
+            break;
+        }
+    }
+
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_read_lock_free
+//--------------------------------------------------------------------------------------------------
+static bool _mtb_kvstore_read_lock_free(mtb_kvstore_t* obj, const char* key, uint8_t* data,
+                                        uint32_t* data_size, uint32_t offset_bytes, bool partial,
+                                        cy_rslt_t* result)
+{
+    // Looks the key up and reads its value without taking the lock. A modification makes the
+    // sequence number odd while it runs, so the result is only kept if the sequence number was
+    // even and did not change. Returns false if the read must take the lock instead: because
+    // modifications kept overlapping it, writes are queued, the value is not stored as is or it is
+    // inline, as its key may be freed at any time. Without data_size and partial only the lookup
+    // is done. Reads only overlap modifications if the block device supports it. Readers are
+    // counted, so that memory they may be using is not freed under them.
+    if (!_mtb_kvstore_has_concurrent_reads(obj))
+    {
+        return false;
+    }
+
+    bool done = false;
+    uint32_t size = (data_size != NULL) ? *data_size : 0U;
+    (void)__atomic_add_fetch(&obj->lock_free_readers, 1U, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (uint32_t attempt = 0; (attempt < _MTB_KVSTORE_LOCK_FREE_READ_ATTEMPTS) && !done;
+         attempt++)
+    {
+        uint32_t seq = __atomic_load_n(&obj->write_seq, __ATOMIC_ACQUIRE);
+        if (((seq & 1U) != 0) ||
+            (__atomic_load_n(&obj->async_queue.count, __ATOMIC_ACQUIRE) != 0))
+        {
+            break;
+        }
+
+        if (data_size != NULL)
+        {
+            *data_size = size;
+        }
+        mtb_kvstore_ram_table_entry_t entry;
+        *result = _mtb_kvstore_find_entry_lock_free(obj, key, &entry);
+        if ((*result == CY_RSLT_SUCCESS) &&
+            (((entry.flags & _MTB_KVSTORE_VALUE_TYPE_FLAGS) != 0) ||
+             _mtb_kvstore_is_inline(&entry)))
+        {
+            break;
+        }
+        if ((*result == CY_RSLT_SUCCESS) && ((data_size != NULL) || partial))
+        {
+            _mtb_kvstore_record_header_t header;
+            uint32_t area_addr = _MTB_KVSTORE_LOAD(obj->active_area_addr);
+            *result = (partial)
+                      ? _mtb_kvstore_read_partial_record(obj, area_addr, entry.offset, &header,
+                                                         key, true, data, data_size, offset_bytes)
+                      : _mtb_kvstore_read_record(obj, area_addr, entry.offset, &header, key,
+                                                 true, data, data_size);
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        done = (__atomic_load_n(&obj->write_seq, __ATOMIC_RELAXED) == seq);
+    }
+    (void)__atomic_sub_fetch(&obj->lock_free_readers, 1U, __ATOMIC_RELEASE);
+
+    if (!done && (data_size != NULL))
+    {
+        *data_size = size;
+    }
+    return done;
+}
+
+
+#else // if MTB_KVSTORE_LOCK_FREE_READS
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_read_lock_free
+//--------------------------------------------------------------------------------------------------
+static inline bool _mtb_kvstore_read_lock_free(mtb_kvstore_t* obj, const char* key, uint8_t* data,
+                                               uint32_t* data_size, uint32_t offset_bytes,
+                                               bool partial, cy_rslt_t* result)
+{
+    CY_UNUSED_PARAMETER(obj);
+    CY_UNUSED_PARAMETER(key);
+    CY_UNUSED_PARAMETER(data);
+    CY_UNUSED_PARAMETER(data_size);
+    CY_UNUSED_PARAMETER(offset_bytes);
+    CY_UNUSED_PARAMETER(partial);
+    CY_UNUSED_PARAMETER(result);
+    return false;
+}
+
+
+#endif // if MTB_KVSTORE_LOCK_FREE_READS
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_async_find
+//--------------------------------------------------------------------------------------------------
+static const mtb_kvstore_async_entry_t* _mtb_kvstore_async_find(mtb_kvstore_t* obj,
+                                                                const char* key)
+{
+    // The caller holds the kv-store lock. Entries are only retired by the worker while it holds
+    // that lock, so the returned entry stays valid until the caller releases it.
+    const mtb_kvstore_async_entry_t* found = NULL;
+    _mtb_kvstore_queue_lock(obj);
+    mtb_kvstore_async_queue_t* queue = &obj->async_queue;
+    for (uint32_t idx = queue->count; (idx > 0) && (found == NULL); idx--)
+    {
+        const mtb_kvstore_async_entry_t* entry =
+            queue->entries[(queue->head + idx - 1) % MTB_KVSTORE_ASYNC_QUEUE_DEPTH];
+        if (strcmp(entry->key, key) == 0)
+        {
+            found = entry;
+        }
+    }
+    _mtb_kvstore_queue_unlock(obj);
+    return found;
+}
+
+
+#if defined(MTB_KVSTORE_RTOS_AWARE)
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_async_worker
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_async_worker(cy_thread_arg_t arg)
+{
+    mtb_kvstore_t* obj = (mtb_kvstore_t*)arg;
+    mtb_kvstore_async_queue_t* queue = &obj->async_queue;
+
+    while (true)
+    {
+        cy_rslt_t result = cy_rtos_get_semaphore(&queue->work_sem, CY_RTOS_NEVER_TIMEOUT, false);
+        CY_ASSERT(result == CY_RSLT_SUCCESS);
+
+        _mtb_kvstore_queue_lock(obj);
+        mtb_kvstore_async_entry_t* entry = (queue->count > 0)
+                                           ? queue->entries[queue->head]
+                                           : NULL;
+        bool stop = queue->stop;
+        _mtb_kvstore_queue_unlock(obj);
+
+        if (entry == NULL)
+        {
+            if (stop)
+            {
+                break;
+            }
+            continue;
+        }
+
+        // The entry is retired while the kv-store lock is still held so that a reader never
+        // misses the value in between the queue and the storage.
+        _mtb_kvstore_lock_wait_forever(obj);
+        result = _mtb_kvstore_write_locked(obj, entry->key, entry->data, entry->size,
+                                           MTB_KVSTORE_WRITE_DEFAULT_FLAGS,
+                                           _MTB_KVSTORE_ANY_VERSION);
+        _mtb_kvstore_queue_lock(obj);
+        queue->head = (queue->head + 1) % MTB_KVSTORE_ASYNC_QUEUE_DEPTH;
+        queue->count--;
+        queue->busy = true;
+        _mtb_kvstore_queue_unlock(obj);
+        _mtb_kvstore_unlock(obj);
+
+        if (entry->callback != NULL)
+        {
+            entry->callback(entry->context, entry->key, result);
+        }
+        free(entry);
+
+        _mtb_kvstore_queue_lock(obj);
+        queue->busy = false;
+        _mtb_kvstore_queue_unlock(obj);
+
+        // Nobody may be waiting, so a full semaphore is not an error.
+        (void)cy_rtos_set_semaphore(&queue->done_sem, false);
+    }
+
+    (void)cy_rtos_exit_thread();
+}
+
+
+#endif // if defined(MTB_KVSTORE_RTOS_AWARE)
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_async_stop
+//--------------------------------------------------------------------------------------------------
+static void _mtb_kvstore_async_stop(mtb_kvstore_t* obj)
+{
+    #if defined(MTB_KVSTORE_RTOS_AWARE)
+    mtb_kvstore_async_queue_t* queue = &obj->async_queue;
+    _mtb_kvstore_queue_lock(obj);
+    bool running = queue->running;
+    queue->stop = true;
+    _mtb_kvstore_queue_unlock(obj);
+
+    // The worker drains all pending writes before it exits.
+    if (running)
+    {
+        cy_rslt_t result = cy_rtos_set_semaphore(&queue->work_sem, false);
+        CY_ASSERT(result == CY_RSLT_SUCCESS);
+        result = cy_rtos_join_thread(&queue->thread);
+        CY_ASSERT(result == CY_RSLT_SUCCESS);
+        CY_UNUSED_PARAMETER(result);
+        queue->running = false;
+    }
+    #else
+    CY_UNUSED_PARAMETER(obj);
+    #endif
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_read_record_key
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_read_record_key(mtb_kvstore_t* obj, uint32_t offset,
+                                              _mtb_kvstore_record_header_t* record_header,
+                                              char* key)
+{
+    // Records referenced by the RAM table were validated when they were added, so the key is read
+    // without checking the CRC of the whole record again. A key ID is resolved to its key.
+    uint32_t record_addr = obj->active_area_addr + offset;
+    cy_rslt_t result = _mtb_kvstore_read_header(obj, record_addr, record_header);
+    if (result == CY_RSLT_SUCCESS)
+    {
+        CY_ASSERT(record_header->key_size < MTB_KVSTORE_MAX_KEY_SIZE);
+        result = obj->bd->read(obj->bd->context, record_addr + record_header->header_size,
+                               record_header->key_size, (uint8_t*)key);
+        key[record_header->key_size] = '\0';
+    }
+
+    uint32_t id;
+    if ((result == CY_RSLT_SUCCESS) && ((record_header->flags & _MTB_KVSTORE_KEY_ID_FLAG) != 0) &&
+        _mtb_kvstore_decode_key_id(key, record_header->key_size, &id))
+    {
+        CY_ASSERT(id < obj->num_key_ids);
+        memcpy(key, obj->key_dict[id].key, strlen(obj->key_dict[id].key) + 1);
+    }
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_delete_marked
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_delete_marked(mtb_kvstore_t* obj, const bool* marked)
+{
+    CY_ASSERT(obj != NULL);
+    cy_rslt_t result = CY_RSLT_SUCCESS;
+    _mtb_kvstore_record_header_t header;
+
+    uint32_t tombstones_size = 0;
+    for (uint32_t idx = 0; idx < obj->num_entries; idx++)
+    {
+        if (marked[idx])
+        {
+            result = _mtb_kvstore_read_record_key(obj, obj->ram_table[idx].offset, &header,
+                                                  obj->key_buffer);
+            if (result != CY_RSLT_SUCCESS)
+            {
+                return result;
+            }
+            tombstones_size += _mtb_kvstore_get_record_size(obj, obj->active_area_addr,
+                                                            header.key_size, 0);
+        }
+    }
+
+    // If the tombstones do not fit, the garbage collection that is needed anyway drops the
+    // records, so there is no need to write the tombstones at all. The RAM table is only updated
+    // once the storage no longer holds the keys, so that a failure leaves both unchanged.
+    bool write_tombstones =
+        ((obj->free_space_offset + tombstones_size) <= _MTB_KVSTORE_AREA_SIZE(obj));
+    if (!write_tombstones)
+    {
+        _mtb_kvstore_record_info_t record_info =
+        {
+            .ram_tbl_idx     = obj->num_entries,
+            .update_rec_info = NULL,
+            .marked          = marked
+        };
+        return _mtb_kvstore_garbage_collection(obj, &record_info);
+    }
+
+    // Append all tombstones as one batch. Each record is padded so that the next one starts
+    // on a program boundary, exactly as if they had been written one at a time.
+    uint32_t write_address;
+    uint32_t buffer_space_left;
+    _mtb_kvstore_start_buffered_write(obj, obj->active_area_addr + obj->free_space_offset,
+                                      &write_address, &buffer_space_left);
+    for (uint32_t idx = 0; idx < obj->num_entries; idx++)
+    {
+        if (!marked[idx])
+        {
+            continue;
+        }
+
+        result = _mtb_kvstore_read_record_key(obj, obj->ram_table[idx].offset, &header,
+                                              obj->key_buffer);
+        if (result != CY_RSLT_SUCCESS)
+        {
+            return result;
+        }
+
+        // The tombstone refers to the key the same way as the record it deletes.
+        uint8_t key_flags = header.flags & _MTB_KVSTORE_KEY_ID_FLAG;
+        char id_key[_MTB_KVSTORE_KEY_ID_SIZE + 1];
+        const char* stored_key = _mtb_kvstore_get_stored_key(obj, obj->key_buffer, key_flags,
+                                                             id_key);
+        CY_ASSERT(stored_key != NULL);
+        _mtb_kvstore_record_header_t tombstone;
+        _mtb_kvstore_setup_record_header(stored_key, NULL, 0,
+                                         _mtb_kvstore_get_format_version(obj),
+                                         _MTB_KVSTORE_OPER_DELETE, key_flags, &tombstone);
+        uint8_t encoded_header[sizeof(_mtb_kvstore_record_header_t)];
+        uint32_t header_size = _mtb_kvstore_encode_header(&tombstone, encoded_header);
+        uint32_t pad_size = _mtb_kvstore_get_record_size(obj, obj->active_area_addr,
+                                                         tombstone.key_size, 0) -
+                            header_size - tombstone.key_size;
+        result = _mtb_kvstore_buffered_write(obj, encoded_header, header_size,
+                                             &write_address, &buffer_space_left, false);
+        if (result == CY_RSLT_SUCCESS)
+        {
+            result = _mtb_kvstore_buffered_write(obj, (uint8_t*)stored_key,
+                                                 tombstone.key_size, &write_address,
+                                                 &buffer_space_left, false);
+        }
+        if (result == CY_RSLT_SUCCESS)
+        {
+            result = _mtb_kvstore_buffered_write(obj, NULL, pad_size, &write_address,
+                                                 &buffer_space_left, false);
+        }
+        if (result != CY_RSLT_SUCCESS)
+        {
+            return result;
+        }
+    }
+
+    result = _mtb_kvstore_buffered_write(obj, NULL, 0, &write_address, &buffer_space_left,
+                                         true);
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
+    obj->free_space_offset += tombstones_size;
+
+    return _mtb_kvstore_remove_marked_entries(obj, marked);
+}
+
+
+/**************************************** PUBLIC API ******************************************/
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_init_instance
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t _mtb_kvstore_init_instance(mtb_kvstore_t* obj, uint32_t start_addr,
+                                            uint32_t length, const mtb_kvstore_bd_t* block_device,
+                                            const mtb_kvstore_config_t* config, uint8_t num_shards)
+{
+    if ((NULL == obj) || (NULL == block_device) || (length == 0))
+    {
+        return MTB_KVSTORE_BAD_PARAM_ERROR;
+    }
+
+    if ((config != NULL) && !_mtb_kvstore_is_aligned(config->buffer_alignment,
+                                                     config->buffer_alignment))
+    {
+        return MTB_KVSTORE_BAD_PARAM_ERROR;
+    }
+
+    // Packed records share program units, which must then be programmed more than once.
+    if ((config != NULL) && config->packed_records &&
+        ((block_device->capabilities & MTB_KVSTORE_BD_CAP_BIT_CLEAR) == 0))
+    {
+        return MTB_KVSTORE_BAD_PARAM_ERROR;
+    }
+
+    // Check if start addr and start addr + length align with erase sector size
+    uint32_t erase_size = block_device->erase_size(block_device->context, start_addr);
+    if (!_mtb_kvstore_is_aligned(start_addr,
+                                 erase_size) ||
+        !_mtb_kvstore_is_aligned(start_addr + length, erase_size))
+    {
+        return MTB_KVSTORE_ALIGNMENT_ERROR;
+    }
+
+    // Check that the storage does not have 0 sectors and has even number
+    // of erase sectors.
+    uint32_t num_erase_sectors = (length / erase_size);
+    if ((num_erase_sectors == 0) || ((num_erase_sectors > 0) && ((num_erase_sectors & 1) != 0)))
+    {
+        return MTB_KVSTORE_ALIGNMENT_ERROR;
+    }
+
+    cy_rslt_t result = _mtb_kvstore_init_registry();
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
+
+    memset(obj, 0, sizeof(mtb_kvstore_t));
+    if (config != NULL)
+    {
+        obj->config = *config;
+    }
+    obj->num_shards = num_shards;
+
+    // Init Mutex
+    result = _mtb_kvstore_initlock(obj);
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
+
+    // Get Mutex
+    result = _mtb_kvstore_lock(obj);
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
+
+    uint32_t prog_size = block_device->program_size(block_device->context, start_addr);
+    uint32_t read_size = block_device->read_size(block_device->context, start_addr);
+    uint32_t buffer_size = (prog_size >= read_size) ? prog_size : read_size;
+    uint32_t min_buffer_size = (obj->config.buffer_size != 0)
+                               ? obj->config.buffer_size
+                               : _MTB_KVSTORE_MIN_BUFF_SIZE;
+    if (min_buffer_size < sizeof(_mtb_kvstore_record_header_t))
+    {
+        min_buffer_size = sizeof(_mtb_kvstore_record_header_t);
+    }
+    if (buffer_size < min_buffer_size)
+    {
+        buffer_size = _mtb_kvstore_align_up(min_buffer_size, prog_size);
+    }
+
+    obj->transaction_buffer = _mtb_kvstore_alloc_buffer(buffer_size,
+                                                        obj->config.buffer_alignment,
+                                                        &obj->transaction_buffer_mem);
+    if (obj->transaction_buffer != NULL)
+    {
+        obj->transaction_buffer_size = buffer_size;
+        obj->bd = block_device;
+        obj->start_addr = start_addr;
+        obj->length = length;
+
+        result = _mtb_kvstore_join_gc_group(obj);
+        if (result == CY_RSLT_SUCCESS)
+        {
+            result = _mtb_kvstore_setup_areas(obj);
+            if (result == CY_RSLT_SUCCESS)
+            {
+                result = _mtb_kvstore_build_ram_table(obj);
+            }
+            // Storage written with the other record layout is rewritten in the configured one.
+            if ((result == CY_RSLT_SUCCESS) &&
+                (obj->active_area_packed != obj->config.packed_records))
+            {
+                result = _mtb_kvstore_garbage_collection(obj, NULL);
+            }
+        }
+    }
+    else
+    {
+        /* Not enough heap available to allocate work buffer */
+        result = MTB_KVSTORE_MEM_ALLOC_ERROR;
+    }
+
+    // Release Mutex
+    _mtb_kvstore_unlock(obj);
+
+    if (result != CY_RSLT_SUCCESS)
+    {
+        mtb_kvstore_deinit(obj);
+    }
+    else
+    {
+        _mtb_kvstore_register(obj);
+    }
+
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// mtb_kvstore_init
+//--------------------------------------------------------------------------------------------------
+cy_rslt_t mtb_kvstore_init(mtb_kvstore_t* obj, uint32_t start_addr, uint32_t length,
+                           const mtb_kvstore_bd_t* block_device)
+{
+    return mtb_kvstore_init_with_config(obj, start_addr, length, block_device, NULL);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// mtb_kvstore_init_with_config
+//--------------------------------------------------------------------------------------------------
+cy_rslt_t mtb_kvstore_init_with_config(mtb_kvstore_t* obj, uint32_t start_addr, uint32_t length,
+                                       const mtb_kvstore_bd_t* block_device,
+                                       const mtb_kvstore_config_t* config)
+{
+    return _mtb_kvstore_init_instance(obj, start_addr, length, block_device, config, 0);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// mtb_kvstore_write
+//--------------------------------------------------------------------------------------------------
+cy_rslt_t mtb_kvstore_write(mtb_kvstore_t* obj, const char* key, const uint8_t* data,
+                            uint32_t size)
+{
+    return mtb_kvstore_write_ex(obj, key, data, size, MTB_KVSTORE_WRITE_DEFAULT_FLAGS);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// mtb_kvstore_write_ex
+//--------------------------------------------------------------------------------------------------
+cy_rslt_t mtb_kvstore_write_ex(mtb_kvstore_t* obj, const char* key, const uint8_t* data,
+                               uint32_t size, uint32_t flags)
+{
+    if (!_mtb_kvstore_is_valid_key(key) || ((data == NULL) && (size != 0)) ||
+        !_mtb_kvstore_is_valid_value_size(size))
+    {
+        return MTB_KVSTORE_BAD_PARAM_ERROR;
+    }
+
+    // Writes that were submitted asynchronously before this one must be applied first.
+    cy_rslt_t result = mtb_kvstore_flush_queue(obj);
     if (result != CY_RSLT_SUCCESS)
     {
         return result;
     }
 
-    // Improper use case: reading after the value ended
-    if (offset_bytes > record_header->data_size)
+    result = _mtb_kvstore_lock(obj);
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
+
+    result = _mtb_kvstore_write_locked(obj, key, data, size, flags, _MTB_KVSTORE_ANY_VERSION);
+
+    _mtb_kvstore_unlock(obj);
+
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// mtb_kvstore_write_if
+//--------------------------------------------------------------------------------------------------
+cy_rslt_t mtb_kvstore_write_if(mtb_kvstore_t* obj, const char* key, const uint8_t* data,
+                               uint32_t size, uint32_t expected_version)
+{
+    if (!_mtb_kvstore_is_valid_key(key) || ((data == NULL) && (size != 0)) ||
+        !_mtb_kvstore_is_valid_value_size(size) || (expected_version == _MTB_KVSTORE_ANY_VERSION))
     {
         return MTB_KVSTORE_BAD_PARAM_ERROR;
     }
 
-    if ((record_header->magic == 0xFFFFFFFFU) || (record_header->magic == 0U))
+    // Versions are only assigned to values that reached the storage.
+    cy_rslt_t result = mtb_kvstore_flush_queue(obj);
+    if (result != CY_RSLT_SUCCESS)
     {
-        return MTB_KVSTORE_ERASED_DATA_ERROR;
+        return result;
     }
 
-    if (record_header->magic != _MTB_KVSTORE_HEADER_MAGIC)
+    result = _mtb_kvstore_lock(obj);
+    if (result != CY_RSLT_SUCCESS)
     {
-        return MTB_KVSTORE_INVALID_DATA_ERROR;
+        return result;
     }
 
-    if ((record_header->key_size == 0U) || (record_header->key_size >= MTB_KVSTORE_MAX_KEY_SIZE))
+    result = _mtb_kvstore_write_locked(obj, key, data, size, MTB_KVSTORE_WRITE_DEFAULT_FLAGS,
+                                       expected_version);
+
+    _mtb_kvstore_unlock(obj);
+
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// mtb_kvstore_update
+//--------------------------------------------------------------------------------------------------
+cy_rslt_t mtb_kvstore_update(mtb_kvstore_t* obj, const char* key, mtb_kvstore_update_fn fn,
+                             void* context)
+{
+    if (!_mtb_kvstore_is_valid_key(key) || (fn == NULL))
     {
-        return MTB_KVSTORE_INVALID_DATA_ERROR;
+        return MTB_KVSTORE_BAD_PARAM_ERROR;
     }
 
-    // Copy key into the provided key area
-    uint32_t key_addr = record_start_addr + record_header->header_size;
-    if (key != NULL)
+    cy_rslt_t result = mtb_kvstore_flush_queue(obj);
+    if (result != CY_RSLT_SUCCESS)
     {
-        if (validate_key)
+        return result;
+    }
+
+    result = _mtb_kvstore_lock(obj);
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
+
+    uint8_t stack_value[MTB_KVSTORE_UPDATE_BUFFER_SIZE];
+    uint8_t* value = stack_value;
+    void* value_mem = NULL;
+    uint32_t max_size = sizeof(stack_value);
+    uint32_t size = 0;
+    uint32_t ram_tbl_idx;
+    uint16_t hash = _mtb_kvstore_crc16((uint8_t*)key, strlen(key), _MTB_KVSTORE_CRC_INIT_VAL);
+
+    // Same walk as _mtb_kvstore_find_record_in_ram_table, but the value is read while the record
+    // is validated so that it only needs to be read once.
+    result = MTB_KVSTORE_ITEM_NOT_FOUND_ERROR;
+    for (ram_tbl_idx = 0; ram_tbl_idx < obj->num_entries; ram_tbl_idx++)
+    {
+        mtb_kvstore_ram_table_entry_t entry = obj->ram_table[ram_tbl_idx];
+        if (hash < entry.hash)
         {
-            result = _mtb_kvstore_validate_key(obj, key_addr, key, record_header->key_size);
-            if (result != CY_RSLT_SUCCESS)
-            {
-                return result;
-            }
+            continue;
         }
-        else
+
+        if (hash > entry.hash)
         {
-            result = obj->bd->read(obj->bd->context, key_addr, record_header->key_size,
-                                   (uint8_t*)key);
-            if (result != CY_RSLT_SUCCESS)
+            break;
+        }
+
+        _mtb_kvstore_record_header_t header;
+        size = max_size;
+        result = _mtb_kvstore_read_record(obj, obj->active_area_addr, entry.offset, &header, key,
+                                          true, value, &size);
+        if (result == MTB_KVSTORE_BUFFER_TOO_SMALL)
+        {
+            free(value_mem);
+            value = _mtb_kvstore_alloc_buffer(size, 0, &value_mem);
+            if (value == NULL)
             {
-                return result;
+                result = MTB_KVSTORE_MEM_ALLOC_ERROR;
+                break;
             }
+            max_size = size;
+            result = _mtb_kvstore_read_record(obj, obj->active_area_addr, entry.offset, &header,
+                                              key, true, value, &size);
         }
-    }
 
-    uint32_t data_addr = key_addr + record_header->key_size;
-    if ((data != NULL) && (data_size != NULL))
-    {
-        // Don't read past the value in memory
-        if (*data_size > (record_header->data_size - offset_bytes))
+        // If there was a key mismatch then keep searching.
+        if (result != MTB_KVSTORE_ITEM_NOT_FOUND_ERROR)
         {
-            *data_size = (record_header->data_size - offset_bytes);
+            break;
         }
+    }
 
-        // Copy data into the data buffer provided
-        result = obj->bd->read(obj->bd->context, (data_addr + offset_bytes), *data_size, data);
-        if (result != CY_RSLT_SUCCESS)
+    bool found_in_table = (result == CY_RSLT_SUCCESS);
+    if (result == MTB_KVSTORE_ITEM_NOT_FOUND_ERROR)
+    {
+        size = 0;
+        result = CY_RSLT_SUCCESS;
+    }
+    else if (found_in_table &&
+             ((obj->ram_table[ram_tbl_idx].flags &
+               (_MTB_KVSTORE_APPEND_FLAG | _MTB_KVSTORE_COMPRESSED_FLAG |
+                _MTB_KVSTORE_CHUNKED_FLAG)) != 0))
+    {
+        // The callback sees the stitched, decompressed or chunked value, not the stored one.
+        size = max_size;
+        result = _mtb_kvstore_read_value(obj, ram_tbl_idx, key, value, &size);
+        if (result == MTB_KVSTORE_BUFFER_TOO_SMALL)
         {
-            return result;
+            free(value_mem);
+            value = _mtb_kvstore_alloc_buffer(size, 0, &value_mem);
+            max_size = size;
+            result = (value == NULL)
+                     ? MTB_KVSTORE_MEM_ALLOC_ERROR
+                     : _mtb_kvstore_read_value(obj, ram_tbl_idx, key, value, &size);
         }
     }
 
-    if (data_size != NULL)
+    if (result == CY_RSLT_SUCCESS)
     {
-        *data_size = record_header->data_size;
+        if (found_in_table &&
+            ((obj->ram_table[ram_tbl_idx].flags & _MTB_KVSTORE_COUNTER_FLAG) != 0))
+        {
+            // The callback sees the value of a counter, not its tally region.
+            uint32_t counter;
+            uint32_t next_idx = UINT32_MAX;
+            memcpy(&counter, value, sizeof(counter));
+            counter += _mtb_kvstore_count_tally(&value[sizeof(counter)], size - sizeof(counter),
+                                                &next_idx);
+            memcpy(value, &counter, sizeof(counter));
+            size = sizeof(counter);
+        }
+
+        if (fn(context, key, value, &size, max_size) == MTB_KVSTORE_UPDATE_UNCHANGED)
+        {
+            obj->stats.skipped_writes++;
+        }
+        else if ((size > max_size) || !_mtb_kvstore_is_valid_value_size(size))
+        {
+            result = MTB_KVSTORE_BAD_PARAM_ERROR;
+        }
+        else if (_mtb_kvstore_is_chunked_size(obj, size))
+        {
+            result = _mtb_kvstore_write_chunked(obj, key, value, size, found_in_table, ram_tbl_idx,
+                                                hash, false);
+        }
+        else
+        {
+            // A compressed value stays compressed.
+            const uint8_t* record_data = value;
+            uint8_t record_flags = _MTB_KVSTORE_NO_FLAG;
+            uint8_t* compressed = NULL;
+            uint32_t compressed_size;
+            if (found_in_table &&
+                ((obj->ram_table[ram_tbl_idx].flags & _MTB_KVSTORE_COMPRESSED_FLAG) != 0) &&
+                _mtb_kvstore_compress_value(value, size, &compressed, &compressed_size))
+            {
+                record_data = compressed;
+                size = compressed_size;
+                record_flags = _MTB_KVSTORE_COMPRESSED_FLAG;
+            }
+
+            _mtb_kvstore_buffer_t saved_buffer;
+            bool grown = _mtb_kvstore_grow_buffer(obj,
+                                                  _mtb_kvstore_get_record_size(obj,
+                                                                               obj->active_area_addr,
+                                                                               strlen(key), size),
+                                                  &saved_buffer);
+
+            result = _mtb_kvstore_append_record(obj, key, record_data, size,
+                                                (found_in_table)
+                                                ? _MTB_KVSTORE_OPER_UPDATE
+                                                : _MTB_KVSTORE_OPER_ADD,
+                                                record_flags, ram_tbl_idx, hash);
+
+            if (grown)
+            {
+                _mtb_kvstore_restore_buffer(obj, &saved_buffer);
+            }
+            free(compressed);
+        }
     }
 
+    _mtb_kvstore_unlock(obj);
+
+    free(value_mem);
+
     return result;
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// _mtb_kvstore_setup_record_header
+// mtb_kvstore_append
 //--------------------------------------------------------------------------------------------------
-static void _mtb_kvstore_setup_record_header(const char* key,
-                                             const uint8_t* data,
-                                             uint32_t data_size,
-                                             uint8_t format_version,
-                                             _mtb_kvstore_operation_t operation,
-                                             _mtb_kvstore_record_header_t* record_header)
+cy_rslt_t mtb_kvstore_append(mtb_kvstore_t* obj, const char* key, const uint8_t* data,
+                             uint32_t size)
 {
-    CY_ASSERT(key != NULL);
+    return mtb_kvstore_append_ex(obj, key, data, size, 0);
+}
 
-    memset(record_header, 0, sizeof(_mtb_kvstore_record_header_t));
 
-    record_header->magic = _MTB_KVSTORE_HEADER_MAGIC;
-    record_header->format_version = format_version;
-    record_header->header_size = sizeof(_mtb_kvstore_record_header_t);
-    record_header->flags = (operation == _MTB_KVSTORE_OPER_DELETE)
-                            ? _MTB_KVSTORE_DELETE_FLAG
-                            : _MTB_KVSTORE_NO_FLAG;
-    record_header->key_size = strlen(key);
-    record_header->data_size = data_size;
-    record_header->crc = _mtb_kvstore_get_record_crc(record_header, key, data);
+//--------------------------------------------------------------------------------------------------
+// mtb_kvstore_append_ex
+//--------------------------------------------------------------------------------------------------
+cy_rslt_t mtb_kvstore_append_ex(mtb_kvstore_t* obj, const char* key, const uint8_t* data,
+                                uint32_t size, uint32_t max_size)
+{
+    if (!_mtb_kvstore_is_valid_key(key) || ((data == NULL) && (size != 0)) ||
+        !_mtb_kvstore_is_valid_value_size(size))
+    {
+        return MTB_KVSTORE_BAD_PARAM_ERROR;
+    }
+
+    cy_rslt_t result = mtb_kvstore_flush_queue(obj);
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
+
+    result = _mtb_kvstore_lock(obj);
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
+
+    uint32_t ram_tbl_idx;
+    uint16_t hash;
+    result = _mtb_kvstore_find_record_in_ram_table(obj, key, &ram_tbl_idx, &hash, NULL);
+    bool found_in_table = (result == CY_RSLT_SUCCESS);
+    if (result == MTB_KVSTORE_ITEM_NOT_FOUND_ERROR)
+    {
+        result = CY_RSLT_SUCCESS;
+    }
+    else if (found_in_table &&
+             ((obj->ram_table[ram_tbl_idx].flags &
+               (_MTB_KVSTORE_COUNTER_FLAG | _MTB_KVSTORE_COMPRESSED_FLAG |
+                _MTB_KVSTORE_CHUNKED_FLAG)) != 0))
+    {
+        result = MTB_KVSTORE_BAD_PARAM_ERROR;
+    }
+
+    uint8_t key_flags = _MTB_KVSTORE_NO_FLAG;
+    if (result == CY_RSLT_SUCCESS)
+    {
+        result = _mtb_kvstore_intern_key(obj, key, &key_flags);
+    }
+
+    if ((result == CY_RSLT_SUCCESS) && !found_in_table && (obj->num_entries >= obj->max_entries))
+    {
+        result = _mtb_kvstore_increment_max_keys(obj);
+    }
+
+    // The previous segments stay live, so only the new segment has to fit. Garbage collection
+    // coalesces the segments and may move the value, so the link is set up afterwards.
+    _mtb_kvstore_segment_info_t info;
+    uint32_t record_size = _mtb_kvstore_get_record_size(obj, obj->active_area_addr,
+                                                        _mtb_kvstore_get_stored_key_size(key,
+                                                                                         key_flags),
+                                                        sizeof(info) + size);
+    if ((result == CY_RSLT_SUCCESS) &&
+        ((obj->free_space_offset + record_size) > _MTB_KVSTORE_AREA_SIZE(obj)))
+    {
+        result = _mtb_kvstore_garbage_collection(obj, NULL);
+        if ((result == CY_RSLT_SUCCESS) &&
+            ((obj->free_space_offset + record_size) > _MTB_KVSTORE_AREA_SIZE(obj)))
+        {
+            result = MTB_KVSTORE_STORAGE_FULL_ERROR;
+        }
+    }
+
+    info.prev_offset = _MTB_KVSTORE_NO_SEGMENT;
+    info.total_size = size;
+    info.max_size = max_size;
+    if ((result == CY_RSLT_SUCCESS) && found_in_table)
+    {
+        _mtb_kvstore_record_header_t header;
+        _mtb_kvstore_segment_info_t prev_info;
+        _mtb_kvstore_segment_t segment;
+        info.prev_offset = obj->ram_table[ram_tbl_idx].offset;
+        result = _mtb_kvstore_read_segment(obj, info.prev_offset, NULL, &header, &prev_info,
+                                           &segment);
+        info.total_size += prev_info.total_size;
+    }
+
+    // A bounded value is trimmed to max_size by garbage collection, so that is what is limited.
+    if ((result == CY_RSLT_SUCCESS) &&
+        !_mtb_kvstore_is_valid_value_size(((max_size != 0) && (max_size < info.total_size))
+                                          ? max_size
+                                          : info.total_size))
+    {
+        result = MTB_KVSTORE_BAD_PARAM_ERROR;
+    }
+
+    void* record_data_mem = NULL;
+    uint8_t* record_data = NULL;
+    if (result == CY_RSLT_SUCCESS)
+    {
+        record_data = _mtb_kvstore_alloc_buffer(sizeof(info) + size, 0, &record_data_mem);
+        if (record_data == NULL)
+        {
+            result = MTB_KVSTORE_MEM_ALLOC_ERROR;
+        }
+    }
+
+    if (result == CY_RSLT_SUCCESS)
+    {
+        memcpy(record_data, &info, sizeof(info));
+        if (size != 0)
+        {
+            memcpy(&record_data[sizeof(info)], data, size);
+        }
+
+        _mtb_kvstore_update_ram_table_info_t ram_tbl_info =
+        {
+            .ram_tbl_idx  = ram_tbl_idx,
+            .entry.hash   = hash,
+            .entry.flags  = _MTB_KVSTORE_APPEND_FLAG | key_flags,
+            .entry.offset = obj->free_space_offset
+        };
+        // Nothing is superseded, so the record only adds to the consumed size.
+        _mtb_kvstore_update_consumed_size_info_t size_info =
+        {
+            .old_record_size = 0,
+            .new_record_size = record_size
+        };
+        result = _mtb_kvstore_write_record(obj, obj->active_area_addr, obj->free_space_offset,
+                                           key, record_data, sizeof(info) + size,
+                                           (found_in_table)
+                                           ? _MTB_KVSTORE_OPER_UPDATE
+                                           : _MTB_KVSTORE_OPER_ADD,
+                                           ram_tbl_info.entry.flags, &ram_tbl_info, &size_info);
+        if (result == CY_RSLT_SUCCESS)
+        {
+            obj->free_space_offset += record_size;
+        }
+    }
+
+    _mtb_kvstore_unlock(obj);
+
+    free(record_data_mem);
+
+    return result;
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// _mtb_kvstore_buffered_write
+// mtb_kvstore_counter_increment
 //--------------------------------------------------------------------------------------------------
-static cy_rslt_t _mtb_kvstore_buffered_write(mtb_kvstore_t* obj,
-                                             const uint8_t* data,
-                                             uint32_t data_size,
-                                             uint32_t* write_address,
-                                             uint32_t* buffer_space_left,
-                                             bool flush)
+cy_rslt_t mtb_kvstore_counter_increment(mtb_kvstore_t* obj, const char* key, uint32_t* value)
 {
-    CY_ASSERT(obj != NULL);
-    cy_rslt_t result = CY_RSLT_SUCCESS;
-    uint8_t* buffer_offset_ptr = obj->transaction_buffer +
-                                 (obj->transaction_buffer_size - *buffer_space_left);
-    const uint8_t* current_data_ptr = data;
-    uint32_t remaining_size = data_size;
-    while (remaining_size > 0)
+    if (!_mtb_kvstore_is_valid_key(key))
     {
-        uint32_t transfer_size =
-            (*buffer_space_left >= remaining_size) ? remaining_size : *buffer_space_left;
-        memcpy(buffer_offset_ptr, current_data_ptr, transfer_size);
-        *buffer_space_left -= transfer_size;
-        buffer_offset_ptr += transfer_size;
-        remaining_size -= transfer_size;
-        current_data_ptr += transfer_size;
-        if (*buffer_space_left == 0)
+        return MTB_KVSTORE_BAD_PARAM_ERROR;
+    }
+
+    cy_rslt_t result = mtb_kvstore_flush_queue(obj);
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
+
+    result = _mtb_kvstore_lock(obj);
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
+
+    bool bit_clear = ((obj->bd->capabilities & MTB_KVSTORE_BD_CAP_BIT_CLEAR) != 0);
+    uint32_t ram_tbl_idx;
+    uint16_t hash;
+    uint32_t data_size = 0;
+    uint32_t counter = 0;
+    result = _mtb_kvstore_find_record_in_ram_table(obj, key, &ram_tbl_idx, &hash, &data_size);
+    bool found_in_table = (result == CY_RSLT_SUCCESS);
+    if (result == MTB_KVSTORE_ITEM_NOT_FOUND_ERROR)
+    {
+        result = CY_RSLT_SUCCESS;
+    }
+    else if ((result == CY_RSLT_SUCCESS) &&
+             ((obj->ram_table[ram_tbl_idx].flags & _MTB_KVSTORE_COUNTER_FLAG) != 0))
+    {
+        uint32_t bit_addr;
+        result = _mtb_kvstore_read_counter(obj, obj->ram_table[ram_tbl_idx].offset, key, &counter,
+                                           &bit_addr);
+        if ((result == CY_RSLT_SUCCESS) && bit_clear && (bit_addr != UINT32_MAX))
         {
-            result = obj->bd->program(obj->bd->context, *write_address,
-                                      obj->transaction_buffer_size,
-                                      obj->transaction_buffer);
-            if (result != CY_RSLT_SUCCESS)
+            // Clear the next bit of the tally by programming the program unit that holds it again.
+            uint32_t prog_size = obj->bd->program_size(obj->bd->context, bit_addr);
+            uint32_t unit_addr = bit_addr - (bit_addr % prog_size);
+            result = obj->bd->read(obj->bd->context, unit_addr, prog_size,
+                                   obj->transaction_buffer);
+            if (result == CY_RSLT_SUCCESS)
             {
-                return result;
+                uint8_t* tally_byte = &obj->transaction_buffer[bit_addr - unit_addr];
+                *tally_byte &= (uint8_t)(*tally_byte - 1U);
+                result = obj->bd->program(obj->bd->context, unit_addr, prog_size,
+                                          obj->transaction_buffer);
             }
-            *buffer_space_left = obj->transaction_buffer_size;
-            buffer_offset_ptr = obj->transaction_buffer;
-            *write_address += obj->transaction_buffer_size;
+            if (result == CY_RSLT_SUCCESS)
+            {
+                counter++;
+                _MTB_KVSTORE_STORE_FIELD(obj->ram_table[ram_tbl_idx].generation,
+                                         _mtb_kvstore_next_generation(obj));
+                if (value != NULL)
+                {
+                    *value = counter;
+                }
+            }
+            _mtb_kvstore_unlock(obj);
+            return result;
         }
     }
+    else if (result == CY_RSLT_SUCCESS)
+    {
+        uint32_t size = sizeof(counter);
+        result = ((data_size == sizeof(counter)) &&
+                  ((obj->ram_table[ram_tbl_idx].flags & _MTB_KVSTORE_APPEND_FLAG) == 0))
+                 ? _mtb_kvstore_read_value(obj, ram_tbl_idx, key, (uint8_t*)&counter, &size)
+                 : MTB_KVSTORE_BAD_PARAM_ERROR;
+    }
 
-    if ((*buffer_space_left != obj->transaction_buffer_size) && flush)
+    // Start a new counter record with a fresh tally region.
+    if (result == CY_RSLT_SUCCESS)
     {
-        uint32_t prog_size = obj->bd->program_size(obj->bd->context, *write_address);
-        uint32_t size = _mtb_kvstore_align_up(obj->transaction_buffer_size - *buffer_space_left,
-                                              prog_size);
-        result = obj->bd->program(obj->bd->context, *write_address,
-                                  size,
-                                  obj->transaction_buffer);
-        if (result != CY_RSLT_SUCCESS)
+        uint8_t data[sizeof(counter) + MTB_KVSTORE_COUNTER_TALLY_SIZE];
+        uint32_t size = (bit_clear) ? sizeof(data) : sizeof(counter);
+        counter++;
+        memcpy(data, &counter, sizeof(counter));
+        memset(&data[sizeof(counter)], 0xFF, sizeof(data) - sizeof(counter));
+
+        result = _mtb_kvstore_append_record(obj, key, data, size,
+                                            (found_in_table)
+                                            ? _MTB_KVSTORE_OPER_UPDATE
+                                            : _MTB_KVSTORE_OPER_ADD,
+                                            _MTB_KVSTORE_COUNTER_FLAG, ram_tbl_idx, hash);
+        if ((result == CY_RSLT_SUCCESS) && (value != NULL))
         {
-            return result;
+            *value = counter;
         }
-        *buffer_space_left = obj->transaction_buffer_size;
     }
+
+    _mtb_kvstore_unlock(obj);
+
     return result;
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// _mtb_kvstore_write_record
+// mtb_kvstore_write_async
 //--------------------------------------------------------------------------------------------------
-static cy_rslt_t _mtb_kvstore_write_record(mtb_kvstore_t* obj,
-                                           uint32_t area_address,
-                                           uint32_t offset,
-                                           const char* key,
-                                           const uint8_t* data,
-                                           uint32_t data_size,
-                                           _mtb_kvstore_operation_t operation,
-                                           const _mtb_kvstore_update_ram_table_info_t* ram_tbl_info,
-                                           const _mtb_kvstore_update_consumed_size_info_t* size_info)
+cy_rslt_t mtb_kvstore_write_async(mtb_kvstore_t* obj, const char* key, const uint8_t* data,
+                                  uint32_t size, mtb_kvstore_write_cb_t callback, void* context)
 {
-    CY_ASSERT(obj != NULL);
-    CY_ASSERT(key != NULL);
+    if (!_mtb_kvstore_is_valid_key(key) || ((data == NULL) && (size != 0)) ||
+        !_mtb_kvstore_is_valid_value_size(size))
+    {
+        return MTB_KVSTORE_BAD_PARAM_ERROR;
+    }
+
+    #if defined(MTB_KVSTORE_RTOS_AWARE)
+    mtb_kvstore_async_entry_t* entry =
+        (mtb_kvstore_async_entry_t*)malloc(sizeof(mtb_kvstore_async_entry_t) + size);
+    if (entry == NULL)
+    {
+        return MTB_KVSTORE_MEM_ALLOC_ERROR;
+    }
+    entry->callback = callback;
+    entry->context = context;
+    entry->size = size;
+    strcpy(entry->key, key);
+    if (size != 0)
+    {
+        memcpy(entry->data, data, size);
+    }
+
     cy_rslt_t result = CY_RSLT_SUCCESS;
+    mtb_kvstore_async_queue_t* queue = &obj->async_queue;
+    _mtb_kvstore_queue_lock(obj);
+    // The worker is only started once it is needed.
+    if (!queue->running)
+    {
+        result = cy_rtos_create_thread(&queue->thread, _mtb_kvstore_async_worker, "kvstore",
+                                       NULL, MTB_KVSTORE_ASYNC_THREAD_STACK_SIZE,
+                                       MTB_KVSTORE_ASYNC_THREAD_PRIORITY, obj);
+        queue->running = (result == CY_RSLT_SUCCESS);
+    }
+    if ((result == CY_RSLT_SUCCESS) && (queue->count == MTB_KVSTORE_ASYNC_QUEUE_DEPTH))
+    {
+        result = MTB_KVSTORE_QUEUE_FULL_ERROR;
+    }
+    if (result == CY_RSLT_SUCCESS)
+    {
+        queue->entries[(queue->head + queue->count) % MTB_KVSTORE_ASYNC_QUEUE_DEPTH] = entry;
+        queue->count++;
+    }
+    _mtb_kvstore_queue_unlock(obj);
 
-    // Calculate write size
-    uint32_t record_address = area_address + offset;
-    size_t header_size = sizeof(_mtb_kvstore_record_header_t);
-    uint32_t prog_size = obj->bd->program_size(obj->bd->context, record_address);
+    if (result == CY_RSLT_SUCCESS)
+    {
+        result = cy_rtos_set_semaphore(&queue->work_sem, false);
+        CY_ASSERT(result == CY_RSLT_SUCCESS);
+    }
+    else
+    {
+        free(entry);
+    }
+    return result;
+    #else // if defined(MTB_KVSTORE_RTOS_AWARE)
+    // Without a worker thread the write is performed right away.
+    cy_rslt_t result = mtb_kvstore_write(obj, key, data, size);
+    if (callback != NULL)
+    {
+        callback(context, key, result);
+    }
+    return result;
+    #endif // if defined(MTB_KVSTORE_RTOS_AWARE)
+}
 
-    // Ensure that the buffer is large enough
-    CY_ASSERT(obj->transaction_buffer_size >= header_size);
-    // Check that the address written to is aligned to program page boundary
-    CY_ASSERT(_mtb_kvstore_is_aligned(area_address, prog_size));
-    // The following transactions assume that the buffer size is aligned to the program
-    // size. We do that in init but just to make sure we check it below.
-    CY_ASSERT((obj->transaction_buffer_size % prog_size) == 0);
 
-    // Setup the area header.
-    _mtb_kvstore_record_header_t record_header;
-    _mtb_kvstore_setup_record_header(key, data, data_size,
-                                     _MTB_KVSTORE_FORMAT_VERSION,
-                                     operation,
-                                     &record_header);
+//--------------------------------------------------------------------------------------------------
+// mtb_kvstore_flush_queue
+//--------------------------------------------------------------------------------------------------
+cy_rslt_t mtb_kvstore_flush_queue(mtb_kvstore_t* obj)
+{
+    #if defined(MTB_KVSTORE_RTOS_AWARE)
+    mtb_kvstore_async_queue_t* queue = &obj->async_queue;
+    while (true)
+    {
+        // The barrier also covers the completion callback of the last write.
+        _mtb_kvstore_queue_lock(obj);
+        bool drained = (queue->count == 0) && !queue->busy;
+        _mtb_kvstore_queue_unlock(obj);
+        if (drained)
+        {
+            break;
+        }
 
-    // Check that total size does not exceed size of area.
-    uint32_t record_size = _mtb_kvstore_get_record_size(obj, record_address,
-                                                        record_header.key_size,
-                                                        record_header.data_size);
-    CY_ASSERT((offset + record_size) <= _MTB_KVSTORE_AREA_SIZE(obj));
-    CY_UNUSED_PARAMETER(prog_size);
-    CY_UNUSED_PARAMETER(record_size);
+        // Other threads may consume the completion signal, so time out and check again.
+        (void)cy_rtos_get_semaphore(&queue->done_sem, MTB_KVSTORE_MUTEX_TIMEOUT_MS, false);
+    }
+    #else
+    CY_UNUSED_PARAMETER(obj);
+    #endif
+    return CY_RSLT_SUCCESS;
+}
 
-    uint32_t buffer_space_left = obj->transaction_buffer_size;
-    result = _mtb_kvstore_buffered_write(obj, (uint8_t*)&record_header, header_size,
-                                         &record_address,
-                                         &buffer_space_left, false);
-    if (result != CY_RSLT_SUCCESS)
+
+//--------------------------------------------------------------------------------------------------
+// mtb_kvstore_key_exists
+//--------------------------------------------------------------------------------------------------
+cy_rslt_t mtb_kvstore_key_exists(mtb_kvstore_t* obj, const char* key)
+{
+    if (!_mtb_kvstore_is_valid_key(key))
     {
-        return result;
+        return MTB_KVSTORE_BAD_PARAM_ERROR;
     }
 
-    result = _mtb_kvstore_buffered_write(obj, (uint8_t*)key, record_header.key_size,
-                                         &record_address, &buffer_space_left, false);
-    if (result != CY_RSLT_SUCCESS)
+    cy_rslt_t result;
+    if (_mtb_kvstore_read_lock_free(obj, key, NULL, NULL, 0, false, &result))
     {
         return result;
     }
 
-    result = _mtb_kvstore_buffered_write(obj, data, record_header.data_size, &record_address,
-                                         &buffer_space_left, true);
+    result = _mtb_kvstore_lock_shared(obj);
     if (result != CY_RSLT_SUCCESS)
     {
         return result;
     }
 
-    if (offset != _MTB_KVSTORE_AREA_HEADER_OFFSET)
+    if (_mtb_kvstore_async_find(obj, key) == NULL)
     {
-        CY_ASSERT((ram_tbl_info != NULL) && (size_info != NULL));
-        // If we wrote the record successfully then update the ram table and consumed size
-        _mtb_kvstore_update_ram_table(obj, operation, ram_tbl_info);
-        _mtb_kvstore_update_consumed_size(obj, operation, size_info);
+        uint32_t ram_tbl_idx;
+        uint16_t hash;
+        result = _mtb_kvstore_find_record_in_ram_table(obj, key, &ram_tbl_idx, &hash, NULL);
     }
 
+    _mtb_kvstore_unlock_shared(obj);
     return result;
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// _mtb_kvstore_check_area_valid
+// mtb_kvstore_value_size
 //--------------------------------------------------------------------------------------------------
-static cy_rslt_t _mtb_kvstore_check_area_valid(mtb_kvstore_t* obj, uint32_t area_address,
-                                               uint16_t* version)
+cy_rslt_t mtb_kvstore_value_size(mtb_kvstore_t* obj, const char* key, uint32_t* size)
 {
-    CY_ASSERT(obj != NULL);
-    _mtb_kvstore_record_header_t header;
-    _mtb_kvstore_area_record_data_t area_header_data;
-    uint32_t data_size = sizeof(_mtb_kvstore_area_record_data_t);
-    cy_rslt_t result = _mtb_kvstore_read_record(obj, area_address, 0, &header,
-                                                _mtb_kvstore_area_rec_key, true,
-                                                (uint8_t*)&area_header_data, &data_size);
-    if (result == CY_RSLT_SUCCESS)
+    if (!_mtb_kvstore_is_valid_key(key))
     {
-        *version = area_header_data.version;
+        return MTB_KVSTORE_BAD_PARAM_ERROR;
     }
-    return result;
-}
 
+    cy_rslt_t result;
+    if (_mtb_kvstore_read_lock_free(obj, key, NULL, size, 0, false, &result))
+    {
+        return result;
+    }
 
-//--------------------------------------------------------------------------------------------------
-// _mtb_kvstore_write_area_record
-//--------------------------------------------------------------------------------------------------
-static cy_rslt_t _mtb_kvstore_write_area_record(mtb_kvstore_t* obj, uint32_t area_address,
-                                                uint32_t area_version)
-{
-    CY_ASSERT(obj != NULL);
+    result = _mtb_kvstore_lock_shared(obj);
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
 
-    _mtb_kvstore_area_record_data_t area_header_data;
-    area_header_data.format_version = _MTB_KVSTORE_FORMAT_VERSION;
-    area_header_data.version = area_version;
+    const mtb_kvstore_async_entry_t* pending = _mtb_kvstore_async_find(obj, key);
+    if (pending != NULL)
+    {
+        *size = pending->size;
+        _mtb_kvstore_unlock_shared(obj);
+        return result;
+    }
 
-    return _mtb_kvstore_write_record(obj, area_address, _MTB_KVSTORE_AREA_HEADER_OFFSET,
-                                     _mtb_kvstore_area_rec_key, (uint8_t*)&area_header_data,
-                                     sizeof(_mtb_kvstore_area_record_data_t),
-                                     _MTB_KVSTORE_OPER_ADD, NULL, NULL);
+    uint32_t ram_tbl_idx;
+    uint16_t hash;
+    result = _mtb_kvstore_find_record_in_ram_table(obj, key, &ram_tbl_idx, &hash, NULL);
+    if (result == CY_RSLT_SUCCESS)
+    {
+        result = _mtb_kvstore_read_value(obj, ram_tbl_idx, key, NULL, size);
+    }
+
+    _mtb_kvstore_unlock_shared(obj);
+    return result;
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// _mtb_kvstore_find_record_in_ram_table
+// mtb_kvstore_read
 //--------------------------------------------------------------------------------------------------
-static cy_rslt_t _mtb_kvstore_find_record_in_ram_table(mtb_kvstore_t* obj, const char* key,
-                                                       uint32_t* ram_table_idx, uint16_t* key_hash,
-                                                       uint32_t* data_size)
+cy_rslt_t mtb_kvstore_read(mtb_kvstore_t* obj, const char* key, uint8_t* data,
+                           uint32_t* size)
 {
-    CY_ASSERT(obj != NULL);
-    cy_rslt_t result = MTB_KVSTORE_ITEM_NOT_FOUND_ERROR;
+    if (!_mtb_kvstore_is_valid_key(key))
+    {
+        return MTB_KVSTORE_BAD_PARAM_ERROR;
+    }
 
-    *key_hash = _mtb_kvstore_crc16((uint8_t*)key, strlen(key), _MTB_KVSTORE_CRC_INIT_VAL);
+    // If data buffer is passed but size is NULL or 0
+    if ((data != NULL) && ((size == NULL) || (*size == 0)))
+    {
+        return MTB_KVSTORE_BAD_PARAM_ERROR;
+    }
 
-    for (*ram_table_idx = 0; *ram_table_idx < obj->num_entries; (*ram_table_idx)++)
+    uint32_t data_size = (size == NULL) ? 0UL : *size;
+    cy_rslt_t result;
+    // Cached values are looked up with the lock held.
+    if ((obj->config.cache_size != 0) ||
+        !_mtb_kvstore_read_lock_free(obj, key, data, size, 0, false, &result))
     {
-        mtb_kvstore_ram_table_entry_t entry = obj->ram_table[*ram_table_idx];
-        if (*key_hash < entry.hash)
+        result = _mtb_kvstore_lock_shared(obj);
+        if (result != CY_RSLT_SUCCESS)
         {
-            continue;
+            return result;
         }
 
-        if (*key_hash > entry.hash)
+        const mtb_kvstore_async_entry_t* pending = _mtb_kvstore_async_find(obj, key);
+        if (pending != NULL)
         {
-            result = MTB_KVSTORE_ITEM_NOT_FOUND_ERROR;
-            break;
+            result = _mtb_kvstore_read_ram_value(pending->data, pending->size, data, size);
         }
-
-        _mtb_kvstore_record_header_t header;
-        result = _mtb_kvstore_read_record(obj, obj->active_area_addr, entry.offset, &header, key,
-                                          true, NULL, data_size);
-        // If there was a key mismatch then keep searching.
-        if (result != MTB_KVSTORE_ITEM_NOT_FOUND_ERROR)
+        else if (!_mtb_kvstore_cache_read(obj, key, data, size, 0, false, &result))
         {
-            break;
+            uint32_t ram_tbl_idx;
+            uint16_t hash;
+            result = _mtb_kvstore_find_record_in_ram_table(obj, key, &ram_tbl_idx, &hash, NULL);
+            if (result == CY_RSLT_SUCCESS)
+            {
+                result = _mtb_kvstore_read_value(obj, ram_tbl_idx, key, data, size);
+            }
+            if ((result == CY_RSLT_SUCCESS) && (data != NULL) &&
+                !_mtb_kvstore_is_inline(&obj->ram_table[ram_tbl_idx]))
+            {
+                // A value that does not fit into the cache is simply not cached.
+                (void)_mtb_kvstore_cache_fill(obj, key, hash,
+                                              obj->ram_table[ram_tbl_idx].generation, data, *size,
+                                              false);
+            }
         }
+
+        _mtb_kvstore_unlock_shared(obj);
+    }
+
+    // Fill excess buffer space with 0's
+    if ((result == CY_RSLT_SUCCESS) && (data != NULL) && (*size < data_size))
+    {
+        // memset with size 0 is well defined (no effect)
+        (void)memset(&(data[*size]), 0, (data_size - *size));
     }
 
     return result;
@@ -973,709 +7399,593 @@ static cy_rslt_t _mtb_kvstore_find_record_in_ram_table(mtb_kvstore_t* obj, const
 
 
 //--------------------------------------------------------------------------------------------------
-// _mtb_kvstore_copy_record
+// mtb_kvstore_read_versioned
 //--------------------------------------------------------------------------------------------------
-static cy_rslt_t _mtb_kvstore_copy_record(mtb_kvstore_t* obj,
-                                          uint32_t src_area_addr,
-                                          uint32_t src_offset,
-                                          uint32_t dst_area_addr,
-                                          uint32_t dst_offset,
-                                          uint32_t* next_dst_offset)
+cy_rslt_t mtb_kvstore_read_versioned(mtb_kvstore_t* obj, const char* key, uint8_t* data,
+                                     uint32_t* size, uint32_t* version)
 {
-    CY_ASSERT(obj != NULL);
-    cy_rslt_t result = CY_RSLT_SUCCESS;
+    if (!_mtb_kvstore_is_valid_key(key) || (version == NULL))
+    {
+        return MTB_KVSTORE_BAD_PARAM_ERROR;
+    }
 
-    uint32_t src_record_addr = src_area_addr + src_offset;
-    uint32_t dst_record_addr = dst_area_addr + dst_offset;
+    // If data buffer is passed but size is NULL or 0
+    if ((data != NULL) && ((size == NULL) || (*size == 0)))
+    {
+        return MTB_KVSTORE_BAD_PARAM_ERROR;
+    }
 
-    _mtb_kvstore_record_header_t header;
-    uint32_t header_size = sizeof(_mtb_kvstore_record_header_t);
-    // Read header for the record
-    result = obj->bd->read(obj->bd->context, src_record_addr, header_size, (uint8_t*)&header);
+    // Versions are only assigned to values that reached the storage.
+    cy_rslt_t result = mtb_kvstore_flush_queue(obj);
     if (result != CY_RSLT_SUCCESS)
     {
         return result;
     }
 
-    uint32_t record_size = _mtb_kvstore_get_record_size(obj, src_record_addr, header.key_size,
-                                                        header.data_size);
-    if ((dst_offset + record_size) > (_MTB_KVSTORE_AREA_SIZE(obj)))
+    result = _mtb_kvstore_lock_shared(obj);
+    if (result != CY_RSLT_SUCCESS)
     {
-        return MTB_KVSTORE_STORAGE_FULL_ERROR;
+        return result;
     }
 
-    uint32_t remaining_size = record_size;
-    uint32_t read_addr = src_record_addr;
-    uint32_t write_addr = dst_record_addr;
-
-    while (remaining_size > 0)
+    *version = MTB_KVSTORE_VERSION_NONE;
+    uint32_t ram_tbl_idx;
+    uint16_t hash;
+    result = _mtb_kvstore_find_record_in_ram_table(obj, key, &ram_tbl_idx, &hash, NULL);
+    if (result == CY_RSLT_SUCCESS)
     {
-        uint32_t transfer_size =
-            (obj->transaction_buffer_size >=
-             remaining_size) ? remaining_size : obj->transaction_buffer_size;
-        result = obj->bd->read(obj->bd->context, read_addr, transfer_size, obj->transaction_buffer);
-        if (result != CY_RSLT_SUCCESS)
-        {
-            return result;
-        }
+        uint32_t data_size = (size == NULL) ? 0UL : *size;
 
-        result = obj->bd->program(obj->bd->context, write_addr, transfer_size,
-                                  obj->transaction_buffer);
-        if (result != CY_RSLT_SUCCESS)
+        *version = obj->ram_table[ram_tbl_idx].generation;
+        result = _mtb_kvstore_read_value(obj, ram_tbl_idx, key, data, size);
+
+        // Fill excess buffer space with 0's
+        if ((data != NULL) && (*size < data_size))
         {
-            return result;
+            (void)memset(&(data[*size]), 0, (data_size - *size));
         }
-        remaining_size -= transfer_size;
-        read_addr += transfer_size;
-        write_addr += transfer_size;
     }
 
-    *next_dst_offset = dst_offset + record_size;
+    _mtb_kvstore_unlock_shared(obj);
 
     return result;
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// _mtb_kvstore_garbage_collection
+// mtb_kvstore_read_partial
 //--------------------------------------------------------------------------------------------------
-static cy_rslt_t _mtb_kvstore_garbage_collection(mtb_kvstore_t* obj,
-                                                 const _mtb_kvstore_record_info_t* record_info)
+cy_rslt_t mtb_kvstore_read_partial(mtb_kvstore_t* obj, const char* key, uint8_t* data,
+                                   uint32_t* size, const uint32_t offset_bytes)
 {
-    CY_ASSERT(obj != NULL);
-    cy_rslt_t result = CY_RSLT_SUCCESS;
-
-    // If we need to update a record then that the new size fits the space remaining space.
-    // Otherwise return area full error before copying over. We can do this because we track
-    // the actual consumed size so we use that to check if there is enough space to accommodate
-    // the updated record.
-    if ((record_info != NULL) && (record_info->update_rec_info != NULL))
+    if (!_mtb_kvstore_is_valid_key(key))
     {
-        // Note that the consumed size is not yet updated so we need to subtract the old record size
-        // while checking for space left.
-        uint32_t total_size = obj->consumed_size - record_info->consumed_size_info.old_record_size +
-                              record_info->consumed_size_info.new_record_size;
-        if (total_size > _MTB_KVSTORE_AREA_SIZE(obj))
-        {
-            return MTB_KVSTORE_STORAGE_FULL_ERROR;
-        }
+        return MTB_KVSTORE_BAD_PARAM_ERROR;
     }
 
-    /* Erase the GC area */
-    result = _mtb_kvstore_erase_area(obj, obj->gc_area_addr);
-    if (result != CY_RSLT_SUCCESS)
+    // If data buffer is passed but size is NULL or 0;
+    if ((data != NULL) && ((size == NULL) || (*size == 0U)))
     {
-        return result;
+        return MTB_KVSTORE_BAD_PARAM_ERROR;
     }
 
-    uint32_t dst_offset = _mtb_kvstore_get_area_header_record_size(obj, obj->gc_area_addr);
-    for (uint32_t idx = 0; idx < obj->num_entries; idx++)
+    uint32_t data_size = (size == NULL) ? 0UL : *size;
+    cy_rslt_t result;
+    if ((obj->config.cache_size != 0) ||
+        !_mtb_kvstore_read_lock_free(obj, key, data, size, offset_bytes, true, &result))
     {
-        if ((record_info != NULL) && (idx == record_info->ram_tbl_idx))
+        result = _mtb_kvstore_lock_shared(obj);
+        if (result != CY_RSLT_SUCCESS)
         {
-            continue;
+            return result;
         }
 
-        uint32_t dst_next_offset;
-        uint32_t src_offset = obj->ram_table[idx].offset;
-        result = _mtb_kvstore_copy_record(obj, obj->active_area_addr, src_offset, obj->gc_area_addr,
-                                          dst_offset, &dst_next_offset);
-        if (result != CY_RSLT_SUCCESS)
+        // Partial reads are served from the cache but do not fill it.
+        const mtb_kvstore_async_entry_t* pending = _mtb_kvstore_async_find(obj, key);
+        if (pending != NULL)
         {
-            return result;
+            result = _mtb_kvstore_read_partial_ram_value(pending->data, pending->size, data, size,
+                                                         offset_bytes);
+        }
+        else if (!_mtb_kvstore_cache_read(obj, key, data, size, offset_bytes, true, &result))
+        {
+            uint32_t ram_tbl_idx;
+            uint16_t hash;
+            result = _mtb_kvstore_find_record_in_ram_table(obj, key, &ram_tbl_idx, &hash, NULL);
+            if (result == CY_RSLT_SUCCESS)
+            {
+                result = _mtb_kvstore_read_partial_value(obj, ram_tbl_idx, key, data, size,
+                                                         offset_bytes);
+            }
         }
 
-        obj->ram_table[idx].offset = dst_offset;
-        dst_offset = dst_next_offset;
+        _mtb_kvstore_unlock_shared(obj);
     }
 
-    // We need to inject a record or delete a record in the case where there may not be enough space
-    // to add a new record for an update or delete operation.
-    if (record_info != NULL)
+    if (result != CY_RSLT_SUCCESS)
     {
-        if (record_info->update_rec_info != NULL)
-        {
-            _mtb_kvstore_update_ram_table_info_t ram_tbl_info =
-            {
-                .ram_tbl_idx  = record_info->ram_tbl_idx,
-                .entry.hash   = record_info->update_rec_info->key_hash,
-                .entry.offset = dst_offset
-            };
-
-            result = _mtb_kvstore_write_record(obj, obj->gc_area_addr, dst_offset,
-                                               record_info->update_rec_info->key,
-                                               record_info->update_rec_info->data,
-                                               record_info->update_rec_info->data_size,
-                                               _MTB_KVSTORE_OPER_UPDATE,
-                                               &ram_tbl_info, &record_info->consumed_size_info);
-            if (result != CY_RSLT_SUCCESS)
-            {
-                return result;
-            }
+        return result;
+    }
+
+    // Fill excess buffer space with 0's
+    if ((data != NULL) && ((*size - offset_bytes) < data_size))
+    {
+        // memset with size 0 is well defined (no effect)
+        (void)memset(&(data[*size - offset_bytes]), 0, (data_size - (*size - offset_bytes)));
+    }
 
-            dst_offset += record_info->consumed_size_info.new_record_size;
+    // Inform caller if the full value could not fit in buffer & indicate how many bytes were
+    // copied over
+    if (data != NULL)
+    {
+        if ((*size - offset_bytes) > data_size)
+        {
+            result = MTB_KVSTORE_BUFFER_TOO_SMALL;
+            *size = data_size;
         }
         else
         {
-            _mtb_kvstore_update_ram_table_info_t ram_tbl_info =
-            {
-                .ram_tbl_idx  = record_info->ram_tbl_idx,
-                .entry.hash   = 0,
-                .entry.offset = 0
-            };
-            _mtb_kvstore_update_ram_table(obj, _MTB_KVSTORE_OPER_DELETE, &ram_tbl_info);
-            _mtb_kvstore_update_consumed_size(obj, _MTB_KVSTORE_OPER_DELETE,
-                                              &record_info->consumed_size_info);
+            *size = *size - offset_bytes;
         }
     }
 
-    obj->active_area_version++;
-    result = _mtb_kvstore_write_area_record(obj, obj->gc_area_addr, obj->active_area_version);
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// mtb_kvstore_delete
+//--------------------------------------------------------------------------------------------------
+cy_rslt_t mtb_kvstore_delete(mtb_kvstore_t* obj, const char* key)
+{
+    cy_rslt_t result = mtb_kvstore_flush_queue(obj);
     if (result != CY_RSLT_SUCCESS)
     {
         return result;
     }
 
-    obj->free_space_offset = dst_offset;
+    result = _mtb_kvstore_lock(obj);
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
 
-    uint32_t new_gc_area_addr = obj->active_area_addr;
-    obj->active_area_addr = obj->gc_area_addr;
-    obj->gc_area_addr = new_gc_area_addr;
+    result = _mtb_kvstore_write_with_flags(obj, key, NULL, 0, true, 0, _MTB_KVSTORE_ANY_VERSION);
+
+    _mtb_kvstore_unlock(obj);
 
     return result;
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// _mtb_kvstore_build_ram_table
+// mtb_kvstore_delete_many
 //--------------------------------------------------------------------------------------------------
-static cy_rslt_t _mtb_kvstore_build_ram_table(mtb_kvstore_t* obj)
+cy_rslt_t mtb_kvstore_delete_many(mtb_kvstore_t* obj, const char* const* keys, uint32_t num_keys)
 {
-    CY_ASSERT(obj != NULL);
-    cy_rslt_t result = CY_RSLT_SUCCESS;
-
-    // Each key will occupy at least a page hence the max number of keys
-    // that fit in the space would be area size / page size.
-    obj->num_entries = 0;
-    obj->max_entries = _MTB_KVSTORE_INIT_MAX_KEYS;
-    obj->free_space_offset = _MTB_KVSTORE_AREA_SIZE(obj);
-
-    //We initially allocate ram table for 32 entries
-    obj->ram_table =
-        (mtb_kvstore_ram_table_entry_t*)malloc(obj->max_entries *
-                                               sizeof(mtb_kvstore_ram_table_entry_t));
-    if (NULL == obj->ram_table)
+    if ((keys == NULL) && (num_keys != 0))
     {
-        return MTB_KVSTORE_MEM_ALLOC_ERROR;
+        return MTB_KVSTORE_BAD_PARAM_ERROR;
     }
 
-    // Start looking from the end of the area header.
-    uint32_t record_size = _mtb_kvstore_get_area_header_record_size(obj, obj->active_area_addr);
-    // Add area header size to consumed size.
-    obj->consumed_size = record_size;
-
-    uint32_t offset = record_size;
-    while ((offset + sizeof(_mtb_kvstore_record_header_t)) < obj->free_space_offset)
+    for (uint32_t key_idx = 0; key_idx < num_keys; key_idx++)
     {
-        _mtb_kvstore_record_header_t header;
-        result = _mtb_kvstore_read_record(obj, obj->active_area_addr, offset, &header,
-                                          obj->key_buffer, false, NULL, NULL);
-        if (result != CY_RSLT_SUCCESS)
+        if (!_mtb_kvstore_is_valid_key(keys[key_idx]))
         {
-            if (MTB_KVSTORE_ERASED_DATA_ERROR == result)
-            {
-                // This is a special case since it is expected that we stop populating
-                // the ram table when we encounter free space.
-                // Hence we return success even though read record return an error.
-                result = CY_RSLT_SUCCESS;
-            }
-            else if (MTB_KVSTORE_INVALID_DATA_ERROR == result)
-            {
-                // If a corrupted record was found we run GC operation
-                // which will copy all valid record until the current corrupted
-                // record was encountered.
-                result = _mtb_kvstore_garbage_collection(obj, NULL);
-                // The above function will set the free space offset in the new area
-                // so we directly return the result. The consumed size
-                // is already updated in this loop and will not change even after the
-                // GC operation.
-                return result;
-            }
-            break;
+            return MTB_KVSTORE_BAD_PARAM_ERROR;
         }
+    }
 
-        // This should be safe as we allocate 1 extra byte in the key buffer than the max key size.
-        obj->key_buffer[header.key_size] = '\0';
-
-        uint32_t ram_tbl_idx;
-        uint16_t hash;
-        uint32_t old_record_data_size = 0;
-        result = _mtb_kvstore_find_record_in_ram_table(obj, obj->key_buffer, &ram_tbl_idx, &hash,
-                                                       &old_record_data_size);
-        if ((result != CY_RSLT_SUCCESS) && (result != MTB_KVSTORE_ITEM_NOT_FOUND_ERROR))
-        {
-            break;
-        }
+    cy_rslt_t result = mtb_kvstore_flush_queue(obj);
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
 
-        uint32_t curr_offset = offset;
-        // Add the current record size to the offset to set the next offset.
-        record_size = _mtb_kvstore_get_record_size(obj, obj->active_area_addr + curr_offset,
-                                                   header.key_size, header.data_size);
-        offset += record_size;
+    result = _mtb_kvstore_lock(obj);
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
+    }
 
-        bool delete = (header.flags & _MTB_KVSTORE_DELETE_FLAG) != 0;
-        bool found_in_table = (result != MTB_KVSTORE_ITEM_NOT_FOUND_ERROR);
+    bool* marked = (obj->num_entries > 0) ? (bool*)calloc(obj->num_entries, sizeof(bool)) : NULL;
+    if ((marked == NULL) && (obj->num_entries > 0))
+    {
+        result = MTB_KVSTORE_MEM_ALLOC_ERROR;
+    }
 
-        // If key was not found in the RAM table and is marked for deletion
-        // then do nothing.
-        if (delete && !found_in_table)
+    bool any_marked = false;
+    for (uint32_t key_idx = 0; (key_idx < num_keys) && (result == CY_RSLT_SUCCESS); key_idx++)
+    {
+        uint32_t ram_tbl_idx;
+        uint16_t hash;
+        result = _mtb_kvstore_find_record_in_ram_table(obj, keys[key_idx], &ram_tbl_idx, &hash,
+                                                       NULL);
+        if (result == CY_RSLT_SUCCESS)
         {
-            continue;
+            marked[ram_tbl_idx] = true;
+            any_marked = true;
         }
-
-        _mtb_kvstore_operation_t operation = (delete)
-                                            ? _MTB_KVSTORE_OPER_DELETE
-                                            : (found_in_table) ? _MTB_KVSTORE_OPER_UPDATE :
-                                             _MTB_KVSTORE_OPER_ADD;
-
-        // If we have to add an entry to the ram table then check
-        // if we need to increment keys.
-        if ((operation == _MTB_KVSTORE_OPER_ADD) && (obj->num_entries >= obj->max_entries))
+        else if (result == MTB_KVSTORE_ITEM_NOT_FOUND_ERROR)
         {
-            result = _mtb_kvstore_increment_max_keys(obj);
-            if (result != CY_RSLT_SUCCESS)
-            {
-                break;
-            }
+            // Same as mtb_kvstore_delete, keys that do not exist are not an error.
+            result = CY_RSLT_SUCCESS;
         }
+    }
 
-        _mtb_kvstore_update_ram_table_info_t ram_tbl_info =
-        {
-            .ram_tbl_idx  = ram_tbl_idx,
-            .entry.hash   = hash,
-            .entry.offset = curr_offset
-        };
-        _mtb_kvstore_update_ram_table(obj, operation, &ram_tbl_info);
-
-        uint32_t old_record_size = (operation == _MTB_KVSTORE_OPER_ADD)
-                                ? 0
-                                : _mtb_kvstore_get_record_size(obj, obj->active_area_addr, strlen(
-                                                                   obj->key_buffer),
-                                                               old_record_data_size);
-        _mtb_kvstore_update_consumed_size_info_t size_info =
-        {
-            .old_record_size = old_record_size,
-            .new_record_size = record_size
-        };
-        _mtb_kvstore_update_consumed_size(obj, operation, &size_info);
-
-
-        result = CY_RSLT_SUCCESS;
+    if ((result == CY_RSLT_SUCCESS) && any_marked)
+    {
+        result = _mtb_kvstore_delete_marked(obj, marked);
     }
 
-    obj->free_space_offset = offset;
+    free(marked);
+    _mtb_kvstore_unlock(obj);
 
     return result;
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// _mtb_kvstore_setup_areas
+// mtb_kvstore_delete_prefix
 //--------------------------------------------------------------------------------------------------
-static cy_rslt_t _mtb_kvstore_setup_areas(mtb_kvstore_t* obj)
+cy_rslt_t mtb_kvstore_delete_prefix(mtb_kvstore_t* obj, const char* prefix)
 {
-    CY_ASSERT(obj != NULL);
-    cy_rslt_t result = CY_RSLT_SUCCESS;
-
-    // Divide the space into 2 equal sizes.
-    uint32_t area1_start_addr = obj->start_addr;
-    uint32_t area2_start_addr = obj->start_addr + _MTB_KVSTORE_AREA_SIZE(obj);
-
-    bool area1_valid;
-    bool area2_valid;
-    uint16_t area1_version;
-    uint16_t area2_version;
-
-    // Read area 1 header
-    cy_rslt_t area_valid_result = _mtb_kvstore_check_area_valid(obj, area1_start_addr,
-                                                                &area1_version);
-    if ((CY_RSLT_SUCCESS != area_valid_result) &&
-        (MTB_KVSTORE_ERASED_DATA_ERROR != area_valid_result) &&
-        (MTB_KVSTORE_INVALID_DATA_ERROR != area_valid_result) &&
-        (MTB_KVSTORE_ITEM_NOT_FOUND_ERROR != area_valid_result))
-    {
-        return area_valid_result;
-    }
-    area1_valid = (CY_RSLT_SUCCESS == area_valid_result);
-
-    area_valid_result = _mtb_kvstore_check_area_valid(obj, area2_start_addr, &area2_version);
-    if ((CY_RSLT_SUCCESS != area_valid_result) &&
-        (MTB_KVSTORE_ERASED_DATA_ERROR != area_valid_result) &&
-        (MTB_KVSTORE_INVALID_DATA_ERROR != area_valid_result) &&
-        (MTB_KVSTORE_ITEM_NOT_FOUND_ERROR != area_valid_result))
+    if ((prefix == NULL) || (strlen(prefix) >= MTB_KVSTORE_MAX_KEY_SIZE))
     {
-        return area_valid_result;
+        return MTB_KVSTORE_BAD_PARAM_ERROR;
     }
-    area2_valid = (CY_RSLT_SUCCESS == area_valid_result);
-
-    // If both are valid, set the one area whose master record has the
-    // higher version as active_area. Erase first sector of the other one.
-    if (area1_valid && area2_valid)
-    {
-        // The versions should never be equal.
-        CY_ASSERT(area1_version != area2_version);
-
-        // Check if the area1 version is greater or 0 in case of wrap around.
-        if ((area1_version > area2_version) || (area1_version == 0))
-        {
-            obj->active_area_addr = area1_start_addr;
-            obj->active_area_version = area1_version;
-            obj->gc_area_addr = area2_start_addr;
-        }
-        else
-        {
-            obj->active_area_addr = area2_start_addr;
-            obj->active_area_version = area2_version;
-            obj->gc_area_addr = area1_start_addr;
-        }
+
+    cy_rslt_t result = mtb_kvstore_flush_queue(obj);
+    if (result != CY_RSLT_SUCCESS)
+    {
+        return result;
     }
-    // If one is valid, set its area as active_area.
-    else if (area1_valid)
+
+    result = _mtb_kvstore_lock(obj);
+    if (result != CY_RSLT_SUCCESS)
     {
-        obj->active_area_addr = area1_start_addr;
-        obj->active_area_version = area1_version;
-        obj->gc_area_addr = area2_start_addr;
+        return result;
     }
-    else if (area2_valid)
+
+    bool* marked = (obj->num_entries > 0) ? (bool*)calloc(obj->num_entries, sizeof(bool)) : NULL;
+    if ((marked == NULL) && (obj->num_entries > 0))
     {
-        obj->active_area_addr = area2_start_addr;
-        obj->active_area_version = area2_version;
-        obj->gc_area_addr = area1_start_addr;
+        result = MTB_KVSTORE_MEM_ALLOC_ERROR;
     }
-    // If none are valid, set area1 as active_area, and program area record
-    //with version 1.
-    else
+
+    bool any_marked = false;
+    size_t prefix_size = strlen(prefix);
+    for (uint32_t idx = 0; (idx < obj->num_entries) && (result == CY_RSLT_SUCCESS); idx++)
     {
-        // Erase first sector of area 1 to be able to write the header.
-        result = _mtb_kvstore_erase_area(obj, area1_start_addr);
-        if (result != CY_RSLT_SUCCESS)
+        _mtb_kvstore_record_header_t header;
+        result = _mtb_kvstore_read_record_key(obj, obj->ram_table[idx].offset, &header,
+                                              obj->key_buffer);
+        if ((result == CY_RSLT_SUCCESS) && (strncmp(obj->key_buffer, prefix, prefix_size) == 0))
         {
-            return result;
+            marked[idx] = true;
+            any_marked = true;
         }
+    }
 
-        // Write the area header into the area 1.
-        result = _mtb_kvstore_write_area_record(obj, area1_start_addr,
-                                                _MTB_KVSTORE_INITIAL_AREA_VERSION);
-        if (result != CY_RSLT_SUCCESS)
-        {
-            return result;
-        }
-        obj->active_area_addr = area1_start_addr;
-        obj->active_area_version = _MTB_KVSTORE_INITIAL_AREA_VERSION;
-        obj->gc_area_addr = area2_start_addr;
+    if ((result == CY_RSLT_SUCCESS) && any_marked)
+    {
+        result = _mtb_kvstore_delete_marked(obj, marked);
     }
 
+    free(marked);
+    _mtb_kvstore_unlock(obj);
+
     return result;
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// _mtb_kvstore_write_with_flags
+// mtb_kvstore_reset
 //--------------------------------------------------------------------------------------------------
-static cy_rslt_t _mtb_kvstore_write_with_flags(mtb_kvstore_t* obj, const char* key,
-                                               const uint8_t* data,
-                                               uint32_t size, bool delete)
+cy_rslt_t mtb_kvstore_reset(mtb_kvstore_t* obj)
 {
-    CY_ASSERT(obj != NULL);
-    cy_rslt_t result = CY_RSLT_SUCCESS;
-
-    uint32_t ram_tbl_idx;
-    uint16_t hash;
-    uint32_t old_record_data_size = 0;
-    result = _mtb_kvstore_find_record_in_ram_table(obj, key, &ram_tbl_idx, &hash,
-                                                   &old_record_data_size);
-    if ((result != CY_RSLT_SUCCESS) && (result != MTB_KVSTORE_ITEM_NOT_FOUND_ERROR))
+    cy_rslt_t result = mtb_kvstore_flush_queue(obj);
+    if (result != CY_RSLT_SUCCESS)
     {
         return result;
     }
 
-    bool found_in_table = (result != MTB_KVSTORE_ITEM_NOT_FOUND_ERROR);
-
-    // If we are trying to delete a record and it is not found in the RAM table then it
-    // is already been removed or does not exist. Hence we return success.
-    if (delete && !found_in_table)
+    result = _mtb_kvstore_lock(obj);
+    if (result != CY_RSLT_SUCCESS)
     {
-        return CY_RSLT_SUCCESS;
+        return result;
     }
 
-    _mtb_kvstore_operation_t operation = (delete)
-                                        ? _MTB_KVSTORE_OPER_DELETE
-                                        : (found_in_table) ? _MTB_KVSTORE_OPER_UPDATE :
-                                         _MTB_KVSTORE_OPER_ADD;
+    // Clear the RAM table, the key dictionary and the blob table
+    _mtb_kvstore_free_inline(obj);
+    _MTB_KVSTORE_PUBLISH(obj->num_entries, 0U);
+    _mtb_kvstore_free_key_dict(obj);
+    _mtb_kvstore_free_blobs(obj);
+    _mtb_kvstore_cache_invalidate(obj, false);
 
-    // We will be adding a new entry if its not found in the table so
-    // check if max keys need to be expanded before we write anything
-    // to flash.
-    if ((operation == _MTB_KVSTORE_OPER_ADD) && (obj->num_entries >= obj->max_entries))
+    // Run GC.
+    result = _mtb_kvstore_garbage_collection(obj, NULL);
+    if (result == CY_RSLT_SUCCESS)
     {
-        result = _mtb_kvstore_increment_max_keys(obj);
-        if (result != CY_RSLT_SUCCESS)
-        {
-            return result;
-        }
+        obj->consumed_size = obj->free_space_offset;
     }
 
-    // Check if space enough for KV record. If not run GC
-    uint32_t record_size = _mtb_kvstore_get_record_size(obj, obj->active_area_addr, strlen(
-                                                            key), size);
-    uint32_t old_record_size = (operation == _MTB_KVSTORE_OPER_ADD)
-                                ? 0
-                                : _mtb_kvstore_get_record_size(obj, obj->active_area_addr,
-                                                               strlen(key),
-                                                               old_record_data_size);
+    _mtb_kvstore_unlock(obj);
 
-    if (((operation == _MTB_KVSTORE_OPER_UPDATE) || (operation == _MTB_KVSTORE_OPER_ADD)) &&
-        ((obj->consumed_size - old_record_size + record_size) > _MTB_KVSTORE_AREA_SIZE(obj)))
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// mtb_kvstore_deinit
+//--------------------------------------------------------------------------------------------------
+void mtb_kvstore_deinit(mtb_kvstore_t* obj)
+{
+    _mtb_kvstore_unregister(obj);
+    _mtb_kvstore_async_stop(obj);
+
+    _mtb_kvstore_lock_wait_forever(obj);
+
+    if (obj->transaction_buffer_mem != NULL)
     {
-        return MTB_KVSTORE_STORAGE_FULL_ERROR;
+        free(obj->transaction_buffer_mem);
     }
 
-    if ((obj->free_space_offset + record_size) > _MTB_KVSTORE_AREA_SIZE(obj))
+    if (obj->ram_table != NULL)
     {
-        // If we need to update or delete a key and we do not enough space left. We can do the
-        // update or
-        // deletion when we run garbage collection by removing the value from the ram table before
-        // GC operation
-        // and injecting new updated entry if it is a update operation.
-        _mtb_kvstore_record_info_t record_info;
-        _mtb_kvstore_update_record_info_t update_rec;
+        _mtb_kvstore_free_inline(obj);
+        free(obj->ram_table);
+    }
 
-        if ((operation == _MTB_KVSTORE_OPER_DELETE) || (operation == _MTB_KVSTORE_OPER_UPDATE))
-        {
-            record_info.ram_tbl_idx = ram_tbl_idx;
-            record_info.consumed_size_info.new_record_size = record_size;
-            record_info.consumed_size_info.old_record_size = old_record_size;
-        }
+    _mtb_kvstore_free_key_dict(obj);
+    _mtb_kvstore_free_blobs(obj);
+    _mtb_kvstore_free_retired(obj);
+    _mtb_kvstore_cache_invalidate(obj, true);
 
-        if (operation == _MTB_KVSTORE_OPER_DELETE)
-        {
-            record_info.update_rec_info = NULL;
-        }
-        else if (operation == _MTB_KVSTORE_OPER_UPDATE)
-        {
-            update_rec.key = key;
-            update_rec.data = data;
-            update_rec.data_size = size;
-            update_rec.key_hash = hash;
+    #if defined(MTB_KVSTORE_RTOS_AWARE)
+    cy_mutex_t local_mutex = obj->mtb_kvstore_mutex;
+    #endif
 
-            record_info.update_rec_info = &update_rec;
-        }
+    _mtb_kvstore_unlock(obj);
 
-        result = _mtb_kvstore_garbage_collection(obj,
-                                                 (operation == _MTB_KVSTORE_OPER_ADD)
-                                                  ? NULL
-                                                  : &record_info);
-        if ((result != CY_RSLT_SUCCESS) || found_in_table)
-        {
-            return result;
-        }
-    }
+    #if defined(MTB_KVSTORE_RTOS_AWARE)
+    cy_rslt_t result = cy_rtos_deinit_mutex(&local_mutex);
+    CY_ASSERT(result == CY_RSLT_SUCCESS);
+    result = cy_rtos_deinit_mutex(&obj->modify_mutex);
+    CY_ASSERT(result == CY_RSLT_SUCCESS);
+    result = cy_rtos_deinit_mutex(&obj->readers_mutex);
+    CY_ASSERT(result == CY_RSLT_SUCCESS);
+    result = cy_rtos_deinit_semaphore(&obj->readers_done_sem);
+    CY_ASSERT(result == CY_RSLT_SUCCESS);
+    result = cy_rtos_deinit_mutex(&obj->cache_mutex);
+    CY_ASSERT(result == CY_RSLT_SUCCESS);
+    result = cy_rtos_deinit_mutex(&obj->views_mutex);
+    CY_ASSERT(result == CY_RSLT_SUCCESS);
+    result = cy_rtos_deinit_semaphore(&obj->views_done_sem);
+    CY_ASSERT(result == CY_RSLT_SUCCESS);
+    result = cy_rtos_deinit_mutex(&obj->async_queue.mutex);
+    CY_ASSERT(result == CY_RSLT_SUCCESS);
+    result = cy_rtos_deinit_semaphore(&obj->async_queue.work_sem);
+    CY_ASSERT(result == CY_RSLT_SUCCESS);
+    result = cy_rtos_deinit_semaphore(&obj->async_queue.done_sem);
+    CY_ASSERT(result == CY_RSLT_SUCCESS);
+    CY_UNUSED_PARAMETER(result);
+    #endif
+}
 
-    // We check that we have enough space earlier so when we get here we must
-    // have enough space.
-    CY_ASSERT((obj->free_space_offset + record_size) <= _MTB_KVSTORE_AREA_SIZE(obj));
 
-    _mtb_kvstore_update_ram_table_info_t ram_tbl_info =
+//--------------------------------------------------------------------------------------------------
+// mtb_kvstore_cache_pin
+//--------------------------------------------------------------------------------------------------
+cy_rslt_t mtb_kvstore_cache_pin(mtb_kvstore_t* obj, const char* key)
+{
+    if (!_mtb_kvstore_is_valid_key(key) || (obj->config.cache_size == 0))
     {
-        .ram_tbl_idx  = ram_tbl_idx,
-        .entry.hash   = hash,
-        .entry.offset = obj->free_space_offset
-    };
+        return MTB_KVSTORE_BAD_PARAM_ERROR;
+    }
 
-    _mtb_kvstore_update_consumed_size_info_t size_info =
+    uint32_t size = 0;
+    cy_rslt_t result = mtb_kvstore_value_size(obj, key, &size);
+    if (result != CY_RSLT_SUCCESS)
     {
-        .old_record_size = old_record_size,
-        .new_record_size = record_size
-    };
+        return result;
+    }
 
-    result = _mtb_kvstore_write_record(obj, obj->active_area_addr, obj->free_space_offset,
-                                       key, data, size, operation, &ram_tbl_info,
-                                       &size_info);
+    // Allocate at least one byte so that an empty value can be read as well.
+    uint8_t* value = (uint8_t*)malloc((size == 0) ? 1U : size);
+    if (value == NULL)
+    {
+        return MTB_KVSTORE_MEM_ALLOC_ERROR;
+    }
+
+    // The value is read with its generation, so a write in between leaves a stale entry that is
+    // filled again by the next read.
+    uint32_t generation;
+    uint32_t read_size = (size == 0) ? 1U : size;
+    result = mtb_kvstore_read_versioned(obj, key, value, &read_size, &generation);
     if (result == CY_RSLT_SUCCESS)
     {
-        obj->free_space_offset += record_size;
+        uint16_t hash = _mtb_kvstore_crc16((uint8_t*)key, strlen(key), _MTB_KVSTORE_CRC_INIT_VAL);
+        result = _mtb_kvstore_cache_fill(obj, key, hash, generation, value, read_size, true);
     }
+    free(value);
 
     return result;
 }
 
 
-/**************************************** PUBLIC API ******************************************/
-
 //--------------------------------------------------------------------------------------------------
-// mtb_kvstore_init
+// mtb_kvstore_cache_unpin
 //--------------------------------------------------------------------------------------------------
-cy_rslt_t mtb_kvstore_init(mtb_kvstore_t* obj, uint32_t start_addr, uint32_t length,
-                           const mtb_kvstore_bd_t* block_device)
+void mtb_kvstore_cache_unpin(mtb_kvstore_t* obj, const char* key)
 {
-    if ((NULL == obj) || (NULL == block_device) || (length == 0))
+    if (!_mtb_kvstore_is_valid_key(key) || (obj->config.cache_size == 0))
     {
-        return MTB_KVSTORE_BAD_PARAM_ERROR;
+        return;
     }
 
-    // Check if start addr and start addr + length align with erase sector size
-    uint32_t erase_size = block_device->erase_size(block_device->context, start_addr);
-    if (!_mtb_kvstore_is_aligned(start_addr,
-                                 erase_size) ||
-        !_mtb_kvstore_is_aligned(start_addr + length, erase_size))
+    uint16_t hash = _mtb_kvstore_crc16((uint8_t*)key, strlen(key), _MTB_KVSTORE_CRC_INIT_VAL);
+    _mtb_kvstore_cache_lock(obj);
+    mtb_kvstore_cache_entry_t* entry = _mtb_kvstore_cache_find(obj, key, hash);
+    if (entry != NULL)
     {
-        return MTB_KVSTORE_ALIGNMENT_ERROR;
+        entry->pinned = false;
     }
+    _mtb_kvstore_cache_unlock(obj);
+}
 
-    // Check that the storage does not have 0 sectors and has even number
-    // of erase sectors.
-    uint32_t num_erase_sectors = (length / erase_size);
-    if ((num_erase_sectors == 0) || ((num_erase_sectors > 0) && ((num_erase_sectors & 1) != 0)))
-    {
-        return MTB_KVSTORE_ALIGNMENT_ERROR;
-    }
 
-    cy_rslt_t result = CY_RSLT_SUCCESS;
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_view_area
+//--------------------------------------------------------------------------------------------------
+static uint32_t _mtb_kvstore_view_area(mtb_kvstore_t* obj, const uint8_t* ptr)
+{
+    // The area is told by the address of the view, so that holding and releasing a view always
+    // agree, even for an empty value at the very end of the first area.
+    uintptr_t second_area = (uintptr_t)obj->bd->map(obj->bd->context,
+                                                    obj->start_addr + _MTB_KVSTORE_AREA_SIZE(obj));
+    uintptr_t addr = (uintptr_t)ptr;
+    return ((second_area != 0U) && (addr >= second_area) &&
+            (addr < (second_area + _MTB_KVSTORE_AREA_SIZE(obj)))) ? 1U : 0U;
+}
 
-    memset(obj, 0, sizeof(mtb_kvstore_t));
 
-    // Init Mutex
-    result = _mtb_kvstore_initlock(obj);
+//--------------------------------------------------------------------------------------------------
+// mtb_kvstore_get_view
+//--------------------------------------------------------------------------------------------------
+cy_rslt_t mtb_kvstore_get_view(mtb_kvstore_t* obj, const char* key, const uint8_t** ptr,
+                               uint32_t* size)
+{
+    if (!_mtb_kvstore_is_valid_key(key) || (ptr == NULL) || (size == NULL) ||
+        (obj->bd->map == NULL))
+    {
+        return MTB_KVSTORE_BAD_PARAM_ERROR;
+    }
+
+    // Views can only point to values that reached the storage.
+    cy_rslt_t result = mtb_kvstore_flush_queue(obj);
     if (result != CY_RSLT_SUCCESS)
     {
         return result;
     }
 
-    // Get Mutex
-    result = _mtb_kvstore_lock(obj);
+    result = _mtb_kvstore_lock_shared(obj);
     if (result != CY_RSLT_SUCCESS)
     {
         return result;
     }
 
-    uint32_t prog_size = block_device->program_size(block_device->context, start_addr);
-    uint32_t read_size = block_device->read_size(block_device->context, start_addr);
-    uint32_t buffer_size = (prog_size >= read_size) ? prog_size : read_size;
-    if (buffer_size < _MTB_KVSTORE_MIN_BUFF_SIZE)
+    uint32_t ram_tbl_idx;
+    uint16_t hash;
+    result = _mtb_kvstore_find_record_in_ram_table(obj, key, &ram_tbl_idx, &hash, NULL);
+    if ((result == CY_RSLT_SUCCESS) &&
+        ((obj->ram_table[ram_tbl_idx].flags & _MTB_KVSTORE_VALUE_TYPE_FLAGS) != 0))
     {
-        buffer_size = _mtb_kvstore_align_up(_MTB_KVSTORE_MIN_BUFF_SIZE, prog_size);
+        result = MTB_KVSTORE_BAD_PARAM_ERROR;
     }
 
-    obj->transaction_buffer = (uint8_t*)malloc(buffer_size);
-    if (obj->transaction_buffer != NULL)
+    if (result == CY_RSLT_SUCCESS)
     {
-        obj->transaction_buffer_size = buffer_size;
-        obj->bd = block_device;
-        obj->start_addr = start_addr;
-        obj->length = length;
-
+        // The record is validated once, the caller then reads the value in place.
+        uint32_t record_addr = obj->active_area_addr + obj->ram_table[ram_tbl_idx].offset;
+        _mtb_kvstore_record_header_t header;
+        result = _mtb_kvstore_read_record(obj, obj->active_area_addr,
+                                          obj->ram_table[ram_tbl_idx].offset, &header, key, true,
+                                          NULL, NULL);
         if (result == CY_RSLT_SUCCESS)
         {
-            result = _mtb_kvstore_setup_areas(obj);
-            if (result == CY_RSLT_SUCCESS)
+            const uint8_t* value = obj->bd->map(obj->bd->context, record_addr +
+                                                header.header_size + header.key_size);
+            if (value == NULL)
             {
-                result = _mtb_kvstore_build_ram_table(obj);
+                result = MTB_KVSTORE_BAD_PARAM_ERROR;
+            }
+            else
+            {
+                _mtb_kvstore_hold_view(obj, _mtb_kvstore_view_area(obj, value));
+                *ptr = value;
+                *size = header.data_size;
             }
         }
     }
-    else
-    {
-        /* Not enough heap available to allocate work buffer */
-        result = MTB_KVSTORE_MEM_ALLOC_ERROR;
-    }
-
-    // Release Mutex
-    _mtb_kvstore_unlock(obj);
 
-    if (result != CY_RSLT_SUCCESS)
-    {
-        mtb_kvstore_deinit(obj);
-    }
+    _mtb_kvstore_unlock_shared(obj);
 
     return result;
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// mtb_kvstore_write
+// mtb_kvstore_release_view
 //--------------------------------------------------------------------------------------------------
-cy_rslt_t mtb_kvstore_write(mtb_kvstore_t* obj, const char* key, const uint8_t* data,
-                            uint32_t size)
+void mtb_kvstore_release_view(mtb_kvstore_t* obj, const uint8_t* ptr)
 {
-    if (!_mtb_kvstore_is_valid_key(key) || ((data == NULL) && (size != 0)))
-    {
-        return MTB_KVSTORE_BAD_PARAM_ERROR;
-    }
-
-    cy_rslt_t result = _mtb_kvstore_lock(obj);
-    if (result != CY_RSLT_SUCCESS)
+    if ((ptr != NULL) && (obj->bd->map != NULL))
     {
-        return result;
+        _mtb_kvstore_drop_view(obj, _mtb_kvstore_view_area(obj, ptr));
     }
+}
 
-    result = _mtb_kvstore_write_with_flags(obj, key, data, size, 0);
-
-    _mtb_kvstore_unlock(obj);
 
-    return result;
+//--------------------------------------------------------------------------------------------------
+// mtb_kvstore_size
+//--------------------------------------------------------------------------------------------------
+uint32_t mtb_kvstore_size(mtb_kvstore_t* obj)
+{
+    return obj->consumed_size;
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// mtb_kvstore_key_exists
+// mtb_kvstore_get_stats
 //--------------------------------------------------------------------------------------------------
-cy_rslt_t mtb_kvstore_key_exists(mtb_kvstore_t* obj, const char* key)
+cy_rslt_t mtb_kvstore_get_stats(mtb_kvstore_t* obj, mtb_kvstore_stats_t* stats)
 {
-    if (!_mtb_kvstore_is_valid_key(key))
-    {
-        return MTB_KVSTORE_BAD_PARAM_ERROR;
-    }
+    CY_ASSERT((obj != NULL) && (stats != NULL));
 
-    cy_rslt_t result = _mtb_kvstore_lock(obj);
-    if (result != CY_RSLT_SUCCESS)
+    // Writers count skipped writes with the lock held exclusively, and readers count cache hits
+    // and misses with the cache lock held.
+    cy_rslt_t result = _mtb_kvstore_lock_shared(obj);
+    if (result == CY_RSLT_SUCCESS)
     {
-        return result;
+        _mtb_kvstore_cache_lock(obj);
+        *stats = obj->stats;
+        _mtb_kvstore_cache_unlock(obj);
+        _mtb_kvstore_unlock_shared(obj);
     }
-
-    uint32_t ram_tbl_idx;
-    uint16_t hash;
-    result = _mtb_kvstore_find_record_in_ram_table(obj, key, &ram_tbl_idx, &hash, NULL);
-
-    _mtb_kvstore_unlock(obj);
     return result;
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// mtb_kvstore_value_size
+// mtb_kvstore_ensure_capacity
 //--------------------------------------------------------------------------------------------------
-cy_rslt_t mtb_kvstore_value_size(mtb_kvstore_t* obj, const char* key, uint32_t* size)
+cy_rslt_t mtb_kvstore_ensure_capacity(mtb_kvstore_t* obj, uint32_t size)
 {
-    if (!_mtb_kvstore_is_valid_key(key))
-    {
-        return MTB_KVSTORE_BAD_PARAM_ERROR;
-    }
-
     cy_rslt_t result = _mtb_kvstore_lock(obj);
     if (result != CY_RSLT_SUCCESS)
     {
         return result;
     }
 
-    uint32_t ram_tbl_idx;
-    uint16_t hash;
-    result = _mtb_kvstore_find_record_in_ram_table(obj, key, &ram_tbl_idx, &hash, NULL);
-    if (result == CY_RSLT_SUCCESS)
+    uint32_t space_without_gc = _MTB_KVSTORE_AREA_SIZE(obj) - obj->free_space_offset;
+    if (space_without_gc < size) /* Will always be true if size is MTB_KVSTORE_ENSURE_MAX */
     {
-        _mtb_kvstore_record_header_t header;
-        result = _mtb_kvstore_read_record(obj, obj->active_area_addr,
-                                          obj->ram_table[ram_tbl_idx].offset, &header, key, true,
-                                          NULL, size);
+        result = _mtb_kvstore_garbage_collection(obj, NULL);
+    }
+
+    /* Put this check after the garbage collection operation, even though we have enough
+     * information before garbage collection runs to know whether it will be able to
+     * free up enough space. That way, success or failure, we always make as much space
+     * available as we can. */
+    if ((CY_RSLT_SUCCESS == result) && (mtb_kvstore_remaining_size(obj) < size))
+    {
+        /* Don't error on ENSURE_MAX because that is deliberately larger than our storage
+         * is ever likely to be, so as to signify that we should always run garbage collection */
+        if (MTB_KVSTORE_ENSURE_MAX != size)
+        {
+            result = MTB_KVSTORE_STORAGE_FULL_ERROR;
+        }
     }
 
     _mtb_kvstore_unlock(obj);
@@ -1684,251 +7994,293 @@ cy_rslt_t mtb_kvstore_value_size(mtb_kvstore_t* obj, const char* key, uint32_t*
 
 
 //--------------------------------------------------------------------------------------------------
-// mtb_kvstore_read
+// mtb_kvstore_maintenance_all
 //--------------------------------------------------------------------------------------------------
-cy_rslt_t mtb_kvstore_read(mtb_kvstore_t* obj, const char* key, uint8_t* data,
-                           uint32_t* size)
+cy_rslt_t mtb_kvstore_maintenance_all(uint32_t budget)
 {
-    if (!_mtb_kvstore_is_valid_key(key))
+    if (!_mtb_kvstore_registry_ready())
     {
-        return MTB_KVSTORE_BAD_PARAM_ERROR;
+        return CY_RSLT_SUCCESS;
     }
 
-    // If data buffer is passed but size is NULL or 0
-    if ((data != NULL) && ((size == NULL) || (*size == 0)))
+    // Instances can not be deinitialized while the registry is locked.
+    _mtb_kvstore_registry_lock();
+
+    uint32_t num_instances = 0;
+    for (mtb_kvstore_t* obj = _mtb_kvstore_instances; obj != NULL; obj = obj->next_instance)
     {
-        return MTB_KVSTORE_BAD_PARAM_ERROR;
+        num_instances++;
     }
 
-    cy_rslt_t result = _mtb_kvstore_lock(obj);
-    if (result != CY_RSLT_SUCCESS)
+    cy_rslt_t result = CY_RSLT_SUCCESS;
+    _mtb_kvstore_maintenance_candidate_t* candidates = NULL;
+    if (num_instances > 0)
     {
-        return result;
+        candidates = (_mtb_kvstore_maintenance_candidate_t*)malloc(
+            num_instances * sizeof(_mtb_kvstore_maintenance_candidate_t));
+        if (candidates == NULL)
+        {
+            result = MTB_KVSTORE_MEM_ALLOC_ERROR;
+        }
     }
 
-    uint32_t ram_tbl_idx;
-    uint16_t hash;
-    result = _mtb_kvstore_find_record_in_ram_table(obj, key, &ram_tbl_idx, &hash, NULL);
-    if (result == CY_RSLT_SUCCESS)
+    // A garbage collection reclaims the space of the records that were replaced or deleted. It
+    // costs erasing an area and programming the live records. Instances that are busy are skipped.
+    uint32_t num_candidates = 0;
+    for (mtb_kvstore_t* obj = _mtb_kvstore_instances; (obj != NULL) && (candidates != NULL);
+         obj = obj->next_instance)
     {
-        _mtb_kvstore_record_header_t header;
-        uint32_t data_size;
+        if (_mtb_kvstore_lock(obj) != CY_RSLT_SUCCESS)
+        {
+            continue;
+        }
+        uint32_t reclaimable = (obj->free_space_offset > obj->consumed_size)
+                               ? (obj->free_space_offset - obj->consumed_size)
+                               : 0U;
+        uint32_t cost = _MTB_KVSTORE_AREA_SIZE(obj) + obj->consumed_size;
+        _mtb_kvstore_unlock(obj);
 
-        if (size == NULL)
+        if (reclaimable == 0)
         {
-            data_size = 0UL;
+            continue;
         }
-        else
+
+        // Sorted by the space reclaimed per byte erased or programmed, best first.
+        uint32_t i = num_candidates;
+        while ((i > 0) && ((uint64_t)reclaimable * candidates[i - 1].cost >
+                           (uint64_t)candidates[i - 1].reclaimable * cost))
         {
-            data_size = *size;
+            candidates[i] = candidates[i - 1];
+            i--;
         }
+        candidates[i].obj = obj;
+        candidates[i].reclaimable = reclaimable;
+        candidates[i].cost = cost;
+        num_candidates++;
+    }
 
-        result = _mtb_kvstore_read_record(obj, obj->active_area_addr,
-                                          obj->ram_table[ram_tbl_idx].offset, &header, key, true,
-                                          data, size);
+    // The instances are compacted one after the other, and only as long as the budget lasts.
+    for (uint32_t i = 0; i < num_candidates; i++)
+    {
+        if (candidates[i].cost > budget)
+        {
+            continue;
+        }
 
-        // Fill excess buffer space with 0's
-        if ((data != NULL) && (*size < data_size))
+        // The budget is only spent on garbage collections that run, not on instances that became
+        // busy or were compacted by a write in the meantime.
+        mtb_kvstore_t* obj = candidates[i].obj;
+        if (_mtb_kvstore_lock(obj) != CY_RSLT_SUCCESS)
         {
-            // memset with size 0 is well defined (no effect)
-            (void)memset(&(data[*size]), 0, (data_size - *size));
+            continue;
         }
-    }
+        cy_rslt_t gc_result = CY_RSLT_SUCCESS;
+        if (obj->free_space_offset > obj->consumed_size)
+        {
+            gc_result = _mtb_kvstore_garbage_collection(obj, NULL);
+            if (budget != MTB_KVSTORE_MAINTENANCE_UNLIMITED)
+            {
+                budget -= candidates[i].cost;
+            }
+        }
+        _mtb_kvstore_unlock(obj);
 
-    _mtb_kvstore_unlock(obj);
+        if (result == CY_RSLT_SUCCESS)
+        {
+            result = gc_result;
+        }
+    }
 
+    free(candidates);
+    _mtb_kvstore_registry_unlock();
     return result;
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// mtb_kvstore_read_partial
+// mtb_kvstore_remaining_size
 //--------------------------------------------------------------------------------------------------
-cy_rslt_t mtb_kvstore_read_partial(mtb_kvstore_t* obj, const char* key, uint8_t* data,
-                                   uint32_t* size, const uint32_t offset_bytes)
+uint32_t mtb_kvstore_remaining_size(mtb_kvstore_t* obj)
 {
-    if (!_mtb_kvstore_is_valid_key(key))
+    return _MTB_KVSTORE_AREA_SIZE(obj) - obj->consumed_size;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// mtb_kvstore_sharded_init
+//--------------------------------------------------------------------------------------------------
+cy_rslt_t mtb_kvstore_sharded_init(mtb_kvstore_sharded_t* obj, uint32_t start_addr,
+                                   uint32_t length, uint32_t num_shards,
+                                   const mtb_kvstore_bd_t* block_device,
+                                   const mtb_kvstore_config_t* config)
+{
+    if ((NULL == obj) || (NULL == block_device) || (length == 0) || (num_shards == 0) ||
+        (num_shards > _MTB_KVSTORE_MAX_SHARDS))
     {
         return MTB_KVSTORE_BAD_PARAM_ERROR;
     }
 
-    // If data buffer is passed but size is NULL or 0;
-    if ((data != NULL) && ((size == NULL) || (*size == 0U)))
+    // Every shard needs an even number of erase sectors of its own.
+    uint32_t erase_size = block_device->erase_size(block_device->context, start_addr);
+    if ((erase_size == 0) || ((length / erase_size) % (2U * num_shards) != 0))
     {
-        return MTB_KVSTORE_BAD_PARAM_ERROR;
+        return MTB_KVSTORE_ALIGNMENT_ERROR;
     }
 
-    cy_rslt_t result = _mtb_kvstore_lock(obj);
-    if (result != CY_RSLT_SUCCESS)
+    obj->shards = (mtb_kvstore_t*)malloc(num_shards * sizeof(mtb_kvstore_t));
+    if (obj->shards == NULL)
     {
-        return result;
+        return MTB_KVSTORE_MEM_ALLOC_ERROR;
     }
 
-    uint32_t ram_tbl_idx;
-    uint16_t hash;
-    result = _mtb_kvstore_find_record_in_ram_table(obj, key, &ram_tbl_idx, &hash, NULL);
-    if (result == CY_RSLT_SUCCESS)
+    uint32_t shard_length = length / num_shards;
+    cy_rslt_t result = CY_RSLT_SUCCESS;
+    for (obj->num_shards = 0; obj->num_shards < num_shards; obj->num_shards++)
     {
-        uint32_t data_size = *size;
-        _mtb_kvstore_record_header_t header;
-        result = _mtb_kvstore_read_partial_record(obj, obj->active_area_addr,
-                                                  obj->ram_table[ram_tbl_idx].offset, &header,
-                                                  key, true, data, size, offset_bytes);
+        result = _mtb_kvstore_init_instance(&obj->shards[obj->num_shards],
+                                            start_addr + (obj->num_shards * shard_length),
+                                            shard_length, block_device, config,
+                                            (uint8_t)num_shards);
         if (result != CY_RSLT_SUCCESS)
         {
-            _mtb_kvstore_unlock(obj);
-            return result;
-        }
-
-        // Fill excess buffer space with 0's
-        if ((data != NULL) && ((*size - offset_bytes) < data_size))
-        {
-            // memset with size 0 is well defined (no effect)
-            (void)memset(&(data[*size - offset_bytes]), 0, (data_size - (*size - offset_bytes)));
-        }
-
-        // Inform caller if the full value could not fit in buffer & indicate how many bytes were
-        // copied over
-        if (data != NULL)
-        {
-            if ((*size - offset_bytes) > data_size)
-            {
-                result = MTB_KVSTORE_BUFFER_TOO_SMALL;
-                *size = data_size;
-            }
-            else
-            {
-                *size = *size - offset_bytes;
-            }
+            mtb_kvstore_sharded_deinit(obj);
+            break;
         }
     }
-
-    _mtb_kvstore_unlock(obj);
     return result;
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// mtb_kvstore_delete
+// mtb_kvstore_sharded_get_shard
 //--------------------------------------------------------------------------------------------------
-cy_rslt_t mtb_kvstore_delete(mtb_kvstore_t* obj, const char* key)
+mtb_kvstore_t* mtb_kvstore_sharded_get_shard(mtb_kvstore_sharded_t* obj, const char* key)
 {
-    cy_rslt_t result = _mtb_kvstore_lock(obj);
-    if (result != CY_RSLT_SUCCESS)
+    CY_ASSERT((obj != NULL) && (obj->num_shards > 0));
+
+    // An invalid key is passed on to the first shard, which reports the error.
+    uint32_t shard = 0;
+    if (key != NULL)
     {
-        return result;
+        shard = _mtb_kvstore_crc16((uint8_t*)key, strlen(key), _MTB_KVSTORE_CRC_INIT_VAL) %
+                obj->num_shards;
     }
+    return &obj->shards[shard];
+}
 
-    result = _mtb_kvstore_write_with_flags(obj, key, NULL, 0, true);
 
-    _mtb_kvstore_unlock(obj);
+//--------------------------------------------------------------------------------------------------
+// mtb_kvstore_sharded_write
+//--------------------------------------------------------------------------------------------------
+cy_rslt_t mtb_kvstore_sharded_write(mtb_kvstore_sharded_t* obj, const char* key,
+                                    const uint8_t* data, uint32_t size)
+{
+    return mtb_kvstore_write(mtb_kvstore_sharded_get_shard(obj, key), key, data, size);
+}
 
-    return result;
+
+//--------------------------------------------------------------------------------------------------
+// mtb_kvstore_sharded_read
+//--------------------------------------------------------------------------------------------------
+cy_rslt_t mtb_kvstore_sharded_read(mtb_kvstore_sharded_t* obj, const char* key, uint8_t* data,
+                                   uint32_t* size)
+{
+    return mtb_kvstore_read(mtb_kvstore_sharded_get_shard(obj, key), key, data, size);
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// mtb_kvstore_reset
+// mtb_kvstore_sharded_read_partial
 //--------------------------------------------------------------------------------------------------
-cy_rslt_t mtb_kvstore_reset(mtb_kvstore_t* obj)
+cy_rslt_t mtb_kvstore_sharded_read_partial(mtb_kvstore_sharded_t* obj, const char* key,
+                                           uint8_t* data, uint32_t* size,
+                                           const uint32_t offset_bytes)
 {
-    cy_rslt_t result = _mtb_kvstore_lock(obj);
-    if (result != CY_RSLT_SUCCESS)
-    {
-        return result;
-    }
+    return mtb_kvstore_read_partial(mtb_kvstore_sharded_get_shard(obj, key), key, data, size,
+                                    offset_bytes);
+}
 
-    // Clear the RAM table
-    memset(obj->ram_table, 0, obj->max_entries * sizeof(mtb_kvstore_ram_table_entry_t));
-    obj->num_entries = 0;
 
-    // Run GC.
-    result = _mtb_kvstore_garbage_collection(obj, NULL);
-    if (result == CY_RSLT_SUCCESS)
-    {
-        obj->consumed_size = obj->free_space_offset;
-    }
+//--------------------------------------------------------------------------------------------------
+// mtb_kvstore_sharded_key_exists
+//--------------------------------------------------------------------------------------------------
+cy_rslt_t mtb_kvstore_sharded_key_exists(mtb_kvstore_sharded_t* obj, const char* key)
+{
+    return mtb_kvstore_key_exists(mtb_kvstore_sharded_get_shard(obj, key), key);
+}
 
-    _mtb_kvstore_unlock(obj);
 
-    return result;
+//--------------------------------------------------------------------------------------------------
+// mtb_kvstore_sharded_value_size
+//--------------------------------------------------------------------------------------------------
+cy_rslt_t mtb_kvstore_sharded_value_size(mtb_kvstore_sharded_t* obj, const char* key,
+                                         uint32_t* size)
+{
+    return mtb_kvstore_value_size(mtb_kvstore_sharded_get_shard(obj, key), key, size);
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// mtb_kvstore_deinit
+// mtb_kvstore_sharded_delete
 //--------------------------------------------------------------------------------------------------
-void mtb_kvstore_deinit(mtb_kvstore_t* obj)
+cy_rslt_t mtb_kvstore_sharded_delete(mtb_kvstore_sharded_t* obj, const char* key)
 {
-    _mtb_kvstore_lock_wait_forever(obj);
+    return mtb_kvstore_delete(mtb_kvstore_sharded_get_shard(obj, key), key);
+}
 
-    if (obj->transaction_buffer != NULL)
-    {
-        free(obj->transaction_buffer);
-    }
 
-    if (obj->ram_table != NULL)
+//--------------------------------------------------------------------------------------------------
+// mtb_kvstore_sharded_size
+//--------------------------------------------------------------------------------------------------
+uint32_t mtb_kvstore_sharded_size(mtb_kvstore_sharded_t* obj)
+{
+    uint32_t size = 0;
+    for (uint32_t i = 0; i < obj->num_shards; i++)
     {
-        free(obj->ram_table);
+        size += mtb_kvstore_size(&obj->shards[i]);
     }
-
-    #if defined(CY_RTOS_AWARE) || defined(COMPONENT_RTOS_AWARE)
-    cy_mutex_t local_mutex = obj->mtb_kvstore_mutex;
-    #endif
-
-    _mtb_kvstore_unlock(obj);
-
-    #if defined(CY_RTOS_AWARE) || defined(COMPONENT_RTOS_AWARE)
-    cy_rslt_t result = cy_rtos_deinit_mutex(&local_mutex);
-    CY_ASSERT(result == CY_RSLT_SUCCESS);
-    CY_UNUSED_PARAMETER(result);
-    #endif
+    return size;
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// mtb_kvstore_size
+// mtb_kvstore_sharded_remaining_size
 //--------------------------------------------------------------------------------------------------
-uint32_t mtb_kvstore_size(mtb_kvstore_t* obj)
+uint32_t mtb_kvstore_sharded_remaining_size(mtb_kvstore_sharded_t* obj)
 {
-    return obj->consumed_size;
+    uint32_t size = 0;
+    for (uint32_t i = 0; i < obj->num_shards; i++)
+    {
+        size += mtb_kvstore_remaining_size(&obj->shards[i]);
+    }
+    return size;
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// mtb_kvstore_ensure_capacity
+// mtb_kvstore_sharded_reset
 //--------------------------------------------------------------------------------------------------
-cy_rslt_t mtb_kvstore_ensure_capacity(mtb_kvstore_t* obj, uint32_t size)
+cy_rslt_t mtb_kvstore_sharded_reset(mtb_kvstore_sharded_t* obj)
 {
-    uint32_t space_without_gc = _MTB_KVSTORE_AREA_SIZE(obj) - obj->free_space_offset;
     cy_rslt_t result = CY_RSLT_SUCCESS;
-    if (space_without_gc < size) /* Will always be true if size is MTB_KVSTORE_ENSURE_MAX */
-    {
-        result = _mtb_kvstore_garbage_collection(obj, NULL);
-    }
-
-    /* Put this check after the garbage collection operation, even though we have enough
-     * information before garbage collection runs to know whether it will be able to
-     * free up enough space. That way, success or failure, we always make as much space
-     * available as we can. */
-    if ((CY_RSLT_SUCCESS == result) && (mtb_kvstore_remaining_size(obj) < size))
+    for (uint32_t i = 0; (i < obj->num_shards) && (result == CY_RSLT_SUCCESS); i++)
     {
-        /* Don't error on ENSURE_MAX because that is deliberately larger than our storage
-         * is ever likely to be, so as to signify that we should always run garbage collection */
-        if (MTB_KVSTORE_ENSURE_MAX != size)
-        {
-            result = MTB_KVSTORE_STORAGE_FULL_ERROR;
-        }
+        result = mtb_kvstore_reset(&obj->shards[i]);
     }
-
     return result;
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// mtb_kvstore_remaining_size
+// mtb_kvstore_sharded_deinit
 //--------------------------------------------------------------------------------------------------
-uint32_t mtb_kvstore_remaining_size(mtb_kvstore_t* obj)
+void mtb_kvstore_sharded_deinit(mtb_kvstore_sharded_t* obj)
 {
-    return _MTB_KVSTORE_AREA_SIZE(obj) - obj->consumed_size;
+    for (uint32_t i = 0; i < obj->num_shards; i++)
+    {
+        mtb_kvstore_deinit(&obj->shards[i]);
+    }
+    free(obj->shards);
+    obj->shards = NULL;
+    obj->num_shards = 0;
 }
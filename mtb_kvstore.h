@@ -25,13 +25,31 @@
  **************************************************************************************************/
 #pragma once
 
+#if defined(MTB_KVSTORE_PTHREAD)
+// Must precede the first system header, see mtb_kvstore_pthread.h.
+#if !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+#if !defined(_XOPEN_SOURCE)
+#define _XOPEN_SOURCE 700
+#endif
+#endif
+
 #include <stdint.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include "cy_result.h"
 
+/** \cond INTERNAL */
+// The lock is implemented with the abstraction-rtos library, or with POSIX threads for host builds.
 #if defined(CY_RTOS_AWARE) || defined(COMPONENT_RTOS_AWARE)
 #include "cyabs_rtos.h"
+#define MTB_KVSTORE_RTOS_AWARE
+#elif defined(MTB_KVSTORE_PTHREAD)
+#include "mtb_kvstore_pthread.h"
+#define MTB_KVSTORE_RTOS_AWARE
 #endif
+/** \endcond */
 
 #if defined(__cplusplus)
 extern "C" {
@@ -108,12 +126,94 @@ extern "C" {
 #define MTB_KVSTORE_MAX_KEY_SIZE                    (64U)
 #endif
 
-#if (defined(CY_RTOS_AWARE) || defined(COMPONENT_RTOS_AWARE)) && \
+#if !defined(MTB_KVSTORE_DIRECT_PROGRAM_ALIGNMENT)
+/** Alignment in bytes that a value passed to a write function must have for large values to be
+ * programmed straight from the caller's buffer instead of being copied through the staging buffer.
+ * Set to 0 to always use the staging buffer, e.g. if the block device cannot program from the
+ * memory the values are stored in. */
+#define MTB_KVSTORE_DIRECT_PROGRAM_ALIGNMENT        (4U)
+#endif
+
+#if defined(MTB_KVSTORE_RTOS_AWARE) && \
     !defined(MTB_KVSTORE_MUTEX_TIMEOUT_MS)
 /** Timeout in ms for mutex timeout when using an RTOS. */
 #define MTB_KVSTORE_MUTEX_TIMEOUT_MS                (50U)
 #endif
 
+#if !defined(MTB_KVSTORE_LOCK_FREE_READS)
+/** Set to 1 when using an RTOS to look keys up and read values that are stored as a single record
+ * without taking the lock. A read that overlapped a modification is repeated, and takes the lock if
+ * it keeps overlapping. Requires the GCC atomic builtins, and is only used with block devices that
+ * have both the \ref MTB_KVSTORE_BD_CAP_PARALLEL_READ and \ref MTB_KVSTORE_BD_CAP_CONCURRENT_READ
+ * capabilities. Reads from other block devices take the lock.
+ */
+#define MTB_KVSTORE_LOCK_FREE_READS                 (0)
+#endif
+
+#if defined(MTB_KVSTORE_RTOS_AWARE) && \
+    !defined(MTB_KVSTORE_VIEW_TIMEOUT_MS)
+/** Timeout in ms for garbage collection to wait for the views into the area that it erases to be
+ * released, see \ref mtb_kvstore_get_view. */
+#define MTB_KVSTORE_VIEW_TIMEOUT_MS                 (1000U)
+#endif
+
+#if !defined(MTB_KVSTORE_ASYNC_QUEUE_DEPTH)
+/** Maximum number of writes submitted with \ref mtb_kvstore_write_async that can be pending. */
+#define MTB_KVSTORE_ASYNC_QUEUE_DEPTH               (8U)
+#endif
+
+#if defined(MTB_KVSTORE_RTOS_AWARE) && \
+    !defined(MTB_KVSTORE_ASYNC_THREAD_STACK_SIZE)
+/** Stack size in bytes of the thread that drains the asynchronous write queue. */
+#define MTB_KVSTORE_ASYNC_THREAD_STACK_SIZE         (2048U)
+#endif
+
+#if defined(MTB_KVSTORE_RTOS_AWARE) && \
+    !defined(MTB_KVSTORE_ASYNC_THREAD_PRIORITY)
+/** Priority of the thread that drains the asynchronous write queue. */
+#define MTB_KVSTORE_ASYNC_THREAD_PRIORITY           (CY_RTOS_PRIORITY_BELOWNORMAL)
+#endif
+
+/** Block device capability: a location that was already programmed can be programmed again to
+ * clear additional bits (1 to 0), without changing the bits that are already cleared. This is
+ * typically true for NOR flash without ECC.
+ */
+#define MTB_KVSTORE_BD_CAP_BIT_CLEAR                (1UL << 0)
+
+/** Block device capability: the read function can be called by several threads at the same time.
+ * Only then do reads share the kv-store lock when using an RTOS. Without it, reads take turns,
+ * while writers are still excluded in either case.
+ */
+#define MTB_KVSTORE_BD_CAP_PARALLEL_READ            (1UL << 1)
+
+/** Block device capability: the read function can be called while another thread programs or
+ * erases the device. A read of a location that is being programmed or erased may return any
+ * content, but it must not fail or disturb the program or erase. Required, together with
+ * \ref MTB_KVSTORE_BD_CAP_PARALLEL_READ, for reads that do not take the lock (see
+ * \ref MTB_KVSTORE_LOCK_FREE_READS) and for reads while garbage collection copies records.
+ */
+#define MTB_KVSTORE_BD_CAP_CONCURRENT_READ          (1UL << 2)
+
+#if !defined(MTB_KVSTORE_COUNTER_TALLY_SIZE)
+/** Size in bytes of the tally region of a counter record. Each bit of the region holds one
+ * increment, so a record absorbs 8 increments per byte before a new record is appended. Only used
+ * if the block device has the \ref MTB_KVSTORE_BD_CAP_BIT_CLEAR capability.
+ */
+#define MTB_KVSTORE_COUNTER_TALLY_SIZE              (32U)
+#endif
+
+#if !defined(MTB_KVSTORE_UPDATE_BUFFER_SIZE)
+/** Size in bytes of the stack buffer in which \ref mtb_kvstore_update stages values. Larger values
+ * are staged in a heap buffer sized to the stored value.
+ */
+#define MTB_KVSTORE_UPDATE_BUFFER_SIZE              (32U)
+#endif
+
+/** Version reported by \ref mtb_kvstore_read_versioned for a key that does not exist. When passed
+ * to \ref mtb_kvstore_write_if, the write only succeeds if the key does not exist.
+ */
+#define MTB_KVSTORE_VERSION_NONE                    (0UL)
+
 /** When passed as an argument to \ref mtb_kvstore_ensure_capacity,
  * indicates that cleanup tasks should always be performed regardless
  * of the amount of space which is currently free, to ensure the maximum
@@ -121,6 +221,76 @@ extern "C" {
  */
 #define MTB_KVSTORE_ENSURE_MAX (0xFFFFFFFFu)
 
+/** When passed as the budget to \ref mtb_kvstore_maintenance_all, compacts every instance that
+ * has space to reclaim.
+ */
+#define MTB_KVSTORE_MAINTENANCE_UNLIMITED           (0xFFFFFFFFu)
+
+/** Write option for \ref mtb_kvstore_write_ex. If the key already holds a value with the same
+ * size and content, the write returns success without programming anything to the storage.
+ */
+#define MTB_KVSTORE_WRITE_SKIP_UNCHANGED            (1UL << 0)
+
+/** Write option for \ref mtb_kvstore_write_ex. The value is compressed in independent blocks of
+ * \ref MTB_KVSTORE_COMPRESSION_BLOCK_SIZE bytes and stored compressed if that makes it smaller.
+ * Reads decompress the value transparently.
+ */
+#define MTB_KVSTORE_WRITE_COMPRESS                  (1UL << 1)
+
+#if !defined(MTB_KVSTORE_COMPRESSION_BLOCK_SIZE)
+/** Size in bytes of the blocks that values written with \ref MTB_KVSTORE_WRITE_COMPRESS are split
+ * into. Each block is compressed on its own, so a partial read only decompresses the blocks it
+ * covers. Reads allocate a heap buffer of twice this size. Must not exceed 32768.
+ */
+#define MTB_KVSTORE_COMPRESSION_BLOCK_SIZE          (256U)
+#endif
+
+#if !defined(MTB_KVSTORE_CHUNK_SIZE)
+/** Size in bytes of the chunk records that values are split into if they are stored in chunks,
+ * see \ref mtb_kvstore_config_t::chunk_min_size and \ref mtb_kvstore_config_t::dedup_min_size.
+ */
+#define MTB_KVSTORE_CHUNK_SIZE                      (4096U)
+#endif
+
+#if !defined(MTB_KVSTORE_MAX_VALUE_SIZE)
+/** Largest value that can be stored. Writes and appends that exceed it fail with
+ * \ref MTB_KVSTORE_BAD_PARAM_ERROR. 0 only limits values by the size of the storage.
+ */
+#define MTB_KVSTORE_MAX_VALUE_SIZE                  (0U)
+#endif
+
+#if !defined(MTB_KVSTORE_INLINE_VALUE_SIZE)
+/** Values of up to this many bytes that are stored as is (not counters, appended, compressed or
+ * chunked values) are kept in the RAM table together with a copy of their key, so that reading
+ * them, querying their size or checking that their key exists does not access the storage. Each
+ * entry of the RAM table grows by this size plus a pointer, and each inline value costs a heap
+ * allocation of its key. Must not exceed 255. 0 disables inline values.
+ */
+#define MTB_KVSTORE_INLINE_VALUE_SIZE               (0U)
+#endif
+
+/** \cond INTERNAL */
+#if defined(MTB_KVSTORE_SKIP_UNCHANGED_WRITES)
+#define _MTB_KVSTORE_SKIP_UNCHANGED_DEFAULT         (MTB_KVSTORE_WRITE_SKIP_UNCHANGED)
+#else
+#define _MTB_KVSTORE_SKIP_UNCHANGED_DEFAULT         (0UL)
+#endif
+#if defined(MTB_KVSTORE_COMPRESS_WRITES)
+#define _MTB_KVSTORE_COMPRESS_DEFAULT               (MTB_KVSTORE_WRITE_COMPRESS)
+#else
+#define _MTB_KVSTORE_COMPRESS_DEFAULT               (0UL)
+#endif
+/** \endcond */
+
+#if !defined(MTB_KVSTORE_WRITE_DEFAULT_FLAGS)
+/** Write options applied by \ref mtb_kvstore_write. Defining `MTB_KVSTORE_SKIP_UNCHANGED_WRITES`
+ * adds \ref MTB_KVSTORE_WRITE_SKIP_UNCHANGED and defining `MTB_KVSTORE_COMPRESS_WRITES` adds
+ * \ref MTB_KVSTORE_WRITE_COMPRESS to every write.
+ */
+#define MTB_KVSTORE_WRITE_DEFAULT_FLAGS             \
+    (_MTB_KVSTORE_SKIP_UNCHANGED_DEFAULT | _MTB_KVSTORE_COMPRESS_DEFAULT)
+#endif
+
 /** An invalid parameter value is passed in. */
 #define MTB_KVSTORE_BAD_PARAM_ERROR                 \
     CY_RSLT_CREATE(CY_RSLT_TYPE_ERROR, CY_RSLT_MODULE_MIDDLEWARE_KVSTORE, 0)
@@ -147,6 +317,19 @@ extern "C" {
 /** Buffer provided is too small for value found. */
 #define MTB_KVSTORE_BUFFER_TOO_SMALL                \
     CY_RSLT_CREATE(CY_RSLT_TYPE_ERROR, CY_RSLT_MODULE_MIDDLEWARE_KVSTORE, 7)
+/** The asynchronous write queue is full. */
+#define MTB_KVSTORE_QUEUE_FULL_ERROR                \
+    CY_RSLT_CREATE(CY_RSLT_TYPE_ERROR, CY_RSLT_MODULE_MIDDLEWARE_KVSTORE, 8)
+/** The version of the value does not match the expected version. */
+#define MTB_KVSTORE_VERSION_MISMATCH_ERROR          \
+    CY_RSLT_CREATE(CY_RSLT_TYPE_ERROR, CY_RSLT_MODULE_MIDDLEWARE_KVSTORE, 9)
+/** Garbage collection could not erase an area because views into it that were returned by
+ * \ref mtb_kvstore_get_view were not released. */
+#define MTB_KVSTORE_VIEW_BUSY_ERROR                 \
+    CY_RSLT_CREATE(CY_RSLT_TYPE_ERROR, CY_RSLT_MODULE_MIDDLEWARE_KVSTORE, 10)
+/** A file operation of the memory mapped file block device (mtb_kvstore_mmap.h) failed. */
+#define MTB_KVSTORE_IO_ERROR                        \
+    CY_RSLT_CREATE(CY_RSLT_TYPE_ERROR, CY_RSLT_MODULE_MIDDLEWARE_KVSTORE, 11)
 
 /** Function prototype for reading data from the block device.
  *
@@ -209,7 +392,25 @@ typedef uint32_t (* mtb_kvstore_bd_program_size)(void* context, uint32_t addr);
  */
 typedef uint32_t (* mtb_kvstore_bd_erase_size)(void* context, uint32_t addr);
 
-/** Block device interface */
+/** Function prototype to get the memory address at which a memory mapped (e.g. XIP) block device
+ * can be read directly.
+ *
+ * @param[in]  context  Context object that is passed into \ref mtb_kvstore_init
+ * @param[in]  addr     Address for which the memory address is queried. This address is passed in
+ *                      as start_addr + offset.
+ * @return Pointer to the memory that holds the content of the device at addr, or NULL if addr is
+ *         not mapped. Each half of the storage must be mapped contiguously, and reads through the
+ *         pointer must return what was last programmed.
+ */
+typedef const uint8_t* (* mtb_kvstore_bd_map)(void* context, uint32_t addr);
+
+/** Block device interface
+ *
+ * The library never calls the functions of a block device from more than one thread at a time,
+ * unless the device advertises otherwise in its capabilities, e.g.
+ * \ref MTB_KVSTORE_BD_CAP_PARALLEL_READ for reads from several threads at once and
+ * \ref MTB_KVSTORE_BD_CAP_CONCURRENT_READ for reads while another thread programs or erases.
+ */
 typedef struct
 {
     mtb_kvstore_bd_read         read;           /**< Function to read from device */
@@ -220,19 +421,174 @@ typedef struct
     mtb_kvstore_bd_erase_size   erase_size;     /**< Function to get erase size for an address */
     void*                       context;        /**< Context object that can be used in the block
                                                    device implementation */
+    uint32_t                    capabilities;   /**< Optional capabilities of the device, a
+                                                   combination of MTB_KVSTORE_BD_CAP_* flags */
+    mtb_kvstore_bd_map          map;            /**< Optional function to get the memory address
+                                                   of a memory mapped device, NULL if the device
+                                                   is not memory mapped */
 } mtb_kvstore_bd_t;
 
+/** Function prototype of the completion callback of \ref mtb_kvstore_write_async.
+ *
+ * The callback is invoked from the thread that drains the write queue, without any kv-store lock
+ * held. It may read from the kv-store, but it must not call modifying functions or
+ * \ref mtb_kvstore_flush_queue, as those wait for the queue that the thread is draining.
+ *
+ * @param[in]  context  Context object that is passed into \ref mtb_kvstore_write_async
+ * @param[in]  key      Key that was written
+ * @param[in]  result   Result of the write operation
+ */
+typedef void (* mtb_kvstore_write_cb_t)(void* context, const char* key, cy_rslt_t result);
+
+/** Outcome of a \ref mtb_kvstore_update_fn callback */
+typedef enum
+{
+    MTB_KVSTORE_UPDATE_WRITE,       /**< Store the modified value */
+    MTB_KVSTORE_UPDATE_UNCHANGED    /**< Keep the stored value, nothing is written */
+} mtb_kvstore_update_action_t;
+
+/** Function prototype of the callback of \ref mtb_kvstore_update.
+ *
+ * The callback is invoked with the kv-store lock held and must not call any kv-store function.
+ *
+ * @param[in]     context  Context object that is passed into \ref mtb_kvstore_update
+ * @param[in]     key      Key that is updated
+ * @param[in,out] data     Current value of the key, to be modified in place
+ * @param[in,out] size     Size of the current value in bytes (0 if the key does not exist). Set to
+ *                         the size of the new value, which must not exceed max_size.
+ * @param[in]     max_size Size of the buffer pointed to by data
+ * @return Whether the modified value should be stored.
+ */
+typedef mtb_kvstore_update_action_t (* mtb_kvstore_update_fn)(void* context, const char* key,
+                                                              uint8_t* data, uint32_t* size,
+                                                              uint32_t max_size);
+
+/** Optional configuration of a kv-store instance, see \ref mtb_kvstore_init_with_config */
+typedef struct
+{
+    /** Size in bytes of the staging buffer used to read, program and copy records. It is rounded
+     * up to a multiple of the program size and is never smaller than the program or read size.
+     * 0 selects the default size (128 bytes or the program/read size, whichever is larger). */
+    uint32_t    buffer_size;
+    /** Alignment in bytes of the staging buffer, e.g. to satisfy DMA requirements of the block
+     * device. Must be 0 or a power of 2. 0 uses the alignment provided by malloc. */
+    uint32_t    buffer_alignment;
+    /** If larger than the staging buffer size, garbage collection and writes of large records
+     * temporarily allocate a staging buffer of up to this many bytes to reduce the number of
+     * block device calls. If the allocation fails the regular staging buffer is used. 0 disables
+     * growing the buffer. */
+    uint32_t    max_buffer_size;
+    /** Pack records at 4 byte boundaries instead of padding each of them to the program size, so
+     * that several small records share one program unit. A record that starts within a program
+     * unit is written by programming the unit again with the erased value in place of the bytes
+     * that are already programmed, so this requires a block device with the
+     * MTB_KVSTORE_BD_CAP_BIT_CLEAR capability. Storage written with a different setting is
+     * converted by a garbage collection during initialization. */
+    bool        packed_records;
+    /** Write records with a compact header that stores the key and value sizes as variable
+     * length integers, which typically takes 6 to 8 bytes instead of 20. Records written with the
+     * full header are still read and are rewritten in the compact format when they are updated.
+     * Storage written with compact headers can only be read by versions that support them. */
+    bool        compact_headers;
+    /** Store each key once in a persisted key dictionary and let records refer to it by a 2 byte
+     * ID instead of carrying the full key. The dictionary is kept in RAM (one copy of each key)
+     * and its entries are only removed by \ref mtb_kvstore_reset, so this suits a fixed set of
+     * long keys that are rewritten often. Storage that contains dictionary records can only be
+     * read by versions that support them. */
+    bool        key_dictionary;
+    /** Store values of at least this many bytes as shared blobs identified by the hash of their
+     * content, so that a value that is already stored under another key only costs a small
+     * manifest record. Values are split into chunks of MTB_KVSTORE_CHUNK_SIZE bytes and each
+     * chunk is shared separately. Reference counts are kept in RAM and rebuilt at
+     * initialization. 0 disables deduplication. Storage that contains shared blobs can only be
+     * read by versions that support them. */
+    uint32_t    dedup_min_size;
+    /** Size in bytes of a RAM cache of the values read with \ref mtb_kvstore_read, including the
+     * keys and the bookkeeping of each entry. Reads and partial reads of a cached value do not
+     * access the storage. When the cache is full the least recently used value is evicted, except
+     * for the values of keys pinned with \ref mtb_kvstore_cache_pin. 0 disables the cache. */
+    uint32_t    cache_size;
+    /** Store values of at least this many bytes uncompressed as a manifest record that refers to
+     * chunk records of MTB_KVSTORE_CHUNK_SIZE bytes. Each chunk has its own CRC, partial reads
+     * only access the chunks they cover, and chunks that are unchanged by a write are kept
+     * instead of being written again. 0 disables chunking. Storage that contains chunked values
+     * can only be read by versions that support them. */
+    uint32_t    chunk_min_size;
+} mtb_kvstore_config_t;
+
+/** Usage statistics of a kv-store instance */
+typedef struct
+{
+    uint32_t    skipped_writes; /**< Writes that were skipped because the value was unchanged */
+    uint32_t    cache_hits;     /**< Reads that were served from the value cache */
+    uint32_t    cache_misses;   /**< Reads that looked for a value in the cache and read storage */
+} mtb_kvstore_stats_t;
+
 /** \cond INTERNAL */
 
+/** Pending asynchronous write */
+typedef struct mtb_kvstore_async_entry mtb_kvstore_async_entry_t;
+
+/** Instances on the same block device, whose garbage collections are serialized */
+typedef struct mtb_kvstore_gc_group mtb_kvstore_gc_group_t;
+
+/** Memory that lock free readers may still access, freed once no such read is in progress */
+typedef struct mtb_kvstore_retired mtb_kvstore_retired_t;
+
+/** Value cache entry */
+typedef struct mtb_kvstore_cache_entry mtb_kvstore_cache_entry_t;
+
+/** Queue of pending asynchronous writes */
+typedef struct
+{
+    mtb_kvstore_async_entry_t*  entries[MTB_KVSTORE_ASYNC_QUEUE_DEPTH];
+    uint32_t                    head;
+    uint32_t                    count;
+    #if defined(MTB_KVSTORE_RTOS_AWARE)
+    cy_mutex_t                  mutex;
+    cy_semaphore_t              work_sem;
+    cy_semaphore_t              done_sem;
+    cy_thread_t                 thread;
+    bool                        busy;
+    bool                        running;
+    bool                        stop;
+    #endif
+} mtb_kvstore_async_queue_t;
+
 /** Ram table entry structure */
 typedef struct
 {
     uint16_t    hash;
+    uint8_t     flags;
     uint32_t    offset;
+    uint32_t    generation;
+    #if (MTB_KVSTORE_INLINE_VALUE_SIZE > 0)
+    char*       inline_key;     /* Copy of the key if the value is inline, otherwise NULL */
+    uint8_t     inline_size;
+    uint8_t     inline_value[MTB_KVSTORE_INLINE_VALUE_SIZE];
+    #endif
 } mtb_kvstore_ram_table_entry_t;
 
-/** KV store context */
+/** Key dictionary entry structure */
 typedef struct
+{
+    uint16_t    hash;
+    uint32_t    offset;
+    uint32_t    gc_offset;
+    char*       key;
+} mtb_kvstore_key_dict_entry_t;
+
+/** Shared blob entry structure */
+typedef struct
+{
+    uint64_t    hash;
+    uint32_t    offset;
+    uint32_t    gc_offset;
+    uint32_t    refcount;
+} mtb_kvstore_blob_entry_t;
+
+/** KV store context */
+typedef struct mtb_kvstore
 {
     uint32_t                        start_addr;
     uint32_t                        length;
@@ -241,23 +597,68 @@ typedef struct
     mtb_kvstore_ram_table_entry_t*  ram_table;
     uint32_t                        num_entries;
     uint32_t                        max_entries;
+    uint32_t                        last_generation;
+
+    mtb_kvstore_key_dict_entry_t*   key_dict;
+    uint32_t                        num_key_ids;
+    uint32_t                        max_key_ids;
+
+    mtb_kvstore_blob_entry_t*       blobs;
+    uint32_t                        num_blobs;
+    uint32_t                        max_blobs;
 
     uint8_t*                        transaction_buffer;
     size_t                          transaction_buffer_size;
+    void*                           transaction_buffer_mem;
+    mtb_kvstore_config_t            config;
     char                            key_buffer[MTB_KVSTORE_MAX_KEY_SIZE];
 
     uint32_t                        active_area_addr;
     uint32_t                        gc_area_addr;
     uint32_t                        free_space_offset;
     uint16_t                        active_area_version;
+    bool                            active_area_packed;
+    uint8_t                         num_shards;
 
     uint32_t                        consumed_size;
 
-    #if defined(CY_RTOS_AWARE) || defined(COMPONENT_RTOS_AWARE)
+    mtb_kvstore_stats_t             stats;
+
+    mtb_kvstore_async_queue_t       async_queue;
+
+    mtb_kvstore_cache_entry_t*      cache_head;
+    mtb_kvstore_cache_entry_t*      cache_tail;
+    uint32_t                        cache_used;
+
+    uint32_t                        num_views[2];
+
+    struct mtb_kvstore*             next_instance;
+    mtb_kvstore_gc_group_t*         gc_group;
+
+    #if defined(MTB_KVSTORE_RTOS_AWARE)
     cy_mutex_t                      mtb_kvstore_mutex;
+    cy_mutex_t                      modify_mutex;
+    cy_mutex_t                      readers_mutex;
+    cy_semaphore_t                  readers_done_sem;
+    uint32_t                        num_readers;
+    bool                            writer_waiting;
+    uint32_t                        write_seq;
+    uint32_t                        lock_free_readers;
+    mtb_kvstore_retired_t*          retired;
+    cy_mutex_t                      cache_mutex;
+    cy_mutex_t                      views_mutex;
+    cy_semaphore_t                  views_done_sem;
+    bool                            gc_waiting_for_views;
     #endif
 } mtb_kvstore_t;
 
+/** Sharded kv-store: independent kv-store instances that each own a key range by hash. */
+typedef struct
+{
+    mtb_kvstore_t*                  shards;
+    uint32_t                        num_shards;
+} mtb_kvstore_sharded_t;
+
 /** \endcond */
 
 /** Initialize a instance kv-store library
@@ -287,6 +688,23 @@ typedef struct
 cy_rslt_t mtb_kvstore_init(mtb_kvstore_t* obj, uint32_t start_addr, uint32_t length,
                            const mtb_kvstore_bd_t* block_device);
 
+/** Initialize a instance kv-store library with a configuration
+ *
+ * This behaves the same as \ref mtb_kvstore_init but allows tuning the staging buffer used for
+ * block device transfers. See \ref mtb_kvstore_config_t for details.
+ *
+ * @param[out]  obj          Pointer to a kv-store object.
+ * @param[in]   start_addr   Start address for the memory. See \ref mtb_kvstore_init.
+ * @param[in]   length       Total space available in bytes. See \ref mtb_kvstore_init.
+ * @param[in]   block_device Block device interface for the underlying memory to be used.
+ * @param[in]   config       Configuration of the instance. NULL selects the default configuration.
+ *
+ * @return Result of the initialization operation.
+ */
+cy_rslt_t mtb_kvstore_init_with_config(mtb_kvstore_t* obj, uint32_t start_addr, uint32_t length,
+                                       const mtb_kvstore_bd_t* block_device,
+                                       const mtb_kvstore_config_t* config);
+
 /** Store a key value pair
  *
  * @param[in] obj  Pointer to a kv-store object
@@ -299,6 +717,52 @@ cy_rslt_t mtb_kvstore_init(mtb_kvstore_t* obj, uint32_t start_addr, uint32_t len
 cy_rslt_t mtb_kvstore_write(mtb_kvstore_t* obj, const char* key, const uint8_t* data,
                             uint32_t size);
 
+/** Store a key value pair with additional write options
+ *
+ * @param[in] obj   Pointer to a kv-store object
+ * @param[in] key   Lookup key for the data.
+ * @param[in] data  Pointer to the start of the data to be stored.
+ * @param[in] size  Total size of the data in bytes.
+ * @param[in] flags Bitwise OR of write options (e.g. \ref MTB_KVSTORE_WRITE_SKIP_UNCHANGED).
+ *
+ * @return Result of the write operation.
+ */
+cy_rslt_t mtb_kvstore_write_ex(mtb_kvstore_t* obj, const char* key, const uint8_t* data,
+                               uint32_t size, uint32_t flags);
+
+/** Submit a key value pair to be stored asynchronously
+ *
+ * The data is copied into a bounded queue and the call returns without waiting for the storage.
+ * A worker thread appends the queued records in submission order and reports the result of each
+ * through the completion callback. Reads of a key with a pending write return the queued value.
+ * Synchronous modifying functions wait until the queue is drained before they are executed, so
+ * the order of all modifications is preserved.
+ *
+ * \note Without an RTOS (`CY_RTOS_AWARE` or `MTB_KVSTORE_PTHREAD`) there is no worker thread. The
+ * write is performed before this function returns, the callback is invoked from it and the result
+ * of the write is also returned.
+ *
+ * @param[in] obj      Pointer to a kv-store object
+ * @param[in] key      Lookup key for the data.
+ * @param[in] data     Pointer to the start of the data to be stored.
+ * @param[in] size     Total size of the data in bytes.
+ * @param[in] callback Function called when the write completed. Can be NULL.
+ * @param[in] context  Context object passed to the callback.
+ *
+ * @return Result of the submission. \ref MTB_KVSTORE_QUEUE_FULL_ERROR if
+ *         \ref MTB_KVSTORE_ASYNC_QUEUE_DEPTH writes are pending.
+ */
+cy_rslt_t mtb_kvstore_write_async(mtb_kvstore_t* obj, const char* key, const uint8_t* data,
+                                  uint32_t size, mtb_kvstore_write_cb_t callback, void* context);
+
+/** Wait until all writes submitted with \ref mtb_kvstore_write_async have completed
+ *
+ * @param[in] obj Pointer to a kv-store object
+ *
+ * @return Result of the flush operation.
+ */
+cy_rslt_t mtb_kvstore_flush_queue(mtb_kvstore_t* obj);
+
 /** Read data associated with a key
  *
  * @param[in]       obj  Pointer to a kv-store object
@@ -331,6 +795,117 @@ cy_rslt_t mtb_kvstore_read(mtb_kvstore_t* obj, const char* key, uint8_t* data,
 cy_rslt_t mtb_kvstore_read_partial(mtb_kvstore_t* obj, const char* key, uint8_t* data,
                                    uint32_t* size, const uint32_t offset_bytes);
 
+/** Read data associated with a key together with the version of the value
+ *
+ * Every modification of a key assigns a new version to it. Versions are unique for the lifetime
+ * of the kv-store instance (i.e. until \ref mtb_kvstore_deinit) and are rebuilt from the order of
+ * the records when the instance is initialized.
+ *
+ * @param[in]       obj     Pointer to a kv-store object
+ * @param[in]       key     Lookup key for the data.
+ * @param[out]      data    Pointer to the start of the buffer for the data to be read into.
+ * @param[in,out]   size    See \ref mtb_kvstore_read.
+ * @param[out]      version Version of the value, or \ref MTB_KVSTORE_VERSION_NONE if the key does
+ *                          not exist.
+ *
+ *  @return Result of the read operation.
+ */
+cy_rslt_t mtb_kvstore_read_versioned(mtb_kvstore_t* obj, const char* key, uint8_t* data,
+                                     uint32_t* size, uint32_t* version);
+
+/** Store a key value pair if the current version of the value matches
+ *
+ * The version check and the write are performed under a single lock acquisition, so
+ * read-modify-write sequences of concurrent tasks can be implemented without an additional lock.
+ *
+ * @param[in] obj              Pointer to a kv-store object
+ * @param[in] key              Lookup key for the data.
+ * @param[in] data             Pointer to the start of the data to be stored.
+ * @param[in] size             Total size of the data in bytes.
+ * @param[in] expected_version Version returned by \ref mtb_kvstore_read_versioned, or
+ *                             \ref MTB_KVSTORE_VERSION_NONE to only create the key.
+ *
+ * @return Result of the write operation. \ref MTB_KVSTORE_VERSION_MISMATCH_ERROR if the key was
+ *         modified since the expected version was read. A version that was read before the
+ *         instance was deinitialized may match a different value after it is initialized again,
+ *         so it must be read again after \ref mtb_kvstore_init.
+ */
+cy_rslt_t mtb_kvstore_write_if(mtb_kvstore_t* obj, const char* key, const uint8_t* data,
+                               uint32_t size, uint32_t expected_version);
+
+/** Atomically modify the value of a key
+ *
+ * The value of the key is read into a staging buffer and passed to the callback, which modifies
+ * it in place. The lookup, the callback and the write of the new value are performed under a
+ * single lock acquisition and the record is only looked up and read once. If the callback returns
+ * \ref MTB_KVSTORE_UPDATE_UNCHANGED nothing is written.
+ *
+ * The staging buffer is \ref MTB_KVSTORE_UPDATE_BUFFER_SIZE bytes or the size of the stored value,
+ * whichever is larger.
+ *
+ * @param[in] obj     Pointer to a kv-store object
+ * @param[in] key     Key to update. It is created if it does not exist.
+ * @param[in] fn      Callback that modifies the value
+ * @param[in] context Context object that is passed to the callback
+ *
+ * @return Result of the update operation.
+ */
+cy_rslt_t mtb_kvstore_update(mtb_kvstore_t* obj, const char* key, mtb_kvstore_update_fn fn,
+                             void* context);
+
+/** Append data to the value of a key
+ *
+ * The data is stored in a continuation record that is linked to the records holding the current
+ * value, so the cost of an append does not depend on the size of the value. \ref mtb_kvstore_read
+ * and \ref mtb_kvstore_read_partial return the segments stitched together. Garbage collection
+ * rewrites the segments of a value as a single record. Counters and values that are stored
+ * compressed or in chunks cannot be appended to; \ref MTB_KVSTORE_BAD_PARAM_ERROR is returned for
+ * them.
+ *
+ * @param[in] obj  Pointer to a kv-store object
+ * @param[in] key  Key to append to. It is created if it does not exist.
+ * @param[in] data Pointer to the start of the data to be appended.
+ * @param[in] size Size of the data in bytes.
+ *
+ * @return Result of the append operation.
+ */
+cy_rslt_t mtb_kvstore_append(mtb_kvstore_t* obj, const char* key, const uint8_t* data,
+                             uint32_t size);
+
+/** Append data to the value of a key with bounded retention
+ *
+ * Same as \ref mtb_kvstore_append. In addition, when garbage collection rewrites the value, the
+ * oldest segments are dropped so that at most max_size bytes are retained. The newest segment is
+ * always retained. Until the next garbage collection the value may be larger than max_size.
+ *
+ * @param[in] obj      Pointer to a kv-store object
+ * @param[in] key      Key to append to. It is created if it does not exist.
+ * @param[in] data     Pointer to the start of the data to be appended.
+ * @param[in] size     Size of the data in bytes.
+ * @param[in] max_size Maximum number of bytes retained by garbage collection, 0 for no limit.
+ *
+ * @return Result of the append operation.
+ */
+cy_rslt_t mtb_kvstore_append_ex(mtb_kvstore_t* obj, const char* key, const uint8_t* data,
+                                uint32_t size, uint32_t max_size);
+
+/** Increment a counter
+ *
+ * Counters are stored as a 32-bit value that is read with \ref mtb_kvstore_read like any other
+ * value. If the block device has the \ref MTB_KVSTORE_BD_CAP_BIT_CLEAR capability, a counter
+ * record contains a tally region of \ref MTB_KVSTORE_COUNTER_TALLY_SIZE bytes and an increment
+ * clears the next bit of the region in place, so a new record is only appended once the region is
+ * exhausted. Otherwise every increment appends a new record.
+ *
+ * @param[in]  obj   Pointer to a kv-store object
+ * @param[in]  key   Key of the counter. If it does not exist it is created with a value of 1. An
+ *                   existing value must be 4 bytes long.
+ * @param[out] value Value of the counter after the increment. Can be NULL.
+ *
+ * @return Result of the increment operation.
+ */
+cy_rslt_t mtb_kvstore_counter_increment(mtb_kvstore_t* obj, const char* key, uint32_t* value);
+
 /** Check if a key is stored in memory
  *
  * @param[in]   obj     Pointer to a kv-store object
@@ -361,6 +936,84 @@ cy_rslt_t mtb_kvstore_value_size(mtb_kvstore_t* obj, const char* key, uint32_t*
  */
 cy_rslt_t mtb_kvstore_delete(mtb_kvstore_t* obj, const char* key);
 
+/** Delete several key value pairs
+ *
+ * The tombstone records of all keys are appended as one batch. If they do not fit into the free
+ * space, the keys are dropped by the garbage collection that would be needed anyway instead.
+ *
+ * \note Keys that cannot be found in the storage are ignored.
+ *
+ * @param[in]   obj      Pointer to a kv-store object.
+ * @param[in]   keys     Array of lookup keys to delete.
+ * @param[in]   num_keys Number of keys in the array.
+ *
+ * @return Result of the delete operation.
+ */
+cy_rslt_t mtb_kvstore_delete_many(mtb_kvstore_t* obj, const char* const* keys, uint32_t num_keys);
+
+/** Delete all key value pairs whose key starts with a prefix
+ *
+ * The deletion is performed the same way as in \ref mtb_kvstore_delete_many.
+ *
+ * @param[in]   obj    Pointer to a kv-store object.
+ * @param[in]   prefix Prefix of the keys to delete, e.g. "net/". An empty prefix matches all keys.
+ *
+ * @return Result of the delete operation.
+ */
+cy_rslt_t mtb_kvstore_delete_prefix(mtb_kvstore_t* obj, const char* prefix);
+
+/** Keep the value of a key in the value cache
+ *
+ * The value is read into the cache if it is not cached yet. It is not evicted to make room for
+ * other values, and when the key is written it is cached again by the next read. The cache must
+ * be enabled with \ref mtb_kvstore_config_t::cache_size.
+ *
+ * @param[in] obj Pointer to a kv-store object
+ * @param[in] key Lookup key for the data.
+ *
+ * @return Result of the operation. \ref MTB_KVSTORE_MEM_ALLOC_ERROR if the value does not fit into
+ *         the cache next to the values that are already pinned.
+ */
+cy_rslt_t mtb_kvstore_cache_pin(mtb_kvstore_t* obj, const char* key);
+
+/** Let the value of a key be evicted from the value cache again
+ *
+ * @param[in] obj Pointer to a kv-store object
+ * @param[in] key Lookup key for the data.
+ */
+void mtb_kvstore_cache_unpin(mtb_kvstore_t* obj, const char* key);
+
+/** Get a pointer to the value of a key in a memory mapped storage
+ *
+ * Instead of copying the value, this returns a pointer into the memory at which the block device
+ * is mapped, so the block device must provide \ref mtb_kvstore_bd_t::map. The pointer stays valid
+ * until it is released with \ref mtb_kvstore_release_view, and keeps pointing to the value at the
+ * time of the call even if the key is written or deleted afterwards. While a view is held, a
+ * garbage collection that needs to erase the area that it points into waits for it to be released
+ * (up to MTB_KVSTORE_VIEW_TIMEOUT_MS in an RTOS environment) and otherwise fails with
+ * \ref MTB_KVSTORE_VIEW_BUSY_ERROR, so views should be held briefly and never across a
+ * modification made by the same thread. All views must be released before
+ * \ref mtb_kvstore_deinit.
+ *
+ * @param[in]  obj  Pointer to a kv-store object
+ * @param[in]  key  Lookup key for the data.
+ * @param[out] ptr  Pointer to the value
+ * @param[out] size Size of the value in bytes
+ *
+ * @return Result of the operation. \ref MTB_KVSTORE_BAD_PARAM_ERROR if the block device is not
+ *         memory mapped or the value is not stored as is in a single record (counters, appended,
+ *         compressed and chunked values).
+ */
+cy_rslt_t mtb_kvstore_get_view(mtb_kvstore_t* obj, const char* key, const uint8_t** ptr,
+                               uint32_t* size);
+
+/** Release a view returned by \ref mtb_kvstore_get_view
+ *
+ * @param[in] obj Pointer to a kv-store object
+ * @param[in] ptr Pointer returned by \ref mtb_kvstore_get_view
+ */
+void mtb_kvstore_release_view(mtb_kvstore_t* obj, const uint8_t* ptr);
+
 /** Query the size consumed in the kv-store storage.
  *
  * @param[in]   obj  Pointer to a kv-store object.
@@ -377,6 +1030,17 @@ uint32_t mtb_kvstore_size(mtb_kvstore_t* obj);
  */
 uint32_t mtb_kvstore_remaining_size(mtb_kvstore_t* obj);
 
+/** Query the usage statistics of a kv-store instance.
+ *
+ * The statistics are copied under the lock, so they are consistent with each other.
+ *
+ * @param[in]   obj   Pointer to a kv-store object
+ * @param[out]  stats Statistics collected since the instance was initialized.
+ *
+ * @return Result of the query, which can only fail if the lock cannot be taken.
+ */
+cy_rslt_t mtb_kvstore_get_stats(mtb_kvstore_t* obj, mtb_kvstore_stats_t* stats);
+
 /** Tries to make the specified amount of space available
  *  for immediate use. If necessary, internal cleanup operations
  *  will be executed to make additional space available, so this
@@ -394,6 +1058,30 @@ uint32_t mtb_kvstore_remaining_size(mtb_kvstore_t* obj);
  */
 cy_rslt_t mtb_kvstore_ensure_capacity(mtb_kvstore_t* obj, uint32_t size);
 
+/** Compact the kv-store instances that gain the most from it, within a budget.
+ *
+ * Every initialized instance is registered for maintenance. The instances that have space to
+ * reclaim, from records that were replaced or deleted, are garbage collected one after the other,
+ * starting with the one that reclaims the most space per byte of work. The work of a garbage
+ * collection is estimated as the size of the area that is erased plus the size of the live
+ * records that are copied. Instances whose work exceeds the remaining budget and instances that
+ * are busy are skipped, and only garbage collections that run are charged against the budget.
+ * Calling this function periodically, e.g. from an idle thread, keeps writes from having to
+ * garbage collect, and spreads the garbage collections of instances that share a storage device
+ * over time.
+ *
+ * Garbage collections of instances that use the same block device (the same
+ * \ref mtb_kvstore_bd_t object), whether they are run by this function or by a write, never erase
+ * and copy records at the same time. Instances on different block devices are not serialized.
+ *
+ * @param[in]   budget Maximum number of bytes to erase and program in total, or
+ *                     \ref MTB_KVSTORE_MAINTENANCE_UNLIMITED.
+ *
+ * @return      Result of the operation. The first error of a garbage collection is returned, the
+ *              other instances are still compacted.
+ */
+cy_rslt_t mtb_kvstore_maintenance_all(uint32_t budget);
+
 /** Reset kv-store storage.
  *
  * This function erases all the data in the storage.
@@ -412,6 +1100,149 @@ cy_rslt_t mtb_kvstore_reset(mtb_kvstore_t* obj);
  */
 void mtb_kvstore_deinit(mtb_kvstore_t* obj);
 
+/** Initialize a sharded kv-store
+ *
+ * The storage is split into `num_shards` equally sized kv-store instances. Each key is stored in
+ * the shard selected by a hash of the key, so operations on keys in different shards take
+ * different locks and garbage collection of one shard does not block the others. The number of
+ * shards and the storage must stay the same across resets of the device for the keys to be found.
+ * The number of shards is recorded in the storage, and initializing storage that was written with
+ * a different number of shards, or as a single instance, fails with
+ * \ref MTB_KVSTORE_BAD_PARAM_ERROR. Storage written by earlier versions of the library does not
+ * record it and is not checked.
+ *
+ * @param[out]  obj          Pointer to a sharded kv-store object. The caller must allocate the
+ *                           memory for this object but the init function will initialize its
+ *                           contents.
+ * @param[in]   start_addr   Start address for the memory. See \ref mtb_kvstore_init.
+ * @param[in]   length       Total space available in bytes for all shards. It must be an even
+ *                           number of erase sectors per shard. (2 * N * num_shards * erase sector
+ *                           size) where N is the number of sectors.
+ * @param[in]   num_shards   Number of kv-store instances to split the storage into, at most 255.
+ * @param[in]   block_device Block device interface for the underlying memory to be used.
+ * @param[in]   config       Configuration of each shard. NULL selects the default configuration.
+ *
+ * @return Result of the initialization operation.
+ */
+cy_rslt_t mtb_kvstore_sharded_init(mtb_kvstore_sharded_t* obj, uint32_t start_addr,
+                                   uint32_t length, uint32_t num_shards,
+                                   const mtb_kvstore_bd_t* block_device,
+                                   const mtb_kvstore_config_t* config);
+
+/** Get the shard that stores a key
+ *
+ * The returned instance can be used with any kv-store function for the key, e.g. to append to
+ * its value or to increment a counter.
+ *
+ * @param[in] obj Pointer to a sharded kv-store object
+ * @param[in] key Lookup key for the data.
+ *
+ * @return Pointer to the kv-store instance that stores the key.
+ */
+mtb_kvstore_t* mtb_kvstore_sharded_get_shard(mtb_kvstore_sharded_t* obj, const char* key);
+
+/** Store a key value pair in a sharded kv-store
+ *
+ * @param[in] obj  Pointer to a sharded kv-store object
+ * @param[in] key  Lookup key for the data.
+ * @param[in] data Pointer to the start of the data to be stored.
+ * @param[in] size Total size of the data in bytes.
+ *
+ * @return Result of the write operation. See \ref mtb_kvstore_write.
+ */
+cy_rslt_t mtb_kvstore_sharded_write(mtb_kvstore_sharded_t* obj, const char* key,
+                                    const uint8_t* data, uint32_t size);
+
+/** Read the value associated with a key from a sharded kv-store
+ *
+ * @param[in]     obj  Pointer to a sharded kv-store object
+ * @param[in]     key  Lookup key for the data.
+ * @param[out]    data Pointer to the start of the buffer for the data to be read into.
+ * @param[in,out] size Size of the buffer in bytes on input, size of the value on output.
+ *
+ * @return Result of the read operation. See \ref mtb_kvstore_read.
+ */
+cy_rslt_t mtb_kvstore_sharded_read(mtb_kvstore_sharded_t* obj, const char* key, uint8_t* data,
+                                   uint32_t* size);
+
+/** Read part of the value associated with a key from a sharded kv-store
+ *
+ * @param[in]     obj          Pointer to a sharded kv-store object
+ * @param[in]     key          Lookup key for the data.
+ * @param[out]    data         Pointer to the start of the buffer for the data to be read into.
+ * @param[in,out] size         Number of bytes to read on input, bytes read on output.
+ * @param[in]     offset_bytes Offset in bytes from the start of the value.
+ *
+ * @return Result of the read operation. See \ref mtb_kvstore_read_partial.
+ */
+cy_rslt_t mtb_kvstore_sharded_read_partial(mtb_kvstore_sharded_t* obj, const char* key,
+                                           uint8_t* data, uint32_t* size,
+                                           const uint32_t offset_bytes);
+
+/** Check if a key exists in a sharded kv-store
+ *
+ * @param[in] obj Pointer to a sharded kv-store object
+ * @param[in] key Lookup key for the data.
+ *
+ * @return Result of the operation. See \ref mtb_kvstore_key_exists.
+ */
+cy_rslt_t mtb_kvstore_sharded_key_exists(mtb_kvstore_sharded_t* obj, const char* key);
+
+/** Query the size of the value associated with a key in a sharded kv-store
+ *
+ * @param[in]  obj  Pointer to a sharded kv-store object
+ * @param[in]  key  Lookup key for the data.
+ * @param[out] size Size of the value in bytes.
+ *
+ * @return Result of the operation. See \ref mtb_kvstore_value_size.
+ */
+cy_rslt_t mtb_kvstore_sharded_value_size(mtb_kvstore_sharded_t* obj, const char* key,
+                                         uint32_t* size);
+
+/** Delete a key value pair from a sharded kv-store
+ *
+ * @param[in] obj Pointer to a sharded kv-store object
+ * @param[in] key Lookup key for the data.
+ *
+ * @return Result of the delete operation. See \ref mtb_kvstore_delete.
+ */
+cy_rslt_t mtb_kvstore_sharded_delete(mtb_kvstore_sharded_t* obj, const char* key);
+
+/** Query the size consumed in all shards of a sharded kv-store.
+ *
+ * @param[in]   obj  Pointer to a sharded kv-store object.
+ *
+ * @return      Size of storage consumed in bytes.
+ */
+uint32_t mtb_kvstore_sharded_size(mtb_kvstore_sharded_t* obj);
+
+/** Query the free space available in all shards of a sharded kv-store.
+ *
+ * As each key can only be stored in its own shard, a value may not fit even if it is smaller than
+ * the free space of all shards.
+ *
+ * @param[in]   obj  Pointer to a sharded kv-store object
+ *
+ * @return      Size of storage free in bytes.
+ */
+uint32_t mtb_kvstore_sharded_remaining_size(mtb_kvstore_sharded_t* obj);
+
+/** Reset all shards of a sharded kv-store.
+ *
+ * @param[in]   obj Pointer to a sharded kv-store object
+ *
+ * @return Result of the reset operation. The shards after the first one that fails are not reset.
+ */
+cy_rslt_t mtb_kvstore_sharded_reset(mtb_kvstore_sharded_t* obj);
+
+/** Delete a sharded kv-store instance.
+ *
+ * This function frees any program memory allocated by the library for all shards.
+ *
+ * @param[in]   obj Pointer to a sharded kv-store object
+ */
+void mtb_kvstore_sharded_deinit(mtb_kvstore_sharded_t* obj);
+
 #if defined(__cplusplus)
 }
 #endif
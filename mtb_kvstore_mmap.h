@@ -0,0 +1,365 @@
+/***********************************************************************************************//**
+ * \file mtb_kvstore_mmap.h
+ *
+ * \brief
+ * Block device for the kv-store library that is backed by a memory mapped file, for host builds.
+ *
+ ***************************************************************************************************
+ * \copyright
+ * Copyright 2018-2022 Cypress Semiconductor Corporation (an Infineon company) or
+ * an affiliate of Cypress Semiconductor Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************************************/
+#pragma once
+
+// This file is included by host applications (e.g. tools, simulations, tests and benchmarks on
+// Linux) that want to run the kv-store library on a file instead of flash. It is not included by
+// mtb_kvstore.h. The functions are static inline so that the library builds for targets without
+// POSIX never compile them.
+//
+// ftruncate and msync are POSIX.1-2008 functions, which the C library does not declare in strict
+// ISO C modes such as -std=c11. The feature test macro below selects them if this header is
+// included before any system header. Otherwise it must be defined on the command line, e.g. with
+// -D_POSIX_C_SOURCE=200809L.
+
+#if !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cy_result.h"
+#include "mtb_kvstore.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+ * \addtogroup group_kvstore
+ * \{
+ */
+
+/** When programmed and erased data of a \ref mtb_kvstore_mmap_t device is written to the file. */
+typedef enum
+{
+    /** The kernel writes the data back to the file at its own pace. Other processes that map the
+     * file see it immediately, but it can be lost on a power failure. This is the fastest mode. */
+    MTB_KVSTORE_MMAP_DURABILITY_NONE,
+    /** Every program and erase operation starts writing the data back to the file (MS_ASYNC). */
+    MTB_KVSTORE_MMAP_DURABILITY_ASYNC,
+    /** Every program and erase operation returns after the data is written to the file (MS_SYNC),
+     * like with flash. */
+    MTB_KVSTORE_MMAP_DURABILITY_SYNC
+} mtb_kvstore_mmap_durability_t;
+
+/** Geometry and durability of a \ref mtb_kvstore_mmap_t device. */
+typedef struct
+{
+    uint32_t                        size;           /**< Size of the device and the file in bytes,
+                                                       a multiple of erase_size */
+    uint32_t                        read_size;      /**< Read size of the device */
+    uint32_t                        program_size;   /**< Program size of the device, a multiple
+                                                       of read_size */
+    uint32_t                        erase_size;     /**< Erase size of the device, a multiple of
+                                                       program_size */
+    uint8_t                         erased_value;   /**< Value of the bytes in the erased state,
+                                                       0xFF or 0x00 */
+    mtb_kvstore_mmap_durability_t   durability;     /**< When changes are written to the file */
+} mtb_kvstore_mmap_config_t;
+
+/** Memory mapped file block device. All fields are for internal use. */
+typedef struct
+{
+    uint8_t*                        mem;
+    int                             fd;
+    uint32_t                        page_size;
+    mtb_kvstore_mmap_config_t       config;
+} mtb_kvstore_mmap_t;
+
+/** \} group_kvstore */
+
+/** \cond INTERNAL */
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_mmap_in_range
+//--------------------------------------------------------------------------------------------------
+static inline bool _mtb_kvstore_mmap_in_range(const mtb_kvstore_mmap_t* obj, uint32_t addr,
+                                              uint32_t length)
+{
+    return (addr <= obj->config.size) && (length <= obj->config.size - addr);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_mmap_sync
+//--------------------------------------------------------------------------------------------------
+static inline cy_rslt_t _mtb_kvstore_mmap_sync(mtb_kvstore_mmap_t* obj, uint32_t addr,
+                                               uint32_t length)
+{
+    if (obj->config.durability == MTB_KVSTORE_MMAP_DURABILITY_NONE)
+    {
+        return CY_RSLT_SUCCESS;
+    }
+
+    // msync() needs a page aligned address.
+    uint32_t start = addr - (addr % obj->page_size);
+    int flags = (obj->config.durability == MTB_KVSTORE_MMAP_DURABILITY_SYNC) ? MS_SYNC : MS_ASYNC;
+    return (msync(obj->mem + start, (size_t)(addr - start) + length, flags) == 0)
+        ? CY_RSLT_SUCCESS
+        : MTB_KVSTORE_IO_ERROR;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_mmap_read
+//--------------------------------------------------------------------------------------------------
+static inline cy_rslt_t _mtb_kvstore_mmap_read(void* context, uint32_t addr, uint32_t length,
+                                               uint8_t* buf)
+{
+    mtb_kvstore_mmap_t* obj = (mtb_kvstore_mmap_t*)context;
+    if (!_mtb_kvstore_mmap_in_range(obj, addr, length))
+    {
+        return MTB_KVSTORE_BAD_PARAM_ERROR;
+    }
+    memcpy(buf, obj->mem + addr, length);
+    return CY_RSLT_SUCCESS;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_mmap_program
+//--------------------------------------------------------------------------------------------------
+static inline cy_rslt_t _mtb_kvstore_mmap_program(void* context, uint32_t addr, uint32_t length,
+                                                  const uint8_t* buf)
+{
+    mtb_kvstore_mmap_t* obj = (mtb_kvstore_mmap_t*)context;
+    if (!_mtb_kvstore_mmap_in_range(obj, addr, length) ||
+        ((addr % obj->config.program_size) != 0U) || ((length % obj->config.program_size) != 0U))
+    {
+        return MTB_KVSTORE_BAD_PARAM_ERROR;
+    }
+
+    // Like flash, programming only moves bits away from the erased state, so a location that was
+    // already programmed keeps the bits that were programmed before.
+    uint8_t erased = obj->config.erased_value;
+    uint8_t* dest = obj->mem + addr;
+    for (uint32_t i = 0; i < length; i++)
+    {
+        dest[i] = (uint8_t)(erased ^ ((dest[i] ^ erased) | (buf[i] ^ erased)));
+    }
+    return _mtb_kvstore_mmap_sync(obj, addr, length);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_mmap_erase
+//--------------------------------------------------------------------------------------------------
+static inline cy_rslt_t _mtb_kvstore_mmap_erase(void* context, uint32_t addr, uint32_t length)
+{
+    mtb_kvstore_mmap_t* obj = (mtb_kvstore_mmap_t*)context;
+    if (!_mtb_kvstore_mmap_in_range(obj, addr, length) ||
+        ((addr % obj->config.erase_size) != 0U) || ((length % obj->config.erase_size) != 0U))
+    {
+        return MTB_KVSTORE_BAD_PARAM_ERROR;
+    }
+    memset(obj->mem + addr, obj->config.erased_value, length);
+    return _mtb_kvstore_mmap_sync(obj, addr, length);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_mmap_read_size
+//--------------------------------------------------------------------------------------------------
+static inline uint32_t _mtb_kvstore_mmap_read_size(void* context, uint32_t addr)
+{
+    (void)addr;
+    return ((mtb_kvstore_mmap_t*)context)->config.read_size;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_mmap_program_size
+//--------------------------------------------------------------------------------------------------
+static inline uint32_t _mtb_kvstore_mmap_program_size(void* context, uint32_t addr)
+{
+    (void)addr;
+    return ((mtb_kvstore_mmap_t*)context)->config.program_size;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_mmap_erase_size
+//--------------------------------------------------------------------------------------------------
+static inline uint32_t _mtb_kvstore_mmap_erase_size(void* context, uint32_t addr)
+{
+    (void)addr;
+    return ((mtb_kvstore_mmap_t*)context)->config.erase_size;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_mmap_map
+//--------------------------------------------------------------------------------------------------
+static inline const uint8_t* _mtb_kvstore_mmap_map(void* context, uint32_t addr)
+{
+    mtb_kvstore_mmap_t* obj = (mtb_kvstore_mmap_t*)context;
+    return (addr < obj->config.size) ? (obj->mem + addr) : NULL;
+}
+
+
+/** \endcond */
+
+/**
+ * \addtogroup group_kvstore
+ * \{
+ */
+
+/**
+ * \brief Opens a file as a memory mapped block device and fills in the block device interface
+ * that is passed to \ref mtb_kvstore_init.
+ *
+ * If the file does not exist or is empty, it is created with the configured size and all of its
+ * bytes erased. Otherwise its size must match the configured size and its content is used as is,
+ * so that the kv-store persists across runs. Reads copy from the mapping. Programs and erases
+ * change the mapping and are written to the file as configured by the durability. If the erased
+ * value is 0xFF, the device has the \ref MTB_KVSTORE_BD_CAP_BIT_CLEAR capability. It always has
+ * the \ref MTB_KVSTORE_BD_CAP_PARALLEL_READ capability and provides \ref mtb_kvstore_bd_t::map, for
+ * \ref mtb_kvstore_get_view.
+ *
+ * @param[out] obj          Pointer to a block device object. The caller must allocate the memory
+ *                          for this object but the init function will initialize its contents.
+ *                          It must stay valid while the block device is used.
+ * @param[in]  path         Path of the file. A file on a tmpfs file system such as /dev/shm is
+ *                          never written to a disk.
+ * @param[in]  config       Geometry and durability of the device
+ * @param[out] block_device Block device interface to initialize
+ * @return Result of the initialization operation. MTB_KVSTORE_BAD_PARAM_ERROR if the geometry is
+ *         invalid or the size of an existing file does not match, MTB_KVSTORE_IO_ERROR if the
+ *         file cannot be opened, sized or mapped (errno holds the cause).
+ */
+static inline cy_rslt_t mtb_kvstore_mmap_init(mtb_kvstore_mmap_t* obj, const char* path,
+                                              const mtb_kvstore_mmap_config_t* config,
+                                              mtb_kvstore_bd_t* block_device)
+{
+    if ((obj == NULL) || (path == NULL) || (config == NULL) || (block_device == NULL) ||
+        (config->read_size == 0U) || (config->program_size == 0U) ||
+        (config->erase_size == 0U) || (config->size == 0U) ||
+        ((config->program_size % config->read_size) != 0U) ||
+        ((config->erase_size % config->program_size) != 0U) ||
+        ((config->size % config->erase_size) != 0U) ||
+        ((config->erased_value != 0xFFU) && (config->erased_value != 0x00U)))
+    {
+        return MTB_KVSTORE_BAD_PARAM_ERROR;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        return MTB_KVSTORE_IO_ERROR;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        (void)close(fd);
+        return MTB_KVSTORE_IO_ERROR;
+    }
+
+    bool is_new = (st.st_size == 0);
+    if (!is_new && (st.st_size != (off_t)config->size))
+    {
+        (void)close(fd);
+        return MTB_KVSTORE_BAD_PARAM_ERROR;
+    }
+    if (is_new && (ftruncate(fd, (off_t)config->size) != 0))
+    {
+        (void)close(fd);
+        return MTB_KVSTORE_IO_ERROR;
+    }
+
+    void* mem = mmap(NULL, config->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED)
+    {
+        (void)close(fd);
+        return MTB_KVSTORE_IO_ERROR;
+    }
+
+    obj->mem = (uint8_t*)mem;
+    obj->fd = fd;
+    obj->page_size = (uint32_t)sysconf(_SC_PAGESIZE);
+    obj->config = *config;
+
+    if (is_new)
+    {
+        memset(obj->mem, config->erased_value, config->size);
+        if (msync(obj->mem, config->size, MS_SYNC) != 0)
+        {
+            (void)munmap(obj->mem, config->size);
+            (void)close(fd);
+            return MTB_KVSTORE_IO_ERROR;
+        }
+    }
+
+    block_device->read = _mtb_kvstore_mmap_read;
+    block_device->program = _mtb_kvstore_mmap_program;
+    block_device->erase = _mtb_kvstore_mmap_erase;
+    block_device->read_size = _mtb_kvstore_mmap_read_size;
+    block_device->program_size = _mtb_kvstore_mmap_program_size;
+    block_device->erase_size = _mtb_kvstore_mmap_erase_size;
+    block_device->context = obj;
+    block_device->capabilities = MTB_KVSTORE_BD_CAP_PARALLEL_READ;
+    if (config->erased_value == 0xFFU)
+    {
+        block_device->capabilities |= MTB_KVSTORE_BD_CAP_BIT_CLEAR;
+    }
+    block_device->map = _mtb_kvstore_mmap_map;
+    return CY_RSLT_SUCCESS;
+}
+
+
+/**
+ * \brief Writes all changes to the file and closes a memory mapped block device.
+ *
+ * The kv-store instance that uses the device must be deinitialized first.
+ *
+ * @param[in] obj Pointer to a block device object initialized by \ref mtb_kvstore_mmap_init
+ * @return Result of writing the changes to the file.
+ */
+static inline cy_rslt_t mtb_kvstore_mmap_deinit(mtb_kvstore_mmap_t* obj)
+{
+    cy_rslt_t result = (msync(obj->mem, obj->config.size, MS_SYNC) == 0)
+        ? CY_RSLT_SUCCESS
+        : MTB_KVSTORE_IO_ERROR;
+    (void)munmap(obj->mem, obj->config.size);
+    (void)close(obj->fd);
+    obj->mem = NULL;
+    obj->fd = -1;
+    return result;
+}
+
+
+/** \} group_kvstore */
+
+#if defined(__cplusplus)
+}
+#endif
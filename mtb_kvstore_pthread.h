@@ -0,0 +1,386 @@
+/***********************************************************************************************//**
+ * \file mtb_kvstore_pthread.h
+ *
+ * \brief
+ * POSIX threads implementation of the RTOS abstraction functions used by the kv-store library.
+ *
+ ***************************************************************************************************
+ * \copyright
+ * Copyright 2018-2022 Cypress Semiconductor Corporation (an Infineon company) or
+ * an affiliate of Cypress Semiconductor Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************************************/
+#pragma once
+
+// This file is included by mtb_kvstore.h when MTB_KVSTORE_PTHREAD is defined and the
+// abstraction-rtos library is not used. It provides the subset of the cyabs_rtos API that the
+// kv-store library uses, with the same semantics, so that the library can run multithreaded on a
+// host such as Linux. The functions are static inline so that they never clash with a real
+// abstraction-rtos library linked into the same application.
+//
+// The implementation uses POSIX.1-2008 and XSI functions (e.g. pthread_mutex_timedlock and
+// recursive mutexes), which the C library does not declare in strict ISO C modes such as -std=c11.
+// The feature test macros below select them, but only take effect if no system header was
+// included before. mtb_kvstore.h and mtb_kvstore.c define them first thing, other files that
+// include system headers before mtb_kvstore.h must define them on the command line, e.g. with
+// -D_POSIX_C_SOURCE=200809L -D_XOPEN_SOURCE=700.
+
+#if !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+#if !defined(_XOPEN_SOURCE)
+#define _XOPEN_SOURCE 700
+#endif
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+#include <errno.h>
+#include "cy_result.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/** \cond INTERNAL */
+
+#define CY_RTOS_TIMEOUT \
+    CY_RSLT_CREATE(CY_RSLT_TYPE_ERROR, CY_RSLT_MODULE_ABSTRACTION_OS, 0)
+#define CY_RTOS_NO_MEMORY \
+    CY_RSLT_CREATE(CY_RSLT_TYPE_ERROR, CY_RSLT_MODULE_ABSTRACTION_OS, 1)
+#define CY_RTOS_GENERAL_ERROR \
+    CY_RSLT_CREATE(CY_RSLT_TYPE_ERROR, CY_RSLT_MODULE_ABSTRACTION_OS, 2)
+
+#define CY_RTOS_NEVER_TIMEOUT               ((uint32_t)0xFFFFFFFFUL)
+
+typedef uint32_t cy_time_t;
+typedef void* cy_thread_arg_t;
+typedef void (* cy_thread_entry_fn_t)(cy_thread_arg_t arg);
+
+typedef enum
+{
+    CY_RTOS_PRIORITY_MIN,
+    CY_RTOS_PRIORITY_LOW,
+    CY_RTOS_PRIORITY_BELOWNORMAL,
+    CY_RTOS_PRIORITY_NORMAL,
+    CY_RTOS_PRIORITY_ABOVENORMAL,
+    CY_RTOS_PRIORITY_HIGH,
+    CY_RTOS_PRIORITY_REALTIME,
+    CY_RTOS_PRIORITY_MAX
+} cy_thread_priority_t;
+
+// Mutexes and semaphores are handles, like with the RTOS ports, so that they can be copied.
+typedef pthread_mutex_t* cy_mutex_t;
+
+typedef struct
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    uint32_t        count;
+    uint32_t        max_count;
+} _mtb_kvstore_pthread_semaphore_t;
+
+typedef _mtb_kvstore_pthread_semaphore_t* cy_semaphore_t;
+
+typedef struct
+{
+    pthread_t            handle;
+    cy_thread_entry_fn_t entry_function;
+    cy_thread_arg_t      arg;
+} cy_thread_t;
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_pthread_deadline
+//--------------------------------------------------------------------------------------------------
+static inline void _mtb_kvstore_pthread_deadline(clockid_t clock, cy_time_t timeout_ms,
+                                                 struct timespec* deadline)
+{
+    (void)clock_gettime(clock, deadline);
+    deadline->tv_sec += (time_t)(timeout_ms / 1000U);
+    deadline->tv_nsec += (long)(timeout_ms % 1000U) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L)
+    {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// cy_rtos_init_mutex
+//--------------------------------------------------------------------------------------------------
+static inline cy_rslt_t cy_rtos_init_mutex(cy_mutex_t* mutex)
+{
+    // Like the RTOS ports, mutexes are recursive.
+    pthread_mutexattr_t attr;
+    cy_rslt_t result = CY_RSLT_SUCCESS;
+    *mutex = (pthread_mutex_t*)malloc(sizeof(pthread_mutex_t));
+    if (*mutex == NULL)
+    {
+        result = CY_RTOS_NO_MEMORY;
+    }
+    else if ((pthread_mutexattr_init(&attr) != 0) ||
+             (pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE) != 0) ||
+             (pthread_mutex_init(*mutex, &attr) != 0))
+    {
+        free(*mutex);
+        *mutex = NULL;
+        result = CY_RTOS_GENERAL_ERROR;
+    }
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// cy_rtos_get_mutex
+//--------------------------------------------------------------------------------------------------
+static inline cy_rslt_t cy_rtos_get_mutex(cy_mutex_t* mutex, cy_time_t timeout_ms)
+{
+    int status;
+    if (timeout_ms == CY_RTOS_NEVER_TIMEOUT)
+    {
+        status = pthread_mutex_lock(*mutex);
+    }
+    else
+    {
+        // pthread_mutex_timedlock only supports CLOCK_REALTIME.
+        struct timespec deadline;
+        _mtb_kvstore_pthread_deadline(CLOCK_REALTIME, timeout_ms, &deadline);
+        status = pthread_mutex_timedlock(*mutex, &deadline);
+    }
+    return (status == 0)
+           ? CY_RSLT_SUCCESS
+           : ((status == ETIMEDOUT) ? CY_RTOS_TIMEOUT : CY_RTOS_GENERAL_ERROR);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// cy_rtos_set_mutex
+//--------------------------------------------------------------------------------------------------
+static inline cy_rslt_t cy_rtos_set_mutex(cy_mutex_t* mutex)
+{
+    return (pthread_mutex_unlock(*mutex) == 0) ? CY_RSLT_SUCCESS : CY_RTOS_GENERAL_ERROR;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// cy_rtos_deinit_mutex
+//--------------------------------------------------------------------------------------------------
+static inline cy_rslt_t cy_rtos_deinit_mutex(cy_mutex_t* mutex)
+{
+    int status = pthread_mutex_destroy(*mutex);
+    free(*mutex);
+    *mutex = NULL;
+    return (status == 0) ? CY_RSLT_SUCCESS : CY_RTOS_GENERAL_ERROR;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// cy_rtos_init_semaphore
+//--------------------------------------------------------------------------------------------------
+static inline cy_rslt_t cy_rtos_init_semaphore(cy_semaphore_t* semaphore, uint32_t maxcount,
+                                               uint32_t initcount)
+{
+    // A POSIX semaphore has no maximum count, so it is built from a mutex and a condition variable
+    // that waits on the monotonic clock.
+    pthread_condattr_t attr;
+    cy_rslt_t result = CY_RSLT_SUCCESS;
+    *semaphore = (cy_semaphore_t)malloc(sizeof(_mtb_kvstore_pthread_semaphore_t));
+    if (*semaphore == NULL)
+    {
+        result = CY_RTOS_NO_MEMORY;
+    }
+    else if (pthread_mutex_init(&(*semaphore)->mutex, NULL) != 0)
+    {
+        free(*semaphore);
+        *semaphore = NULL;
+        result = CY_RTOS_GENERAL_ERROR;
+    }
+    else if ((pthread_condattr_init(&attr) != 0) ||
+             (pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) != 0) ||
+             (pthread_cond_init(&(*semaphore)->cond, &attr) != 0))
+    {
+        (void)pthread_mutex_destroy(&(*semaphore)->mutex);
+        free(*semaphore);
+        *semaphore = NULL;
+        result = CY_RTOS_GENERAL_ERROR;
+    }
+    else
+    {
+        (*semaphore)->count = initcount;
+        (*semaphore)->max_count = maxcount;
+    }
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// cy_rtos_get_semaphore
+//--------------------------------------------------------------------------------------------------
+static inline cy_rslt_t cy_rtos_get_semaphore(cy_semaphore_t* semaphore, cy_time_t timeout_ms,
+                                              bool in_isr)
+{
+    (void)in_isr;
+    _mtb_kvstore_pthread_semaphore_t* sem = *semaphore;
+    struct timespec deadline;
+    int status = 0;
+    if (timeout_ms != CY_RTOS_NEVER_TIMEOUT)
+    {
+        _mtb_kvstore_pthread_deadline(CLOCK_MONOTONIC, timeout_ms, &deadline);
+    }
+
+    (void)pthread_mutex_lock(&sem->mutex);
+    while ((sem->count == 0) && (status == 0))
+    {
+        status = (timeout_ms == CY_RTOS_NEVER_TIMEOUT)
+                 ? pthread_cond_wait(&sem->cond, &sem->mutex)
+                 : pthread_cond_timedwait(&sem->cond, &sem->mutex, &deadline);
+    }
+    if (sem->count > 0)
+    {
+        sem->count--;
+        status = 0;
+    }
+    (void)pthread_mutex_unlock(&sem->mutex);
+
+    return (status == 0)
+           ? CY_RSLT_SUCCESS
+           : ((status == ETIMEDOUT) ? CY_RTOS_TIMEOUT : CY_RTOS_GENERAL_ERROR);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// cy_rtos_set_semaphore
+//--------------------------------------------------------------------------------------------------
+static inline cy_rslt_t cy_rtos_set_semaphore(cy_semaphore_t* semaphore, bool in_isr)
+{
+    (void)in_isr;
+    _mtb_kvstore_pthread_semaphore_t* sem = *semaphore;
+    cy_rslt_t result = CY_RSLT_SUCCESS;
+
+    (void)pthread_mutex_lock(&sem->mutex);
+    if (sem->count < sem->max_count)
+    {
+        sem->count++;
+        (void)pthread_cond_signal(&sem->cond);
+    }
+    else
+    {
+        result = CY_RTOS_GENERAL_ERROR;
+    }
+    (void)pthread_mutex_unlock(&sem->mutex);
+
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// cy_rtos_deinit_semaphore
+//--------------------------------------------------------------------------------------------------
+static inline cy_rslt_t cy_rtos_deinit_semaphore(cy_semaphore_t* semaphore)
+{
+    int status = pthread_cond_destroy(&(*semaphore)->cond);
+    if (pthread_mutex_destroy(&(*semaphore)->mutex) != 0)
+    {
+        status = -1;
+    }
+    free(*semaphore);
+    *semaphore = NULL;
+    return (status == 0) ? CY_RSLT_SUCCESS : CY_RTOS_GENERAL_ERROR;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// _mtb_kvstore_pthread_entry
+//--------------------------------------------------------------------------------------------------
+static inline void* _mtb_kvstore_pthread_entry(void* arg)
+{
+    cy_thread_t* thread = (cy_thread_t*)arg;
+    thread->entry_function(thread->arg);
+    return NULL;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// cy_rtos_create_thread
+//--------------------------------------------------------------------------------------------------
+static inline cy_rslt_t cy_rtos_create_thread(cy_thread_t* thread,
+                                              cy_thread_entry_fn_t entry_function,
+                                              const char* name, void* stack,
+                                              uint32_t stack_size,
+                                              cy_thread_priority_t priority,
+                                              cy_thread_arg_t arg)
+{
+    // The stack sizes chosen for an MCU are too small for a host thread, so the default stack is
+    // used. Priorities are left to the host scheduler.
+    (void)name;
+    (void)stack;
+    (void)stack_size;
+    (void)priority;
+    thread->entry_function = entry_function;
+    thread->arg = arg;
+    return (pthread_create(&thread->handle, NULL, _mtb_kvstore_pthread_entry, thread) == 0)
+           ? CY_RSLT_SUCCESS
+           : CY_RTOS_GENERAL_ERROR;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// cy_rtos_exit_thread
+//--------------------------------------------------------------------------------------------------
+static inline cy_rslt_t cy_rtos_exit_thread(void)
+{
+    pthread_exit(NULL);
+    return CY_RSLT_SUCCESS;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// cy_rtos_join_thread
+//--------------------------------------------------------------------------------------------------
+static inline cy_rslt_t cy_rtos_join_thread(cy_thread_t* thread)
+{
+    return (pthread_join(thread->handle, NULL) == 0) ? CY_RSLT_SUCCESS : CY_RTOS_GENERAL_ERROR;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// cy_rtos_delay_milliseconds
+//--------------------------------------------------------------------------------------------------
+static inline cy_rslt_t cy_rtos_delay_milliseconds(cy_time_t num_ms)
+{
+    struct timespec delay;
+    delay.tv_sec = (time_t)(num_ms / 1000U);
+    delay.tv_nsec = (long)(num_ms % 1000U) * 1000000L;
+    while (nanosleep(&delay, &delay) != 0)
+    {
+        if (errno != EINTR)
+        {
+            return CY_RTOS_GENERAL_ERROR;
+        }
+    }
+    return CY_RSLT_SUCCESS;
+}
+
+
+/** \endcond */
+
+#if defined(__cplusplus)
+}
+#endif
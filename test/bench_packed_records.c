@@ -0,0 +1,156 @@
+/***********************************************************************************************//**
+ * \file bench_packed_records.c
+ *
+ * \brief
+ * Space efficiency of packed records against records padded to the program size, for a set of
+ * device settings that are updated at random. For program sizes from 16 to 512 bytes it reports the
+ * storage that the settings occupy, and the bytes programmed, program calls and erases per update.
+ * The optional argument is the number of updates.
+ *
+ ***************************************************************************************************
+ * \copyright
+ * Copyright 2018-2022 Cypress Semiconductor Corporation (an Infineon company) or
+ * an affiliate of Cypress Semiconductor Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************************************/
+
+#include "test_bd.h"
+
+typedef struct
+{
+    const char* key;
+    uint32_t    size;
+} setting_t;
+
+// Settings of a connected device: flags, counters, short strings and a few larger blobs.
+static const setting_t settings[] =
+{
+    { "wifi/ssid",          12  },
+    { "wifi/pass",          16  },
+    { "wifi/chan",          1   },
+    { "wifi/sec",           1   },
+    { "net/ip",             4   },
+    { "net/mask",           4   },
+    { "net/gw",             4   },
+    { "net/dns",            8   },
+    { "dev/name",           20  },
+    { "dev/boots",          4   },
+    { "dev/uptime",         8   },
+    { "dev/tz",             2   },
+    { "dev/led",            1   },
+    { "dev/volume",         1   },
+    { "cloud/url",          48  },
+    { "cloud/token",        64  },
+    { "cloud/interval",     4   },
+    { "sensor/cal",         24  },
+    { "sensor/offset",      4   },
+    { "sensor/last",        8   },
+};
+
+#define NUM_SETTINGS        (sizeof(settings) / sizeof(settings[0]))
+#define STORAGE_SIZE        (TEST_BD_SIZE)
+
+static mtb_kvstore_bd_t bd;
+
+
+//--------------------------------------------------------------------------------------------------
+// write_setting
+//--------------------------------------------------------------------------------------------------
+static void write_setting(mtb_kvstore_t* kv, size_t idx, uint32_t update)
+{
+    uint8_t value[64];
+    memset(value, (int)update, settings[idx].size);
+    TEST_CHECK(mtb_kvstore_write(kv, settings[idx].key, value, settings[idx].size) ==
+               CY_RSLT_SUCCESS);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// run_config
+//--------------------------------------------------------------------------------------------------
+static void run_config(uint32_t program_size, bool packed, bool compact, uint32_t updates)
+{
+    test_bd_init(&bd, program_size, MTB_KVSTORE_BD_CAP_BIT_CLEAR);
+    mtb_kvstore_config_t config = { 0 };
+    config.packed_records = packed;
+    config.compact_headers = compact;
+    mtb_kvstore_t kv;
+    TEST_CHECK(mtb_kvstore_init_with_config(&kv, 0, STORAGE_SIZE, &bd, &config) ==
+               CY_RSLT_SUCCESS);
+    uint32_t empty_size = mtb_kvstore_size(&kv);
+    for (size_t i = 0; i < NUM_SETTINGS; i++)
+    {
+        write_setting(&kv, i, 0);
+    }
+    uint32_t settings_size = mtb_kvstore_size(&kv) - empty_size;
+
+    unsigned long programmed_bytes = test_bd.programmed_bytes;
+    unsigned long programs = test_bd.programs;
+    unsigned long erases = test_bd.erases;
+    unsigned seed = 1;
+    for (uint32_t update = 1; update <= updates; update++)
+    {
+        write_setting(&kv, (size_t)rand_r(&seed) % NUM_SETTINGS, update);
+    }
+    programmed_bytes = test_bd.programmed_bytes - programmed_bytes;
+    programs = test_bd.programs - programs;
+    erases = test_bd.erases - erases;
+
+    // The settings survive reinitialization.
+    mtb_kvstore_deinit(&kv);
+    TEST_CHECK(mtb_kvstore_init_with_config(&kv, 0, STORAGE_SIZE, &bd, &config) ==
+               CY_RSLT_SUCCESS);
+    for (size_t i = 0; i < NUM_SETTINGS; i++)
+    {
+        uint32_t size;
+        TEST_CHECK(mtb_kvstore_value_size(&kv, settings[i].key, &size) == CY_RSLT_SUCCESS);
+        TEST_CHECK(size == settings[i].size);
+    }
+    mtb_kvstore_deinit(&kv);
+
+    printf("%8u %-16s %10u %14.1f %14.2f %14.4f\n", (unsigned)program_size,
+           packed ? (compact ? "packed, compact" : "packed") : "padded", (unsigned)settings_size,
+           (double)programmed_bytes / (double)updates, (double)programs / (double)updates,
+           (double)erases / (double)updates);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// main
+//--------------------------------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+    int updates = (argc > 1) ? atoi(argv[1]) : 20000;
+    TEST_CHECK(updates > 0);
+
+    uint32_t total_size = 0;
+    for (size_t i = 0; i < NUM_SETTINGS; i++)
+    {
+        total_size += settings[i].size;
+    }
+    printf("%u settings with %u bytes of values, %d random updates\n", (unsigned)NUM_SETTINGS,
+           (unsigned)total_size, updates);
+    printf("%8s %-16s %10s %14s %14s %14s\n", "program", "records", "size",
+           "bytes/update", "programs/upd", "erases/update");
+    static const uint32_t program_sizes[] = { 16, 64, 256, 512 };
+    for (size_t i = 0; i < sizeof(program_sizes) / sizeof(program_sizes[0]); i++)
+    {
+        run_config(program_sizes[i], false, false, (uint32_t)updates);
+        run_config(program_sizes[i], true, false, (uint32_t)updates);
+        run_config(program_sizes[i], true, true, (uint32_t)updates);
+    }
+    return 0;
+}
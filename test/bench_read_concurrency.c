@@ -0,0 +1,156 @@
+/***********************************************************************************************//**
+ * \file bench_read_concurrency.c
+ *
+ * \brief
+ * Read throughput of 1 to 16 reader threads while a writer thread keeps updating values. Linked
+ * with a library that has MTB_KVSTORE_LOCK_FREE_READS, the reads do not take the lock. The optional
+ * argument is the number of reads per thread.
+ *
+ ***************************************************************************************************
+ * \copyright
+ * Copyright 2018-2022 Cypress Semiconductor Corporation (an Infineon company) or
+ * an affiliate of Cypress Semiconductor Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************************************/
+
+#include "test_bd.h"
+#include <pthread.h>
+
+#define NUM_KEYS            (32)
+#define VALUE_SIZE          (64U)
+#define MAX_READERS         (16)
+#define WRITE_INTERVAL_US   (100U)
+
+static mtb_kvstore_bd_t bd;
+static mtb_kvstore_t kv;
+static bool readers_done;
+static unsigned long reads_per_thread;
+static unsigned long num_writes;
+static unsigned long num_timeouts;
+
+
+//--------------------------------------------------------------------------------------------------
+// reader_thread
+//--------------------------------------------------------------------------------------------------
+static void* reader_thread(void* arg)
+{
+    unsigned seed = (unsigned)(size_t)arg;
+    uint8_t buf[VALUE_SIZE];
+    for (unsigned long i = 0; i < reads_per_thread; i++)
+    {
+        char key[16];
+        sprintf(key, "key%d", rand_r(&seed) % NUM_KEYS);
+        uint32_t size = sizeof(buf);
+        cy_rslt_t result = mtb_kvstore_read(&kv, key, buf, &size);
+        if (test_timed_out(result))
+        {
+            __atomic_add_fetch(&num_timeouts, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        TEST_CHECK((result == CY_RSLT_SUCCESS) && (size == VALUE_SIZE));
+    }
+    return NULL;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// writer_thread
+//--------------------------------------------------------------------------------------------------
+static void* writer_thread(void* arg)
+{
+    (void)arg;
+    uint8_t value[VALUE_SIZE];
+    for (uint32_t i = 0; !__atomic_load_n(&readers_done, __ATOMIC_SEQ_CST); i++)
+    {
+        char key[16];
+        sprintf(key, "key%u", (unsigned)(i % NUM_KEYS));
+        memset(value, (int)i, sizeof(value));
+        cy_rslt_t result = mtb_kvstore_write(&kv, key, value, sizeof(value));
+        if (result == CY_RSLT_SUCCESS)
+        {
+            __atomic_add_fetch(&num_writes, 1, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            TEST_CHECK(test_timed_out(result));
+        }
+        test_sleep_us(WRITE_INTERVAL_US);
+    }
+    return NULL;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// run_readers
+//--------------------------------------------------------------------------------------------------
+static void run_readers(int num_readers)
+{
+    __atomic_store_n(&readers_done, false, __ATOMIC_SEQ_CST);
+    num_writes = 0;
+    num_timeouts = 0;
+    pthread_t writer;
+    TEST_CHECK(pthread_create(&writer, NULL, writer_thread, NULL) == 0);
+
+    double start_us = test_now_us();
+    pthread_t readers[MAX_READERS];
+    for (int i = 0; i < num_readers; i++)
+    {
+        TEST_CHECK(pthread_create(&readers[i], NULL, reader_thread, (void*)(size_t)(i + 1)) == 0);
+    }
+    for (int i = 0; i < num_readers; i++)
+    {
+        TEST_CHECK(pthread_join(readers[i], NULL) == 0);
+    }
+    double us = test_now_us() - start_us;
+    __atomic_store_n(&readers_done, true, __ATOMIC_SEQ_CST);
+    TEST_CHECK(pthread_join(writer, NULL) == 0);
+
+    printf("%8d %14.0f %10lu %10lu\n", num_readers,
+           ((double)reads_per_thread * (double)num_readers * 1e6) / us, num_writes, num_timeouts);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// main
+//--------------------------------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+    int reads = (argc > 1) ? atoi(argv[1]) : 200000;
+    TEST_CHECK(reads > 0);
+    reads_per_thread = (unsigned long)reads;
+
+    // Lock free reads need a device that can be read while it is programmed or erased.
+    test_bd_init(&bd, 16, MTB_KVSTORE_BD_CAP_PARALLEL_READ | MTB_KVSTORE_BD_CAP_CONCURRENT_READ);
+    TEST_CHECK(mtb_kvstore_init(&kv, 0, TEST_BD_SIZE, &bd) == CY_RSLT_SUCCESS);
+    uint8_t value[VALUE_SIZE] = { 0 };
+    for (int i = 0; i < NUM_KEYS; i++)
+    {
+        char key[16];
+        sprintf(key, "key%d", i);
+        TEST_CHECK(mtb_kvstore_write(&kv, key, value, sizeof(value)) == CY_RSLT_SUCCESS);
+    }
+
+    printf("%s reads, %d reads per thread, a write every %u us\n",
+           MTB_KVSTORE_LOCK_FREE_READS ? "lock free" : "locked", reads,
+           (unsigned)WRITE_INTERVAL_US);
+    printf("%8s %14s %10s %10s\n", "readers", "reads/s", "writes", "timeouts");
+    for (int num_readers = 1; num_readers <= MAX_READERS; num_readers *= 2)
+    {
+        run_readers(num_readers);
+    }
+    mtb_kvstore_deinit(&kv);
+    return 0;
+}
@@ -0,0 +1,172 @@
+/***********************************************************************************************//**
+ * \file bench_staging_buffer.c
+ *
+ * \brief
+ * Throughput of writes, reads and garbage collection for staging buffer sizes from the default
+ * to 4096 bytes, and with a default buffer that grows to 4096 bytes. The block device calls per
+ * operation show the effect of the buffer size independent of the host. The optional argument is
+ * the number of iterations.
+ *
+ ***************************************************************************************************
+ * \copyright
+ * Copyright 2018-2022 Cypress Semiconductor Corporation (an Infineon company) or
+ * an affiliate of Cypress Semiconductor Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************************************/
+
+#include "test_bd.h"
+
+#define NUM_KEYS            (8)
+#define VALUE_SIZE          (1500U)
+#define READS_PER_WRITE     (4)
+
+typedef struct
+{
+    uint32_t    buffer_size;
+    uint32_t    max_buffer_size;
+} bench_config_t;
+
+typedef struct
+{
+    double          us;
+    unsigned long   accesses;
+    unsigned long   ops;
+} bench_phase_t;
+
+static mtb_kvstore_bd_t bd;
+
+
+//--------------------------------------------------------------------------------------------------
+// phase_start
+//--------------------------------------------------------------------------------------------------
+static void phase_start(double* start_us, unsigned long* start_accesses)
+{
+    *start_us = test_now_us();
+    *start_accesses = test_bd_accesses();
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// phase_end
+//--------------------------------------------------------------------------------------------------
+static void phase_end(bench_phase_t* phase, double start_us, unsigned long start_accesses,
+                      unsigned long ops)
+{
+    phase->us += test_now_us() - start_us;
+    phase->accesses += test_bd_accesses() - start_accesses;
+    phase->ops += ops;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// run_config
+//--------------------------------------------------------------------------------------------------
+static void run_config(const bench_config_t* bench_config, int iterations)
+{
+    test_bd_init(&bd, 16, 0);
+    mtb_kvstore_config_t config = { 0 };
+    config.buffer_size = bench_config->buffer_size;
+    config.max_buffer_size = bench_config->max_buffer_size;
+    mtb_kvstore_t kv;
+    TEST_CHECK(mtb_kvstore_init_with_config(&kv, 0, TEST_BD_SIZE, &bd, &config) ==
+               CY_RSLT_SUCCESS);
+
+    // The values are written from an unaligned buffer, so that all of each value goes through
+    // the staging buffer.
+    static uint8_t value[VALUE_SIZE + 1];
+    static uint8_t buf[VALUE_SIZE];
+    bench_phase_t writes = { 0 };
+    bench_phase_t reads = { 0 };
+    bench_phase_t gc = { 0 };
+    double start_us;
+    unsigned long start_accesses;
+    for (int iter = 0; iter < iterations; iter++)
+    {
+        phase_start(&start_us, &start_accesses);
+        for (int i = 0; i < NUM_KEYS; i++)
+        {
+            char key[16];
+            sprintf(key, "key%d", i);
+            memset(&value[1], iter + i, VALUE_SIZE);
+            TEST_CHECK(mtb_kvstore_write(&kv, key, &value[1], VALUE_SIZE) == CY_RSLT_SUCCESS);
+        }
+        phase_end(&writes, start_us, start_accesses, NUM_KEYS);
+
+        phase_start(&start_us, &start_accesses);
+        for (int i = 0; i < NUM_KEYS * READS_PER_WRITE; i++)
+        {
+            char key[16];
+            sprintf(key, "key%d", i % NUM_KEYS);
+            uint32_t size = sizeof(buf);
+            TEST_CHECK(mtb_kvstore_read(&kv, key, buf, &size) == CY_RSLT_SUCCESS);
+            TEST_CHECK((size == VALUE_SIZE) && (buf[0] == (uint8_t)(iter + (i % NUM_KEYS))));
+        }
+        phase_end(&reads, start_us, start_accesses, NUM_KEYS * READS_PER_WRITE);
+
+        // Each round of writes leaves the previous values as garbage.
+        phase_start(&start_us, &start_accesses);
+        TEST_CHECK(mtb_kvstore_ensure_capacity(&kv, MTB_KVSTORE_ENSURE_MAX) == CY_RSLT_SUCCESS);
+        phase_end(&gc, start_us, start_accesses, 1);
+    }
+    mtb_kvstore_deinit(&kv);
+
+    char name[32];
+    if (bench_config->max_buffer_size != 0)
+    {
+        sprintf(name, "%u-%u", (unsigned)bench_config->buffer_size,
+                (unsigned)bench_config->max_buffer_size);
+    }
+    else
+    {
+        sprintf(name, "%u", (unsigned)bench_config->buffer_size);
+    }
+    printf("%-10s %12.1f %12.1f %12.1f %12.1f %12.1f %12.1f\n", name,
+           (double)(writes.ops * VALUE_SIZE) / writes.us,
+           (double)writes.accesses / (double)writes.ops,
+           (double)(reads.ops * VALUE_SIZE) / reads.us,
+           (double)reads.accesses / (double)reads.ops,
+           gc.us / (double)gc.ops, (double)gc.accesses / (double)gc.ops);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// main
+//--------------------------------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+    int iterations = (argc > 1) ? atoi(argv[1]) : 200;
+    TEST_CHECK(iterations > 0);
+
+    // 128 bytes is the default size for a device with a program size of 16 bytes.
+    static const bench_config_t configs[] =
+    {
+        { 128,  0    },
+        { 256,  0    },
+        { 512,  0    },
+        { 1024, 0    },
+        { 4096, 0    },
+        { 128,  4096 },
+    };
+    printf("%d iterations of %d writes and %d reads of %u byte values and a garbage collection\n",
+           iterations, NUM_KEYS, NUM_KEYS * READS_PER_WRITE, (unsigned)VALUE_SIZE);
+    printf("%-10s %12s %12s %12s %12s %12s %12s\n", "buffer", "write MB/s", "calls/write",
+           "read MB/s", "calls/read", "gc us", "calls/gc");
+    for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++)
+    {
+        run_config(&configs[i], iterations);
+    }
+    return 0;
+}
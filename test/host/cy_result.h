@@ -0,0 +1,58 @@
+/***********************************************************************************************//**
+ * \file cy_result.h
+ *
+ * \brief
+ * Host stand-in for cy_result.h of the core-lib library, with the subset that the kv-store uses.
+ * The result codes have the layout of core-lib, the module numbers only keep them apart.
+ *
+ ***************************************************************************************************
+ * \copyright
+ * Copyright 2018-2022 Cypress Semiconductor Corporation (an Infineon company) or
+ * an affiliate of Cypress Semiconductor Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************************************/
+#pragma once
+
+#include <stdint.h>
+
+/** Result of an operation, 0 on success */
+typedef uint32_t cy_rslt_t;
+
+#define CY_RSLT_SUCCESS                     ((cy_rslt_t)0x00000000U)
+
+#define CY_RSLT_TYPE_POSITION               (16U)
+#define CY_RSLT_TYPE_WIDTH                  (2U)
+#define CY_RSLT_MODULE_POSITION             (18U)
+#define CY_RSLT_MODULE_WIDTH                (14U)
+#define CY_RSLT_CODE_POSITION               (0U)
+#define CY_RSLT_CODE_WIDTH                  (16U)
+
+#define CY_RSLT_TYPE_MASK                   ((1U << CY_RSLT_TYPE_WIDTH) - 1U)
+#define CY_RSLT_MODULE_MASK                 ((1U << CY_RSLT_MODULE_WIDTH) - 1U)
+#define CY_RSLT_CODE_MASK                   ((1U << CY_RSLT_CODE_WIDTH) - 1U)
+
+#define CY_RSLT_TYPE_INFO                   (0U)
+#define CY_RSLT_TYPE_WARNING                (1U)
+#define CY_RSLT_TYPE_ERROR                  (2U)
+#define CY_RSLT_TYPE_FATAL                  (3U)
+
+#define CY_RSLT_MODULE_ABSTRACTION_OS       (0x0183U)
+#define CY_RSLT_MODULE_MIDDLEWARE_KVSTORE   (0x0250U)
+
+#define CY_RSLT_CREATE(type, module, code) \
+    ((cy_rslt_t)((((module) & CY_RSLT_MODULE_MASK) << CY_RSLT_MODULE_POSITION) | \
+                 (((code) & CY_RSLT_CODE_MASK) << CY_RSLT_CODE_POSITION) | \
+                 (((type) & CY_RSLT_TYPE_MASK) << CY_RSLT_TYPE_POSITION)))
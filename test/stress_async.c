@@ -0,0 +1,183 @@
+/***********************************************************************************************//**
+ * \file stress_async.c
+ *
+ * \brief
+ * Several threads queue asynchronous writes to their own keys while they read the values back,
+ * flush the queue and write synchronously. Each thread checks that it reads the value it queued
+ * last, and that every queued write completes once.
+ *
+ ***************************************************************************************************
+ * \copyright
+ * Copyright 2018-2022 Cypress Semiconductor Corporation (an Infineon company) or
+ * an affiliate of Cypress Semiconductor Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************************************/
+
+#include "test_bd.h"
+#include <pthread.h>
+
+#define STORAGE_SIZE        (32768U)
+#define NUM_THREADS         (4)
+#define NUM_WRITES          (1500U)
+#define KEYS_PER_THREAD     (5U)
+
+typedef struct
+{
+    uint32_t    thread_idx;
+    uint32_t    completed;
+    uint32_t    failed;
+    uint32_t    last[KEYS_PER_THREAD];
+} writer_t;
+
+static mtb_kvstore_bd_t bd;
+static mtb_kvstore_t kv;
+
+
+//--------------------------------------------------------------------------------------------------
+// write_done
+//--------------------------------------------------------------------------------------------------
+static void write_done(void* context, const char* key, cy_rslt_t result)
+{
+    (void)key;
+    writer_t* writer = (writer_t*)context;
+    if (result != CY_RSLT_SUCCESS)
+    {
+        __atomic_add_fetch(&writer->failed, 1, __ATOMIC_SEQ_CST);
+    }
+    __atomic_add_fetch(&writer->completed, 1, __ATOMIC_SEQ_CST);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// check_value
+//--------------------------------------------------------------------------------------------------
+static void check_value(const char* key, uint32_t expected)
+{
+    uint32_t value[2] = { 0 };
+    uint32_t size = sizeof(value);
+    cy_rslt_t result;
+    do
+    {
+        result = mtb_kvstore_read(&kv, key, (uint8_t*)value, &size);
+    } while (test_timed_out(result));
+    TEST_CHECK((result == CY_RSLT_SUCCESS) && (size == sizeof(value)));
+    TEST_CHECK((value[0] == expected) && (value[1] == ~expected));
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// check_values
+//--------------------------------------------------------------------------------------------------
+static void check_values(const writer_t* writer)
+{
+    for (uint32_t key_idx = 0; key_idx < KEYS_PER_THREAD; key_idx++)
+    {
+        char key[16];
+        sprintf(key, "t%u/%u", (unsigned)writer->thread_idx, (unsigned)key_idx);
+        check_value(key, writer->last[key_idx]);
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// writer_thread
+//--------------------------------------------------------------------------------------------------
+static void* writer_thread(void* arg)
+{
+    writer_t* writer = (writer_t*)arg;
+    for (uint32_t i = 1; i <= NUM_WRITES; i++)
+    {
+        uint32_t key_idx = i % KEYS_PER_THREAD;
+        char key[16];
+        sprintf(key, "t%u/%u", (unsigned)writer->thread_idx, (unsigned)key_idx);
+        uint32_t value[2] = { i, ~i };
+        cy_rslt_t result;
+        do
+        {
+            result = mtb_kvstore_write_async(&kv, key, (const uint8_t*)value, sizeof(value),
+                                             write_done, writer);
+        } while ((result == MTB_KVSTORE_QUEUE_FULL_ERROR) || test_timed_out(result));
+        TEST_CHECK(result == CY_RSLT_SUCCESS);
+        writer->last[key_idx] = i;
+        check_value(key, i);
+
+        if ((i % 100U) == 0)
+        {
+            do
+            {
+                result = mtb_kvstore_flush_queue(&kv);
+            } while (test_timed_out(result));
+            TEST_CHECK(result == CY_RSLT_SUCCESS);
+            // The writes of this thread queued before the flush have completed.
+            TEST_CHECK(__atomic_load_n(&writer->completed, __ATOMIC_SEQ_CST) == i);
+        }
+        else if ((i % 37U) == 0)
+        {
+            // A synchronous write replaces the queued value.
+            value[0] = i + NUM_WRITES;
+            value[1] = ~value[0];
+            do
+            {
+                result = mtb_kvstore_write(&kv, key, (const uint8_t*)value, sizeof(value));
+            } while (test_timed_out(result));
+            TEST_CHECK(result == CY_RSLT_SUCCESS);
+            writer->last[key_idx] = value[0];
+            check_value(key, value[0]);
+        }
+    }
+    check_values(writer);
+    return NULL;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// main
+//--------------------------------------------------------------------------------------------------
+int main(void)
+{
+    test_bd_init(&bd, 16, MTB_KVSTORE_BD_CAP_PARALLEL_READ);
+    TEST_CHECK(mtb_kvstore_init(&kv, 0, STORAGE_SIZE, &bd) == CY_RSLT_SUCCESS);
+
+    pthread_t threads[NUM_THREADS];
+    writer_t writers[NUM_THREADS];
+    memset(writers, 0, sizeof(writers));
+    for (uint32_t i = 0; i < NUM_THREADS; i++)
+    {
+        writers[i].thread_idx = i;
+        TEST_CHECK(pthread_create(&threads[i], NULL, writer_thread, &writers[i]) == 0);
+    }
+    for (uint32_t i = 0; i < NUM_THREADS; i++)
+    {
+        TEST_CHECK(pthread_join(threads[i], NULL) == 0);
+    }
+    TEST_CHECK(mtb_kvstore_flush_queue(&kv) == CY_RSLT_SUCCESS);
+    for (uint32_t i = 0; i < NUM_THREADS; i++)
+    {
+        TEST_CHECK((writers[i].completed == NUM_WRITES) && (writers[i].failed == 0));
+    }
+
+    // The values survive reinitialization.
+    mtb_kvstore_deinit(&kv);
+    TEST_CHECK(mtb_kvstore_init(&kv, 0, STORAGE_SIZE, &bd) == CY_RSLT_SUCCESS);
+    for (uint32_t i = 0; i < NUM_THREADS; i++)
+    {
+        check_values(&writers[i]);
+    }
+    mtb_kvstore_deinit(&kv);
+
+    printf("stress_async passed\n");
+    return 0;
+}
@@ -0,0 +1,356 @@
+/***********************************************************************************************//**
+ * \file stress_read_write.c
+ *
+ * \brief
+ * Readers in several threads against a writer that rewrites values, grows and shrinks the table,
+ * collects garbage and resets the kv-store. The first argument selects the capabilities of the
+ * block device: "serial" for none, "parallel" for MTB_KVSTORE_BD_CAP_PARALLEL_READ and
+ * "concurrent" for that and MTB_KVSTORE_BD_CAP_CONCURRENT_READ. The program checks that block
+ * device reads overlap only if the device allows it, and that reads never see a torn value. Linked
+ * with a library with MTB_KVSTORE_LOCK_FREE_READS, it also checks that the memory that lock-free
+ * readers could still access is reclaimed.
+ *
+ ***************************************************************************************************
+ * \copyright
+ * Copyright 2018-2022 Cypress Semiconductor Corporation (an Infineon company) or
+ * an affiliate of Cypress Semiconductor Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************************************/
+
+#include "test_bd.h"
+#include <pthread.h>
+#include <sched.h>
+
+#define STORAGE_SIZE        (32768U)
+#define NUM_READERS         (4)
+#define NUM_KEYS            (8)
+#define NUM_TMP_KEYS        (300)
+#define MAX_VALUE_SIZE      (300U)
+
+static mtb_kvstore_bd_t bd;
+static mtb_kvstore_t kv;
+static int reads_in_progress;
+static int max_reads_in_progress;
+static int writes_during_reads;
+static bool stop;
+static bool resetting;
+static long num_reads;
+
+
+//--------------------------------------------------------------------------------------------------
+// tracked_read
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t tracked_read(void* context, uint32_t addr, uint32_t length, uint8_t* buf)
+{
+    int in_progress = __atomic_add_fetch(&reads_in_progress, 1, __ATOMIC_SEQ_CST);
+    int max = __atomic_load_n(&max_reads_in_progress, __ATOMIC_SEQ_CST);
+    while ((in_progress > max) &&
+           !__atomic_compare_exchange_n(&max_reads_in_progress, &max, in_progress, false,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+    {
+    }
+    // A slow device makes the reads of several threads overlap.
+    if (length >= 16)
+    {
+        test_sleep_us(20);
+    }
+    cy_rslt_t result = test_bd_read(context, addr, length, buf);
+    __atomic_sub_fetch(&reads_in_progress, 1, __ATOMIC_SEQ_CST);
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// note_write_during_reads
+//--------------------------------------------------------------------------------------------------
+static void note_write_during_reads(void)
+{
+    if (__atomic_load_n(&reads_in_progress, __ATOMIC_SEQ_CST) != 0)
+    {
+        __atomic_add_fetch(&writes_during_reads, 1, __ATOMIC_SEQ_CST);
+    }
+    sched_yield();
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// tracked_program
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t tracked_program(void* context, uint32_t addr, uint32_t length,
+                                 const uint8_t* buf)
+{
+    note_write_during_reads();
+    return test_bd_program(context, addr, length, buf);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// tracked_erase
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t tracked_erase(void* context, uint32_t addr, uint32_t length)
+{
+    note_write_during_reads();
+    return test_bd_erase(context, addr, length);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// value_size
+//--------------------------------------------------------------------------------------------------
+static uint32_t value_size(int key_idx)
+{
+    return 100U + ((uint32_t)key_idx * 20U);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// fill_value
+//--------------------------------------------------------------------------------------------------
+static void fill_value(uint8_t* value, int key_idx, uint32_t generation, uint32_t size)
+{
+    // The generation is stored first, so that a reader can tell what the rest must be.
+    for (uint32_t i = 0; i < size; i++)
+    {
+        value[i] = (uint8_t)(((uint32_t)key_idx * 31U) + generation + i);
+    }
+    memcpy(value, &generation, sizeof(generation));
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// resetting_started
+//--------------------------------------------------------------------------------------------------
+static bool resetting_started(void)
+{
+    // The writer sets the flag before the first reset, so an operation that returned before the
+    // flag was seen completed before any reset.
+    return __atomic_load_n(&resetting, __ATOMIC_SEQ_CST);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// reader_thread
+//--------------------------------------------------------------------------------------------------
+static void* reader_thread(void* arg)
+{
+    unsigned seed = (unsigned)(size_t)arg;
+    uint8_t value[MAX_VALUE_SIZE];
+    uint8_t expected[MAX_VALUE_SIZE];
+    while (!__atomic_load_n(&stop, __ATOMIC_SEQ_CST))
+    {
+        int key_idx = rand_r(&seed) % NUM_KEYS;
+        char key[16];
+        sprintf(key, "key%d", key_idx);
+        uint32_t size = sizeof(value);
+        cy_rslt_t result = mtb_kvstore_read(&kv, key, value, &size);
+        if (result == CY_RSLT_SUCCESS)
+        {
+            TEST_CHECK(size == value_size(key_idx));
+            uint32_t generation;
+            memcpy(&generation, value, sizeof(generation));
+            fill_value(expected, key_idx, generation, size);
+            TEST_CHECK(memcmp(value, expected, size) == 0);
+        }
+        else
+        {
+            TEST_CHECK(test_timed_out(result) ||
+                       (resetting_started() && (result == MTB_KVSTORE_ITEM_NOT_FOUND_ERROR)));
+        }
+
+        result = mtb_kvstore_value_size(&kv, key, &size);
+        TEST_CHECK((result == CY_RSLT_SUCCESS) || test_timed_out(result) ||
+                   (resetting_started() && (result == MTB_KVSTORE_ITEM_NOT_FOUND_ERROR)));
+        TEST_CHECK((result != CY_RSLT_SUCCESS) || (size == value_size(key_idx)));
+        result = mtb_kvstore_key_exists(&kv, key);
+        TEST_CHECK((result == CY_RSLT_SUCCESS) || test_timed_out(result) ||
+                   (resetting_started() && (result == MTB_KVSTORE_ITEM_NOT_FOUND_ERROR)));
+
+        // Keys that come and go, and a value that is appended to.
+        sprintf(key, "tmp%d", rand_r(&seed) % NUM_TMP_KEYS);
+        size = sizeof(value);
+        result = mtb_kvstore_read(&kv, key, value, &size);
+        TEST_CHECK((result == CY_RSLT_SUCCESS) || (result == MTB_KVSTORE_ITEM_NOT_FOUND_ERROR) ||
+                   test_timed_out(result));
+        size = 10;
+        result = mtb_kvstore_read_partial(&kv, "log", value, &size, (uint32_t)rand_r(&seed) % 50U);
+        TEST_CHECK((result == CY_RSLT_SUCCESS) || (result == MTB_KVSTORE_ITEM_NOT_FOUND_ERROR) ||
+                   (result == MTB_KVSTORE_BAD_PARAM_ERROR) ||
+                   (result == MTB_KVSTORE_BUFFER_TOO_SMALL) || test_timed_out(result));
+        __atomic_add_fetch(&num_reads, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// write_value
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t write_value(const char* key, const uint8_t* value, uint32_t size)
+{
+    cy_rslt_t result;
+    do
+    {
+        result = mtb_kvstore_write(&kv, key, value, size);
+    } while (test_timed_out(result));
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// write_key
+//--------------------------------------------------------------------------------------------------
+static void write_key(int key_idx, uint32_t generation)
+{
+    char key[16];
+    uint8_t value[MAX_VALUE_SIZE];
+    sprintf(key, "key%d", key_idx);
+    fill_value(value, key_idx, generation, value_size(key_idx));
+    TEST_CHECK(write_value(key, value, value_size(key_idx)) == CY_RSLT_SUCCESS);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// main
+//--------------------------------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+    const char* mode = (argc > 1) ? argv[1] : "concurrent";
+    uint32_t capabilities;
+    if (strcmp(mode, "serial") == 0)
+    {
+        capabilities = 0;
+    }
+    else if (strcmp(mode, "parallel") == 0)
+    {
+        capabilities = MTB_KVSTORE_BD_CAP_PARALLEL_READ;
+    }
+    else
+    {
+        TEST_CHECK(strcmp(mode, "concurrent") == 0);
+        capabilities = MTB_KVSTORE_BD_CAP_PARALLEL_READ | MTB_KVSTORE_BD_CAP_CONCURRENT_READ;
+    }
+    test_bd_init(&bd, 16, capabilities);
+    bd.read = tracked_read;
+    bd.program = tracked_program;
+    bd.erase = tracked_erase;
+
+    // The key dictionary grows along with the RAM table while the readers run.
+    mtb_kvstore_config_t config = { 0 };
+    config.key_dictionary = true;
+    TEST_CHECK(mtb_kvstore_init_with_config(&kv, 0, STORAGE_SIZE, &bd, &config) ==
+               CY_RSLT_SUCCESS);
+    for (int key_idx = 0; key_idx < NUM_KEYS; key_idx++)
+    {
+        write_key(key_idx, 0);
+    }
+    pthread_t readers[NUM_READERS];
+    for (int i = 0; i < NUM_READERS; i++)
+    {
+        TEST_CHECK(pthread_create(&readers[i], NULL, reader_thread, (void*)(size_t)(i + 1)) == 0);
+    }
+
+    uint8_t value[MAX_VALUE_SIZE] = { 0 };
+    for (uint32_t generation = 1; generation < 500; generation++)
+    {
+        write_key((int)(generation % NUM_KEYS), generation);
+        char key[16];
+        sprintf(key, "tmp%u", (unsigned)(generation % NUM_TMP_KEYS));
+        cy_rslt_t result = write_value(key, value, 8U + (generation % 40U));
+        TEST_CHECK((result == CY_RSLT_SUCCESS) || (result == MTB_KVSTORE_STORAGE_FULL_ERROR));
+        if ((generation % 5U) == 0)
+        {
+            do
+            {
+                result = mtb_kvstore_append(&kv, "log", value, 3);
+            } while (test_timed_out(result));
+            TEST_CHECK((result == CY_RSLT_SUCCESS) || (result == MTB_KVSTORE_STORAGE_FULL_ERROR));
+        }
+        if ((generation % 97U) == 0)
+        {
+            do
+            {
+                result = mtb_kvstore_ensure_capacity(&kv, MTB_KVSTORE_ENSURE_MAX);
+            } while (test_timed_out(result));
+            TEST_CHECK(result == CY_RSLT_SUCCESS);
+        }
+        if ((generation % 90U) == 0)
+        {
+            for (int i = 0; i < NUM_TMP_KEYS; i++)
+            {
+                sprintf(key, "tmp%d", i);
+                do
+                {
+                    result = mtb_kvstore_delete(&kv, key);
+                } while (test_timed_out(result));
+                TEST_CHECK(result == CY_RSLT_SUCCESS);
+            }
+            do
+            {
+                result = mtb_kvstore_delete(&kv, "log");
+            } while (test_timed_out(result));
+            TEST_CHECK(result == CY_RSLT_SUCCESS);
+        }
+    }
+
+    __atomic_store_n(&resetting, true, __ATOMIC_SEQ_CST);
+    for (uint32_t round = 0; round < 6; round++)
+    {
+        cy_rslt_t result;
+        do
+        {
+            result = mtb_kvstore_reset(&kv);
+        } while (test_timed_out(result));
+        TEST_CHECK(result == CY_RSLT_SUCCESS);
+        for (int i = 0; i < 100; i++)
+        {
+            char key[16];
+            sprintf(key, "tmp%d", i);
+            fill_value(value, i, round, 20);
+            TEST_CHECK(write_value(key, value, 20) == CY_RSLT_SUCCESS);
+        }
+        for (int key_idx = 0; key_idx < NUM_KEYS; key_idx++)
+        {
+            write_key(key_idx, round);
+        }
+    }
+
+    __atomic_store_n(&stop, true, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < NUM_READERS; i++)
+    {
+        TEST_CHECK(pthread_join(readers[i], NULL) == 0);
+    }
+    #if MTB_KVSTORE_LOCK_FREE_READS
+    // Once no reader is in progress, the next modification frees the retired memory.
+    write_key(0, 1);
+    TEST_CHECK(kv.retired == NULL);
+    #endif
+    mtb_kvstore_deinit(&kv);
+
+    printf("stress_read_write passed, %s: %ld reads, at most %d block device reads at once, "
+           "%d block device writes during reads\n", mode, num_reads, max_reads_in_progress,
+           writes_during_reads);
+    if (capabilities == 0)
+    {
+        TEST_CHECK(max_reads_in_progress == 1);
+    }
+    else
+    {
+        TEST_CHECK(max_reads_in_progress > 1);
+    }
+    TEST_CHECK(((capabilities & MTB_KVSTORE_BD_CAP_CONCURRENT_READ) != 0) ||
+               (writes_during_reads == 0));
+    return 0;
+}
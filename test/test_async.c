@@ -0,0 +1,143 @@
+/***********************************************************************************************//**
+ * \file test_async.c
+ *
+ * \brief
+ * Asynchronous writes, with a worker thread if the library is built for an RTOS and performed
+ * before mtb_kvstore_write_async returns otherwise.
+ *
+ ***************************************************************************************************
+ * \copyright
+ * Copyright 2018-2022 Cypress Semiconductor Corporation (an Infineon company) or
+ * an affiliate of Cypress Semiconductor Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************************************/
+
+#include "test_bd.h"
+
+#define STORAGE_SIZE        (16384U)
+#define NUM_WRITES          (2000U)
+
+typedef struct
+{
+    uint32_t    completed;
+    uint32_t    failed;
+    cy_rslt_t   last_result;
+} completions_t;
+
+static mtb_kvstore_bd_t bd;
+
+
+//--------------------------------------------------------------------------------------------------
+// write_done
+//--------------------------------------------------------------------------------------------------
+static void write_done(void* context, const char* key, cy_rslt_t result)
+{
+    (void)key;
+    completions_t* completions = (completions_t*)context;
+    if (result != CY_RSLT_SUCCESS)
+    {
+        __atomic_add_fetch(&completions->failed, 1, __ATOMIC_SEQ_CST);
+    }
+    __atomic_store_n(&completions->last_result, result, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&completions->completed, 1, __ATOMIC_SEQ_CST);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// submit
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t submit(mtb_kvstore_t* kv, const char* key, const uint8_t* data, uint32_t size,
+                        completions_t* completions)
+{
+    cy_rslt_t result;
+    do
+    {
+        result = mtb_kvstore_write_async(kv, key, data, size, write_done, completions);
+    } while (result == MTB_KVSTORE_QUEUE_FULL_ERROR);
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// main
+//--------------------------------------------------------------------------------------------------
+int main(void)
+{
+    test_bd_init(&bd, 16, 0);
+    mtb_kvstore_t kv;
+    TEST_CHECK(mtb_kvstore_init(&kv, 0, STORAGE_SIZE, &bd) == CY_RSLT_SUCCESS);
+
+    // Reads see the queued value, and synchronous writes keep the order.
+    completions_t completions = { 0 };
+    for (uint32_t i = 0; i < NUM_WRITES; i++)
+    {
+        char key[16];
+        sprintf(key, "k%u", (unsigned)(i % 13U));
+        TEST_CHECK(submit(&kv, key, (const uint8_t*)&i, sizeof(i), &completions) ==
+                   CY_RSLT_SUCCESS);
+        uint32_t value = 0;
+        uint32_t size = sizeof(value);
+        TEST_CHECK(mtb_kvstore_read(&kv, key, (uint8_t*)&value, &size) == CY_RSLT_SUCCESS);
+        TEST_CHECK((value == i) && (size == sizeof(value)));
+        TEST_CHECK(mtb_kvstore_value_size(&kv, key, &size) == CY_RSLT_SUCCESS);
+        TEST_CHECK(size == sizeof(value));
+        if ((i % 100U) == 0)
+        {
+            TEST_CHECK(mtb_kvstore_write(&kv, "sync", (const uint8_t*)&i, sizeof(i)) ==
+                       CY_RSLT_SUCCESS);
+        }
+    }
+    TEST_CHECK(mtb_kvstore_flush_queue(&kv) == CY_RSLT_SUCCESS);
+    TEST_CHECK((completions.completed == NUM_WRITES) && (completions.failed == 0));
+
+    // A write that cannot succeed reports its error through the callback, and without an RTOS
+    // also as the result.
+    static uint8_t huge[STORAGE_SIZE];
+    memset(&completions, 0, sizeof(completions));
+    cy_rslt_t result = submit(&kv, "huge", huge, sizeof(huge), &completions);
+    TEST_CHECK(mtb_kvstore_flush_queue(&kv) == CY_RSLT_SUCCESS);
+    TEST_CHECK((completions.completed == 1) && (completions.failed == 1));
+    #if defined(MTB_KVSTORE_RTOS_AWARE)
+    TEST_CHECK(result == CY_RSLT_SUCCESS);
+    #else
+    TEST_CHECK((result != CY_RSLT_SUCCESS) && (result == completions.last_result));
+    #endif
+    TEST_CHECK(mtb_kvstore_key_exists(&kv, "huge") == MTB_KVSTORE_ITEM_NOT_FOUND_ERROR);
+
+    // Deinitialization completes the pending writes.
+    uint32_t last = 5;
+    TEST_CHECK(mtb_kvstore_write_async(&kv, "last", (const uint8_t*)&last, sizeof(last), NULL,
+                                       NULL) == CY_RSLT_SUCCESS);
+    mtb_kvstore_deinit(&kv);
+    TEST_CHECK(mtb_kvstore_init(&kv, 0, STORAGE_SIZE, &bd) == CY_RSLT_SUCCESS);
+    for (uint32_t i = NUM_WRITES - 13U; i < NUM_WRITES; i++)
+    {
+        char key[16];
+        sprintf(key, "k%u", (unsigned)(i % 13U));
+        uint32_t value = 0;
+        uint32_t size = sizeof(value);
+        TEST_CHECK(mtb_kvstore_read(&kv, key, (uint8_t*)&value, &size) == CY_RSLT_SUCCESS);
+        TEST_CHECK(value == i);
+    }
+    uint32_t value = 0;
+    uint32_t size = sizeof(value);
+    TEST_CHECK(mtb_kvstore_read(&kv, "last", (uint8_t*)&value, &size) == CY_RSLT_SUCCESS);
+    TEST_CHECK(value == last);
+    mtb_kvstore_deinit(&kv);
+
+    printf("test_async passed\n");
+    return 0;
+}
@@ -0,0 +1,296 @@
+/***********************************************************************************************//**
+ * \file test_basic.c
+ *
+ * \brief
+ * Random writes, deletes and reinitializations of a kv-store, checked against a model, with the
+ * default configuration and with small and growable staging buffers. Also checks skipping
+ * unchanged writes and programming values from unaligned buffers.
+ *
+ ***************************************************************************************************
+ * \copyright
+ * Copyright 2018-2022 Cypress Semiconductor Corporation (an Infineon company) or
+ * an affiliate of Cypress Semiconductor Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************************************/
+
+#include "test_bd.h"
+
+#define NUM_KEYS            (40)
+#define MAX_VALUE_SIZE      (300U)
+#define STORAGE_SIZE        (16384U)
+
+typedef struct
+{
+    uint8_t     value[MAX_VALUE_SIZE];
+    uint32_t    size;
+    bool        exists;
+} model_entry_t;
+
+static mtb_kvstore_bd_t bd;
+static model_entry_t model[NUM_KEYS];
+
+
+//--------------------------------------------------------------------------------------------------
+// key_name
+//--------------------------------------------------------------------------------------------------
+static void key_name(int idx, char* key)
+{
+    sprintf(key, "key/%d/%s", idx, ((idx % 3) != 0) ? "x" : "a_long_key_name_here");
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// verify
+//--------------------------------------------------------------------------------------------------
+static void verify(mtb_kvstore_t* kv)
+{
+    for (int idx = 0; idx < NUM_KEYS; idx++)
+    {
+        char key[64];
+        key_name(idx, key);
+        uint8_t buf[MAX_VALUE_SIZE];
+        uint32_t size = sizeof(buf);
+        cy_rslt_t result = mtb_kvstore_read(kv, key, buf, &size);
+        if (model[idx].exists)
+        {
+            TEST_CHECK(result == CY_RSLT_SUCCESS);
+            TEST_CHECK((size == model[idx].size) && (memcmp(buf, model[idx].value, size) == 0));
+            uint32_t value_size;
+            TEST_CHECK(mtb_kvstore_value_size(kv, key, &value_size) == CY_RSLT_SUCCESS);
+            TEST_CHECK(value_size == model[idx].size);
+            if (size > 2)
+            {
+                uint8_t part[2];
+                uint32_t part_size = sizeof(part);
+                result = mtb_kvstore_read_partial(kv, key, part, &part_size, 1);
+                TEST_CHECK((result == CY_RSLT_SUCCESS) || (result == MTB_KVSTORE_BUFFER_TOO_SMALL));
+                TEST_CHECK(memcmp(part, &model[idx].value[1], sizeof(part)) == 0);
+            }
+        }
+        else
+        {
+            TEST_CHECK(result == MTB_KVSTORE_ITEM_NOT_FOUND_ERROR);
+            TEST_CHECK(mtb_kvstore_key_exists(kv, key) == MTB_KVSTORE_ITEM_NOT_FOUND_ERROR);
+        }
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// run_model
+//--------------------------------------------------------------------------------------------------
+static void run_model(const mtb_kvstore_config_t* config, unsigned seed)
+{
+    srand(seed);
+    test_bd_init(&bd, 16, 0);
+    memset(model, 0, sizeof(model));
+
+    mtb_kvstore_t kv;
+    TEST_CHECK(mtb_kvstore_init_with_config(&kv, 0, STORAGE_SIZE, &bd, config) == CY_RSLT_SUCCESS);
+    for (int iter = 0; iter < 3000; iter++)
+    {
+        int idx = rand() % NUM_KEYS;
+        char key[64];
+        key_name(idx, key);
+        int op = rand() % 13;
+        if (op < 7)
+        {
+            uint32_t size = (uint32_t)rand() % (((idx % 5) == 0) ? MAX_VALUE_SIZE : 24U);
+            uint8_t value[MAX_VALUE_SIZE];
+            for (uint32_t i = 0; i < size; i++)
+            {
+                value[i] = (uint8_t)rand();
+            }
+            cy_rslt_t result = mtb_kvstore_write(&kv, key, value, size);
+            if (result != MTB_KVSTORE_STORAGE_FULL_ERROR)
+            {
+                TEST_CHECK(result == CY_RSLT_SUCCESS);
+                memcpy(model[idx].value, value, size);
+                model[idx].size = size;
+                model[idx].exists = true;
+            }
+        }
+        else if (op < 9)
+        {
+            TEST_CHECK(mtb_kvstore_delete(&kv, key) == CY_RSLT_SUCCESS);
+            model[idx].exists = false;
+        }
+        else if (op == 9)
+        {
+            mtb_kvstore_deinit(&kv);
+            TEST_CHECK(mtb_kvstore_init_with_config(&kv, 0, STORAGE_SIZE, &bd, config) ==
+                       CY_RSLT_SUCCESS);
+        }
+        else if (op == 10)
+        {
+            char prefix[16];
+            sprintf(prefix, "key/%d", rand() % 5);
+            TEST_CHECK(mtb_kvstore_delete_prefix(&kv, prefix) == CY_RSLT_SUCCESS);
+            for (int other = 0; other < NUM_KEYS; other++)
+            {
+                char other_key[64];
+                key_name(other, other_key);
+                if (strncmp(other_key, prefix, strlen(prefix)) == 0)
+                {
+                    model[other].exists = false;
+                }
+            }
+        }
+        else
+        {
+            char keys[4][64];
+            const char* key_ptrs[4];
+            for (int i = 0; i < 4; i++)
+            {
+                int other = rand() % NUM_KEYS;
+                key_name(other, keys[i]);
+                key_ptrs[i] = keys[i];
+                model[other].exists = false;
+            }
+            TEST_CHECK(mtb_kvstore_delete_many(&kv, key_ptrs, 4) == CY_RSLT_SUCCESS);
+        }
+
+        if ((iter % 50) == 0)
+        {
+            verify(&kv);
+        }
+    }
+    verify(&kv);
+
+    mtb_kvstore_deinit(&kv);
+    TEST_CHECK(mtb_kvstore_init_with_config(&kv, 0, STORAGE_SIZE, &bd, config) == CY_RSLT_SUCCESS);
+    verify(&kv);
+    TEST_CHECK(mtb_kvstore_reset(&kv) == CY_RSLT_SUCCESS);
+    for (int idx = 0; idx < NUM_KEYS; idx++)
+    {
+        model[idx].exists = false;
+    }
+    verify(&kv);
+    mtb_kvstore_deinit(&kv);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// test_skip_unchanged
+//--------------------------------------------------------------------------------------------------
+static void test_skip_unchanged(void)
+{
+    test_bd_init(&bd, 16, 0);
+    mtb_kvstore_t kv;
+    TEST_CHECK(mtb_kvstore_init(&kv, 0, STORAGE_SIZE, &bd) == CY_RSLT_SUCCESS);
+
+    uint8_t value[200];
+    for (uint32_t i = 0; i < sizeof(value); i++)
+    {
+        value[i] = (uint8_t)i;
+    }
+    TEST_CHECK(mtb_kvstore_write_ex(&kv, "a", value, sizeof(value),
+                                    MTB_KVSTORE_WRITE_SKIP_UNCHANGED) == CY_RSLT_SUCCESS);
+    uint32_t used = mtb_kvstore_size(&kv);
+    unsigned long programs = test_bd.programs;
+    TEST_CHECK(mtb_kvstore_write_ex(&kv, "a", value, sizeof(value),
+                                    MTB_KVSTORE_WRITE_SKIP_UNCHANGED) == CY_RSLT_SUCCESS);
+    TEST_CHECK((test_bd.programs == programs) && (mtb_kvstore_size(&kv) == used));
+    mtb_kvstore_stats_t stats;
+    mtb_kvstore_get_stats(&kv, &stats);
+    TEST_CHECK(stats.skipped_writes == 1);
+
+    // A change in the last byte is written.
+    value[sizeof(value) - 1] ^= 1;
+    TEST_CHECK(mtb_kvstore_write_ex(&kv, "a", value, sizeof(value),
+                                    MTB_KVSTORE_WRITE_SKIP_UNCHANGED) == CY_RSLT_SUCCESS);
+    TEST_CHECK(test_bd.programs > programs);
+    mtb_kvstore_get_stats(&kv, &stats);
+    TEST_CHECK(stats.skipped_writes == 1);
+    uint8_t buf[200];
+    uint32_t size = sizeof(buf);
+    TEST_CHECK(mtb_kvstore_read(&kv, "a", buf, &size) == CY_RSLT_SUCCESS);
+    TEST_CHECK(memcmp(buf, value, sizeof(value)) == 0);
+
+    // Empty values are compared as well.
+    TEST_CHECK(mtb_kvstore_write_ex(&kv, "e", NULL, 0, MTB_KVSTORE_WRITE_SKIP_UNCHANGED) ==
+               CY_RSLT_SUCCESS);
+    programs = test_bd.programs;
+    TEST_CHECK(mtb_kvstore_write_ex(&kv, "e", NULL, 0, MTB_KVSTORE_WRITE_SKIP_UNCHANGED) ==
+               CY_RSLT_SUCCESS);
+    TEST_CHECK(test_bd.programs == programs);
+    mtb_kvstore_deinit(&kv);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// test_unaligned_values
+//--------------------------------------------------------------------------------------------------
+static void test_unaligned_values(void)
+{
+    // Values are programmed from the caller's buffer at any alignment of the buffer and of the
+    // value in the record.
+    test_bd_init(&bd, 16, 0);
+    mtb_kvstore_t kv;
+    TEST_CHECK(mtb_kvstore_init(&kv, 0, STORAGE_SIZE, &bd) == CY_RSLT_SUCCESS);
+
+    static uint8_t value[3001];
+    static uint8_t buf[3000];
+    for (uint32_t i = 0; i < sizeof(value); i++)
+    {
+        value[i] = (uint8_t)(i * 7U);
+    }
+    for (int offset = 0; offset < 4; offset++)
+    {
+        for (int key_size = 1; key_size < 8; key_size++)
+        {
+            char key[8];
+            memset(key, 'k', (size_t)key_size);
+            key[key_size] = '\0';
+            TEST_CHECK(mtb_kvstore_write(&kv, key, &value[offset], 2997) == CY_RSLT_SUCCESS);
+            uint32_t size = sizeof(buf);
+            TEST_CHECK(mtb_kvstore_read(&kv, key, buf, &size) == CY_RSLT_SUCCESS);
+            TEST_CHECK((size == 2997) && (memcmp(buf, &value[offset], size) == 0));
+            TEST_CHECK(mtb_kvstore_delete(&kv, key) == CY_RSLT_SUCCESS);
+        }
+    }
+    mtb_kvstore_deinit(&kv);
+    TEST_CHECK(mtb_kvstore_init(&kv, 0, STORAGE_SIZE, &bd) == CY_RSLT_SUCCESS);
+    mtb_kvstore_deinit(&kv);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// main
+//--------------------------------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+    unsigned seed = (argc > 1) ? (unsigned)atoi(argv[1]) : 1U;
+
+    // Default, a small aligned staging buffer that grows for large records with compact headers
+    // and the key dictionary, and a staging buffer larger than the program size.
+    mtb_kvstore_config_t config = { 0 };
+    run_model(NULL, seed);
+    config.buffer_size = 32;
+    config.buffer_alignment = 64;
+    config.max_buffer_size = 4096;
+    config.compact_headers = true;
+    config.key_dictionary = true;
+    run_model(&config, seed);
+    memset(&config, 0, sizeof(config));
+    config.buffer_size = 256;
+    run_model(&config, seed);
+
+    test_skip_unchanged();
+    test_unaligned_values();
+    printf("test_basic passed, seed %u\n", seed);
+    return 0;
+}
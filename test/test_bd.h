@@ -0,0 +1,259 @@
+/***********************************************************************************************//**
+ * \file test_bd.h
+ *
+ * \brief
+ * RAM block device and checks shared by the kv-store tests, stress programs and benchmarks.
+ *
+ ***************************************************************************************************
+ * \copyright
+ * Copyright 2018-2022 Cypress Semiconductor Corporation (an Infineon company) or
+ * an affiliate of Cypress Semiconductor Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************************************/
+#pragma once
+
+// The device behaves like NOR flash: erasing sets the bytes to 0xFF and programming only clears
+// bits. Programming bytes that are not erased aborts the test unless the device has the
+// MTB_KVSTORE_BD_CAP_BIT_CLEAR capability, as do accesses that are unaligned or out of range.
+// The operations are counted, and the counters and the memory are accessed atomically so that
+// programs with several threads can use the device as well.
+
+// nanosleep and clock_gettime are POSIX functions that are not declared in strict ISO C modes.
+// Every test includes this header first.
+#if !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mtb_kvstore.h"
+
+#define TEST_BD_SIZE            (64U * 1024U)
+#define TEST_BD_ERASE_SIZE      (4096U)
+
+// Aborts the program with the location of the failed check. Unlike assert, it is never compiled
+// out.
+#define TEST_CHECK(cond)                                                                     \
+    do                                                                                       \
+    {                                                                                        \
+        if (!(cond))                                                                         \
+        {                                                                                    \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);         \
+            abort();                                                                         \
+        }                                                                                    \
+    } while (0)
+
+typedef struct
+{
+    uint8_t         mem[TEST_BD_SIZE];
+    uint32_t        read_size;
+    uint32_t        program_size;
+    unsigned long   reads;
+    unsigned long   programs;
+    unsigned long   programmed_bytes;
+    unsigned long   erases;
+} test_bd_t;
+
+static test_bd_t test_bd;
+
+
+//--------------------------------------------------------------------------------------------------
+// test_bd_read
+//--------------------------------------------------------------------------------------------------
+static inline cy_rslt_t test_bd_read(void* context, uint32_t addr, uint32_t length, uint8_t* buf)
+{
+    (void)context;
+    TEST_CHECK(addr + length <= TEST_BD_SIZE);
+    for (uint32_t i = 0; i < length; i++)
+    {
+        buf[i] = __atomic_load_n(&test_bd.mem[addr + i], __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&test_bd.reads, 1, __ATOMIC_RELAXED);
+    return CY_RSLT_SUCCESS;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// test_bd_program_bytes
+//--------------------------------------------------------------------------------------------------
+static inline void test_bd_program_bytes(uint32_t addr, uint32_t length, const uint8_t* buf,
+                                         bool bit_clear)
+{
+    TEST_CHECK((addr % test_bd.program_size == 0) && (length % test_bd.program_size == 0));
+    TEST_CHECK(addr + length <= TEST_BD_SIZE);
+    for (uint32_t i = 0; i < length; i++)
+    {
+        uint8_t old = __atomic_fetch_and(&test_bd.mem[addr + i], buf[i], __ATOMIC_RELAXED);
+        TEST_CHECK(bit_clear || (old == 0xFF));
+    }
+    __atomic_add_fetch(&test_bd.programs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&test_bd.programmed_bytes, length, __ATOMIC_RELAXED);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// test_bd_program
+//--------------------------------------------------------------------------------------------------
+static inline cy_rslt_t test_bd_program(void* context, uint32_t addr, uint32_t length,
+                                        const uint8_t* buf)
+{
+    const mtb_kvstore_bd_t* bd = (const mtb_kvstore_bd_t*)context;
+    test_bd_program_bytes(addr, length, buf,
+                          (bd != NULL) && ((bd->capabilities & MTB_KVSTORE_BD_CAP_BIT_CLEAR) != 0));
+    return CY_RSLT_SUCCESS;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// test_bd_erase
+//--------------------------------------------------------------------------------------------------
+static inline cy_rslt_t test_bd_erase(void* context, uint32_t addr, uint32_t length)
+{
+    (void)context;
+    TEST_CHECK((addr % TEST_BD_ERASE_SIZE == 0) && (length % TEST_BD_ERASE_SIZE == 0));
+    TEST_CHECK(addr + length <= TEST_BD_SIZE);
+    for (uint32_t i = 0; i < length; i++)
+    {
+        __atomic_store_n(&test_bd.mem[addr + i], 0xFF, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&test_bd.erases, 1, __ATOMIC_RELAXED);
+    return CY_RSLT_SUCCESS;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// test_bd_read_size
+//--------------------------------------------------------------------------------------------------
+static inline uint32_t test_bd_read_size(void* context, uint32_t addr)
+{
+    (void)context;
+    (void)addr;
+    return test_bd.read_size;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// test_bd_program_size
+//--------------------------------------------------------------------------------------------------
+static inline uint32_t test_bd_program_size(void* context, uint32_t addr)
+{
+    (void)context;
+    (void)addr;
+    return test_bd.program_size;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// test_bd_erase_size
+//--------------------------------------------------------------------------------------------------
+static inline uint32_t test_bd_erase_size(void* context, uint32_t addr)
+{
+    (void)context;
+    (void)addr;
+    return TEST_BD_ERASE_SIZE;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// test_bd_map
+//--------------------------------------------------------------------------------------------------
+static inline const uint8_t* test_bd_map(void* context, uint32_t addr)
+{
+    (void)context;
+    return (addr < TEST_BD_SIZE) ? &test_bd.mem[addr] : NULL;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// test_bd_init
+//--------------------------------------------------------------------------------------------------
+static inline void test_bd_init(mtb_kvstore_bd_t* bd, uint32_t program_size,
+                                uint32_t capabilities)
+{
+    // Erases the whole device, resets the counters and fills in the interface. The interface is
+    // its own context, so that programming can check the capabilities that the test sets.
+    memset(&test_bd, 0xFF, sizeof(test_bd.mem));
+    test_bd.read_size = 1;
+    test_bd.program_size = program_size;
+    test_bd.reads = 0;
+    test_bd.programs = 0;
+    test_bd.programmed_bytes = 0;
+    test_bd.erases = 0;
+
+    memset(bd, 0, sizeof(*bd));
+    bd->read = test_bd_read;
+    bd->program = test_bd_program;
+    bd->erase = test_bd_erase;
+    bd->read_size = test_bd_read_size;
+    bd->program_size = test_bd_program_size;
+    bd->erase_size = test_bd_erase_size;
+    bd->context = bd;
+    bd->capabilities = capabilities;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// test_bd_accesses
+//--------------------------------------------------------------------------------------------------
+static inline unsigned long test_bd_accesses(void)
+{
+    return __atomic_load_n(&test_bd.reads, __ATOMIC_RELAXED) +
+           __atomic_load_n(&test_bd.programs, __ATOMIC_RELAXED) +
+           __atomic_load_n(&test_bd.erases, __ATOMIC_RELAXED);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// test_timed_out
+//--------------------------------------------------------------------------------------------------
+static inline bool test_timed_out(cy_rslt_t result)
+{
+    // With several threads, an operation times out if another thread keeps the lock for longer
+    // than the mutex timeout, and the tests repeat it. Without an RTOS nothing times out.
+    #if defined(MTB_KVSTORE_RTOS_AWARE)
+    return result == CY_RTOS_TIMEOUT;
+    #else
+    (void)result;
+    return false;
+    #endif
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// test_sleep_us
+//--------------------------------------------------------------------------------------------------
+static inline void test_sleep_us(uint32_t us)
+{
+    struct timespec ts = { (time_t)(us / 1000000U), (long)(us % 1000000U) * 1000L };
+    while (nanosleep(&ts, &ts) != 0)
+    {
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// test_now_us
+//--------------------------------------------------------------------------------------------------
+static inline double test_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((double)ts.tv_sec * 1e6) + ((double)ts.tv_nsec / 1e3);
+}
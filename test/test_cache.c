@@ -0,0 +1,288 @@
+/***********************************************************************************************//**
+ * \file test_cache.c
+ *
+ * \brief
+ * The read cache: hits, invalidation by modifications, eviction within the budget and pinned
+ * values. With an RTOS, also readers that run while values are written.
+ *
+ ***************************************************************************************************
+ * \copyright
+ * Copyright 2018-2022 Cypress Semiconductor Corporation (an Infineon company) or
+ * an affiliate of Cypress Semiconductor Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************************************/
+
+#include "test_bd.h"
+
+#if defined(MTB_KVSTORE_RTOS_AWARE)
+#include <pthread.h>
+#endif
+
+#define STORAGE_SIZE        (16384U)
+#define CACHE_SIZE          (600U)
+#define NUM_READERS         (3)
+#define NUM_SHARED_KEYS     (6)
+#define SHARED_VALUE_SIZE   (40U)
+
+static mtb_kvstore_bd_t bd;
+static mtb_kvstore_t kv;
+
+
+//--------------------------------------------------------------------------------------------------
+// read_value
+//--------------------------------------------------------------------------------------------------
+static uint32_t read_value(const char* key, uint8_t* buf, uint32_t buf_size)
+{
+    uint32_t size;
+    cy_rslt_t result;
+    do
+    {
+        size = buf_size;
+        result = mtb_kvstore_read(&kv, key, buf, &size);
+    } while (test_timed_out(result));
+    TEST_CHECK(result == CY_RSLT_SUCCESS);
+    return size;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// read_all_keys
+//--------------------------------------------------------------------------------------------------
+static void read_all_keys(void)
+{
+    uint8_t buf[200];
+    for (int i = 0; i < 10; i++)
+    {
+        char key[16];
+        sprintf(key, "e%d", i);
+        TEST_CHECK(read_value(key, buf, sizeof(buf)) == 100);
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// test_hits_and_invalidation
+//--------------------------------------------------------------------------------------------------
+static void test_hits_and_invalidation(void)
+{
+    uint8_t value[200];
+    uint8_t buf[200];
+    memset(value, 7, 100);
+    TEST_CHECK(mtb_kvstore_write(&kv, "a", value, 100) == CY_RSLT_SUCCESS);
+    memset(buf, 0, sizeof(buf));
+    TEST_CHECK((read_value("a", buf, sizeof(buf)) == 100) && (buf[0] == 7) && (buf[150] == 0));
+    TEST_CHECK((kv.stats.cache_misses == 1) && (kv.stats.cache_hits == 0));
+
+    // Hits do not read the device, also for partial reads, and also clear the rest of the buffer.
+    unsigned long reads = test_bd.reads;
+    memset(buf, 1, sizeof(buf));
+    TEST_CHECK((read_value("a", buf, sizeof(buf)) == 100) && (buf[99] == 7) && (buf[150] == 0));
+    TEST_CHECK((test_bd.reads == reads) && (kv.stats.cache_hits == 1));
+    uint32_t size = 10;
+    TEST_CHECK(mtb_kvstore_read_partial(&kv, "a", buf, &size, 95) == CY_RSLT_SUCCESS);
+    TEST_CHECK((size == 5) && (test_bd.reads == reads) && (kv.stats.cache_hits == 2));
+    size = 2;
+    TEST_CHECK(mtb_kvstore_read(&kv, "a", buf, &size) == MTB_KVSTORE_BUFFER_TOO_SMALL);
+
+    // Writes, appends, counters and deletes invalidate the cached value.
+    memset(value, 8, 100);
+    TEST_CHECK(mtb_kvstore_write(&kv, "a", value, 100) == CY_RSLT_SUCCESS);
+    TEST_CHECK((read_value("a", buf, sizeof(buf)) == 100) && (buf[0] == 8));
+    TEST_CHECK(mtb_kvstore_append(&kv, "a", value, 20) == CY_RSLT_SUCCESS);
+    TEST_CHECK((read_value("a", buf, sizeof(buf)) == 120) && (buf[110] == 8));
+    uint32_t count = 0;
+    TEST_CHECK(mtb_kvstore_counter_increment(&kv, "n", &count) == CY_RSLT_SUCCESS);
+    TEST_CHECK(read_value("n", buf, sizeof(buf)) == sizeof(count));
+    TEST_CHECK(mtb_kvstore_counter_increment(&kv, "n", &count) == CY_RSLT_SUCCESS);
+    TEST_CHECK((read_value("n", (uint8_t*)&count, sizeof(count)) == sizeof(count)) && (count == 2));
+    TEST_CHECK(mtb_kvstore_delete(&kv, "a") == CY_RSLT_SUCCESS);
+    size = sizeof(buf);
+    TEST_CHECK(mtb_kvstore_read(&kv, "a", buf, &size) == MTB_KVSTORE_ITEM_NOT_FOUND_ERROR);
+
+    // Garbage collection keeps the cached values valid.
+    memset(value, 9, 100);
+    TEST_CHECK(mtb_kvstore_write(&kv, "b", value, 100) == CY_RSLT_SUCCESS);
+    TEST_CHECK(read_value("b", buf, sizeof(buf)) == 100);
+    for (int i = 0; i < 60; i++)
+    {
+        memset(value, i, 150);
+        TEST_CHECK(mtb_kvstore_write(&kv, "x", value, 150) == CY_RSLT_SUCCESS);
+    }
+    uint32_t hits = kv.stats.cache_hits;
+    reads = test_bd.reads;
+    TEST_CHECK((read_value("b", buf, sizeof(buf)) == 100) && (buf[5] == 9));
+    TEST_CHECK((kv.stats.cache_hits == hits + 1U) && (test_bd.reads == reads));
+    TEST_CHECK((read_value("x", buf, sizeof(buf)) == 150) && (buf[0] == 59));
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// test_eviction_and_pinning
+//--------------------------------------------------------------------------------------------------
+static void test_eviction_and_pinning(void)
+{
+    // The least recently used values are evicted to stay within the budget.
+    uint8_t value[200];
+    uint8_t buf[200];
+    TEST_CHECK(kv.cache_used <= CACHE_SIZE);
+    for (int i = 0; i < 10; i++)
+    {
+        char key[16];
+        sprintf(key, "e%d", i);
+        memset(value, i, 100);
+        TEST_CHECK(mtb_kvstore_write(&kv, key, value, 100) == CY_RSLT_SUCCESS);
+        TEST_CHECK(read_value(key, buf, sizeof(buf)) == 100);
+        TEST_CHECK(kv.cache_used <= CACHE_SIZE);
+    }
+    uint32_t hits = kv.stats.cache_hits;
+    TEST_CHECK(read_value("e9", buf, sizeof(buf)) == 100);
+    TEST_CHECK(kv.stats.cache_hits == hits + 1U);
+    hits = kv.stats.cache_hits;
+    TEST_CHECK(read_value("e0", buf, sizeof(buf)) == 100);
+    TEST_CHECK(kv.stats.cache_hits == hits);
+
+    // Values larger than the budget are read but not cached, and cannot be pinned.
+    static uint8_t big[700];
+    TEST_CHECK(mtb_kvstore_write(&kv, "big", big, sizeof(big)) == CY_RSLT_SUCCESS);
+    TEST_CHECK(read_value("big", big, sizeof(big)) == sizeof(big));
+    TEST_CHECK(mtb_kvstore_cache_pin(&kv, "big") == MTB_KVSTORE_MEM_ALLOC_ERROR);
+    TEST_CHECK(mtb_kvstore_cache_pin(&kv, "none") == MTB_KVSTORE_ITEM_NOT_FOUND_ERROR);
+
+    // A pinned value stays cached, also after it is written, until it is unpinned.
+    TEST_CHECK(mtb_kvstore_cache_pin(&kv, "b") == CY_RSLT_SUCCESS);
+    read_all_keys();
+    hits = kv.stats.cache_hits;
+    unsigned long reads = test_bd.reads;
+    TEST_CHECK(read_value("b", buf, sizeof(buf)) == 100);
+    TEST_CHECK((kv.stats.cache_hits == hits + 1U) && (test_bd.reads == reads));
+    memset(value, 3, 100);
+    TEST_CHECK(mtb_kvstore_write(&kv, "b", value, 100) == CY_RSLT_SUCCESS);
+    TEST_CHECK((read_value("b", buf, sizeof(buf)) == 100) && (buf[0] == 3));
+    read_all_keys();
+    hits = kv.stats.cache_hits;
+    TEST_CHECK((read_value("b", buf, sizeof(buf)) == 100) && (buf[0] == 3));
+    TEST_CHECK(kv.stats.cache_hits == hits + 1U);
+    mtb_kvstore_cache_unpin(&kv, "b");
+    read_all_keys();
+    hits = kv.stats.cache_hits;
+    TEST_CHECK(read_value("b", buf, sizeof(buf)) == 100);
+    TEST_CHECK(kv.stats.cache_hits == hits);
+
+    // A reset drops pinned values too.
+    TEST_CHECK(mtb_kvstore_cache_pin(&kv, "b") == CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_reset(&kv) == CY_RSLT_SUCCESS);
+    uint32_t size = sizeof(buf);
+    TEST_CHECK(mtb_kvstore_read(&kv, "b", buf, &size) == MTB_KVSTORE_ITEM_NOT_FOUND_ERROR);
+    memset(value, 4, 100);
+    TEST_CHECK(mtb_kvstore_write(&kv, "b", value, 100) == CY_RSLT_SUCCESS);
+    TEST_CHECK((read_value("b", buf, sizeof(buf)) == 100) && (buf[0] == 4));
+    TEST_CHECK((read_value("b", buf, sizeof(buf)) == 100) && (buf[0] == 4));
+
+    // Empty values can be pinned, empty keys cannot.
+    TEST_CHECK(mtb_kvstore_write(&kv, "z", NULL, 0) == CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_cache_pin(&kv, "z") == CY_RSLT_SUCCESS);
+    TEST_CHECK(read_value("z", buf, sizeof(buf)) == 0);
+    TEST_CHECK(mtb_kvstore_cache_pin(&kv, "") == MTB_KVSTORE_BAD_PARAM_ERROR);
+}
+
+
+#if defined(MTB_KVSTORE_RTOS_AWARE)
+static bool readers_stop;
+
+//--------------------------------------------------------------------------------------------------
+// reader_thread
+//--------------------------------------------------------------------------------------------------
+static void* reader_thread(void* arg)
+{
+    // Each value is written with all bytes the same, so a torn read shows up as different bytes.
+    (void)arg;
+    while (!__atomic_load_n(&readers_stop, __ATOMIC_SEQ_CST))
+    {
+        for (int i = 0; i < NUM_SHARED_KEYS; i++)
+        {
+            char key[16];
+            sprintf(key, "c%d", i);
+            uint8_t buf[64];
+            TEST_CHECK(read_value(key, buf, sizeof(buf)) == SHARED_VALUE_SIZE);
+            for (uint32_t j = 1; j < SHARED_VALUE_SIZE; j++)
+            {
+                TEST_CHECK(buf[j] == buf[0]);
+            }
+        }
+    }
+    return NULL;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// test_concurrent_readers
+//--------------------------------------------------------------------------------------------------
+static void test_concurrent_readers(void)
+{
+    uint8_t value[SHARED_VALUE_SIZE];
+    for (int i = 0; i < NUM_SHARED_KEYS; i++)
+    {
+        char key[16];
+        sprintf(key, "c%d", i);
+        memset(value, i, sizeof(value));
+        TEST_CHECK(mtb_kvstore_write(&kv, key, value, sizeof(value)) == CY_RSLT_SUCCESS);
+    }
+    pthread_t readers[NUM_READERS];
+    for (int i = 0; i < NUM_READERS; i++)
+    {
+        TEST_CHECK(pthread_create(&readers[i], NULL, reader_thread, NULL) == 0);
+    }
+    for (int i = 0; i < 300; i++)
+    {
+        char key[16];
+        sprintf(key, "c%d", i % NUM_SHARED_KEYS);
+        memset(value, i, sizeof(value));
+        cy_rslt_t result;
+        do
+        {
+            result = mtb_kvstore_write(&kv, key, value, sizeof(value));
+        } while (test_timed_out(result));
+        TEST_CHECK(result == CY_RSLT_SUCCESS);
+    }
+    __atomic_store_n(&readers_stop, true, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < NUM_READERS; i++)
+    {
+        TEST_CHECK(pthread_join(readers[i], NULL) == 0);
+    }
+}
+
+
+#endif // if defined(MTB_KVSTORE_RTOS_AWARE)
+
+//--------------------------------------------------------------------------------------------------
+// main
+//--------------------------------------------------------------------------------------------------
+int main(void)
+{
+    test_bd_init(&bd, 16, 0);
+    mtb_kvstore_config_t config = { 0 };
+    config.cache_size = CACHE_SIZE;
+    TEST_CHECK(mtb_kvstore_init_with_config(&kv, 0, STORAGE_SIZE, &bd, &config) ==
+               CY_RSLT_SUCCESS);
+    test_hits_and_invalidation();
+    test_eviction_and_pinning();
+    #if defined(MTB_KVSTORE_RTOS_AWARE)
+    test_concurrent_readers();
+    #endif
+    mtb_kvstore_deinit(&kv);
+    printf("test_cache passed\n");
+    return 0;
+}
@@ -0,0 +1,427 @@
+/***********************************************************************************************//**
+ * \file test_chunk_dedup.c
+ *
+ * \brief
+ * Large values that are stored in chunks, and values that are stored once and referenced by every
+ * key that holds the same bytes.
+ *
+ ***************************************************************************************************
+ * \copyright
+ * Copyright 2018-2022 Cypress Semiconductor Corporation (an Infineon company) or
+ * an affiliate of Cypress Semiconductor Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************************************/
+
+#include "test_bd.h"
+
+#define NUM_KEYS            (4)
+#define MAX_VALUE_SIZE      (14000U)
+#define CERT_SIZE           (6000U)
+
+static mtb_kvstore_bd_t bd;
+static mtb_kvstore_config_t config;
+static uint8_t values[NUM_KEYS][MAX_VALUE_SIZE];
+static uint32_t value_sizes[NUM_KEYS];
+static uint8_t buf[MAX_VALUE_SIZE];
+
+
+//--------------------------------------------------------------------------------------------------
+// reinit
+//--------------------------------------------------------------------------------------------------
+static void reinit(mtb_kvstore_t* kv)
+{
+    // Reinitialization finds the same consumed space.
+    uint32_t remaining = mtb_kvstore_remaining_size(kv);
+    mtb_kvstore_deinit(kv);
+    TEST_CHECK(mtb_kvstore_init_with_config(kv, 0, TEST_BD_SIZE, &bd, &config) ==
+               CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_remaining_size(kv) == remaining);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// verify_value
+//--------------------------------------------------------------------------------------------------
+static void verify_value(mtb_kvstore_t* kv, const char* key, const uint8_t* value,
+                         uint32_t value_size)
+{
+    uint32_t size = 0;
+    TEST_CHECK(mtb_kvstore_value_size(kv, key, &size) == CY_RSLT_SUCCESS);
+    TEST_CHECK(size == value_size);
+    size = sizeof(buf);
+    TEST_CHECK(mtb_kvstore_read(kv, key, buf, &size) == CY_RSLT_SUCCESS);
+    TEST_CHECK((size == value_size) && (memcmp(buf, value, size) == 0));
+    size = value_size - 1U;
+    TEST_CHECK(mtb_kvstore_read(kv, key, buf, &size) == MTB_KVSTORE_BUFFER_TOO_SMALL);
+    TEST_CHECK(size == value_size);
+
+    // Partial reads within a chunk and across chunks.
+    for (int i = 0; i < 10; i++)
+    {
+        uint32_t offset = (uint32_t)rand() % (value_size + 1U);
+        uint32_t length = 1U + ((uint32_t)rand() % 7000U);
+        uint32_t expected = (length < (value_size - offset)) ? length : (value_size - offset);
+        size = length;
+        cy_rslt_t result = mtb_kvstore_read_partial(kv, key, buf, &size, offset);
+        TEST_CHECK((result == CY_RSLT_SUCCESS) || (result == MTB_KVSTORE_BUFFER_TOO_SMALL));
+        TEST_CHECK((size == expected) && (memcmp(buf, &value[offset], expected) == 0));
+    }
+    size = 10;
+    TEST_CHECK(mtb_kvstore_read_partial(kv, key, buf, &size, value_size + 1U) ==
+               MTB_KVSTORE_BAD_PARAM_ERROR);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// verify
+//--------------------------------------------------------------------------------------------------
+static void verify(mtb_kvstore_t* kv)
+{
+    for (int idx = 0; idx < NUM_KEYS; idx++)
+    {
+        char key[32];
+        sprintf(key, "chunk/key/%d", idx);
+        verify_value(kv, key, values[idx], value_sizes[idx]);
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// generate
+//--------------------------------------------------------------------------------------------------
+static void generate(int idx, unsigned seed)
+{
+    srand(seed);
+    value_sizes[idx] = (idx == (NUM_KEYS - 1))
+        ? 1U + ((uint32_t)rand() % 200U)
+        : 4097U + ((uint32_t)rand() % 3000U);
+    for (uint32_t i = 0; i < value_sizes[idx]; i++)
+    {
+        values[idx][i] = (uint8_t)rand();
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// flip_last_bit
+//--------------------------------------------------------------------------------------------------
+static mtb_kvstore_update_action_t flip_last_bit(void* context, const char* key, uint8_t* data,
+                                                 uint32_t* size, uint32_t max_size)
+{
+    (void)key;
+    (void)max_size;
+    int idx = *(int*)context;
+    TEST_CHECK((*size == value_sizes[idx]) && (memcmp(data, values[idx], *size) == 0));
+    data[*size - 1U] ^= 1;
+    values[idx][*size - 1U] ^= 1;
+    return MTB_KVSTORE_UPDATE_WRITE;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// test_chunks
+//--------------------------------------------------------------------------------------------------
+static void test_chunks(unsigned seed)
+{
+    test_bd_init(&bd, 16, 0);
+    memset(&config, 0, sizeof(config));
+    config.chunk_min_size = MTB_KVSTORE_CHUNK_SIZE + 1U;
+    mtb_kvstore_t kv;
+    TEST_CHECK(mtb_kvstore_init_with_config(&kv, 0, TEST_BD_SIZE, &bd, &config) ==
+               CY_RSLT_SUCCESS);
+    for (int round = 0; round < 30; round++)
+    {
+        int idx = round % NUM_KEYS;
+        char key[32];
+        sprintf(key, "chunk/key/%d", idx);
+        generate(idx, (seed * 100U) + (unsigned)round);
+        TEST_CHECK(mtb_kvstore_write(&kv, key, values[idx], value_sizes[idx]) == CY_RSLT_SUCCESS);
+        if ((round % 5) == 4)
+        {
+            verify(&kv);
+            reinit(&kv);
+        }
+    }
+    verify(&kv);
+
+    // Changing one byte programs only its chunk and the manifest, unless garbage collection ran.
+    unsigned long programmed_bytes = test_bd.programmed_bytes;
+    unsigned long erases = test_bd.erases;
+    values[1][100] ^= 0x55;
+    TEST_CHECK(mtb_kvstore_write_ex(&kv, "chunk/key/1", values[1], value_sizes[1],
+                                    MTB_KVSTORE_WRITE_SKIP_UNCHANGED) == CY_RSLT_SUCCESS);
+    programmed_bytes = test_bd.programmed_bytes - programmed_bytes;
+    TEST_CHECK((test_bd.erases != erases) ||
+               ((programmed_bytes > MTB_KVSTORE_CHUNK_SIZE) &&
+                (programmed_bytes < MTB_KVSTORE_CHUNK_SIZE + 512U)));
+    verify(&kv);
+    mtb_kvstore_stats_t stats;
+    mtb_kvstore_get_stats(&kv, &stats);
+    uint32_t skipped = stats.skipped_writes;
+    programmed_bytes = test_bd.programmed_bytes;
+    TEST_CHECK(mtb_kvstore_write_ex(&kv, "chunk/key/1", values[1], value_sizes[1],
+                                    MTB_KVSTORE_WRITE_SKIP_UNCHANGED) == CY_RSLT_SUCCESS);
+    mtb_kvstore_get_stats(&kv, &stats);
+    TEST_CHECK((stats.skipped_writes == skipped + 1U) &&
+               (test_bd.programmed_bytes == programmed_bytes));
+
+    // Chunked values can be updated, but not appended to or counted.
+    int idx = 2;
+    TEST_CHECK(mtb_kvstore_update(&kv, "chunk/key/2", flip_last_bit, &idx) == CY_RSLT_SUCCESS);
+    verify(&kv);
+    TEST_CHECK(mtb_kvstore_append(&kv, "chunk/key/2", (const uint8_t*)"x", 1) ==
+               MTB_KVSTORE_BAD_PARAM_ERROR);
+    TEST_CHECK(mtb_kvstore_counter_increment(&kv, "chunk/key/2", NULL) ==
+               MTB_KVSTORE_BAD_PARAM_ERROR);
+
+    // Garbage collection keeps the consumed space.
+    uint32_t remaining = mtb_kvstore_remaining_size(&kv);
+    TEST_CHECK(mtb_kvstore_ensure_capacity(&kv, MTB_KVSTORE_ENSURE_MAX) == CY_RSLT_SUCCESS);
+    verify(&kv);
+    TEST_CHECK(mtb_kvstore_remaining_size(&kv) == remaining);
+    reinit(&kv);
+    verify(&kv);
+
+    // A chunked value replaced by a small one and the other way round, then deleted.
+    TEST_CHECK(mtb_kvstore_write(&kv, "chunk/key/0", (const uint8_t*)"tiny", 4) ==
+               CY_RSLT_SUCCESS);
+    memcpy(values[0], "tiny", 4);
+    value_sizes[0] = 4;
+    verify(&kv);
+    generate(0, seed + 999U);
+    TEST_CHECK(mtb_kvstore_write(&kv, "chunk/key/0", values[0], value_sizes[0]) ==
+               CY_RSLT_SUCCESS);
+    verify(&kv);
+    remaining = mtb_kvstore_remaining_size(&kv);
+    TEST_CHECK(mtb_kvstore_delete(&kv, "chunk/key/0") == CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_remaining_size(&kv) > remaining + value_sizes[0]);
+    TEST_CHECK(mtb_kvstore_key_exists(&kv, "chunk/key/0") == MTB_KVSTORE_ITEM_NOT_FOUND_ERROR);
+    reinit(&kv);
+    TEST_CHECK(mtb_kvstore_key_exists(&kv, "chunk/key/0") == MTB_KVSTORE_ITEM_NOT_FOUND_ERROR);
+
+    // A value larger than the area does not fit in chunks either.
+    static uint8_t huge[40000];
+    TEST_CHECK(mtb_kvstore_write(&kv, "huge", huge, sizeof(huge)) ==
+               MTB_KVSTORE_STORAGE_FULL_ERROR);
+    mtb_kvstore_deinit(&kv);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// test_no_chunks
+//--------------------------------------------------------------------------------------------------
+static void test_no_chunks(void)
+{
+    // Without chunk_min_size a large value is a single record, and changing one byte programs it
+    // again.
+    test_bd_init(&bd, 16, 0);
+    memset(&config, 0, sizeof(config));
+    mtb_kvstore_t kv;
+    TEST_CHECK(mtb_kvstore_init(&kv, 0, TEST_BD_SIZE, &bd) == CY_RSLT_SUCCESS);
+    static uint8_t value[10000];
+    for (uint32_t i = 0; i < sizeof(value); i++)
+    {
+        value[i] = (uint8_t)(i * 13U);
+    }
+    TEST_CHECK(mtb_kvstore_write(&kv, "big", value, sizeof(value)) == CY_RSLT_SUCCESS);
+    value[100] ^= 0x55;
+    unsigned long programmed_bytes = test_bd.programmed_bytes;
+    TEST_CHECK(mtb_kvstore_write(&kv, "big", value, sizeof(value)) == CY_RSLT_SUCCESS);
+    TEST_CHECK((test_bd.programmed_bytes - programmed_bytes) > sizeof(value));
+    TEST_CHECK(kv.num_entries == 1);
+    verify_value(&kv, "big", value, sizeof(value));
+    mtb_kvstore_deinit(&kv);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// test_dedup
+//--------------------------------------------------------------------------------------------------
+static void test_dedup(unsigned seed)
+{
+    static uint8_t cert[CERT_SIZE];
+    static uint8_t other[CERT_SIZE];
+    srand(seed);
+    for (uint32_t i = 0; i < CERT_SIZE; i++)
+    {
+        cert[i] = (uint8_t)rand();
+        other[i] = (uint8_t)rand();
+    }
+    test_bd_init(&bd, 16, 0);
+    memset(&config, 0, sizeof(config));
+    config.dedup_min_size = 512;
+    mtb_kvstore_t kv;
+    TEST_CHECK(mtb_kvstore_init_with_config(&kv, 0, TEST_BD_SIZE, &bd, &config) ==
+               CY_RSLT_SUCCESS);
+
+    // Further copies of a value only take a manifest.
+    uint32_t max_manifest_size = 128U + (4U * ((CERT_SIZE / MTB_KVSTORE_CHUNK_SIZE) + 1U));
+    uint32_t remaining = mtb_kvstore_remaining_size(&kv);
+    TEST_CHECK(mtb_kvstore_write(&kv, "profile/0/cert", cert, CERT_SIZE) == CY_RSLT_SUCCESS);
+    TEST_CHECK((remaining - mtb_kvstore_remaining_size(&kv)) > CERT_SIZE);
+    for (int i = 1; i < 8; i++)
+    {
+        char key[32];
+        sprintf(key, "profile/%d/cert", i);
+        remaining = mtb_kvstore_remaining_size(&kv);
+        unsigned long programmed_bytes = test_bd.programmed_bytes;
+        unsigned long erases = test_bd.erases;
+        TEST_CHECK(mtb_kvstore_write(&kv, key, cert, CERT_SIZE) == CY_RSLT_SUCCESS);
+        TEST_CHECK((remaining - mtb_kvstore_remaining_size(&kv)) < max_manifest_size);
+        TEST_CHECK((test_bd.erases != erases) ||
+                   ((test_bd.programmed_bytes - programmed_bytes) < max_manifest_size));
+    }
+    for (int i = 0; i < 8; i++)
+    {
+        char key[32];
+        sprintf(key, "profile/%d/cert", i);
+        verify_value(&kv, key, cert, CERT_SIZE);
+    }
+
+    // Values below the threshold are stored as before.
+    TEST_CHECK(mtb_kvstore_write(&kv, "small", cert, 100) == CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_write(&kv, "small2", cert, 100) == CY_RSLT_SUCCESS);
+    verify_value(&kv, "small", cert, 100);
+    reinit(&kv);
+
+    // Garbage collection copies the shared value once.
+    remaining = mtb_kvstore_remaining_size(&kv);
+    TEST_CHECK(mtb_kvstore_ensure_capacity(&kv, MTB_KVSTORE_ENSURE_MAX) == CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_remaining_size(&kv) == remaining);
+    for (int i = 0; i < 8; i++)
+    {
+        char key[32];
+        sprintf(key, "profile/%d/cert", i);
+        verify_value(&kv, key, cert, CERT_SIZE);
+    }
+    reinit(&kv);
+
+    // Changing one reference leaves the others, and an unchanged value is skipped.
+    TEST_CHECK(mtb_kvstore_write(&kv, "profile/3/cert", other, CERT_SIZE) == CY_RSLT_SUCCESS);
+    verify_value(&kv, "profile/3/cert", other, CERT_SIZE);
+    verify_value(&kv, "profile/4/cert", cert, CERT_SIZE);
+    mtb_kvstore_stats_t stats;
+    mtb_kvstore_get_stats(&kv, &stats);
+    uint32_t skipped = stats.skipped_writes;
+    unsigned long programmed_bytes = test_bd.programmed_bytes;
+    TEST_CHECK(mtb_kvstore_write_ex(&kv, "profile/4/cert", cert, CERT_SIZE,
+                                    MTB_KVSTORE_WRITE_SKIP_UNCHANGED) == CY_RSLT_SUCCESS);
+    mtb_kvstore_get_stats(&kv, &stats);
+    TEST_CHECK((stats.skipped_writes == skipped + 1U) &&
+               (test_bd.programmed_bytes == programmed_bytes));
+
+    // A value whose chunks repeat stores the chunk once.
+    static uint8_t repeated[(3U * MTB_KVSTORE_CHUNK_SIZE) + 10U];
+    memset(repeated, 0x5A, sizeof(repeated));
+    remaining = mtb_kvstore_remaining_size(&kv);
+    TEST_CHECK(mtb_kvstore_write(&kv, "rep", repeated, sizeof(repeated)) == CY_RSLT_SUCCESS);
+    verify_value(&kv, "rep", repeated, sizeof(repeated));
+    TEST_CHECK((remaining - mtb_kvstore_remaining_size(&kv)) < MTB_KVSTORE_CHUNK_SIZE + 400U);
+    reinit(&kv);
+    verify_value(&kv, "rep", repeated, sizeof(repeated));
+
+    // Deleting every reference frees the shared value.
+    remaining = mtb_kvstore_remaining_size(&kv);
+    for (int i = 0; i < 8; i++)
+    {
+        char key[32];
+        sprintf(key, "profile/%d/cert", i);
+        if (i != 3)
+        {
+            TEST_CHECK(mtb_kvstore_delete(&kv, key) == CY_RSLT_SUCCESS);
+        }
+    }
+    TEST_CHECK(mtb_kvstore_remaining_size(&kv) > remaining + CERT_SIZE);
+    reinit(&kv);
+    verify_value(&kv, "profile/3/cert", other, CERT_SIZE);
+    TEST_CHECK(mtb_kvstore_key_exists(&kv, "profile/0/cert") == MTB_KVSTORE_ITEM_NOT_FOUND_ERROR);
+
+    // Many keys with few distinct values, through several garbage collections.
+    static uint8_t shared[3][5000];
+    for (int v = 0; v < 3; v++)
+    {
+        for (uint32_t i = 0; i < sizeof(shared[v]); i++)
+        {
+            shared[v][i] = (uint8_t)rand();
+        }
+    }
+    int current[12];
+    for (int i = 0; i < 12; i++)
+    {
+        current[i] = -1;
+    }
+    for (int round = 0; round < 300; round++)
+    {
+        int i = rand() % 12;
+        int v = rand() % 4;
+        char key[32];
+        sprintf(key, "churn/%d", i);
+        if (v == 3)
+        {
+            TEST_CHECK(mtb_kvstore_delete(&kv, key) == CY_RSLT_SUCCESS);
+            current[i] = -1;
+        }
+        else
+        {
+            TEST_CHECK(mtb_kvstore_write(&kv, key, shared[v], 600U + ((uint32_t)v * 1500U)) ==
+                       CY_RSLT_SUCCESS);
+            current[i] = v;
+        }
+        if ((round % 37) == 0)
+        {
+            reinit(&kv);
+        }
+        if ((round % 50) == 0)
+        {
+            for (int j = 0; j < 12; j++)
+            {
+                sprintf(key, "churn/%d", j);
+                if (current[j] < 0)
+                {
+                    TEST_CHECK(mtb_kvstore_key_exists(&kv, key) ==
+                               MTB_KVSTORE_ITEM_NOT_FOUND_ERROR);
+                }
+                else
+                {
+                    verify_value(&kv, key, shared[current[j]],
+                                 600U + ((uint32_t)current[j] * 1500U));
+                }
+            }
+        }
+    }
+
+    // A reset drops the shared values.
+    TEST_CHECK(mtb_kvstore_reset(&kv) == CY_RSLT_SUCCESS);
+    TEST_CHECK(kv.num_blobs == 0);
+    TEST_CHECK(mtb_kvstore_write(&kv, "a", cert, CERT_SIZE) == CY_RSLT_SUCCESS);
+    reinit(&kv);
+    verify_value(&kv, "a", cert, CERT_SIZE);
+    mtb_kvstore_deinit(&kv);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// main
+//--------------------------------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+    unsigned seed = (argc > 1) ? (unsigned)atoi(argv[1]) : 1U;
+    test_chunks(seed);
+    test_no_chunks();
+    test_dedup(seed);
+    printf("test_chunk_dedup passed, seed %u\n", seed);
+    return 0;
+}
@@ -0,0 +1,196 @@
+/***********************************************************************************************//**
+ * \file test_compress.c
+ *
+ * \brief
+ * Compressed values: reads, partial reads, updates and garbage collection of values that compress
+ * well, poorly or not at all.
+ *
+ ***************************************************************************************************
+ * \copyright
+ * Copyright 2018-2022 Cypress Semiconductor Corporation (an Infineon company) or
+ * an affiliate of Cypress Semiconductor Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************************************/
+
+#include "test_bd.h"
+
+#define STORAGE_SIZE        (32768U)
+#define NUM_KEYS            (6)
+#define MAX_VALUE_SIZE      (3000U)
+#define TEXT_SIZE           (4000U)
+
+static mtb_kvstore_bd_t bd;
+static uint8_t values[NUM_KEYS][MAX_VALUE_SIZE];
+static uint32_t value_sizes[NUM_KEYS];
+
+
+//--------------------------------------------------------------------------------------------------
+// generate
+//--------------------------------------------------------------------------------------------------
+static void generate(int idx, unsigned seed)
+{
+    static const char json[] = "{\"name\":\"sensor\",\"rate\":100,\"enabled\":true}\n";
+    srand(seed);
+    uint32_t size = 1U + ((uint32_t)rand() % 2900U);
+    int kind = rand() % 3;
+    value_sizes[idx] = size;
+    for (uint32_t i = 0; i < size; i++)
+    {
+        if (kind == 0)
+        {
+            values[idx][i] = (uint8_t)rand();
+        }
+        else if (kind == 1)
+        {
+            values[idx][i] = (uint8_t)json[(i + (uint32_t)(rand() % 3 / 2)) % (sizeof(json) - 1U)];
+        }
+        else
+        {
+            values[idx][i] = ((i % 50U) < 25U) ? (uint8_t)('a' + (i % 7U)) : (uint8_t)(rand() % 4);
+        }
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// verify
+//--------------------------------------------------------------------------------------------------
+static void verify(mtb_kvstore_t* kv)
+{
+    static uint8_t buf[MAX_VALUE_SIZE];
+    for (int idx = 0; idx < NUM_KEYS; idx++)
+    {
+        char key[16];
+        sprintf(key, "c%d", idx);
+        uint32_t value_size = value_sizes[idx];
+        uint32_t size = 0;
+        TEST_CHECK(mtb_kvstore_value_size(kv, key, &size) == CY_RSLT_SUCCESS);
+        TEST_CHECK(size == value_size);
+        size = sizeof(buf);
+        TEST_CHECK(mtb_kvstore_read(kv, key, buf, &size) == CY_RSLT_SUCCESS);
+        TEST_CHECK((size == value_size) && (memcmp(buf, values[idx], size) == 0));
+        if (value_size > 1)
+        {
+            size = value_size - 1U;
+            TEST_CHECK(mtb_kvstore_read(kv, key, buf, &size) == MTB_KVSTORE_BUFFER_TOO_SMALL);
+            TEST_CHECK(size == value_size);
+        }
+
+        // Partial reads decompress from the start of the value up to the requested bytes.
+        for (int i = 0; i < 10; i++)
+        {
+            uint32_t offset = (uint32_t)rand() % (value_size + 1U);
+            uint32_t length = 1U + ((uint32_t)rand() % 600U);
+            uint32_t expected = (length < (value_size - offset)) ? length : (value_size - offset);
+            size = length;
+            cy_rslt_t result = mtb_kvstore_read_partial(kv, key, buf, &size, offset);
+            TEST_CHECK((result == CY_RSLT_SUCCESS) || (result == MTB_KVSTORE_BUFFER_TOO_SMALL));
+            TEST_CHECK(memcmp(buf, &values[idx][offset], expected) == 0);
+        }
+        size = 10;
+        TEST_CHECK(mtb_kvstore_read_partial(kv, key, buf, &size, value_size + 1U) ==
+                   MTB_KVSTORE_BAD_PARAM_ERROR);
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// flip_first_bit
+//--------------------------------------------------------------------------------------------------
+static mtb_kvstore_update_action_t flip_first_bit(void* context, const char* key, uint8_t* data,
+                                                  uint32_t* size, uint32_t max_size)
+{
+    (void)key;
+    (void)max_size;
+    int idx = *(int*)context;
+    TEST_CHECK((*size == value_sizes[idx]) && (memcmp(data, values[idx], *size) == 0));
+    data[0] ^= 1;
+    values[idx][0] ^= 1;
+    return MTB_KVSTORE_UPDATE_WRITE;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// main
+//--------------------------------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+    unsigned seed = (argc > 1) ? (unsigned)atoi(argv[1]) : 1U;
+    test_bd_init(&bd, 16, 0);
+    mtb_kvstore_t kv;
+    TEST_CHECK(mtb_kvstore_init(&kv, 0, STORAGE_SIZE, &bd) == CY_RSLT_SUCCESS);
+
+    for (int round = 0; round < 40; round++)
+    {
+        int idx = round % NUM_KEYS;
+        char key[16];
+        sprintf(key, "c%d", idx);
+        generate(idx, (seed * 100U) + (unsigned)round);
+        TEST_CHECK(mtb_kvstore_write_ex(&kv, key, values[idx], value_sizes[idx],
+                                        MTB_KVSTORE_WRITE_COMPRESS) == CY_RSLT_SUCCESS);
+        if ((round % 7) == 6)
+        {
+            verify(&kv);
+            mtb_kvstore_deinit(&kv);
+            TEST_CHECK(mtb_kvstore_init(&kv, 0, STORAGE_SIZE, &bd) == CY_RSLT_SUCCESS);
+        }
+    }
+    verify(&kv);
+
+    // Skipping unchanged writes compares the uncompressed value.
+    mtb_kvstore_stats_t stats;
+    mtb_kvstore_get_stats(&kv, &stats);
+    uint32_t skipped = stats.skipped_writes;
+    TEST_CHECK(mtb_kvstore_write_ex(&kv, "c1", values[1], value_sizes[1],
+                                    MTB_KVSTORE_WRITE_COMPRESS |
+                                    MTB_KVSTORE_WRITE_SKIP_UNCHANGED) == CY_RSLT_SUCCESS);
+    mtb_kvstore_get_stats(&kv, &stats);
+    TEST_CHECK(stats.skipped_writes == skipped + 1U);
+
+    // Updates see the uncompressed value, and garbage collection keeps compressed records.
+    int idx = 2;
+    TEST_CHECK(mtb_kvstore_update(&kv, "c2", flip_first_bit, &idx) == CY_RSLT_SUCCESS);
+    verify(&kv);
+    TEST_CHECK(mtb_kvstore_ensure_capacity(&kv, MTB_KVSTORE_ENSURE_MAX) == CY_RSLT_SUCCESS);
+    verify(&kv);
+    TEST_CHECK(mtb_kvstore_write(&kv, "c3", (const uint8_t*)"plain", 5) == CY_RSLT_SUCCESS);
+    memcpy(values[3], "plain", 5);
+    value_sizes[3] = 5;
+    verify(&kv);
+
+    // Text takes much less space, and compressed values cannot be appended to or counted.
+    static const char pem[] = "-----BEGIN CERTIFICATE-----\nMIIBszCCAVmgAwIBAgIU\n";
+    static uint8_t text[TEXT_SIZE];
+    static uint8_t buf[TEXT_SIZE];
+    for (uint32_t i = 0; i < TEXT_SIZE; i++)
+    {
+        text[i] = (uint8_t)pem[i % (sizeof(pem) - 1U)];
+    }
+    uint32_t remaining = mtb_kvstore_remaining_size(&kv);
+    TEST_CHECK(mtb_kvstore_write_ex(&kv, "cert", text, TEXT_SIZE, MTB_KVSTORE_WRITE_COMPRESS) ==
+               CY_RSLT_SUCCESS);
+    TEST_CHECK((remaining - mtb_kvstore_remaining_size(&kv)) < (TEXT_SIZE / 4U));
+    TEST_CHECK(mtb_kvstore_append(&kv, "cert", (const uint8_t*)"x", 1) ==
+               MTB_KVSTORE_BAD_PARAM_ERROR);
+    TEST_CHECK(mtb_kvstore_counter_increment(&kv, "cert", NULL) == MTB_KVSTORE_BAD_PARAM_ERROR);
+    uint32_t size = sizeof(buf);
+    TEST_CHECK(mtb_kvstore_read(&kv, "cert", buf, &size) == CY_RSLT_SUCCESS);
+    TEST_CHECK((size == TEXT_SIZE) && (memcmp(buf, text, TEXT_SIZE) == 0));
+    mtb_kvstore_deinit(&kv);
+
+    printf("test_compress passed, seed %u\n", seed);
+    return 0;
+}
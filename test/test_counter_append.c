@@ -0,0 +1,271 @@
+/***********************************************************************************************//**
+ * \file test_counter_append.c
+ *
+ * \brief
+ * Counters, with and without a block device that can clear bits of programmed bytes, and values
+ * that are appended to, without and with a retention limit.
+ *
+ ***************************************************************************************************
+ * \copyright
+ * Copyright 2018-2022 Cypress Semiconductor Corporation (an Infineon company) or
+ * an affiliate of Cypress Semiconductor Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************************************/
+
+#include "test_bd.h"
+
+#define STORAGE_SIZE        (16384U)
+#define LOG_STORAGE_SIZE    (32768U)
+#define MAX_LOG_SIZE        (20000U)
+
+static mtb_kvstore_bd_t bd;
+static uint8_t log_model[MAX_LOG_SIZE];
+static uint32_t log_size;
+
+
+//--------------------------------------------------------------------------------------------------
+// read_u32
+//--------------------------------------------------------------------------------------------------
+static uint32_t read_u32(mtb_kvstore_t* kv, const char* key)
+{
+    uint32_t value = 0;
+    uint32_t size = sizeof(value);
+    TEST_CHECK(mtb_kvstore_read(kv, key, (uint8_t*)&value, &size) == CY_RSLT_SUCCESS);
+    TEST_CHECK(size == sizeof(value));
+    return value;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// test_counter
+//--------------------------------------------------------------------------------------------------
+static void test_counter(uint32_t capabilities)
+{
+    test_bd_init(&bd, 16, capabilities);
+    mtb_kvstore_t kv;
+    TEST_CHECK(mtb_kvstore_init(&kv, 0, STORAGE_SIZE, &bd) == CY_RSLT_SUCCESS);
+
+    uint32_t value = 0;
+    for (uint32_t i = 1; i <= 1000; i++)
+    {
+        TEST_CHECK(mtb_kvstore_counter_increment(&kv, "boot", &value) == CY_RSLT_SUCCESS);
+        TEST_CHECK(value == i);
+        if ((i % 97U) == 0)
+        {
+            TEST_CHECK(read_u32(&kv, "boot") == i);
+        }
+        if ((i % 50U) == 0)
+        {
+            TEST_CHECK(mtb_kvstore_write(&kv, "filler", (const uint8_t*)&i, sizeof(i)) ==
+                       CY_RSLT_SUCCESS);
+        }
+    }
+    uint32_t size = 0;
+    TEST_CHECK(mtb_kvstore_value_size(&kv, "boot", &size) == CY_RSLT_SUCCESS);
+    TEST_CHECK(size == sizeof(uint32_t));
+    uint8_t part[2];
+    size = sizeof(part);
+    TEST_CHECK(mtb_kvstore_read_partial(&kv, "boot", part, &size, 2) == CY_RSLT_SUCCESS);
+    TEST_CHECK((size == sizeof(part)) && (part[0] == ((1000U >> 16) & 0xFFU)));
+
+    // Every increment is a new version.
+    uint32_t version1;
+    uint32_t version2;
+    TEST_CHECK(mtb_kvstore_read_versioned(&kv, "boot", NULL, NULL, &version1) == CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_counter_increment(&kv, "boot", NULL) == CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_read_versioned(&kv, "boot", NULL, NULL, &version2) == CY_RSLT_SUCCESS);
+    TEST_CHECK(version1 != version2);
+    mtb_kvstore_deinit(&kv);
+    TEST_CHECK(mtb_kvstore_init(&kv, 0, STORAGE_SIZE, &bd) == CY_RSLT_SUCCESS);
+    TEST_CHECK(read_u32(&kv, "boot") == 1001);
+
+    // A 4 byte value is incremented, other sizes are refused, and writes replace a counter.
+    uint32_t seven = 7;
+    TEST_CHECK(mtb_kvstore_write(&kv, "c2", (const uint8_t*)&seven, sizeof(seven)) ==
+               CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_counter_increment(&kv, "c2", &value) == CY_RSLT_SUCCESS);
+    TEST_CHECK(value == 8);
+    TEST_CHECK(mtb_kvstore_write(&kv, "c3", (const uint8_t*)"abc", 3) == CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_counter_increment(&kv, "c3", &value) == MTB_KVSTORE_BAD_PARAM_ERROR);
+    TEST_CHECK(mtb_kvstore_write(&kv, "boot", (const uint8_t*)&seven, sizeof(seven)) ==
+               CY_RSLT_SUCCESS);
+    TEST_CHECK(read_u32(&kv, "boot") == 7);
+    TEST_CHECK(mtb_kvstore_counter_increment(&kv, "boot", &value) == CY_RSLT_SUCCESS);
+    TEST_CHECK(value == 8);
+    TEST_CHECK(mtb_kvstore_counter_increment(&kv, "boot", &value) == CY_RSLT_SUCCESS);
+    TEST_CHECK(value == 9);
+
+    // The counter survives garbage collection, and restarts at 1 after a delete.
+    uint8_t big[500] = { 0 };
+    for (int i = 0; i < 100; i++)
+    {
+        big[0] = (uint8_t)i;
+        TEST_CHECK(mtb_kvstore_write(&kv, "big", big, sizeof(big)) == CY_RSLT_SUCCESS);
+    }
+    TEST_CHECK(mtb_kvstore_counter_increment(&kv, "boot", &value) == CY_RSLT_SUCCESS);
+    TEST_CHECK(value == 10);
+    TEST_CHECK(mtb_kvstore_delete(&kv, "boot") == CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_counter_increment(&kv, "boot", &value) == CY_RSLT_SUCCESS);
+    TEST_CHECK(value == 1);
+    mtb_kvstore_deinit(&kv);
+    TEST_CHECK(mtb_kvstore_init(&kv, 0, STORAGE_SIZE, &bd) == CY_RSLT_SUCCESS);
+    TEST_CHECK(read_u32(&kv, "boot") == 1);
+    TEST_CHECK(read_u32(&kv, "c2") == 8);
+    mtb_kvstore_deinit(&kv);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// verify_log
+//--------------------------------------------------------------------------------------------------
+static void verify_log(mtb_kvstore_t* kv)
+{
+    static uint8_t buf[MAX_LOG_SIZE];
+    uint32_t size = sizeof(buf);
+    TEST_CHECK(mtb_kvstore_read(kv, "log", buf, &size) == CY_RSLT_SUCCESS);
+    TEST_CHECK((size == log_size) && (memcmp(buf, log_model, log_size) == 0));
+    TEST_CHECK(mtb_kvstore_value_size(kv, "log", &size) == CY_RSLT_SUCCESS);
+    TEST_CHECK(size == log_size);
+    if (log_size > 10)
+    {
+        uint32_t offset = log_size / 3U;
+        uint32_t length = log_size / 3U;
+        size = length;
+        cy_rslt_t result = mtb_kvstore_read_partial(kv, "log", buf, &size, offset);
+        TEST_CHECK((result == CY_RSLT_SUCCESS) || (result == MTB_KVSTORE_BUFFER_TOO_SMALL));
+        TEST_CHECK((size == length) && (memcmp(buf, &log_model[offset], length) == 0));
+    }
+    if (log_size > 0)
+    {
+        size = log_size - 1U;
+        TEST_CHECK(mtb_kvstore_read(kv, "log", buf, &size) == MTB_KVSTORE_BUFFER_TOO_SMALL);
+        TEST_CHECK(size == log_size);
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// test_append
+//--------------------------------------------------------------------------------------------------
+static void test_append(void)
+{
+    srand(1);
+    test_bd_init(&bd, 16, 0);
+    mtb_kvstore_t kv;
+    TEST_CHECK(mtb_kvstore_init(&kv, 0, LOG_STORAGE_SIZE, &bd) == CY_RSLT_SUCCESS);
+
+    // An unbounded log, across reinitializations and garbage collections.
+    log_size = 0;
+    for (int i = 0; i < 300; i++)
+    {
+        uint8_t event[40];
+        uint32_t size = 1U + ((uint32_t)rand() % sizeof(event));
+        for (uint32_t j = 0; j < size; j++)
+        {
+            event[j] = (uint8_t)rand();
+        }
+        TEST_CHECK(mtb_kvstore_append(&kv, "log", event, size) == CY_RSLT_SUCCESS);
+        memcpy(&log_model[log_size], event, size);
+        log_size += size;
+        if ((i % 37) == 0)
+        {
+            verify_log(&kv);
+        }
+        if ((i % 101) == 0)
+        {
+            mtb_kvstore_deinit(&kv);
+            TEST_CHECK(mtb_kvstore_init(&kv, 0, LOG_STORAGE_SIZE, &bd) == CY_RSLT_SUCCESS);
+            verify_log(&kv);
+        }
+        if ((i % 50) == 0)
+        {
+            uint8_t filler[300] = { 0 };
+            TEST_CHECK(mtb_kvstore_write(&kv, "fill", filler, sizeof(filler)) == CY_RSLT_SUCCESS);
+        }
+    }
+    verify_log(&kv);
+    uint32_t used = mtb_kvstore_size(&kv);
+    mtb_kvstore_deinit(&kv);
+    TEST_CHECK(mtb_kvstore_init(&kv, 0, LOG_STORAGE_SIZE, &bd) == CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_size(&kv) == used);
+    verify_log(&kv);
+
+    // Appending to a written value, and writing over an appended one.
+    uint8_t buf[16];
+    uint32_t size = sizeof(buf);
+    TEST_CHECK(mtb_kvstore_write(&kv, "r", (const uint8_t*)"abc", 3) == CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_append(&kv, "r", (const uint8_t*)"def", 3) == CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_read(&kv, "r", buf, &size) == CY_RSLT_SUCCESS);
+    TEST_CHECK((size == 6) && (memcmp(buf, "abcdef", 6) == 0));
+    used = mtb_kvstore_size(&kv);
+    TEST_CHECK(mtb_kvstore_write(&kv, "r", (const uint8_t*)"x", 1) == CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_size(&kv) < used);
+    size = sizeof(buf);
+    TEST_CHECK(mtb_kvstore_read(&kv, "r", buf, &size) == CY_RSLT_SUCCESS);
+    TEST_CHECK((size == 1) && (buf[0] == 'x'));
+    TEST_CHECK(mtb_kvstore_append(&kv, "r", (const uint8_t*)"yz", 2) == CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_delete(&kv, "r") == CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_key_exists(&kv, "r") == MTB_KVSTORE_ITEM_NOT_FOUND_ERROR);
+    TEST_CHECK(mtb_kvstore_append(&kv, "r", (const uint8_t*)"q", 1) == CY_RSLT_SUCCESS);
+    size = sizeof(buf);
+    TEST_CHECK(mtb_kvstore_read(&kv, "r", buf, &size) == CY_RSLT_SUCCESS);
+    TEST_CHECK((size == 1) && (buf[0] == 'q'));
+
+    // Counters and appended values do not mix.
+    TEST_CHECK(mtb_kvstore_counter_increment(&kv, "cnt", NULL) == CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_append(&kv, "cnt", buf, 1) == MTB_KVSTORE_BAD_PARAM_ERROR);
+    TEST_CHECK(mtb_kvstore_counter_increment(&kv, "r", NULL) == MTB_KVSTORE_BAD_PARAM_ERROR);
+
+    // With a retention limit, garbage collection keeps whole appended segments from the end.
+    TEST_CHECK(mtb_kvstore_delete(&kv, "log") == CY_RSLT_SUCCESS);
+    for (int i = 0; i < 400; i++)
+    {
+        uint8_t event[10];
+        memset(event, i, sizeof(event));
+        TEST_CHECK(mtb_kvstore_append_ex(&kv, "ring", event, sizeof(event), 200) ==
+                   CY_RSLT_SUCCESS);
+    }
+    TEST_CHECK(mtb_kvstore_ensure_capacity(&kv, MTB_KVSTORE_ENSURE_MAX) == CY_RSLT_SUCCESS);
+    uint32_t ring_size = 0;
+    TEST_CHECK(mtb_kvstore_value_size(&kv, "ring", &ring_size) == CY_RSLT_SUCCESS);
+    static uint8_t ring[8000];
+    size = sizeof(ring);
+    TEST_CHECK(mtb_kvstore_read(&kv, "ring", ring, &size) == CY_RSLT_SUCCESS);
+    TEST_CHECK((size == ring_size) && (size >= 200) && ((size % 10U) == 0));
+    for (uint32_t j = 0; j < size; j++)
+    {
+        TEST_CHECK(ring[j] == (uint8_t)(400U - (size / 10U) + (j / 10U)));
+    }
+    mtb_kvstore_deinit(&kv);
+    TEST_CHECK(mtb_kvstore_init(&kv, 0, LOG_STORAGE_SIZE, &bd) == CY_RSLT_SUCCESS);
+    size = sizeof(ring);
+    TEST_CHECK(mtb_kvstore_read(&kv, "ring", ring, &size) == CY_RSLT_SUCCESS);
+    TEST_CHECK(size == ring_size);
+    mtb_kvstore_deinit(&kv);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// main
+//--------------------------------------------------------------------------------------------------
+int main(void)
+{
+    test_counter(0);
+    test_counter(MTB_KVSTORE_BD_CAP_BIT_CLEAR);
+    test_append();
+    printf("test_counter_append passed\n");
+    return 0;
+}
@@ -0,0 +1,357 @@
+/***********************************************************************************************//**
+ * \file test_formats.c
+ *
+ * \brief
+ * Random operations on a kv-store with packed records, compact headers and the key dictionary,
+ * checked against a model. The formats are switched between reinitializations, so that one area
+ * holds records of several formats.
+ *
+ ***************************************************************************************************
+ * \copyright
+ * Copyright 2018-2022 Cypress Semiconductor Corporation (an Infineon company) or
+ * an affiliate of Cypress Semiconductor Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************************************/
+
+#include "test_bd.h"
+
+#define NUM_KEYS            (40)
+#define MAX_VALUE_SIZE      (200U)
+#define STORAGE_SIZE        (32768U)
+#define BIG_VALUE_SIZE      (20000U)
+
+typedef struct
+{
+    uint8_t     value[MAX_VALUE_SIZE];
+    uint32_t    size;
+    bool        exists;
+} model_entry_t;
+
+static mtb_kvstore_bd_t bd;
+static model_entry_t model[NUM_KEYS];
+
+
+//--------------------------------------------------------------------------------------------------
+// key_name
+//--------------------------------------------------------------------------------------------------
+static void key_name(int idx, char* key)
+{
+    // Long keys with a shared prefix, and two short keys whose bytes look like dictionary
+    // references.
+    if (idx == (NUM_KEYS - 1))
+    {
+        strcpy(key, "\xC3\x81");
+    }
+    else if (idx == (NUM_KEYS - 2))
+    {
+        strcpy(key, "\x81\x80");
+    }
+    else
+    {
+        sprintf(key, "app/sensors/imu/calibration/gyro_bias_%02d", idx);
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// verify
+//--------------------------------------------------------------------------------------------------
+static void verify(mtb_kvstore_t* kv)
+{
+    for (int idx = 0; idx < NUM_KEYS; idx++)
+    {
+        char key[64];
+        key_name(idx, key);
+        uint8_t buf[MAX_VALUE_SIZE];
+        uint32_t size = sizeof(buf);
+        cy_rslt_t result = mtb_kvstore_read(kv, key, buf, &size);
+        if (model[idx].exists)
+        {
+            TEST_CHECK(result == CY_RSLT_SUCCESS);
+            TEST_CHECK((size == model[idx].size) && (memcmp(buf, model[idx].value, size) == 0));
+            TEST_CHECK(mtb_kvstore_key_exists(kv, key) == CY_RSLT_SUCCESS);
+        }
+        else
+        {
+            TEST_CHECK(result == MTB_KVSTORE_ITEM_NOT_FOUND_ERROR);
+            TEST_CHECK(mtb_kvstore_key_exists(kv, key) == MTB_KVSTORE_ITEM_NOT_FOUND_ERROR);
+        }
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// invert
+//--------------------------------------------------------------------------------------------------
+static mtb_kvstore_update_action_t invert(void* context, const char* key, uint8_t* data,
+                                          uint32_t* size, uint32_t max_size)
+{
+    (void)context;
+    (void)key;
+    (void)max_size;
+    for (uint32_t i = 0; i < *size; i++)
+    {
+        data[i] ^= 0x5A;
+    }
+    return MTB_KVSTORE_UPDATE_WRITE;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// run_cycle
+//--------------------------------------------------------------------------------------------------
+static void run_cycle(mtb_kvstore_t* kv, mtb_kvstore_config_t* config, unsigned seed,
+                      int iterations, bool switch_formats)
+{
+    srand(seed);
+    for (int iter = 0; iter < iterations; iter++)
+    {
+        int idx = rand() % NUM_KEYS;
+        char key[64];
+        key_name(idx, key);
+        model_entry_t* entry = &model[idx];
+        int op = rand() % 14;
+        if (op == 0)
+        {
+            TEST_CHECK(mtb_kvstore_delete(kv, key) == CY_RSLT_SUCCESS);
+            entry->exists = false;
+        }
+        else if (op == 1)
+        {
+            const char* keys[2] = { key, "none" };
+            TEST_CHECK(mtb_kvstore_delete_many(kv, keys, 2) == CY_RSLT_SUCCESS);
+            entry->exists = false;
+        }
+        else if ((op == 2) && (idx < 10))
+        {
+            TEST_CHECK(mtb_kvstore_delete_prefix(kv, "app/sensors/imu/calibration/gyro_bias_0") ==
+                       CY_RSLT_SUCCESS);
+            for (int other = 0; other < 10; other++)
+            {
+                model[other].exists = false;
+            }
+        }
+        else if (op == 3)
+        {
+            uint32_t value = 0;
+            cy_rslt_t result = mtb_kvstore_counter_increment(kv, key, &value);
+            if (!entry->exists)
+            {
+                TEST_CHECK((result == CY_RSLT_SUCCESS) && (value == 1));
+                memcpy(entry->value, &value, sizeof(value));
+                entry->size = sizeof(value);
+                entry->exists = true;
+            }
+            else if ((entry->size == sizeof(value)) && (result == CY_RSLT_SUCCESS))
+            {
+                uint32_t old;
+                memcpy(&old, entry->value, sizeof(old));
+                TEST_CHECK(value == old + 1U);
+                memcpy(entry->value, &value, sizeof(value));
+            }
+        }
+        else if (op == 4)
+        {
+            uint8_t data[5];
+            for (uint32_t i = 0; i < sizeof(data); i++)
+            {
+                data[i] = (uint8_t)rand();
+            }
+            if (mtb_kvstore_append(kv, key, data, sizeof(data)) == CY_RSLT_SUCCESS)
+            {
+                if (!entry->exists)
+                {
+                    entry->size = 0;
+                }
+                if ((entry->size + sizeof(data)) <= MAX_VALUE_SIZE)
+                {
+                    memcpy(&entry->value[entry->size], data, sizeof(data));
+                    entry->size += sizeof(data);
+                    entry->exists = true;
+                }
+                else
+                {
+                    TEST_CHECK(mtb_kvstore_delete(kv, key) == CY_RSLT_SUCCESS);
+                    entry->exists = false;
+                }
+            }
+        }
+        else if ((op == 5) && entry->exists)
+        {
+            if (mtb_kvstore_update(kv, key, invert, NULL) == CY_RSLT_SUCCESS)
+            {
+                for (uint32_t i = 0; i < entry->size; i++)
+                {
+                    entry->value[i] ^= 0x5A;
+                }
+            }
+        }
+        else
+        {
+            // Values that compress well and values that do not.
+            uint32_t size = 1U + ((uint32_t)rand() % ((op == 13) ? MAX_VALUE_SIZE : 8U));
+            bool repetitive = (rand() % 2) != 0;
+            for (uint32_t i = 0; i < size; i++)
+            {
+                entry->value[i] = repetitive ? (uint8_t)(i % 7U) : (uint8_t)rand();
+            }
+            uint32_t flags = ((rand() % 2) != 0)
+                ? MTB_KVSTORE_WRITE_COMPRESS
+                : MTB_KVSTORE_WRITE_SKIP_UNCHANGED;
+            TEST_CHECK(mtb_kvstore_write_ex(kv, key, entry->value, size, flags) ==
+                       CY_RSLT_SUCCESS);
+            entry->size = size;
+            entry->exists = true;
+        }
+
+        if ((iter % 250) == 249)
+        {
+            verify(kv);
+            mtb_kvstore_deinit(kv);
+            if (switch_formats)
+            {
+                config->key_dictionary = !config->key_dictionary;
+                if (((iter / 250) % 3) == 0)
+                {
+                    config->compact_headers = !config->compact_headers;
+                }
+            }
+            TEST_CHECK(mtb_kvstore_init_with_config(kv, 0, STORAGE_SIZE, &bd, config) ==
+                       CY_RSLT_SUCCESS);
+            verify(kv);
+        }
+    }
+    verify(kv);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// run_formats
+//--------------------------------------------------------------------------------------------------
+static void run_formats(bool packed_records, unsigned seed)
+{
+    // Packed records need a device that can program bytes next to programmed ones.
+    test_bd_init(&bd, packed_records ? 256U : 16U, MTB_KVSTORE_BD_CAP_BIT_CLEAR);
+    memset(model, 0, sizeof(model));
+    mtb_kvstore_config_t config = { 0 };
+    config.packed_records = packed_records;
+    config.compact_headers = true;
+    config.key_dictionary = true;
+
+    mtb_kvstore_t kv;
+    TEST_CHECK(mtb_kvstore_init_with_config(&kv, 0, STORAGE_SIZE, &bd, &config) ==
+               CY_RSLT_SUCCESS);
+    run_cycle(&kv, &config, seed, 2000, false);
+    run_cycle(&kv, &config, seed + 7U, 4000, true);
+
+    // Switching packed records on and off again keeps the values. This starts without packed
+    // records, as the values do not fit the storage in padded records of the larger program size.
+    if (!packed_records)
+    {
+        mtb_kvstore_deinit(&kv);
+        config.packed_records = true;
+        TEST_CHECK(mtb_kvstore_init_with_config(&kv, 0, STORAGE_SIZE, &bd, &config) ==
+                   CY_RSLT_SUCCESS);
+        verify(&kv);
+        run_cycle(&kv, &config, seed + 8U, 600, true);
+        mtb_kvstore_deinit(&kv);
+        config.packed_records = false;
+        TEST_CHECK(mtb_kvstore_init_with_config(&kv, 0, STORAGE_SIZE, &bd, &config) ==
+                   CY_RSLT_SUCCESS);
+        verify(&kv);
+    }
+
+    // A reset also forgets the dictionary.
+    TEST_CHECK(mtb_kvstore_reset(&kv) == CY_RSLT_SUCCESS);
+    memset(model, 0, sizeof(model));
+    verify(&kv);
+    TEST_CHECK(kv.num_key_ids == 0);
+    run_cycle(&kv, &config, seed + 9U, 1000, true);
+    mtb_kvstore_deinit(&kv);
+
+    // A value larger than 16383 bytes needs the longest compact size field.
+    static uint8_t big[BIG_VALUE_SIZE];
+    static uint8_t buf[BIG_VALUE_SIZE];
+    for (uint32_t i = 0; i < BIG_VALUE_SIZE; i++)
+    {
+        big[i] = (uint8_t)(i * 7U);
+    }
+    test_bd_init(&bd, packed_records ? 256U : 16U, MTB_KVSTORE_BD_CAP_BIT_CLEAR);
+    TEST_CHECK(mtb_kvstore_init_with_config(&kv, 0, TEST_BD_SIZE, &bd, &config) ==
+               CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_write(&kv, "big", big, BIG_VALUE_SIZE) == CY_RSLT_SUCCESS);
+    mtb_kvstore_deinit(&kv);
+    TEST_CHECK(mtb_kvstore_init_with_config(&kv, 0, TEST_BD_SIZE, &bd, &config) ==
+               CY_RSLT_SUCCESS);
+    uint32_t size = sizeof(buf);
+    TEST_CHECK(mtb_kvstore_read(&kv, "big", buf, &size) == CY_RSLT_SUCCESS);
+    TEST_CHECK((size == BIG_VALUE_SIZE) && (memcmp(big, buf, size) == 0));
+    mtb_kvstore_deinit(&kv);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// test_space
+//--------------------------------------------------------------------------------------------------
+static void test_space(void)
+{
+    // Each format programs fewer bytes than the one before for repeated writes of small settings
+    // with long keys.
+    mtb_kvstore_config_t config = { 0 };
+    mtb_kvstore_t kv;
+    unsigned long last_programmed = ULONG_MAX;
+    for (int format = 0; format < 4; format++)
+    {
+        test_bd_init(&bd, 256, MTB_KVSTORE_BD_CAP_BIT_CLEAR);
+        config.packed_records = (format >= 1);
+        config.compact_headers = (format >= 2);
+        config.key_dictionary = (format >= 3);
+        TEST_CHECK(mtb_kvstore_init_with_config(&kv, 0, STORAGE_SIZE, &bd, &config) ==
+                   CY_RSLT_SUCCESS);
+        for (uint32_t i = 0; i < 400; i++)
+        {
+            char key[64];
+            key_name((int)(i % 20U), key);
+            TEST_CHECK(mtb_kvstore_write(&kv, key, (const uint8_t*)&i, sizeof(i)) ==
+                       CY_RSLT_SUCCESS);
+        }
+        TEST_CHECK(test_bd.programmed_bytes < last_programmed);
+        last_programmed = test_bd.programmed_bytes;
+        mtb_kvstore_deinit(&kv);
+    }
+
+    // Packed records are refused on a device that cannot clear bits of programmed bytes.
+    test_bd_init(&bd, 256, 0);
+    config.key_dictionary = false;
+    config.compact_headers = false;
+    config.packed_records = true;
+    TEST_CHECK(mtb_kvstore_init_with_config(&kv, 0, STORAGE_SIZE, &bd, &config) ==
+               MTB_KVSTORE_BAD_PARAM_ERROR);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// main
+//--------------------------------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+    unsigned seed = (argc > 1) ? (unsigned)atoi(argv[1]) : 1U;
+    test_space();
+    run_formats(false, seed);
+    run_formats(true, seed);
+    printf("test_formats passed, seed %u\n", seed);
+    return 0;
+}
@@ -0,0 +1,215 @@
+/***********************************************************************************************//**
+ * \file test_gc_failure.c
+ *
+ * \brief
+ * Garbage collections that fail part way, at every program into the area that they write. The
+ * kv-store keeps reading the values that it held before, and a later garbage collection succeeds.
+ *
+ ***************************************************************************************************
+ * \copyright
+ * Copyright 2018-2022 Cypress Semiconductor Corporation (an Infineon company) or
+ * an affiliate of Cypress Semiconductor Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************************************/
+
+#include "test_bd.h"
+
+#define STORAGE_SIZE        (16384U)
+#define AREA_SIZE           (STORAGE_SIZE / 2U)
+#define NUM_KEYS            (8)
+#define MAX_VALUE_SIZE      (300U)
+#define TEST_PROGRAM_ERROR  \
+    CY_RSLT_CREATE(CY_RSLT_TYPE_ERROR, CY_RSLT_MODULE_MIDDLEWARE_KVSTORE, 0xFF)
+
+typedef struct
+{
+    uint8_t     value[MAX_VALUE_SIZE];
+    uint32_t    size;
+} model_entry_t;
+
+static mtb_kvstore_bd_t bd;
+static mtb_kvstore_t kv;
+static model_entry_t model[NUM_KEYS];
+static int programs_left;
+
+
+//--------------------------------------------------------------------------------------------------
+// failing_program
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t failing_program(void* context, uint32_t addr, uint32_t length,
+                                 const uint8_t* buf)
+{
+    // Unless programs_left is negative, that many programs into the area that garbage collection
+    // writes succeed, and the next one fails.
+    if ((programs_left >= 0) && (addr >= kv.gc_area_addr) && (addr < (kv.gc_area_addr + AREA_SIZE)))
+    {
+        if (programs_left == 0)
+        {
+            return TEST_PROGRAM_ERROR;
+        }
+        programs_left--;
+    }
+    return test_bd_program(context, addr, length, buf);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// write_value
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t write_value(int idx, uint32_t size, uint8_t fill)
+{
+    char key[16];
+    sprintf(key, "key%d", idx);
+    uint8_t value[MAX_VALUE_SIZE];
+    memset(value, fill, size);
+    cy_rslt_t result = mtb_kvstore_write(&kv, key, value, size);
+    if (result == CY_RSLT_SUCCESS)
+    {
+        memcpy(model[idx].value, value, size);
+        model[idx].size = size;
+    }
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// append_value
+//--------------------------------------------------------------------------------------------------
+static void append_value(int idx, uint32_t size, uint8_t fill)
+{
+    char key[16];
+    sprintf(key, "key%d", idx);
+    uint8_t value[MAX_VALUE_SIZE];
+    memset(value, fill, size);
+    TEST_CHECK(mtb_kvstore_append(&kv, key, value, size) == CY_RSLT_SUCCESS);
+    memcpy(&model[idx].value[model[idx].size], value, size);
+    model[idx].size += size;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// verify
+//--------------------------------------------------------------------------------------------------
+static void verify(void)
+{
+    for (int idx = 0; idx < NUM_KEYS; idx++)
+    {
+        char key[16];
+        sprintf(key, "key%d", idx);
+        uint8_t buf[MAX_VALUE_SIZE];
+        uint32_t size = sizeof(buf);
+        TEST_CHECK(mtb_kvstore_read(&kv, key, buf, &size) == CY_RSLT_SUCCESS);
+        TEST_CHECK((size == model[idx].size) && (memcmp(buf, model[idx].value, size) == 0));
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// fill_area
+//--------------------------------------------------------------------------------------------------
+static void fill_area(void)
+{
+    // Leaves too little space for another record of MAX_VALUE_SIZE bytes.
+    uint8_t value[200];
+    memset(value, 0xA5, sizeof(value));
+    while ((kv.free_space_offset + MAX_VALUE_SIZE) <= AREA_SIZE)
+    {
+        TEST_CHECK(mtb_kvstore_write(&kv, "fill", value, sizeof(value)) == CY_RSLT_SUCCESS);
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// run_failures
+//--------------------------------------------------------------------------------------------------
+static void run_failures(uint32_t capabilities, const mtb_kvstore_config_t* config)
+{
+    test_bd_init(&bd, 16, capabilities);
+    bd.program = failing_program;
+    programs_left = -1;
+    TEST_CHECK(mtb_kvstore_init_with_config(&kv, 0, STORAGE_SIZE, &bd, config) == CY_RSLT_SUCCESS);
+
+    // Pairs of keys hold the same value, so that values of at least the deduplication size share a
+    // blob. The first key is made of appended segments.
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (int idx = 0; idx < NUM_KEYS; idx++)
+        {
+            uint32_t size = 20U + ((uint32_t)(idx / 2) * 80U);
+            TEST_CHECK(write_value(idx, size, (uint8_t)(pass + (idx / 2))) == CY_RSLT_SUCCESS);
+        }
+    }
+    for (int segment = 0; segment < 3; segment++)
+    {
+        append_value(0, 10, (uint8_t)(0x40 + segment));
+    }
+
+    // Garbage collections that only compact the area, and garbage collections that also write
+    // an updated value that did not fit into the area any more. Each attempt lets one more
+    // program succeed, until the garbage collection completes.
+    for (int update = 0; update < 2; update++)
+    {
+        cy_rslt_t result;
+        int allowed = 0;
+        do
+        {
+            if (update != 0)
+            {
+                fill_area();
+            }
+            programs_left = allowed;
+            result = (update != 0)
+                     ? write_value(1, MAX_VALUE_SIZE, (uint8_t)allowed)
+                     : mtb_kvstore_ensure_capacity(&kv, MTB_KVSTORE_ENSURE_MAX);
+            programs_left = -1;
+            TEST_CHECK((result == CY_RSLT_SUCCESS) || (result == TEST_PROGRAM_ERROR));
+            verify();
+            allowed++;
+        } while (result != CY_RSLT_SUCCESS);
+        TEST_CHECK(allowed > 1);
+    }
+
+    mtb_kvstore_deinit(&kv);
+    TEST_CHECK(mtb_kvstore_init_with_config(&kv, 0, STORAGE_SIZE, &bd, config) == CY_RSLT_SUCCESS);
+    verify();
+    mtb_kvstore_deinit(&kv);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// main
+//--------------------------------------------------------------------------------------------------
+int main(void)
+{
+    // The new offsets are staged in a copy of the RAM table whether or not readers are let in
+    // during garbage collection.
+    run_failures(MTB_KVSTORE_BD_CAP_PARALLEL_READ | MTB_KVSTORE_BD_CAP_CONCURRENT_READ, NULL);
+    run_failures(0, NULL);
+
+    // The offsets of the key dictionary records are staged as well.
+    mtb_kvstore_config_t config = { 0 };
+    config.key_dictionary = true;
+    run_failures(0, &config);
+
+    // Chunked values whose chunks are shared blobs are copied chunk by chunk.
+    memset(&config, 0, sizeof(config));
+    config.chunk_min_size = 100;
+    config.dedup_min_size = 100;
+    run_failures(0, &config);
+    run_failures(MTB_KVSTORE_BD_CAP_PARALLEL_READ | MTB_KVSTORE_BD_CAP_CONCURRENT_READ, &config);
+    printf("test_gc_failure passed\n");
+    return 0;
+}
@@ -0,0 +1,175 @@
+/***********************************************************************************************//**
+ * \file test_inline.c
+ *
+ * \brief
+ * Small values that are kept in RAM with MTB_KVSTORE_INLINE_VALUE_SIZE, which is 8 in the library
+ * that this test is linked with. Reads of such values do not access the block device.
+ *
+ ***************************************************************************************************
+ * \copyright
+ * Copyright 2018-2022 Cypress Semiconductor Corporation (an Infineon company) or
+ * an affiliate of Cypress Semiconductor Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************************************/
+
+#include "test_bd.h"
+
+#define STORAGE_SIZE        (16384U)
+#define NUM_FLAGS           (20)
+
+static mtb_kvstore_bd_t bd;
+static mtb_kvstore_t kv;
+
+
+//--------------------------------------------------------------------------------------------------
+// read_flag
+//--------------------------------------------------------------------------------------------------
+static void read_flag(int idx)
+{
+    char key[16];
+    sprintf(key, "flag%d", idx);
+    uint8_t buf[64];
+    memset(buf, 0xAA, sizeof(buf));
+    uint32_t size = sizeof(buf);
+    TEST_CHECK(mtb_kvstore_read(&kv, key, buf, &size) == CY_RSLT_SUCCESS);
+    TEST_CHECK(size == (uint32_t)(idx % 9));
+    TEST_CHECK((size == 0) || (buf[0] == idx));
+    TEST_CHECK(buf[size] == 0);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// main
+//--------------------------------------------------------------------------------------------------
+int main(void)
+{
+    TEST_CHECK(MTB_KVSTORE_INLINE_VALUE_SIZE == 8);
+    test_bd_init(&bd, 16, 0);
+    TEST_CHECK(mtb_kvstore_init(&kv, 0, STORAGE_SIZE, &bd) == CY_RSLT_SUCCESS);
+
+    uint8_t value[64];
+    uint8_t buf[64];
+    for (int i = 0; i < NUM_FLAGS; i++)
+    {
+        char key[16];
+        sprintf(key, "flag%d", i);
+        value[0] = (uint8_t)i;
+        TEST_CHECK(mtb_kvstore_write(&kv, key, value, (uint32_t)(i % 9)) == CY_RSLT_SUCCESS);
+    }
+    TEST_CHECK(mtb_kvstore_write(&kv, "big", value, 40) == CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_write(&kv, "empty", NULL, 0) == CY_RSLT_SUCCESS);
+
+    // Reads, sizes and lookups of small values do not access the device.
+    unsigned long accesses = test_bd_accesses();
+    for (int i = 0; i < NUM_FLAGS; i++)
+    {
+        char key[16];
+        sprintf(key, "flag%d", i);
+        read_flag(i);
+        TEST_CHECK(mtb_kvstore_key_exists(&kv, key) == CY_RSLT_SUCCESS);
+        uint32_t size = 0;
+        TEST_CHECK(mtb_kvstore_value_size(&kv, key, &size) == CY_RSLT_SUCCESS);
+        TEST_CHECK(size == (uint32_t)(i % 9));
+    }
+    uint32_t size = 4;
+    TEST_CHECK(mtb_kvstore_read(&kv, "flag8", buf, &size) == MTB_KVSTORE_BUFFER_TOO_SMALL);
+    TEST_CHECK(size == 8);
+    size = 1;
+    TEST_CHECK(mtb_kvstore_read_partial(&kv, "flag8", buf, &size, 7) == CY_RSLT_SUCCESS);
+    TEST_CHECK((size == 1) && (buf[0] == value[7]));
+    TEST_CHECK(mtb_kvstore_key_exists(&kv, "empty") == CY_RSLT_SUCCESS);
+    TEST_CHECK(test_bd_accesses() == accesses);
+    size = sizeof(buf);
+    TEST_CHECK(mtb_kvstore_read(&kv, "big", buf, &size) == CY_RSLT_SUCCESS);
+    TEST_CHECK((size == 40) && (test_bd_accesses() > accesses));
+
+    // Values that change size across the limit.
+    value[0] = 77;
+    TEST_CHECK(mtb_kvstore_write(&kv, "flag3", value, 3) == CY_RSLT_SUCCESS);
+    accesses = test_bd_accesses();
+    size = sizeof(buf);
+    TEST_CHECK(mtb_kvstore_read(&kv, "flag3", buf, &size) == CY_RSLT_SUCCESS);
+    TEST_CHECK((size == 3) && (buf[0] == 77) && (test_bd_accesses() == accesses));
+    memset(value, 5, 20);
+    TEST_CHECK(mtb_kvstore_write(&kv, "flag3", value, 20) == CY_RSLT_SUCCESS);
+    size = sizeof(buf);
+    TEST_CHECK(mtb_kvstore_read(&kv, "flag3", buf, &size) == CY_RSLT_SUCCESS);
+    TEST_CHECK((size == 20) && (buf[19] == 5));
+    value[0] = 9;
+    TEST_CHECK(mtb_kvstore_write(&kv, "big", value, 1) == CY_RSLT_SUCCESS);
+    accesses = test_bd_accesses();
+    size = sizeof(buf);
+    TEST_CHECK(mtb_kvstore_read(&kv, "big", buf, &size) == CY_RSLT_SUCCESS);
+    TEST_CHECK((size == 1) && (buf[0] == 9) && (test_bd_accesses() == accesses));
+
+    // Deletes, counters and appends.
+    TEST_CHECK(mtb_kvstore_delete(&kv, "flag4") == CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_key_exists(&kv, "flag4") == MTB_KVSTORE_ITEM_NOT_FOUND_ERROR);
+    uint32_t count = 0;
+    TEST_CHECK(mtb_kvstore_counter_increment(&kv, "cnt", &count) == CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_counter_increment(&kv, "cnt", &count) == CY_RSLT_SUCCESS);
+    TEST_CHECK(count == 2);
+    size = sizeof(count);
+    TEST_CHECK(mtb_kvstore_read(&kv, "cnt", (uint8_t*)&count, &size) == CY_RSLT_SUCCESS);
+    TEST_CHECK(count == 2);
+    TEST_CHECK(mtb_kvstore_append(&kv, "flag5", value, 3) == CY_RSLT_SUCCESS);
+    size = sizeof(buf);
+    TEST_CHECK(mtb_kvstore_read(&kv, "flag5", buf, &size) == CY_RSLT_SUCCESS);
+    TEST_CHECK(size == 8);
+    const char* keys[2] = { "flag6", "flag7" };
+    TEST_CHECK(mtb_kvstore_delete_many(&kv, keys, 2) == CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_key_exists(&kv, "flag6") == MTB_KVSTORE_ITEM_NOT_FOUND_ERROR);
+
+    // Garbage collection keeps the values in RAM.
+    for (int i = 0; i < 60; i++)
+    {
+        memset(value, i, 60);
+        TEST_CHECK(mtb_kvstore_write(&kv, "churn", value, 60) == CY_RSLT_SUCCESS);
+    }
+    accesses = test_bd_accesses();
+    read_flag(2);
+    TEST_CHECK(test_bd_accesses() == accesses);
+
+    // Initialization loads the values.
+    mtb_kvstore_deinit(&kv);
+    TEST_CHECK(mtb_kvstore_init(&kv, 0, STORAGE_SIZE, &bd) == CY_RSLT_SUCCESS);
+    accesses = test_bd_accesses();
+    for (int i = 0; i < NUM_FLAGS; i++)
+    {
+        if ((i < 3) || (i > 7))
+        {
+            read_flag(i);
+        }
+    }
+    size = sizeof(buf);
+    TEST_CHECK(mtb_kvstore_read(&kv, "big", buf, &size) == CY_RSLT_SUCCESS);
+    TEST_CHECK((size == 1) && (buf[0] == 9) && (test_bd_accesses() == accesses));
+    size = sizeof(buf);
+    TEST_CHECK(mtb_kvstore_read(&kv, "flag3", buf, &size) == CY_RSLT_SUCCESS);
+    TEST_CHECK(size == 20);
+    TEST_CHECK(mtb_kvstore_key_exists(&kv, "flag4") == MTB_KVSTORE_ITEM_NOT_FOUND_ERROR);
+    size = sizeof(count);
+    TEST_CHECK(mtb_kvstore_read(&kv, "cnt", (uint8_t*)&count, &size) == CY_RSLT_SUCCESS);
+    TEST_CHECK(count == 2);
+
+    TEST_CHECK(mtb_kvstore_reset(&kv) == CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_key_exists(&kv, "flag1") == MTB_KVSTORE_ITEM_NOT_FOUND_ERROR);
+    TEST_CHECK(mtb_kvstore_write(&kv, "flag1", value, 1) == CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_key_exists(&kv, "flag1") == CY_RSLT_SUCCESS);
+    mtb_kvstore_deinit(&kv);
+    printf("test_inline passed\n");
+    return 0;
+}
@@ -0,0 +1,184 @@
+/***********************************************************************************************//**
+ * \file test_maintenance.c
+ *
+ * \brief
+ * Maintenance of all initialized kv-stores: the budget goes to the instances with the most garbage
+ * first, and with an RTOS the garbage collections of instances on one block device never erase at
+ * the same time.
+ *
+ ***************************************************************************************************
+ * \copyright
+ * Copyright 2018-2022 Cypress Semiconductor Corporation (an Infineon company) or
+ * an affiliate of Cypress Semiconductor Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************************************/
+
+#include "test_bd.h"
+
+#if defined(MTB_KVSTORE_RTOS_AWARE)
+#include <pthread.h>
+#endif
+
+#define STORAGE_SIZE        (16384U)
+#define NUM_INSTANCES       (4)
+
+static mtb_kvstore_bd_t bd;
+static mtb_kvstore_bd_t other_bd;
+static mtb_kvstore_t kv[NUM_INSTANCES];
+static int erasing[2];
+static bool overlap;
+
+
+//--------------------------------------------------------------------------------------------------
+// slow_erase
+//--------------------------------------------------------------------------------------------------
+static cy_rslt_t slow_erase(void* context, uint32_t addr, uint32_t length)
+{
+    // Both device objects share the RAM device, but each of them counts its own erases that are
+    // in progress. Erases through different objects may overlap.
+    int device = (context == &other_bd) ? 1 : 0;
+    if (__atomic_add_fetch(&erasing[device], 1, __ATOMIC_SEQ_CST) > 1)
+    {
+        __atomic_store_n(&overlap, true, __ATOMIC_SEQ_CST);
+    }
+    test_sleep_us(200);
+    cy_rslt_t result = test_bd_erase(context, addr, length);
+    __atomic_sub_fetch(&erasing[device], 1, __ATOMIC_SEQ_CST);
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// garbage
+//--------------------------------------------------------------------------------------------------
+static uint32_t garbage(const mtb_kvstore_t* obj)
+{
+    return obj->free_space_offset - obj->consumed_size;
+}
+
+
+#if defined(MTB_KVSTORE_RTOS_AWARE)
+//--------------------------------------------------------------------------------------------------
+// churn_thread
+//--------------------------------------------------------------------------------------------------
+static void* churn_thread(void* arg)
+{
+    mtb_kvstore_t* obj = (mtb_kvstore_t*)arg;
+    uint8_t value[300];
+    for (int i = 0; i < 600; i++)
+    {
+        char key[16];
+        sprintf(key, "k%d", i % 5);
+        memset(value, i, sizeof(value));
+        // Writes time out while a slow garbage collection keeps the lock.
+        cy_rslt_t result;
+        do
+        {
+            result = mtb_kvstore_write(obj, key, value, sizeof(value));
+        } while (test_timed_out(result));
+        TEST_CHECK(result == CY_RSLT_SUCCESS);
+    }
+    return NULL;
+}
+
+
+#endif // if defined(MTB_KVSTORE_RTOS_AWARE)
+
+//--------------------------------------------------------------------------------------------------
+// main
+//--------------------------------------------------------------------------------------------------
+int main(void)
+{
+    test_bd_init(&bd, 16, 0);
+    bd.erase = slow_erase;
+    other_bd = bd;
+    other_bd.context = &other_bd;
+    TEST_CHECK(mtb_kvstore_maintenance_all(MTB_KVSTORE_MAINTENANCE_UNLIMITED) == CY_RSLT_SUCCESS);
+    for (int i = 0; i < NUM_INSTANCES; i++)
+    {
+        TEST_CHECK(mtb_kvstore_init(&kv[i], (uint32_t)i * STORAGE_SIZE, STORAGE_SIZE, &bd) ==
+                   CY_RSLT_SUCCESS);
+    }
+    TEST_CHECK(mtb_kvstore_maintenance_all(MTB_KVSTORE_MAINTENANCE_UNLIMITED) == CY_RSLT_SUCCESS);
+
+    // Much garbage in the first instance, a little in the second, none in the third, and the
+    // fourth is no longer initialized.
+    uint8_t value[200];
+    memset(value, 1, sizeof(value));
+    for (int i = 0; i < 20; i++)
+    {
+        TEST_CHECK(mtb_kvstore_write(&kv[0], "a", value, sizeof(value)) == CY_RSLT_SUCCESS);
+    }
+    TEST_CHECK(mtb_kvstore_write(&kv[1], "a", value, sizeof(value)) == CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_write(&kv[1], "b", value, sizeof(value)) == CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_write(&kv[1], "a", value, 10) == CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_write(&kv[2], "a", value, sizeof(value)) == CY_RSLT_SUCCESS);
+    for (int i = 0; i < 5; i++)
+    {
+        TEST_CHECK(mtb_kvstore_write(&kv[3], "a", value, sizeof(value)) == CY_RSLT_SUCCESS);
+    }
+    mtb_kvstore_deinit(&kv[3]);
+    TEST_CHECK((garbage(&kv[0]) > 0) && (garbage(&kv[1]) > 0) && (garbage(&kv[2]) == 0));
+
+    // A budget of one garbage collection goes to the instance with the most garbage, and a
+    // budget that is too small for any does nothing.
+    TEST_CHECK(mtb_kvstore_maintenance_all((STORAGE_SIZE / 2U) + 1000U) == CY_RSLT_SUCCESS);
+    TEST_CHECK((garbage(&kv[0]) == 0) && (garbage(&kv[1]) > 0));
+    TEST_CHECK(mtb_kvstore_maintenance_all(100) == CY_RSLT_SUCCESS);
+    TEST_CHECK(garbage(&kv[1]) > 0);
+    TEST_CHECK(mtb_kvstore_maintenance_all(MTB_KVSTORE_MAINTENANCE_UNLIMITED) == CY_RSLT_SUCCESS);
+    TEST_CHECK(garbage(&kv[1]) == 0);
+    uint32_t size = sizeof(value);
+    TEST_CHECK(mtb_kvstore_read(&kv[1], "a", value, &size) == CY_RSLT_SUCCESS);
+    TEST_CHECK(size == 10);
+    size = sizeof(value);
+    TEST_CHECK(mtb_kvstore_read(&kv[0], "a", value, &size) == CY_RSLT_SUCCESS);
+    TEST_CHECK(size == sizeof(value));
+
+    // Two instances on another device object.
+    mtb_kvstore_deinit(&kv[2]);
+    TEST_CHECK(mtb_kvstore_init(&kv[2], 2U * STORAGE_SIZE, STORAGE_SIZE, &other_bd) ==
+               CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_init(&kv[3], 3U * STORAGE_SIZE, STORAGE_SIZE, &other_bd) ==
+               CY_RSLT_SUCCESS);
+
+    #if defined(MTB_KVSTORE_RTOS_AWARE)
+    // Writers in every instance, with maintenance in between.
+    pthread_t writers[NUM_INSTANCES];
+    for (int i = 0; i < NUM_INSTANCES; i++)
+    {
+        TEST_CHECK(pthread_create(&writers[i], NULL, churn_thread, &kv[i]) == 0);
+    }
+    for (int i = 0; i < 50; i++)
+    {
+        TEST_CHECK(mtb_kvstore_maintenance_all(20000) == CY_RSLT_SUCCESS);
+        test_sleep_us(500);
+    }
+    for (int i = 0; i < NUM_INSTANCES; i++)
+    {
+        TEST_CHECK(pthread_join(writers[i], NULL) == 0);
+    }
+    TEST_CHECK(!overlap);
+    #endif
+
+    for (int i = 0; i < NUM_INSTANCES; i++)
+    {
+        mtb_kvstore_deinit(&kv[i]);
+    }
+    TEST_CHECK(mtb_kvstore_maintenance_all(MTB_KVSTORE_MAINTENANCE_UNLIMITED) == CY_RSLT_SUCCESS);
+    printf("test_maintenance passed\n");
+    return 0;
+}
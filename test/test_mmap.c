@@ -0,0 +1,137 @@
+/***********************************************************************************************//**
+ * \file test_mmap.c
+ *
+ * \brief
+ * The memory mapped file block device, with both erased values and every durability mode. The
+ * file is created at the path that is passed as the first argument.
+ *
+ ***************************************************************************************************
+ * \copyright
+ * Copyright 2018-2022 Cypress Semiconductor Corporation (an Infineon company) or
+ * an affiliate of Cypress Semiconductor Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************************************/
+
+#include "test_bd.h"
+#include "mtb_kvstore_mmap.h"
+#include <unistd.h>
+
+#define STORAGE_SIZE        (65536U)
+#define NUM_KEYS            (37)
+#define NUM_WRITES          (3000)
+
+
+//--------------------------------------------------------------------------------------------------
+// fill_value
+//--------------------------------------------------------------------------------------------------
+static uint32_t fill_value(int write, char* key, uint8_t* value)
+{
+    sprintf(key, "k%d", write % NUM_KEYS);
+    for (int i = 0; i < 200; i++)
+    {
+        value[i] = (uint8_t)(write + i);
+    }
+    return 50U + ((uint32_t)write % 150U);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// run_config
+//--------------------------------------------------------------------------------------------------
+static void run_config(const char* path, uint8_t erased_value,
+                       mtb_kvstore_mmap_durability_t durability, bool packed_records)
+{
+    (void)unlink(path);
+    mtb_kvstore_mmap_config_t mmap_config =
+    {
+        STORAGE_SIZE, 1, 16, 4096, erased_value, durability
+    };
+    mtb_kvstore_mmap_t mmap_obj;
+    mtb_kvstore_bd_t bd;
+    TEST_CHECK(mtb_kvstore_mmap_init(&mmap_obj, path, &mmap_config, &bd) == CY_RSLT_SUCCESS);
+    TEST_CHECK(mmap_obj.mem[100] == erased_value);
+    TEST_CHECK(((bd.capabilities & MTB_KVSTORE_BD_CAP_BIT_CLEAR) != 0) == (erased_value == 0xFF));
+    TEST_CHECK((bd.capabilities & MTB_KVSTORE_BD_CAP_PARALLEL_READ) != 0);
+
+    mtb_kvstore_config_t config = { 0 };
+    config.packed_records = packed_records;
+    mtb_kvstore_t kv;
+    TEST_CHECK(mtb_kvstore_init_with_config(&kv, 0, STORAGE_SIZE, &bd, &config) ==
+               CY_RSLT_SUCCESS);
+    char key[16];
+    uint8_t value[200];
+    uint8_t buf[200];
+    for (int i = 0; i < NUM_WRITES; i++)
+    {
+        uint32_t size = fill_value(i, key, value);
+        TEST_CHECK(mtb_kvstore_write(&kv, key, value, size) == CY_RSLT_SUCCESS);
+    }
+    const uint8_t* view;
+    uint32_t size;
+    TEST_CHECK(mtb_kvstore_get_view(&kv, "k0", &view, &size) == CY_RSLT_SUCCESS);
+    TEST_CHECK(size > 0);
+    mtb_kvstore_release_view(&kv, view);
+    mtb_kvstore_deinit(&kv);
+    TEST_CHECK(mtb_kvstore_mmap_deinit(&mmap_obj) == CY_RSLT_SUCCESS);
+
+    // The values are read back from the file.
+    TEST_CHECK(mtb_kvstore_mmap_init(&mmap_obj, path, &mmap_config, &bd) == CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_init_with_config(&kv, 0, STORAGE_SIZE, &bd, &config) ==
+               CY_RSLT_SUCCESS);
+    for (int i = NUM_WRITES - NUM_KEYS; i < NUM_WRITES; i++)
+    {
+        uint32_t expected_size = fill_value(i, key, value);
+        size = sizeof(buf);
+        TEST_CHECK(mtb_kvstore_read(&kv, key, buf, &size) == CY_RSLT_SUCCESS);
+        TEST_CHECK((size == expected_size) && (memcmp(buf, value, size) == 0));
+    }
+    mtb_kvstore_deinit(&kv);
+    TEST_CHECK(mtb_kvstore_mmap_deinit(&mmap_obj) == CY_RSLT_SUCCESS);
+
+    // A file of another size and an invalid geometry are refused.
+    mmap_config.size = STORAGE_SIZE / 2U;
+    TEST_CHECK(mtb_kvstore_mmap_init(&mmap_obj, path, &mmap_config, &bd) ==
+               MTB_KVSTORE_BAD_PARAM_ERROR);
+    mmap_config.size = STORAGE_SIZE;
+    mmap_config.program_size = 3;
+    TEST_CHECK(mtb_kvstore_mmap_init(&mmap_obj, path, &mmap_config, &bd) ==
+               MTB_KVSTORE_BAD_PARAM_ERROR);
+    (void)unlink(path);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// main
+//--------------------------------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+    const char* path = (argc > 1) ? argv[1] : "test_mmap.bin";
+    run_config(path, 0xFF, MTB_KVSTORE_MMAP_DURABILITY_NONE, false);
+    run_config(path, 0xFF, MTB_KVSTORE_MMAP_DURABILITY_ASYNC, true);
+    run_config(path, 0x00, MTB_KVSTORE_MMAP_DURABILITY_SYNC, false);
+    run_config(path, 0x00, MTB_KVSTORE_MMAP_DURABILITY_NONE, false);
+
+    mtb_kvstore_mmap_config_t mmap_config =
+    {
+        STORAGE_SIZE, 1, 16, 4096, 0xFF, MTB_KVSTORE_MMAP_DURABILITY_NONE
+    };
+    mtb_kvstore_mmap_t mmap_obj;
+    mtb_kvstore_bd_t bd;
+    TEST_CHECK(mtb_kvstore_mmap_init(&mmap_obj, "/nonexistent/dir/file", &mmap_config, &bd) ==
+               MTB_KVSTORE_IO_ERROR);
+    printf("test_mmap passed\n");
+    return 0;
+}
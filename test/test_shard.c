@@ -0,0 +1,171 @@
+/***********************************************************************************************//**
+ * \file test_shard.c
+ *
+ * \brief
+ * Sharded kv-stores: key placement, the recorded shard count, and with an RTOS writers in several
+ * threads.
+ *
+ ***************************************************************************************************
+ * \copyright
+ * Copyright 2018-2022 Cypress Semiconductor Corporation (an Infineon company) or
+ * an affiliate of Cypress Semiconductor Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************************************/
+
+#include "test_bd.h"
+
+#if defined(MTB_KVSTORE_RTOS_AWARE)
+#include <pthread.h>
+#endif
+
+#define NUM_SHARDS          (4U)
+#define NUM_KEYS            (64)
+#define NUM_WRITERS         (4)
+
+static mtb_kvstore_bd_t bd;
+static mtb_kvstore_sharded_t kv;
+
+
+#if defined(MTB_KVSTORE_RTOS_AWARE)
+//--------------------------------------------------------------------------------------------------
+// writer_thread
+//--------------------------------------------------------------------------------------------------
+static void* writer_thread(void* arg)
+{
+    int thread = (int)(size_t)arg;
+    uint8_t value[200];
+    uint8_t buf[200];
+    for (int i = 0; i < 400; i++)
+    {
+        char key[24];
+        sprintf(key, "t%d/k%d", thread, i % 20);
+        uint32_t size = 10U + ((uint32_t)(i * 7) % 190U);
+        memset(value, (thread * 50) + i, size);
+        // The threads share the shards, so the operations may time out.
+        cy_rslt_t result;
+        do
+        {
+            result = mtb_kvstore_sharded_write(&kv, key, value, size);
+        } while (test_timed_out(result));
+        TEST_CHECK(result == CY_RSLT_SUCCESS);
+        uint32_t read_size;
+        do
+        {
+            read_size = sizeof(buf);
+            result = mtb_kvstore_sharded_read(&kv, key, buf, &read_size);
+        } while (test_timed_out(result));
+        TEST_CHECK(result == CY_RSLT_SUCCESS);
+        TEST_CHECK((read_size == size) && (memcmp(buf, value, size) == 0));
+    }
+    return NULL;
+}
+
+
+#endif // if defined(MTB_KVSTORE_RTOS_AWARE)
+
+//--------------------------------------------------------------------------------------------------
+// main
+//--------------------------------------------------------------------------------------------------
+int main(void)
+{
+    test_bd_init(&bd, 16, 0);
+    TEST_CHECK(mtb_kvstore_sharded_init(&kv, 0, TEST_BD_SIZE, 3, &bd, NULL) ==
+               MTB_KVSTORE_ALIGNMENT_ERROR);
+    TEST_CHECK(mtb_kvstore_sharded_init(&kv, 0, TEST_BD_SIZE, 0, &bd, NULL) ==
+               MTB_KVSTORE_BAD_PARAM_ERROR);
+    TEST_CHECK(mtb_kvstore_sharded_init(&kv, 0, TEST_BD_SIZE, NUM_SHARDS, &bd, NULL) ==
+               CY_RSLT_SUCCESS);
+    uint32_t empty_size = mtb_kvstore_sharded_size(&kv);
+    TEST_CHECK(mtb_kvstore_sharded_write(&kv, NULL, (const uint8_t*)"x", 1) ==
+               MTB_KVSTORE_BAD_PARAM_ERROR);
+
+    // The keys are spread over every shard.
+    uint32_t keys_per_shard[NUM_SHARDS] = { 0 };
+    for (int i = 0; i < NUM_KEYS; i++)
+    {
+        char key[16];
+        sprintf(key, "key%d", i);
+        TEST_CHECK(mtb_kvstore_sharded_write(&kv, key, (const uint8_t*)key, strlen(key)) ==
+                   CY_RSLT_SUCCESS);
+        keys_per_shard[mtb_kvstore_sharded_get_shard(&kv, key) - kv.shards]++;
+    }
+    for (uint32_t i = 0; i < NUM_SHARDS; i++)
+    {
+        TEST_CHECK(keys_per_shard[i] > 0);
+    }
+    uint32_t size = mtb_kvstore_sharded_size(&kv);
+    uint32_t remaining = mtb_kvstore_sharded_remaining_size(&kv);
+    mtb_kvstore_sharded_deinit(&kv);
+
+    // The storage records the shard count. Another count or a single kv-store is refused and
+    // leaves the storage alone.
+    TEST_CHECK(mtb_kvstore_sharded_init(&kv, 0, TEST_BD_SIZE, 256, &bd, NULL) ==
+               MTB_KVSTORE_BAD_PARAM_ERROR);
+    TEST_CHECK(mtb_kvstore_sharded_init(&kv, 0, TEST_BD_SIZE, 2, &bd, NULL) ==
+               MTB_KVSTORE_BAD_PARAM_ERROR);
+    TEST_CHECK(mtb_kvstore_sharded_init(&kv, 0, TEST_BD_SIZE, 8, &bd, NULL) ==
+               MTB_KVSTORE_BAD_PARAM_ERROR);
+    mtb_kvstore_t single;
+    TEST_CHECK(mtb_kvstore_init(&single, 0, TEST_BD_SIZE, &bd) == MTB_KVSTORE_BAD_PARAM_ERROR);
+    TEST_CHECK(mtb_kvstore_sharded_init(&kv, 0, TEST_BD_SIZE, NUM_SHARDS, &bd, NULL) ==
+               CY_RSLT_SUCCESS);
+    TEST_CHECK((mtb_kvstore_sharded_size(&kv) == size) &&
+               (mtb_kvstore_sharded_remaining_size(&kv) == remaining));
+    for (int i = 0; i < NUM_KEYS; i++)
+    {
+        char key[16];
+        char buf[16];
+        sprintf(key, "key%d", i);
+        uint32_t read_size = sizeof(buf);
+        TEST_CHECK(mtb_kvstore_sharded_read(&kv, key, (uint8_t*)buf, &read_size) ==
+                   CY_RSLT_SUCCESS);
+        TEST_CHECK((read_size == strlen(key)) && (memcmp(buf, key, read_size) == 0));
+        TEST_CHECK(mtb_kvstore_sharded_key_exists(&kv, key) == CY_RSLT_SUCCESS);
+        TEST_CHECK(mtb_kvstore_sharded_value_size(&kv, key, &read_size) == CY_RSLT_SUCCESS);
+        TEST_CHECK(read_size == strlen(key));
+        read_size = 2;
+        cy_rslt_t result = mtb_kvstore_sharded_read_partial(&kv, key, (uint8_t*)buf, &read_size,
+                                                            1);
+        TEST_CHECK((result == CY_RSLT_SUCCESS) || (result == MTB_KVSTORE_BUFFER_TOO_SMALL));
+        TEST_CHECK((read_size == 2) && (memcmp(buf, &key[1], 2) == 0));
+    }
+    for (int i = 0; i < NUM_KEYS; i += 2)
+    {
+        char key[16];
+        sprintf(key, "key%d", i);
+        TEST_CHECK(mtb_kvstore_sharded_delete(&kv, key) == CY_RSLT_SUCCESS);
+        TEST_CHECK(mtb_kvstore_sharded_key_exists(&kv, key) == MTB_KVSTORE_ITEM_NOT_FOUND_ERROR);
+    }
+
+    #if defined(MTB_KVSTORE_RTOS_AWARE)
+    pthread_t writers[NUM_WRITERS];
+    for (int i = 0; i < NUM_WRITERS; i++)
+    {
+        TEST_CHECK(pthread_create(&writers[i], NULL, writer_thread, (void*)(size_t)i) == 0);
+    }
+    for (int i = 0; i < NUM_WRITERS; i++)
+    {
+        TEST_CHECK(pthread_join(writers[i], NULL) == 0);
+    }
+    #endif
+
+    TEST_CHECK(mtb_kvstore_sharded_reset(&kv) == CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_sharded_size(&kv) == empty_size);
+    TEST_CHECK(mtb_kvstore_sharded_key_exists(&kv, "key1") == MTB_KVSTORE_ITEM_NOT_FOUND_ERROR);
+    mtb_kvstore_sharded_deinit(&kv);
+    printf("test_shard passed\n");
+    return 0;
+}
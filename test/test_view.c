@@ -0,0 +1,275 @@
+/***********************************************************************************************//**
+ * \file test_view.c
+ *
+ * \brief
+ * Views into memory mapped storage: values stay readable until the view is released, garbage
+ * collection waits for the views into the area that it erases, and a delete that fails for a
+ * view leaves every key in place.
+ *
+ ***************************************************************************************************
+ * \copyright
+ * Copyright 2018-2022 Cypress Semiconductor Corporation (an Infineon company) or
+ * an affiliate of Cypress Semiconductor Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************************************/
+
+#include "test_bd.h"
+
+#if defined(MTB_KVSTORE_RTOS_AWARE)
+#include <pthread.h>
+#endif
+
+#define STORAGE_SIZE        (16384U)
+#define AREA_SIZE           (STORAGE_SIZE / 2U)
+#define NUM_DELETE_KEYS     (20)
+
+static mtb_kvstore_bd_t bd;
+static mtb_kvstore_t kv;
+static uint32_t last_area_addr;
+static uint32_t num_areas_used;
+
+
+//--------------------------------------------------------------------------------------------------
+// count_collections
+//--------------------------------------------------------------------------------------------------
+static uint32_t count_collections(void)
+{
+    // Every garbage collection moves the records to the other area.
+    if (kv.active_area_addr != last_area_addr)
+    {
+        last_area_addr = kv.active_area_addr;
+        num_areas_used++;
+    }
+    return num_areas_used;
+}
+
+
+#if defined(MTB_KVSTORE_RTOS_AWARE)
+//--------------------------------------------------------------------------------------------------
+// release_later
+//--------------------------------------------------------------------------------------------------
+static void* release_later(void* view)
+{
+    test_sleep_us(100000);
+    mtb_kvstore_release_view(&kv, (const uint8_t*)view);
+    return NULL;
+}
+
+
+#endif // if defined(MTB_KVSTORE_RTOS_AWARE)
+
+//--------------------------------------------------------------------------------------------------
+// test_views
+//--------------------------------------------------------------------------------------------------
+static void test_views(void)
+{
+    // Views need a device that maps its storage.
+    test_bd_init(&bd, 16, 0);
+    TEST_CHECK(mtb_kvstore_init(&kv, 0, STORAGE_SIZE, &bd) == CY_RSLT_SUCCESS);
+    uint8_t value[200];
+    memset(value, 1, 100);
+    TEST_CHECK(mtb_kvstore_write(&kv, "a", value, 100) == CY_RSLT_SUCCESS);
+    const uint8_t* view;
+    uint32_t size;
+    TEST_CHECK(mtb_kvstore_get_view(&kv, "a", &view, &size) == MTB_KVSTORE_BAD_PARAM_ERROR);
+    mtb_kvstore_deinit(&kv);
+
+    bd.map = test_bd_map;
+    TEST_CHECK(mtb_kvstore_init(&kv, 0, STORAGE_SIZE, &bd) == CY_RSLT_SUCCESS);
+    last_area_addr = UINT32_MAX;
+    num_areas_used = 0;
+    (void)count_collections();
+    TEST_CHECK(mtb_kvstore_get_view(&kv, "none", &view, &size) ==
+               MTB_KVSTORE_ITEM_NOT_FOUND_ERROR);
+    TEST_CHECK(mtb_kvstore_get_view(&kv, "a", NULL, &size) == MTB_KVSTORE_BAD_PARAM_ERROR);
+    TEST_CHECK(mtb_kvstore_get_view(&kv, "a", &view, &size) == CY_RSLT_SUCCESS);
+    TEST_CHECK((size == 100) && (view >= test_bd.mem) && (view < &test_bd.mem[TEST_BD_SIZE]));
+    for (uint32_t i = 0; i < size; i++)
+    {
+        TEST_CHECK(view[i] == 1);
+    }
+
+    // The view keeps the old value after an overwrite and a delete.
+    memset(value, 2, 100);
+    TEST_CHECK(mtb_kvstore_write(&kv, "a", value, 100) == CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_delete(&kv, "a") == CY_RSLT_SUCCESS);
+    for (uint32_t i = 0; i < 100; i++)
+    {
+        TEST_CHECK(view[i] == 1);
+    }
+
+    // Counters have no view, empty values have an empty one.
+    const uint8_t* other;
+    TEST_CHECK(mtb_kvstore_counter_increment(&kv, "cnt", NULL) == CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_get_view(&kv, "cnt", &other, &size) == MTB_KVSTORE_BAD_PARAM_ERROR);
+    TEST_CHECK(mtb_kvstore_write(&kv, "e", NULL, 0) == CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_get_view(&kv, "e", &other, &size) == CY_RSLT_SUCCESS);
+    TEST_CHECK(size == 0);
+    mtb_kvstore_release_view(&kv, other);
+
+    // The first garbage collection erases the other area and keeps the view valid.
+    int i = 0;
+    while (count_collections() < 2)
+    {
+        memset(value, i, 150);
+        TEST_CHECK(mtb_kvstore_write(&kv, "x", value, 150) == CY_RSLT_SUCCESS);
+        i++;
+    }
+    for (uint32_t j = 0; j < 100; j++)
+    {
+        TEST_CHECK(view[j] == 1);
+    }
+
+    // The second one has to wait for the view. Without an RTOS nothing can release it while
+    // the kv-store waits, so the write fails and leaves the area alone.
+    #if defined(MTB_KVSTORE_RTOS_AWARE)
+    pthread_t releaser;
+    TEST_CHECK(pthread_create(&releaser, NULL, release_later, (void*)view) == 0);
+    while (count_collections() < 3)
+    {
+        memset(value, i, 150);
+        cy_rslt_t result = mtb_kvstore_write(&kv, "x", value, 150);
+        TEST_CHECK((result == CY_RSLT_SUCCESS) || (result == MTB_KVSTORE_VIEW_BUSY_ERROR));
+        if (result == CY_RSLT_SUCCESS)
+        {
+            i++;
+        }
+    }
+    TEST_CHECK(pthread_join(releaser, NULL) == 0);
+    #else // if defined(MTB_KVSTORE_RTOS_AWARE)
+    cy_rslt_t result;
+    for (;;)
+    {
+        memset(value, i, 150);
+        result = mtb_kvstore_write(&kv, "x", value, 150);
+        if (result != CY_RSLT_SUCCESS)
+        {
+            break;
+        }
+        i++;
+        TEST_CHECK(i < 10000);
+    }
+    TEST_CHECK((result == MTB_KVSTORE_VIEW_BUSY_ERROR) && (count_collections() == 2));
+    for (uint32_t j = 0; j < 100; j++)
+    {
+        TEST_CHECK(view[j] == 1);
+    }
+    TEST_CHECK(mtb_kvstore_ensure_capacity(&kv, MTB_KVSTORE_ENSURE_MAX) ==
+               MTB_KVSTORE_VIEW_BUSY_ERROR);
+    uint8_t buf[200];
+    size = sizeof(buf);
+    TEST_CHECK(mtb_kvstore_read(&kv, "x", buf, &size) == CY_RSLT_SUCCESS);
+    TEST_CHECK(buf[0] == (uint8_t)(i - 1));
+    mtb_kvstore_release_view(&kv, view);
+    TEST_CHECK(mtb_kvstore_write(&kv, "x", value, 150) == CY_RSLT_SUCCESS);
+    TEST_CHECK(count_collections() == 3);
+    #endif // if defined(MTB_KVSTORE_RTOS_AWARE)
+    TEST_CHECK((kv.num_views[0] == 0) && (kv.num_views[1] == 0));
+
+    TEST_CHECK(mtb_kvstore_get_view(&kv, "x", &other, &size) == CY_RSLT_SUCCESS);
+    TEST_CHECK(size == 150);
+    mtb_kvstore_release_view(&kv, other);
+    TEST_CHECK((kv.num_views[0] == 0) && (kv.num_views[1] == 0));
+    mtb_kvstore_deinit(&kv);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// fill_area
+//--------------------------------------------------------------------------------------------------
+static void fill_area(const uint8_t* value)
+{
+    // Leaves too little space for the delete records of all keys.
+    while ((kv.free_space_offset + 240U) <= (AREA_SIZE - 300U))
+    {
+        TEST_CHECK(mtb_kvstore_write(&kv, "fill", value, 200) == CY_RSLT_SUCCESS);
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// test_delete_many_with_view
+//--------------------------------------------------------------------------------------------------
+static void test_delete_many_with_view(void)
+{
+    test_bd_init(&bd, 16, 0);
+    bd.map = test_bd_map;
+    TEST_CHECK(mtb_kvstore_init(&kv, 0, STORAGE_SIZE, &bd) == CY_RSLT_SUCCESS);
+    uint8_t value[200];
+    memset(value, 7, sizeof(value));
+    TEST_CHECK(mtb_kvstore_write(&kv, "held", value, 50) == CY_RSLT_SUCCESS);
+    const uint8_t* view;
+    uint32_t size;
+    TEST_CHECK(mtb_kvstore_get_view(&kv, "held", &view, &size) == CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_ensure_capacity(&kv, MTB_KVSTORE_ENSURE_MAX) == CY_RSLT_SUCCESS);
+
+    char keys[NUM_DELETE_KEYS][8];
+    const char* key_ptrs[NUM_DELETE_KEYS];
+    for (int i = 0; i < NUM_DELETE_KEYS; i++)
+    {
+        sprintf(keys[i], "d%d", i);
+        key_ptrs[i] = keys[i];
+        TEST_CHECK(mtb_kvstore_write(&kv, keys[i], value, 40) == CY_RSLT_SUCCESS);
+    }
+
+    // The garbage collection that the delete needs cannot erase the area with the view, and
+    // the delete then removes none of the keys, also after reinitialization.
+    fill_area(value);
+    TEST_CHECK(mtb_kvstore_delete_many(&kv, key_ptrs, NUM_DELETE_KEYS) ==
+               MTB_KVSTORE_VIEW_BUSY_ERROR);
+    for (int i = 0; i < NUM_DELETE_KEYS; i++)
+    {
+        TEST_CHECK(mtb_kvstore_key_exists(&kv, keys[i]) == CY_RSLT_SUCCESS);
+    }
+    mtb_kvstore_release_view(&kv, view);
+    mtb_kvstore_deinit(&kv);
+    TEST_CHECK(mtb_kvstore_init(&kv, 0, STORAGE_SIZE, &bd) == CY_RSLT_SUCCESS);
+    for (int i = 0; i < NUM_DELETE_KEYS; i++)
+    {
+        TEST_CHECK(mtb_kvstore_key_exists(&kv, keys[i]) == CY_RSLT_SUCCESS);
+    }
+
+    // Without the view the garbage collection runs and the keys are deleted.
+    fill_area(value);
+    uint32_t area_addr = kv.active_area_addr;
+    TEST_CHECK(mtb_kvstore_delete_many(&kv, key_ptrs, NUM_DELETE_KEYS) == CY_RSLT_SUCCESS);
+    TEST_CHECK(kv.active_area_addr != area_addr);
+    for (int i = 0; i < NUM_DELETE_KEYS; i++)
+    {
+        TEST_CHECK(mtb_kvstore_key_exists(&kv, keys[i]) == MTB_KVSTORE_ITEM_NOT_FOUND_ERROR);
+    }
+    TEST_CHECK(mtb_kvstore_key_exists(&kv, "held") == CY_RSLT_SUCCESS);
+    TEST_CHECK(mtb_kvstore_key_exists(&kv, "fill") == CY_RSLT_SUCCESS);
+    mtb_kvstore_deinit(&kv);
+    TEST_CHECK(mtb_kvstore_init(&kv, 0, STORAGE_SIZE, &bd) == CY_RSLT_SUCCESS);
+    for (int i = 0; i < NUM_DELETE_KEYS; i++)
+    {
+        TEST_CHECK(mtb_kvstore_key_exists(&kv, keys[i]) == MTB_KVSTORE_ITEM_NOT_FOUND_ERROR);
+    }
+    mtb_kvstore_deinit(&kv);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// main
+//--------------------------------------------------------------------------------------------------
+int main(void)
+{
+    test_views();
+    test_delete_many_with_view();
+    printf("test_view passed\n");
+    return 0;
+}